@@ -0,0 +1,69 @@
+// Benchmarks for sample queues and device reads.
+
+#include <benchmark/benchmark.h>
+
+#include <array>
+#include <vector>
+
+#include "fixtures.hpp"
+#include <libsmu/libsmu.hpp>
+
+using namespace smu;
+
+// Push and pop single samples through an input queue.
+static void BM_in_queue_push_pop(benchmark::State& state)
+{
+	InSampleQueue q(100000);
+	std::array<float, 4> sample = {1, 2, 3, 4};
+
+	for (auto _ : state) {
+		q.push(sample);
+		q.pop(sample);
+		benchmark::DoNotOptimize(sample);
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_in_queue_push_pop);
+
+// Push a block of values into an output queue at once and pop them individually.
+static void BM_out_queue_push_block(benchmark::State& state)
+{
+	OutSampleQueue q(100000);
+	std::vector<float> buf(state.range(0), 2.5);
+	float val;
+
+	for (auto _ : state) {
+		q.push(buf.begin(), buf.end());
+		while (q.pop(val))
+			benchmark::DoNotOptimize(val);
+	}
+
+	state.SetItemsProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_out_queue_push_block)->ArgName("block")->RangeMultiplier(16)->Range(1, 16384);
+
+// Read blocks of queued samples from a device.
+static void BM_read(benchmark::State& state)
+{
+	Session session;
+	BenchDevice dev(&session);
+	std::vector<std::array<float, 4>> buf;
+	std::array<float, 4> sample = {1, 2, 3, 4};
+	size_t samples = state.range(0);
+
+	for (auto _ : state) {
+		state.PauseTiming();
+		for (size_t i = 0; i < samples; i++)
+			dev.m_in_samples_q->push(sample);
+		dev.m_in_samples_avail = samples;
+		state.ResumeTiming();
+
+		dev.read(buf, samples, 0, false);
+	}
+
+	state.SetItemsProcessed(state.iterations() * samples);
+}
+BENCHMARK(BM_read)->ArgName("samples")->RangeMultiplier(16)->Range(1, 16384);
+
+BENCHMARK_MAIN();
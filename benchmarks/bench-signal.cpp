@@ -0,0 +1,52 @@
+// Benchmarks for signal waveform generation.
+
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "fixtures.hpp"
+#include <libsmu/libsmu.hpp>
+
+using namespace smu;
+
+// Generate a block of samples from the given source.
+static void BM_signal(benchmark::State& state)
+{
+	Signal sig(&m1000_signal_info[0]);
+	std::vector<float> buf;
+	uint64_t samples = state.range(1);
+	buf.reserve(samples);
+
+	for (auto _ : state) {
+		buf.clear();
+		switch (state.range(0)) {
+			case CONSTANT:
+				sig.constant(buf, samples, 2.5);
+				break;
+			case SQUARE:
+				sig.square(buf, samples, 0, 5, 100, 0, 0.5);
+				break;
+			case SAWTOOTH:
+				sig.sawtooth(buf, samples, 0, 5, 100, 0);
+				break;
+			case STAIRSTEP:
+				sig.stairstep(buf, samples, 0, 5, 100, 0);
+				break;
+			case SINE:
+				sig.sine(buf, samples, 0, 5, 100, 0);
+				break;
+			case TRIANGLE:
+				sig.triangle(buf, samples, 0, 5, 100, 0);
+				break;
+		}
+		benchmark::DoNotOptimize(buf.data());
+	}
+
+	state.SetItemsProcessed(state.iterations() * samples);
+}
+BENCHMARK(BM_signal)
+	->ArgNames({"src", "samples"})
+	->Args({CONSTANT, 1024})->Args({SQUARE, 1024})->Args({SAWTOOTH, 1024})
+	->Args({STAIRSTEP, 1024})->Args({SINE, 1024})->Args({TRIANGLE, 1024});
+
+BENCHMARK_MAIN();
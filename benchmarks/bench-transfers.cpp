@@ -0,0 +1,80 @@
+// Benchmarks for USB transfer decoding and encoding.
+
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "fixtures.hpp"
+#include <libsmu/libsmu.hpp>
+
+using namespace smu;
+
+// Decode an incoming transfer into the input queue.
+// Arguments: ADC mux mode, interleaved (firmware >= 2.00) packet layout.
+static void BM_handle_in_transfer(benchmark::State& state)
+{
+	Session session;
+	BenchDevice dev(&session, state.range(1) ? "2.17" : "1.02");
+	RecordedTransfer t(dev.m_packets_per_transfer * 256 * 8);
+
+	::ADC_MUX_Mode = state.range(0);
+	for (auto _ : state) {
+		dev.handle_in_transfer(t.transfer());
+		dev.reset_input();
+	}
+	::ADC_MUX_Mode = 0;
+
+	state.SetItemsProcessed(state.iterations() * dev.m_samples_per_transfer);
+}
+BENCHMARK(BM_handle_in_transfer)
+	->ArgNames({"mux", "interleaved"})
+	->Args({0, 1})->Args({1, 1})->Args({2, 1})->Args({4, 1})->Args({5, 1})->Args({7, 1})
+	// the planar layout of older firmware doesn't support ADC mux modes
+	->Args({0, 0});
+
+// Encode a single output sample for a channel in the given mode.
+static void BM_encode_out(benchmark::State& state)
+{
+	Session session;
+	BenchDevice dev(&session);
+	unsigned mode = state.range(0);
+
+	dev.m_mode[0] = mode;
+	dev.m_next_output[0] = (mode == SIMV || mode == SIMV_SPLIT) ? 0.05 : 2.5;
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(dev.encode_out(0, true));
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_encode_out)->ArgName("mode")->DenseRange(HI_Z, SIMV_SPLIT);
+
+// Encode an outgoing transfer from the output queues with both channels in
+// the given mode.
+static void BM_handle_out_transfer(benchmark::State& state)
+{
+	Session session;
+	BenchDevice dev(&session);
+	unsigned mode = state.range(0);
+	RecordedTransfer t(dev.m_packets_per_transfer * 256 * 4);
+	float val = (mode == SIMV || mode == SIMV_SPLIT) ? 0.05 : 2.5;
+	std::vector<float> buf(dev.m_samples_per_transfer, val);
+
+	dev.m_mode[0] = dev.m_mode[1] = mode;
+	for (auto _ : state) {
+		state.PauseTiming();
+		for (unsigned ch = 0; ch < 2; ch++) {
+			dev.m_out_samples_q[ch]->reset();
+			dev.m_out_samples_q[ch]->push(buf.begin(), buf.end());
+			dev.m_out_samples_avail[ch] = buf.size();
+		}
+		state.ResumeTiming();
+
+		dev.handle_out_transfer(t.transfer());
+	}
+
+	state.SetItemsProcessed(state.iterations() * dev.m_samples_per_transfer);
+}
+BENCHMARK(BM_handle_out_transfer)->ArgName("mode")->DenseRange(HI_Z, SIMV_SPLIT);
+
+BENCHMARK_MAIN();
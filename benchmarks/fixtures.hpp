@@ -0,0 +1,80 @@
+// Benchmark fixtures.
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <vector>
+
+#include <libusb.h>
+
+#include "device_m1000.hpp"
+#include "emulator.hpp"
+#include <libsmu/libsmu.hpp>
+
+using namespace smu;
+
+// ADC mux mode used to decode incoming samples.
+extern int ADC_MUX_Mode;
+
+// Virtual device exposing the internal sample handling methods.
+class BenchDevice : public M1000_Device {
+	public:
+		BenchDevice(Session* s, const char* fwver = "2.17"):
+			M1000_Device(s, NULL, new M1000_Emulator(config(fwver)), "F", fwver, "BENCH")
+		{
+			read_calibration();
+			configure(get_default_rate());
+		}
+
+		using M1000_Device::handle_in_transfer;
+		using M1000_Device::handle_out_transfer;
+		using M1000_Device::encode_out;
+		using M1000_Device::m_in_samples_q;
+		using M1000_Device::m_in_samples_avail;
+		using M1000_Device::m_out_samples_q;
+		using M1000_Device::m_out_samples_avail;
+		using M1000_Device::m_next_output;
+		using M1000_Device::m_mode;
+		using M1000_Device::m_packets_per_transfer;
+		using M1000_Device::m_samples_per_transfer;
+
+		// Drop all queued input samples.
+		void reset_input() {
+			m_in_samples_q->reset();
+			m_in_samples_avail = 0;
+		}
+
+	private:
+		static VirtualConfig config(const char* fwver) {
+			VirtualConfig config;
+			config.realtime = false;
+			config.fwver = fwver;
+			return config;
+		}
+};
+
+// Transfer with a buffer of sample data in the format sent by the device.
+// The data is synthesized from a slow ramp on every signal so all code
+// paths see realistic, varying values.
+class RecordedTransfer {
+	public:
+		RecordedTransfer(size_t length): m_buf(length), m_transfer(libusb_alloc_transfer(0)) {
+			for (size_t i = 0; i < length / 2; i++) {
+				uint16_t code = (i * 37) & 0xffff;
+				m_buf[i * 2] = code >> 8;
+				m_buf[i * 2 + 1] = code & 0xff;
+			}
+			m_transfer->buffer = m_buf.data();
+			m_transfer->length = length;
+			m_transfer->actual_length = length;
+		}
+		~RecordedTransfer() { libusb_free_transfer(m_transfer); }
+		RecordedTransfer(const RecordedTransfer&) = delete;
+		RecordedTransfer& operator=(const RecordedTransfer&) = delete;
+
+		libusb_transfer* transfer() { return m_transfer; }
+
+	private:
+		std::vector<unsigned char> m_buf;
+		libusb_transfer* m_transfer;
+};
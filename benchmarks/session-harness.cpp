@@ -0,0 +1,437 @@
+// End-to-end session throughput and latency harness using virtual devices.
+//
+// For each requested session size a full session is run (scan, add,
+// configure, start, write, read, end) while recording the sustained sample
+// rate, library CPU usage per device, dropped samples, read wakeup latency and the
+// time taken to start and stop the session. Results are written as JSON and
+// compared against thresholds, the exit status is nonzero if any fail.
+
+#ifdef USE_CUSTOM_GETOPT
+#include "getopt_internal.h"
+#else
+#include <getopt.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <dirent.h>
+#endif
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <libsmu/libsmu.hpp>
+
+using namespace smu;
+
+typedef std::chrono::steady_clock Clock;
+
+// Limits a run has to stay within to pass.
+struct Thresholds {
+	// minimum sustained rate as a fraction of the configured sample rate
+	double min_rate = 0.99;
+	// maximum library CPU time per device as a fraction of a single core,
+	// excluding the emulator threads producing the samples
+	double max_cpu = 0.25;
+	// maximum number of samples dropped due to full input queues
+	uint64_t max_drops = 0;
+	// maximum 99th percentile read wakeup latency in milliseconds
+	double max_latency = 50;
+	// maximum time to start or stop the session in milliseconds
+	double max_start_stop = 500;
+};
+
+struct Result {
+	unsigned devices;
+	double rate;
+	double cpu_per_device;
+	uint64_t drops;
+	double latency_p50;
+	double latency_p99;
+	double latency_max;
+	double start_ms;
+	double stop_ms;
+	std::vector<std::string> failures;
+};
+
+// CPU time (user and system) in seconds used by each library thread, keyed by
+// thread ID. The emulator threads synthesizing samples for the virtual devices
+// ("smu-virtual") stand in for the hardware and are left out. Only Linux
+// exposes per-thread usage, elsewhere the process total is reported under a
+// single key.
+static std::map<std::string, double> cpu_times()
+{
+	std::map<std::string, double> times;
+#ifdef __linux__
+	long ticks = sysconf(_SC_CLK_TCK);
+	DIR* dir = opendir("/proc/self/task");
+	if (!dir)
+		return times;
+	while (struct dirent* entry = readdir(dir)) {
+		if (entry->d_name[0] == '.')
+			continue;
+		std::ifstream file(std::string("/proc/self/task/") + entry->d_name + "/stat");
+		std::string stat((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		size_t open = stat.find('('), close = stat.rfind(')');
+		if (open == std::string::npos || close == std::string::npos)
+			continue;
+		if (stat.substr(open + 1, close - open - 1) == "smu-virtual")
+			continue;
+
+		// utime and stime are the 14th and 15th fields, the fields
+		// following the name start at the 3rd
+		std::istringstream fields(stat.substr(close + 2));
+		std::string field;
+		unsigned long utime = 0, stime = 0;
+		for (unsigned i = 3; i <= 15 && fields >> field; i++) {
+			if (i == 14)
+				utime = std::strtoul(field.c_str(), NULL, 10);
+			else if (i == 15)
+				stime = std::strtoul(field.c_str(), NULL, 10);
+		}
+		times[entry->d_name] = (double)(utime + stime) / ticks;
+	}
+	closedir(dir);
+#elif defined(_WIN32)
+	FILETIME create, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &create, &exit, &kernel, &user);
+	auto to_sec = [](FILETIME t) {
+		return (((uint64_t)t.dwHighDateTime << 32) | t.dwLowDateTime) * 1e-7;
+	};
+	times["process"] = to_sec(kernel) + to_sec(user);
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	times["process"] = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+		usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+#endif
+	return times;
+}
+
+// CPU time used by the library threads since the given snapshot, threads
+// started after it are counted in full.
+static double cpu_since(const std::map<std::string, double>& start)
+{
+	double cpu = 0;
+	for (const auto& t: cpu_times()) {
+		auto prev = start.find(t.first);
+		cpu += t.second - (prev == start.end() ? 0 : prev->second);
+	}
+	return cpu;
+}
+
+static double ms_since(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static double percentile(std::vector<double>& values, double p)
+{
+	if (values.empty())
+		return 0;
+	std::sort(values.begin(), values.end());
+	size_t i = std::min<size_t>(values.size() - 1, p * values.size());
+	return values[i];
+}
+
+static int run_session(unsigned devices, const VirtualConfig& config, unsigned rate,
+	double duration, unsigned block, Result& result)
+{
+	Session session;
+	int ret;
+
+	result = Result();
+	result.devices = devices;
+
+	ret = session.add_virtual(devices, config);
+	if (ret < 0)
+		return ret;
+	session.scan();
+	ret = session.add_all();
+	if (ret < 0)
+		return ret;
+	ret = session.configure(rate);
+	if (ret < 0)
+		return ret;
+	rate = session.m_sample_rate;
+
+	// source a waveform on channel A of every device, measure on channel B
+	std::vector<float> wave;
+	for (Device* dev: session.m_devices) {
+		dev->set_mode(0, SVMI);
+		dev->set_mode(1, HI_Z);
+		if (wave.empty())
+			dev->signal(0, 0)->sine(wave, rate / 100, 0.5, 4.5, rate / 100, 0);
+		dev->write(wave, 0, true);
+	}
+
+	std::vector<std::vector<std::array<float, 4>>> frames;
+	std::vector<double> arrivals;
+	uint64_t samples = 0;
+
+	auto start = Clock::now();
+	ret = session.start(0);
+	result.start_ms = ms_since(start);
+	if (ret < 0)
+		return ret;
+
+	auto cpu_start = cpu_times();
+	auto read_start = Clock::now();
+	while (ms_since(read_start) < duration * 1000) {
+		auto read_call = Clock::now();
+		try {
+			ret = session.read(frames, block, -1);
+		} catch (const std::system_error& e) {
+			// overflows are counted in samples from the session stats below
+			if (e.code().value() != EBUSY)
+				throw;
+			continue;
+		}
+		if (ret < 0)
+			break;
+		samples += ret;
+		if (config.realtime) {
+			// arrival time of the block minus the time its last sample was taken
+			arrivals.push_back(ms_since(read_start) - samples * 1000.0 / rate);
+		} else {
+			// samples aren't paced by a clock so use the time spent reading
+			arrivals.push_back(ms_since(read_call));
+		}
+	}
+	double elapsed = ms_since(read_start) / 1000;
+	double cpu = cpu_since(cpu_start);
+	result.drops = session.stats().samples_dropped;
+
+	auto stop = Clock::now();
+	session.cancel();
+	session.end();
+	result.stop_ms = ms_since(stop);
+	if (ret < 0)
+		return ret;
+
+	result.rate = samples / elapsed;
+	result.cpu_per_device = cpu / elapsed / devices;
+
+	// Latency is measured relative to the earliest block arrival since the
+	// exact time sampling started on the devices isn't known.
+	if (config.realtime && !arrivals.empty()) {
+		double base = *std::min_element(arrivals.begin(), arrivals.end());
+		for (auto& a: arrivals)
+			a -= base;
+	}
+	result.latency_max = arrivals.empty() ? 0 : *std::max_element(arrivals.begin(), arrivals.end());
+	result.latency_p50 = percentile(arrivals, 0.50);
+	result.latency_p99 = percentile(arrivals, 0.99);
+	return 0;
+}
+
+static void check(Result& result, const Thresholds& limits, unsigned rate)
+{
+	std::ostringstream msg;
+	if (result.rate < limits.min_rate * rate) {
+		msg << "rate " << result.rate << " below " << limits.min_rate * rate;
+		result.failures.push_back(msg.str());
+		msg.str("");
+	}
+	if (result.cpu_per_device > limits.max_cpu) {
+		msg << "cpu per device " << result.cpu_per_device << " above " << limits.max_cpu;
+		result.failures.push_back(msg.str());
+		msg.str("");
+	}
+	if (result.drops > limits.max_drops) {
+		msg << "drops " << result.drops << " above " << limits.max_drops;
+		result.failures.push_back(msg.str());
+		msg.str("");
+	}
+	if (result.latency_p99 > limits.max_latency) {
+		msg << "p99 latency " << result.latency_p99 << " ms above " << limits.max_latency << " ms";
+		result.failures.push_back(msg.str());
+		msg.str("");
+	}
+	if (std::max(result.start_ms, result.stop_ms) > limits.max_start_stop) {
+		msg << "start/stop time above " << limits.max_start_stop << " ms";
+		result.failures.push_back(msg.str());
+	}
+}
+
+static void write_json(std::ostream& out, const std::vector<Result>& results,
+	const Thresholds& limits, unsigned rate, double duration, bool realtime, bool pass)
+{
+	out << "{\n";
+	out << "  \"rate\": " << rate << ",\n";
+	out << "  \"duration\": " << duration << ",\n";
+	out << "  \"realtime\": " << (realtime ? "true" : "false") << ",\n";
+	out << "  \"thresholds\": {\"min_rate\": " << limits.min_rate
+		<< ", \"max_cpu\": " << limits.max_cpu
+		<< ", \"max_drops\": " << limits.max_drops
+		<< ", \"max_latency_ms\": " << limits.max_latency
+		<< ", \"max_start_stop_ms\": " << limits.max_start_stop << "},\n";
+	out << "  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result& r = results[i];
+		out << "    {\"devices\": " << r.devices
+			<< ", \"samples_per_second\": " << r.rate
+			<< ", \"cpu_per_device\": " << r.cpu_per_device
+			<< ", \"samples_dropped\": " << r.drops
+			<< ", \"read_latency_ms\": {\"p50\": " << r.latency_p50
+			<< ", \"p99\": " << r.latency_p99 << ", \"max\": " << r.latency_max << "}"
+			<< ", \"start_ms\": " << r.start_ms
+			<< ", \"stop_ms\": " << r.stop_ms
+			<< ", \"failures\": [";
+		for (size_t j = 0; j < r.failures.size(); j++)
+			out << (j ? ", " : "") << "\"" << r.failures[j] << "\"";
+		out << "]}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "  ],\n";
+	out << "  \"pass\": " << (pass ? "true" : "false") << "\n";
+	out << "}\n";
+}
+
+static void display_usage(void)
+{
+	printf("session-harness: end-to-end session benchmarks using virtual devices\n"
+		"\n"
+		" -h, --help                  print this help message and exit\n"
+		" -n, --devices <list>        comma separated session sizes (default: 1,4,16,64)\n"
+		" -t, --duration <seconds>    streaming time per session size (default: 5)\n"
+		" -r, --rate <samples/s>      sample rate (default: 100000)\n"
+		" -b, --block <samples>       samples per read (default: 1000)\n"
+		" -f, --fast                  produce samples as fast as possible instead of in real time\n"
+		" -o, --output <file>         write JSON results to a file instead of stdout\n"
+		" --min-rate <fraction>       minimum sustained rate relative to the sample rate (default: 0.99)\n"
+		" --max-cpu <fraction>        maximum library CPU usage per device, excluding the\n"
+		"                             device emulators (default: 0.25)\n"
+		" --max-drops <count>         maximum dropped samples (default: 0)\n"
+		" --max-latency <ms>          maximum p99 read wakeup latency, or read call time\n"
+		"                             when using --fast (default: 50)\n"
+		" --max-start-stop <ms>       maximum session start and stop time (default: 500)\n");
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<unsigned> sizes = {1, 4, 16, 64};
+	double duration = 5;
+	unsigned rate = 100000;
+	unsigned block = 1000;
+	std::string output;
+	VirtualConfig config;
+	Thresholds limits;
+
+	int opt;
+	int option_index = 0;
+	static struct option long_options[] = {
+		{"help",           no_argument,       0, 'h'},
+		{"devices",        required_argument, 0, 'n'},
+		{"duration",       required_argument, 0, 't'},
+		{"rate",           required_argument, 0, 'r'},
+		{"block",          required_argument, 0, 'b'},
+		{"fast",           no_argument,       0, 'f'},
+		{"output",         required_argument, 0, 'o'},
+		{"min-rate",       required_argument, 0, 1},
+		{"max-cpu",        required_argument, 0, 2},
+		{"max-drops",      required_argument, 0, 3},
+		{"max-latency",    required_argument, 0, 4},
+		{"max-start-stop", required_argument, 0, 5},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "hn:t:r:b:fo:",
+			long_options, &option_index)) != -1) {
+		switch (opt) {
+			case 'n': {
+				sizes.clear();
+				std::istringstream list(optarg);
+				std::string size;
+				while (std::getline(list, size, ','))
+					sizes.push_back(std::strtoul(size.c_str(), NULL, 10));
+				break;
+			}
+			case 't':
+				duration = std::atof(optarg);
+				break;
+			case 'r':
+				rate = std::strtoul(optarg, NULL, 10);
+				break;
+			case 'b':
+				block = std::strtoul(optarg, NULL, 10);
+				break;
+			case 'f':
+				config.realtime = false;
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 1:
+				limits.min_rate = std::atof(optarg);
+				break;
+			case 2:
+				limits.max_cpu = std::atof(optarg);
+				break;
+			case 3:
+				limits.max_drops = std::strtoull(optarg, NULL, 10);
+				break;
+			case 4:
+				limits.max_latency = std::atof(optarg);
+				break;
+			case 5:
+				limits.max_start_stop = std::atof(optarg);
+				break;
+			case 'h':
+				display_usage();
+				return EXIT_SUCCESS;
+			default:
+				display_usage();
+				return 2;
+		}
+	}
+
+	if (sizes.empty() || block == 0) {
+		display_usage();
+		return 2;
+	}
+
+	std::vector<Result> results;
+	bool pass = true;
+	for (unsigned devices: sizes) {
+		Result result;
+		int ret = run_session(devices, config, rate, duration, block, result);
+		if (ret < 0) {
+			std::cerr << "session-harness: " << devices << " device session failed: "
+				<< std::system_category().message(-ret) << std::endl;
+			return 2;
+		}
+		// rate thresholds only apply when sampling in real time
+		check(result, limits, config.realtime ? rate : 0);
+		pass = pass && result.failures.empty();
+		results.push_back(result);
+	}
+
+	if (output.empty()) {
+		write_json(std::cout, results, limits, rate, duration, config.realtime, pass);
+	} else {
+		std::ofstream out(output);
+		write_json(out, results, limits, rate, duration, config.realtime, pass);
+	}
+
+	return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,7 +1,7 @@
 # Interface wrapper for the libsmu library.
 # distutils: language = c++
 
-from libc.stdint cimport uint32_t, uint64_t
+from libc.stdint cimport int64_t, uint32_t, uint64_t
 from libcpp.set cimport set
 from libcpp.string cimport string
 from libcpp.vector cimport vector
@@ -20,18 +20,105 @@ cdef extern from "libsmu/version.hpp":
     const char* libsmu_version_str()
 
 
+cdef extern from "libsmu/libsmu.hpp" nogil:
+    cdef enum VirtualLoad:
+        VIRTUAL_LOOPBACK
+        VIRTUAL_RC
+        VIRTUAL_WIRE
+
+    cdef cppclass VirtualConfig:
+        bint realtime
+        VirtualLoad load
+        double resistance
+        double capacitance
+        string fwver
+        string hwver
+        unsigned start_delay
+
+
+cdef extern from "libsmu/pyramid.hpp" namespace "smu" nogil:
+    cdef struct SignalStats:
+        float min
+        float max
+        float mean
+
+
 cdef extern from "libsmu/libsmu.hpp" namespace "smu" nogil:
+    cdef enum LogLevel:
+        LOG_LEVEL_NONE
+        LOG_LEVEL_ERROR
+        LOG_LEVEL_WARNING
+        LOG_LEVEL_INFO
+        LOG_LEVEL_DEBUG
+
+    void set_log_level(LogLevel level)
+    LogLevel log_level()
+
+    cdef enum EventKind:
+        EVENT_OVERFLOW
+        EVENT_UNDERFLOW
+        EVENT_UNDERRUN
+        EVENT_TRANSFER_ERROR
+        EVENT_RECORD_ERROR
+
+    cdef struct DeviceEvent:
+        EventKind kind
+        Device* device
+        int channel
+        uint64_t sample
+        uint64_t count
+        int error
+
+    cdef struct TimingStats:
+        uint64_t count
+        double min
+        double mean
+        double max
+
+    cdef struct DataflowStats:
+        uint64_t transfers_submitted
+        uint64_t transfers_completed
+        uint64_t bytes_in
+        uint64_t bytes_out
+        uint64_t samples_decoded
+        uint64_t samples_encoded
+        uint64_t samples_dropped
+        uint64_t underruns
+        uint64_t in_queue_high_water
+        uint64_t out_queue_high_water
+        TimingStats completion_interval
+        TimingStats callback_duration
+
+    cdef struct StageProfile:
+        string name
+        uint64_t calls
+        uint64_t samples
+        uint64_t transfers
+        double total
+        double per_sample
+        double per_transfer
+        vector[uint64_t] histogram
+
     cdef cppclass Session:
-        vector[Device*] m_available_devices
         set[Device*] m_devices
         int m_active_devices
         int m_queue_size
+        double m_queue_time
+        size_t m_queue_memory_budget
+        bint m_locked_buffers
+        bint m_zerocopy_transfers
+        unsigned m_executor_threads
+        bint m_decode_offload
+        bint m_dataflow_exceptions
         int m_sample_rate
         bint m_continuous
 
         int scan()
+        vector[Device*] available_devices()
         int add(Device* dev)
         int add_all()
+        int add_virtual(unsigned count, const VirtualConfig& config)
+        int add_replay(string path, bint realtime, bint loop)
         int remove(Device* dev, bint detached)
         int destroy(Device* dev)
         int configure(uint32_t sample_rate)
@@ -40,8 +127,17 @@ cdef extern from "libsmu/libsmu.hpp" namespace "smu" nogil:
         int cancel()
         bint cancelled()
         void flush()
+        int start_capture(string path, size_t block_size)
+        int64_t stop_capture()
+        int start_trace(size_t events_per_thread)
+        int64_t stop_trace(string path)
         int flash_firmware(const char* path, vector[Device*]) except +
         int end()
+        size_t queue_memory()
+        DataflowStats stats()
+        void reset_stats()
+        vector[StageProfile] profile()
+        void reset_profile()
 
     cdef cppclass Device:
         string m_serial
@@ -57,6 +153,12 @@ cdef extern from "libsmu/libsmu.hpp" namespace "smu" nogil:
         ssize_t read(vector[array[float, four]]& buf, size_t samples, int timeout, bint skipsamples) except +
         int write(vector[float]& buf, unsigned channel, bint cyclic) except +
         void flush(int channel, bint read)
+        int set_queue_size(unsigned in_size, unsigned out_size)
+        bint poll_event(DeviceEvent& event)
+        uint64_t events_dropped()
+        DataflowStats stats()
+        void reset_stats()
+        size_t queue_memory()
         int ctrl_transfer(
             int bmRequestType, int bRequest, int wValue, int wIndex,
             unsigned char* data, int wLength, int timeout)
@@ -67,6 +169,14 @@ cdef extern from "libsmu/libsmu.hpp" namespace "smu" nogil:
         void unlock()
         int write_calibration(const char* path)
         void calibration(vector[vector[float]]* cal)
+        int record(string path)
+        int set_history(size_t max_bytes)
+        ssize_t read_history(vector[array[float, four]]& buf, uint64_t start, size_t samples)
+        int history_range(uint64_t& first, uint64_t& end)
+        size_t history_memory()
+        int set_summary(size_t max_bins)
+        int64_t read_summary(unsigned signal, uint64_t start, uint64_t end, size_t pixels, vector[SignalStats]& stats)
+        int summary_range(uint64_t& first, uint64_t& end)
         int set_led(unsigned leds)
         int set_adc_mux(unsigned adc_mux)
 
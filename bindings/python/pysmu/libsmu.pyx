@@ -7,7 +7,7 @@ import os
 from signal import signal, SIG_DFL, SIGINT
 import warnings
 
-from libc.stdint cimport uint32_t, uint64_t
+from libc.stdint cimport int64_t, uint32_t, uint64_t
 from libcpp.vector cimport vector
 
 # enum is only in py34 and up, use vendored backport if the system doesn't have
@@ -43,6 +43,36 @@ class Mode(Enum):
     SVMI_SPLIT = 4
     SIMV_SPLIT = 5
 
+class VirtualLoad(Enum):
+    """Load models attached to the channels of virtual devices."""
+    LOOPBACK = 0 # sourced values are measured back
+    RC = 1 # series resistor and capacitor to ground
+    WIRE = 2 # same channel of all devices wired together
+
+class EventKind(Enum):
+    """Kinds of device data flow events."""
+    OVERFLOW = 0 # incoming samples dropped
+    UNDERFLOW = 1 # output samples needed before any were written
+    UNDERRUN = 2 # output queue ran empty
+    TRANSFER_ERROR = 3 # USB transfer failed
+    RECORD_ERROR = 4 # writing a recording failed
+
+class LogLevel(Enum):
+    """Levels of library log messages."""
+    NONE = 0
+    ERROR = 1
+    WARNING = 2
+    INFO = 3
+    DEBUG = 4
+
+def set_log_level(level):
+    """Set the most detailed level of messages the library writes to stderr."""
+    cpp_libsmu.set_log_level(<cpp_libsmu.LogLevel>LogLevel(level).value)
+
+def get_log_level():
+    """Get the most detailed level of messages the library writes to stderr."""
+    return LogLevel(<int>cpp_libsmu.log_level())
+
 class LED(Enum):
     """Available device LEDs to control."""
     red = 47
@@ -50,6 +80,27 @@ class LED(Enum):
     blue = 28
     all = 0
 
+cdef _timing_stats(const cpp_libsmu.TimingStats& t):
+    """Convert timings to a (count, min, mean, max) tuple in seconds."""
+    return (t.count, t.min, t.mean, t.max)
+
+cdef _dataflow_stats(const cpp_libsmu.DataflowStats& stats):
+    """Convert data flow counters to a dict."""
+    return {
+        'transfers_submitted': stats.transfers_submitted,
+        'transfers_completed': stats.transfers_completed,
+        'bytes_in': stats.bytes_in,
+        'bytes_out': stats.bytes_out,
+        'samples_decoded': stats.samples_decoded,
+        'samples_encoded': stats.samples_encoded,
+        'samples_dropped': stats.samples_dropped,
+        'underruns': stats.underruns,
+        'in_queue_high_water': stats.in_queue_high_water,
+        'out_queue_high_water': stats.out_queue_high_water,
+        'completion_interval': _timing_stats(stats.completion_interval),
+        'callback_duration': _timing_stats(stats.callback_duration),
+    }
+
 cdef class Session:
     # pointer to the underlying C++ smu::Session object
     cdef cpp_libsmu.Session *_session
@@ -106,7 +157,7 @@ cdef class Session:
     property available_devices:
         """Devices that are accessible on the system."""
         def __get__(self):
-            return tuple(Device._create(d) for d in self._session.m_available_devices)
+            return tuple(Device._create(d) for d in self._session.available_devices())
 
     property devices:
         """Devices that are included in this session."""
@@ -131,6 +182,94 @@ cdef class Session:
         def __set__(self, size):
             self._session.m_queue_size = size
 
+    property queue_time:
+        """Buffered time in seconds used to size sample queues, overrides queue_size if non-zero."""
+        def __get__(self):
+            return self._session.m_queue_time
+        def __set__(self, seconds):
+            self._session.m_queue_time = seconds
+
+    property queue_memory_budget:
+        """Memory budget in bytes for the sample queues of all session devices (0 means unlimited)."""
+        def __get__(self):
+            return self._session.m_queue_memory_budget
+        def __set__(self, size):
+            self._session.m_queue_memory_budget = size
+
+    property locked_buffers:
+        """Back sample queues and transfer buffers with locked, prefaulted huge pages on configure."""
+        def __get__(self):
+            return bool(self._session.m_locked_buffers)
+        def __set__(self, locked):
+            self._session.m_locked_buffers = locked
+
+    property zerocopy_transfers:
+        """Allocate USB transfer buffers from kernel mapped memory on configure when supported."""
+        def __get__(self):
+            return bool(self._session.m_zerocopy_transfers)
+        def __set__(self, zerocopy):
+            self._session.m_zerocopy_transfers = zerocopy
+
+    property executor_threads:
+        """Number of threads shared by all session devices for background work (0 picks one per CPU, up to 4)."""
+        def __get__(self):
+            return self._session.m_executor_threads
+        def __set__(self, threads):
+            self._session.m_executor_threads = threads
+
+    property decode_offload:
+        """Decode incoming transfers on the session executor instead of the USB thread."""
+        def __get__(self):
+            return bool(self._session.m_decode_offload)
+        def __set__(self, offload):
+            self._session.m_decode_offload = offload
+
+    property dataflow_exceptions:
+        """Raise data flow errors from device reads and writes in addition to reporting them as device events."""
+        def __get__(self):
+            return bool(self._session.m_dataflow_exceptions)
+        def __set__(self, enable):
+            self._session.m_dataflow_exceptions = enable
+
+    property queue_memory:
+        """Memory in bytes allocated for the sample queues of all session devices."""
+        def __get__(self):
+            return self._session.queue_memory()
+
+    property stats:
+        """Combined data flow counters of all session devices."""
+        def __get__(self):
+            return _dataflow_stats(self._session.stats())
+
+    def reset_stats(self):
+        """Reset the data flow counters of all session devices."""
+        self._session.reset_stats()
+
+    property profile:
+        """CPU time spent in each processing stage of the session.
+
+        Maps stage names to dicts of timed calls, processed samples, total
+        seconds, seconds per sample and per completed transfer, and a
+        histogram of calls per power of two nanoseconds. Empty if libsmu was
+        built without profiling.
+        """
+        def __get__(self):
+            return {
+                stage.name.decode(): {
+                    'calls': stage.calls,
+                    'samples': stage.samples,
+                    'transfers': stage.transfers,
+                    'total': stage.total,
+                    'per_sample': stage.per_sample,
+                    'per_transfer': stage.per_transfer,
+                    'histogram': list(stage.histogram),
+                } for stage in self._session.profile()
+            }
+
+    def reset_profile(self):
+        """Reset the profile of the session."""
+        self._session.reset_profile()
+
     property cancelled:
         """Cancellation status of a session."""
         def __get__(self):
@@ -186,6 +325,55 @@ cdef class Session:
 
         return ret
 
+    def add_virtual(self, unsigned count=1, bint realtime=True, load=VirtualLoad.LOOPBACK,
+                    double resistance=1000, double capacitance=1e-6, unsigned start_delay=0):
+        """Create emulated devices and add them to the session.
+
+        Virtual devices emulate the device firmware in software, allowing
+        sessions to run without hardware attached.
+
+        Attributes:
+            count: number of devices to create
+            realtime: produce samples at the configured sample rate, otherwise
+                as fast as they're read
+            load: load model attached to both channels
+            resistance: series resistance of the RC load in ohms
+            capacitance: capacitance of the RC load in farads
+            start_delay: USB microframes the devices start sampling late
+
+        Raises: SessionError on failure.
+        Returns: The number of devices added to the session is returned.
+        """
+        cdef int ret = 0
+        cdef cpp_libsmu.VirtualConfig config
+        config.realtime = realtime
+        config.load = <cpp_libsmu.VirtualLoad>VirtualLoad(load).value
+        config.resistance = resistance
+        config.capacitance = capacitance
+        config.start_delay = start_delay
+        ret = self._session.add_virtual(count, config)
+        if ret < 0:
+            raise SessionError('failed adding virtual devices', ret)
+
+        return ret
+
+    def add_replay(self, path, bint realtime=True, bint loop=False):
+        """Create a device replaying a recording and add it to the session.
+
+        Attributes:
+            path (str): recording created with Device.record()
+            realtime: deliver samples at the configured sample rate, otherwise
+                as fast as they're read
+            loop: restart at the end of the recording, otherwise the session
+                stops once it's exhausted
+
+        Raises: SessionError on failure.
+        """
+        cdef int ret = 0
+        ret = self._session.add_replay(path.encode(), realtime, loop)
+        if ret < 0:
+            raise SessionError('failed adding replay device', ret)
+
     def add(self, Device dev):
         """Add a device to the session.
 
@@ -296,6 +484,66 @@ cdef class Session:
         if ret:
             raise SessionError('failed ending session stream', ret)
 
+    def start_capture(self, path, size_t block_size=1 << 20):
+        """Start capturing the samples of all session devices to a file.
+
+        Samples are written as 32-bit float frames in large aligned blocks
+        following a header describing the session and its devices. Samples
+        may not be read by other means while capturing.
+
+        Attributes:
+            path (str): file to capture to
+            block_size (int): size in bytes of the blocks written to disk
+
+        Raises: SessionError on failure.
+        """
+        cdef int ret = 0
+        ret = self._session.start_capture(path.encode(), block_size)
+        if ret < 0:
+            raise SessionError('failed starting capture', ret)
+
+    def stop_capture(self):
+        """Stop capturing after writing all queued samples.
+
+        Raises: SessionError on failure.
+        Returns: The number of samples captured per device.
+        """
+        cdef int64_t ret = 0
+        ret = self._session.stop_capture()
+        if ret < 0:
+            raise SessionError('failed capturing samples', ret)
+
+        return ret
+
+    def start_trace(self, size_t events_per_thread=1 << 16):
+        """Start tracing the USB and sample pipeline of all sessions.
+
+        Args:
+            events_per_thread (int, optional): Number of newest events kept per thread.
+
+        Raises: SessionError on failure, e.g. if libsmu was built without tracing.
+        """
+        cdef int ret = 0
+        ret = self._session.start_trace(events_per_thread)
+        if ret < 0:
+            raise SessionError('failed starting trace', ret)
+
+    def stop_trace(self, path):
+        """Stop tracing and write the events as Chrome trace event JSON.
+
+        Args:
+            path (str): File to write the trace to.
+
+        Raises: SessionError on failure.
+        Returns: The number of events written.
+        """
+        cdef int64_t ret = 0
+        ret = self._session.stop_trace(path.encode())
+        if ret < 0:
+            raise SessionError('failed writing trace', ret)
+
+        return ret
+
     def flash_firmware(self, path, devices=()):
         """Update firmware for a given device.
 
@@ -442,6 +690,52 @@ cdef class Device:
         def __get__(self):
             return self._device.get_default_rate()
 
+    property queue_memory:
+        """Memory in bytes allocated for the device's sample queues."""
+        def __get__(self):
+            return self._device.queue_memory()
+
+    def set_queue_size(self, unsigned in_size=0, unsigned out_size=0):
+        """Set the device's sample queue sizes, applied on the next session configure.
+
+        Args:
+            in_size (int, optional): Input queue size in samples, 0 uses the session sizing.
+            out_size (int, optional): Output queue size in samples per channel, 0 uses the session sizing.
+
+        Raises: DeviceError on failure.
+        """
+        cdef int ret = 0
+        ret = self._device.set_queue_size(in_size, out_size)
+        if ret < 0:
+            raise DeviceError('failed setting queue sizes', ret)
+
+    def poll_events(self):
+        """Get the pending data flow events of the device.
+
+        Returns: List of (kind, channel, sample, count, error) tuples, oldest
+            first, where kind is an EventKind, channel is -1 for events of
+            the whole device and error is a negative errno code.
+        """
+        cdef cpp_libsmu.DeviceEvent event
+        events = []
+        while self._device.poll_event(event):
+            events.append((EventKind(event.kind), event.channel, event.sample, event.count, event.error))
+        return events
+
+    property events_dropped:
+        """Number of events discarded since the device's event queue was full."""
+        def __get__(self):
+            return self._device.events_dropped()
+
+    property stats:
+        """Data flow counters of the device."""
+        def __get__(self):
+            return _dataflow_stats(self._device.stats())
+
+    def reset_stats(self):
+        """Reset the data flow counters of the device."""
+        self._device.reset_stats()
+
     def write_calibration(self, file):
         """Write calibration data to the device's EEPROM.
 
@@ -463,6 +757,19 @@ cdef class Device:
         if ret < 0:
             raise DeviceError('failed writing device calibration data')
 
+    def record(self, file=None):
+        """Record the device's raw USB traffic for replay.
+
+        Args:
+            file (str): path to record to (use None to stop recording)
+
+        Raises: DeviceError on failure.
+        """
+        cdef int ret = 0
+        ret = self._device.record(file.encode() if file is not None else b'')
+        if ret < 0:
+            raise DeviceError('failed recording device', ret)
+
     def __str__(self):
         return 'serial {} : fw {} : hw {}'.format(self.serial, self.fwver, self.hwver)
 
@@ -605,6 +912,84 @@ cdef class SessionDevice(Device):
 
         return [((x[0], x[1]), (x[2], x[3])) for x in buf]
 
+    def set_history(self, size_t max_bytes):
+        """Keep a losslessly compressed history of the device's samples.
+
+        Args:
+            max_bytes (int): memory budget of the history, the oldest samples
+                are dropped once exceeded (use 0 to disable the history)
+
+        Raises: DeviceError on failure.
+        """
+        cdef int ret = 0
+        ret = self._device.set_history(max_bytes)
+        if ret < 0:
+            raise DeviceError('failed setting history', ret)
+
+    def read_history(self, uint64_t start, size_t num_samples):
+        """Read samples from the device's history without consuming them.
+
+        Args:
+            start (int): index of the first sample, counting from the first
+                sample received after the history was enabled
+            num_samples (int): number of samples to read
+
+        Raises: DeviceError on failure.
+        Returns: A list containing sample values.
+        """
+        cdef ssize_t ret = 0
+        cdef vector[array[float, cpp_libsmu.four]] buf
+        ret = self._device.read_history(buf, start, num_samples)
+        if ret < 0:
+            raise DeviceError('failed reading history', ret)
+
+        return [((x[0], x[1]), (x[2], x[3])) for x in buf]
+
+    property history_range:
+        """Indices of the oldest and one past the newest sample in the history."""
+        def __get__(self):
+            cdef uint64_t first = 0, end = 0
+            ret = self._device.history_range(first, end)
+            if ret < 0:
+                raise DeviceError('history is disabled', ret)
+            return (first, end)
+
+    def set_summary(self, size_t max_bins):
+        """Keep a multi-resolution min/max/mean summary of the device's samples.
+
+        Args:
+            max_bins (int): number of bins kept per summary level (use 0 to
+                disable the summary)
+
+        Raises: DeviceError on failure.
+        """
+        cdef int ret = 0
+        ret = self._device.set_summary(max_bins)
+        if ret < 0:
+            raise DeviceError('failed setting summary', ret)
+
+    def read_summary(self, unsigned signal, uint64_t start, uint64_t end, size_t pixels):
+        """Summarize a range of the device's samples for plotting.
+
+        Args:
+            signal (int): signal index in the sample frame, 0 and 1 for
+                channel A voltage and current, 2 and 3 for channel B
+            start (int): index of the first sample
+            end (int): one past the index of the last sample
+            pixels (int): maximum number of pixels
+
+        Raises: DeviceError on failure.
+        Returns: A tuple of the number of samples per pixel and a list of
+            (min, max, mean) tuples for each pixel.
+        """
+        cdef int64_t ret = 0
+        cdef vector[cpp_libsmu.SignalStats] stats
+        ret = self._device.read_summary(signal, start, end, pixels, stats)
+        if ret < 0:
+            raise DeviceError('failed reading summary', ret)
+
+        return (ret, [(x.min, x.max, x.mean) for x in stats])
+
     def write(self, data, unsigned channel, bint cyclic=False):
         """Write data to a specified channel of the device.
 
@@ -24,7 +24,7 @@ int main(int argc, char **argv)
 		std::this_thread::sleep_for(std::chrono::milliseconds(2000));
 		session->scan();
 
-		std::vector < Device* > available_devices = session->m_available_devices;
+		std::vector < Device* > available_devices = session->available_devices();
 
 		//check if there is any disconnected device
 		for (auto other_device : last_devices) {
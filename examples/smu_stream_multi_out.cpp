@@ -48,36 +48,30 @@ int main(int argc, char **argv)
 	// Run session in continuous mode.
 	session->start(0);
 
-	// Data to be read from the device is formatted into a vector of four
-	// floats in an array, specifically in the format
-	// <Chan A voltage, Chan A current, Chan B coltage, Chan B current>.
-	std::vector<std::array<float, 4>> buf;
+	// Data is read from all devices at once, one vector per device, with
+	// samples aligned across devices. Each sample is formatted into an array
+	// of four floats, specifically in the format
+	// <Chan A voltage, Chan A current, Chan B voltage, Chan B current>.
+	std::vector<std::vector<std::array<float, 4>>> frames;
 	float v;
-	int i;
 
 	while (true) {
-		i = 0;
-		for (auto dev: session->m_devices) {
-			try {
-				// Read 1024 samples at a time from the device.
-				// Note that the timeout (3rd parameter to read() defaults to 0
-				// (nonblocking mode) so the number of samples returned won't
-				// necessarily be 1024.
-				dev->read(buf, 1024);
-			} catch (const std::system_error& e) {
-				// Exit on dropped samples.
-				cerr << "sample(s) dropped!" << endl;
-				exit(1);
-			}
+		try {
+			// Block until 1024 samples are available from every device.
+			session->read(frames, 1024, -1);
+		} catch (const std::system_error& e) {
+			// Exit on dropped samples.
+			cerr << "sample(s) dropped!" << endl;
+			exit(1);
+		}
 
-			// Iterate over all returned samples, doesn't have to be 1024.
-			for (auto a: buf) {
+		for (unsigned i = 0; i < frames.size(); i++) {
+			for (auto a: frames[i]) {
 				v = a[0] + a[1] + a[2] + a[3];
 				// Can force samples to drop on slower setups and/or slower
 				// terminals, redirect stdout to alleviate this.
-				printf("device %i: %f\n", i, v);
+				printf("device %u: %f\n", i, v);
 			}
-			i++;
 		}
 	};
 }
@@ -0,0 +1,209 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+/// @file capture.hpp
+/// @brief Capture file format and reader.
+///
+/// Captures written by Session::start_capture() start with a CaptureHeader
+/// followed by one CaptureDeviceInfo per device, padded to header_size.
+/// Fixed size blocks of frames_per_block sample frames follow, each frame
+/// holding the four signals of every device. Once a capture is complete, a
+/// trailing index mapping each block to its first sample and file offset
+/// along with per-block signal statistics is appended after the last block
+/// and referenced by index_offset. All values are stored in host byte order.
+///
+/// CaptureReader also summarizes the samples of each device for plotting
+/// long captures at any zoom, combining the per-block statistics for coarse
+/// views and only reading samples for views finer than a block.
+
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <string>
+#include <vector>
+
+#include <libsmu/pyramid.hpp>
+
+#define CAPTURE_MAGIC "SMUCAP\0\0"
+#define CAPTURE_INDEX_MAGIC "SMUIDX\0\0"
+#define CAPTURE_VERSION 1
+/// Alignment of the header, blocks and index, satisfying O_DIRECT on common filesystems.
+#define CAPTURE_ALIGNMENT 4096
+
+namespace smu {
+	/// @brief Sample formats of capture blocks.
+	enum CaptureFormat : uint32_t {
+		/// Frames of 32-bit floats ordered as [sample][device][signal],
+		/// matching FRAME_INTERLEAVED.
+		CAPTURE_FLOAT32 = 1,
+	};
+
+	/// @brief Header at the start of a capture file.
+	struct CaptureHeader {
+		char magic[8];
+		uint32_t version;
+		/// Offset of the first block.
+		uint32_t header_size;
+		uint32_t block_size;
+		uint32_t frames_per_block;
+		uint32_t num_devices;
+		uint32_t format;
+		uint64_t sample_rate;
+		/// Number of samples per device stored in complete blocks, updated
+		/// as blocks are written.
+		uint64_t num_samples;
+		/// Number of sample overflows that occurred while capturing.
+		uint64_t overflows;
+		int32_t adc_mux;
+		uint32_t reserved;
+		/// Offset of the trailing index, 0 while the capture is in progress.
+		uint64_t index_offset;
+	};
+
+	/// @brief Description of a captured device.
+	struct CaptureDeviceInfo {
+		char serial[32];
+		char hwver[32];
+		char fwver[32];
+		uint32_t mode[2];
+		/// Calibration offset, positive and negative gain of each signal
+		/// as reported by Device::calibration().
+		float cal[8][3];
+	};
+
+	/// @brief Statistics of a signal over the samples of a block.
+	typedef SignalStats CaptureStats;
+
+	/// @brief Entry of the trailing index.
+	/// Each entry is followed by num_devices * 4 CaptureStats ordered as
+	/// [device][signal]. The entries are preceded by CAPTURE_INDEX_MAGIC and
+	/// the number of entries as a 64-bit value.
+	struct CaptureIndexEntry {
+		uint64_t first_sample;
+		uint64_t offset;
+		uint32_t num_samples;
+		uint32_t reserved;
+	};
+
+	/// @brief Zero-copy view of consecutive samples stored within one block.
+	struct CaptureSpan {
+		/// Index of the first sample in the view.
+		uint64_t first_sample;
+		/// Number of samples in the view.
+		uint64_t num_samples;
+		/// Number of devices in each frame.
+		unsigned num_devices;
+		/// Frames of the view, pointing into the mapped file.
+		const std::array<float, 4>* frames;
+
+		/// @brief Get the signals of a device at a sample relative to the start of the view.
+		const std::array<float, 4>& at(uint64_t sample, unsigned device) const {
+			return frames[sample * num_devices + device];
+		}
+	};
+
+	/// @brief Memory mapped reader for capture files.
+	/// Captures can be read while they're still being written; refresh()
+	/// picks up blocks written since the file was opened. The returned
+	/// views stay valid until the next refresh() or close().
+	class CaptureReader {
+	public:
+		~CaptureReader();
+
+		/// @brief Open and map a capture file.
+		/// @param path Capture file to open.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		int open(const std::string& path);
+
+		/// @brief Unmap and close the capture file.
+		void close();
+
+		/// @brief Update the view of a capture that's still being written.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		int refresh();
+
+		/// @brief Header of the capture as of the last open() or refresh().
+		const CaptureHeader& header() const { return m_header; }
+
+		/// @brief Devices described by the capture header.
+		const std::vector<CaptureDeviceInfo>& devices() const { return m_devices; }
+
+		/// @brief Number of samples per device available to read.
+		uint64_t samples() const { return m_header.num_samples; }
+
+		/// @brief Number of blocks holding available samples.
+		uint64_t blocks() const;
+
+		/// @brief Whether the capture is complete and its index has been loaded.
+		bool complete() const { return m_index != NULL; }
+
+		/// @brief Get zero-copy views of a range of samples.
+		/// Blocks pad their frames to the block size so a range spanning
+		/// multiple blocks is returned as one view per block.
+		/// @param start Index of the first sample.
+		/// @param count Number of samples to view, clipped to the available samples.
+		/// @param spans Views of the requested samples, in order.
+		/// @return On success, the number of samples covered by the views is returned.
+		/// @return On error, a negative errno code is returned.
+		int64_t view(uint64_t start, uint64_t count, std::vector<CaptureSpan>& spans) const;
+
+		/// @brief Get the statistics of all signals over a block.
+		/// Statistics are read from the index of complete captures and
+		/// computed from the samples otherwise, once per block.
+		/// @param block Index of the block.
+		/// @param stats Statistics ordered as [device][signal].
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		int stats(uint64_t block, std::vector<CaptureStats>& stats) const;
+
+		/// @brief Summarize a range of samples of a device's signal.
+		/// The range is split into equally sized pixels. Pixels spanning at
+		/// least a block are combined from the block statistics, see
+		/// stats(), with boundaries rounded to blocks. Finer pixels are
+		/// computed from the samples with boundaries rounded to
+		/// PYRAMID_DECIMATION samples, reading fewer than frames_per_block
+		/// samples per pixel.
+		/// @param device Index of the device in the capture.
+		/// @param signal Signal to summarize, indexed as in Device::read() frames.
+		/// @param start Index of the first sample.
+		/// @param end One past the index of the last sample, clipped to the
+		/// available samples.
+		/// @param pixels Maximum number of pixels.
+		/// @param stats Statistics of each pixel, in order.
+		/// @return On success, the number of samples covered by each pixel is returned.
+		/// @return On error, a negative errno code is returned, -ERANGE if
+		/// the first sample isn't available.
+		int64_t summary(unsigned device, unsigned signal, uint64_t start, uint64_t end,
+			size_t pixels, std::vector<SignalStats>& stats) const;
+
+	private:
+		int map();
+		void unmap();
+		// Statistics of a block ordered as [device][signal], read from the
+		// index or computed and cached for incomplete captures.
+		const CaptureStats* block_stats(uint64_t block) const;
+
+		CaptureHeader m_header = {};
+		std::vector<CaptureDeviceInfo> m_devices;
+		// Start of the trailing index entries, NULL if not available.
+		const unsigned char* m_index = NULL;
+		// Statistics of the blocks of an incomplete capture computed so
+		// far, ordered as [block][device][signal]. Blocks aren't rewritten
+		// once their samples are counted so entries stay valid.
+		mutable std::vector<CaptureStats> m_block_stats;
+		mutable std::vector<bool> m_block_stats_valid;
+
+		const unsigned char* m_data = NULL;
+		uint64_t m_size = 0;
+#ifdef _WIN32
+		void* m_file = NULL;
+		void* m_mapping = NULL;
+#else
+		int m_fd = -1;
+#endif
+	};
+}
@@ -13,6 +13,7 @@
 #include <array>
 #include <atomic>
 #include <condition_variable>
+#include <exception>
 #include <functional>
 #include <mutex>
 #include <set>
@@ -20,9 +21,11 @@
 #include <thread>
 #include <vector>
 #include <map>
+#include <memory>
 
 #include <libusb.h>
 
+#include <libsmu/pyramid.hpp>
 #include <libsmu/version.hpp>
 
 /// @brief List of supported devices.
@@ -94,6 +97,61 @@ enum Mode {
 	SIMV_SPLIT, ///< SIMV with enabled switch for the input only pin added in Rev F.
 };
 
+/// @brief Sample layouts for flat session frame reads.
+enum FrameLayout {
+	FRAME_INTERLEAVED, ///< Samples ordered as [sample][device][signal].
+	FRAME_TENSOR, ///< Samples ordered as a [device][signal][sample] tensor.
+};
+
+/// @brief Load models attached to the channels of virtual devices.
+enum VirtualLoad {
+	VIRTUAL_LOOPBACK, ///< Sourced values are measured back, the other signal reads zero.
+	VIRTUAL_RC, ///< Series resistor and capacitor to ground.
+	/// Each channel is wired to the same channel of all other devices using
+	/// this load. A channel sourcing voltage drives the wire and measures it
+	/// back, HI_Z channels measure the wire at their own sample times,
+	/// ramping linearly between the driver's samples. Only one device should
+	/// drive a wire and devices have to sample in real time.
+	VIRTUAL_WIRE,
+};
+
+/// @brief Virtual device settings.
+struct VirtualConfig {
+	/// Produce samples at the configured sample rate, otherwise as fast as they're read.
+	bool realtime = true;
+	/// Load model attached to both channels.
+	VirtualLoad load = VIRTUAL_LOOPBACK;
+	/// Series resistance of the RC load in ohms.
+	double resistance = 1000;
+	/// Capacitance of the RC load in farads, 0 for a purely resistive load.
+	double capacitance = 1e-6;
+	/// Reported firmware version, versions older than 2.00 use the planar packet format.
+	std::string fwver = "2.17";
+	/// Reported hardware version.
+	std::string hwver = "F";
+	/// USB microframes (125 us) the device starts sampling after the one
+	/// requested by the host, emulating residual skew between devices.
+	unsigned start_delay = 0;
+};
+
+/// @brief Scheduling policies of library threads.
+enum ThreadPolicy {
+	THREAD_DEFAULT, ///< Default time-sharing scheduling.
+	THREAD_FIFO, ///< Real-time first in, first out scheduling (SCHED_FIFO).
+	THREAD_RR, ///< Real-time round-robin scheduling (SCHED_RR).
+};
+
+/// @brief Scheduling settings of library threads.
+struct ThreadConfig {
+	/// CPUs the threads are pinned to, their affinity is left as is if empty.
+	std::vector<unsigned> cpus;
+	/// Scheduling policy, real-time policies usually require privileges
+	/// (e.g. CAP_SYS_NICE or RLIMIT_RTPRIO on Linux).
+	ThreadPolicy policy = THREAD_DEFAULT;
+	/// Priority for real-time policies, clamped to the range the system supports.
+	int priority = 1;
+};
+
 /// @private
 enum LED{
     RED = 47,
@@ -103,8 +161,163 @@ enum LED{
 };
 
 namespace smu {
+	class Capture;
+	class DataflowCounters;
 	class Device;
+	class EventQueue;
+	class Executor;
+	class Profiler;
+	class Recorder;
 	class Signal;
+	class Strand;
+	class Transport;
+
+	/// @brief Kinds of device data flow events.
+	enum EventKind {
+		/// Incoming samples were dropped since the input queue was full.
+		EVENT_OVERFLOW,
+		/// A noncontinuous run needed output samples before any were written.
+		EVENT_UNDERFLOW,
+		/// The output queue of a sourcing channel ran empty and transfers
+		/// waited for samples to be written.
+		EVENT_UNDERRUN,
+		/// A USB transfer failed, cancelling the session.
+		EVENT_TRANSFER_ERROR,
+		/// Writing the recording of the device's traffic failed, stopping
+		/// the recording, see Device::record().
+		EVENT_RECORD_ERROR,
+	};
+
+	/// @brief Data flow event of a device.
+	struct DeviceEvent {
+		/// Kind of event.
+		EventKind kind;
+		/// Device the event occurred on.
+		Device* device;
+		/// Affected channel, -1 if the event isn't specific to a channel.
+		int channel;
+		/// Index of the first affected sample.
+		uint64_t sample;
+		/// Number of affected samples, e.g. the samples dropped by an overflow.
+		uint64_t count;
+		/// Negative errno code describing the error.
+		int error;
+	};
+
+	/// @brief Minimum, mean and maximum of a recurring duration.
+	struct TimingStats {
+		/// Number of recorded durations.
+		uint64_t count;
+		/// Shortest duration in seconds, 0 if none were recorded.
+		double min;
+		/// Mean duration in seconds, 0 if none were recorded.
+		double mean;
+		/// Longest duration in seconds.
+		double max;
+	};
+
+	/// @brief Snapshot of the data flow counters of a device or session.
+	struct DataflowStats {
+		/// USB transfers submitted.
+		uint64_t transfers_submitted;
+		/// USB transfers completed successfully.
+		uint64_t transfers_completed;
+		/// Bytes received from the device.
+		uint64_t bytes_in;
+		/// Bytes sent to the device.
+		uint64_t bytes_out;
+		/// Incoming samples decoded.
+		uint64_t samples_decoded;
+		/// Outgoing samples encoded.
+		uint64_t samples_encoded;
+		/// Incoming samples dropped since the input queue was full.
+		uint64_t samples_dropped;
+		/// Times an output queue ran empty while sourcing, see Device::m_underruns.
+		uint64_t underruns;
+		/// Highest number of samples held by the input queue.
+		uint64_t in_queue_high_water;
+		/// Highest number of samples held by an output queue.
+		uint64_t out_queue_high_water;
+		/// Time between consecutive completions of incoming transfers.
+		TimingStats completion_interval;
+		/// Time spent handling completed transfers, i.e. decoding or
+		/// encoding samples and resubmitting the transfer.
+		TimingStats callback_duration;
+	};
+
+	/// @brief Processing stages timed by the profiler, see Session::profile().
+	enum ProfileStage {
+		/// Decoding incoming transfers into the input queues.
+		PROFILE_DECODE,
+		/// Encoding output queue samples into outgoing transfers.
+		PROFILE_ENCODE,
+		/// Copying samples from the input queue in Device::read().
+		PROFILE_QUEUE,
+		/// Feeding written samples into the output queues.
+		PROFILE_FEED,
+		/// Running completion, hotplug and device event callbacks.
+		PROFILE_CALLBACK,
+		/// @private
+		PROFILE_STAGES,
+	};
+
+	/// @brief CPU time spent in a processing stage of a session.
+	struct StageProfile {
+		/// Stage the profile is for.
+		ProfileStage stage;
+		/// Stage name, e.g. "decode".
+		std::string name;
+		/// Number of timed calls.
+		uint64_t calls;
+		/// Samples processed by the calls, 0 for callbacks.
+		uint64_t samples;
+		/// USB transfers completed by the session while profiling.
+		uint64_t transfers;
+		/// Total time spent in the stage in seconds.
+		double total;
+		/// Mean time per processed sample in seconds, 0 if none were processed.
+		double per_sample;
+		/// Time per completed transfer in seconds, 0 if none completed.
+		double per_transfer;
+		/// Number of calls per duration, element i counts calls taking at
+		/// least 2^(i-1) and less than 2^i nanoseconds. The last element
+		/// counts all longer calls.
+		std::vector<uint64_t> histogram;
+	};
+
+	/// @brief Levels of library log messages.
+	enum LogLevel {
+		/// Nothing is logged.
+		LOG_LEVEL_NONE,
+		/// Failures the library can't recover from.
+		LOG_LEVEL_ERROR,
+		/// Recoverable failures, e.g. falling back to slower code paths.
+		LOG_LEVEL_WARNING,
+		/// Notable events.
+		LOG_LEVEL_INFO,
+		/// Data flow details, including messages from streaming loops.
+		LOG_LEVEL_DEBUG,
+	};
+
+	/// @brief Set the most detailed level of messages logged by the library.
+	/// Defaults to the SMU_LOG_LEVEL environment variable (a level name such
+	/// as "debug" or its number) if set, otherwise LOG_LEVEL_DEBUG for debug
+	/// builds and LOG_LEVEL_NONE for others. Messages are queued by the
+	/// logging threads and written by a background thread that sleeps while
+	/// nothing is queued.
+	void set_log_level(LogLevel level);
+
+	/// @brief Get the most detailed level of messages logged by the library.
+	LogLevel log_level();
+
+	/// @brief Handle log messages instead of writing them to stderr.
+	/// @param handler Function called on the background logging thread for
+	/// every message, pass an empty function to restore writing to stderr.
+	void set_log_handler(std::function<void(LogLevel level, const char* message)> handler);
+
+	/// @brief Wait until all queued log messages have been handled.
+	/// May not be called from a log handler.
+	void flush_log();
 
 	/// @brief Generic session class.
 	class Session {
@@ -112,23 +325,26 @@ namespace smu {
 		Session();
 		~Session();
 
-		/// @private
-		void set_off(Device*);
-
 		/// @brief Devices that are present on the system.
 		/// Note that these devices consist of all supported devices currently
 		/// recognized on the system; however, the devices aren't necessarily
 		/// bound to a session. In order to add devices to a session, add()
 		/// must be used.
+		///
+		/// Where libusb supports hotplug events the vector is changed on the
+		/// session executor at any time, so reading it directly can race
+		/// with a device being plugged in or removed. Use
+		/// available_devices() instead, which copies it under m_lock_devlist.
 		std::vector<Device*> m_available_devices;
 
 		/// @brief Devices that are part of this session.
 		/// These devices will be started when start() is called.
-		/// Use `add()` and `remove()` to manipulate this set.
+		/// Use `add()` and `remove()` to manipulate this set, changes while
+		/// the session is running are guarded by m_devices_lock.
 		std::set<Device*> m_devices;
 
 		/// @brief Number of devices currently streaming samples.
-		unsigned m_active_devices;
+		std::atomic<unsigned> m_active_devices;
 
 		/// @brief Map for the workaround described in session.cpp -> probe_device().
 		std::map<libusb_device*, libusb_device_handle*> m_deviceHandles;
@@ -136,38 +352,196 @@ namespace smu {
 		/// @brief Size of input/output sample queues for every device.
 		/// Alter this if necessary to make continuous data flow work for the
 		/// target usage. The default is approximately 100ms worth of samples
-		/// at the maximum sampling rate. Note that must be changed before
-		/// devices are added to a session otherwise they'll use the default.
+		/// at the maximum sampling rate. Changes are applied to the devices in
+		/// the session on the next configure() call. Devices with queue sizes
+		/// set via Device::set_queue_size() aren't affected.
 		unsigned m_queue_size = 100000;
 
+		/// @brief Amount of buffered time in seconds used to size sample queues.
+		/// If non-zero, configure() sizes the queues of all devices without
+		/// explicit queue sizes to hold this much data at the configured
+		/// sample rate, overriding m_queue_size.
+		double m_queue_time = 0;
+
+		/// @brief Memory budget in bytes for the sample queues of all devices in the session.
+		/// If non-zero, configure() shrinks the queues sized by the session
+		/// (via m_queue_size or m_queue_time) so the queues of all devices
+		/// fit within the budget. Explicitly sized queues are never shrunk
+		/// and no queue is shrunk below the minimum size required to keep
+		/// data flowing, configure() returns -ENOMEM if those don't fit.
+		size_t m_queue_memory_budget = 0;
+
+		/// @brief Back sample queues and USB transfer buffers with locked memory.
+		/// If enabled, configure() allocates the buffers of all session
+		/// devices from huge pages where available, locks them into RAM, and
+		/// prefaults them so page faults can't stall the USB thread. Huge
+		/// pages and locking are used on a best effort basis, falling back to
+		/// regular pages if they aren't permitted (e.g. due to RLIMIT_MEMLOCK).
+		bool m_locked_buffers = false;
+
+		/// @brief Use zero-copy USB transfer buffers.
+		/// If enabled, configure() allocates USB transfer buffers from memory
+		/// mapped by the kernel (usbfs on Linux) via libusb_dev_mem_alloc(),
+		/// avoiding copies between kernel and user space for every bulk
+		/// transfer. Falls back to regular buffers if the kernel, driver, or
+		/// libusb version doesn't support it. Takes precedence over
+		/// m_locked_buffers for transfer buffers when available.
+		bool m_zerocopy_transfers = false;
+
+		/// @brief Amount of time in seconds buffered by the USB transfers of each device.
+		/// Larger transfers lower the per-sample overhead and tolerate
+		/// longer scheduling delays at the cost of latency. If 0, a platform
+		/// default of 20ms (50ms on Windows) is used. Changes are applied on
+		/// the next configure() call.
+		double m_transfer_time = 0;
+
+		/// @brief Number of threads shared by all session devices for background work.
+		/// The session executor feeds written samples to the output queues,
+		/// decodes incoming transfers if m_decode_offload is enabled, and
+		/// runs the completion and hotplug callbacks. If 0, one thread per
+		/// CPU is used, up to 4. Changes are applied on the next configure()
+		/// call.
+		unsigned m_executor_threads = 0;
+
+		/// @brief Decode incoming transfers on the session executor.
+		/// By default transfers are decoded on the USB thread, serializing
+		/// all devices. If enabled, each device decodes its transfers on the
+		/// executor in order, spreading the decoding of multiple devices
+		/// over the executor threads.
+		bool m_decode_offload = false;
+
+		/// @private
+		Executor* executor() { return m_executor; }
+		/// @private
+		Profiler* profiler() { return m_profiler; }
+
+		/// @brief Throw data flow errors from the read(), write() and run() calls.
+		/// If enabled (the default), overflows and underflows of a device
+		/// are thrown as std::system_error from its next read() or write()
+		/// call, in addition to being reported as device events. If
+		/// disabled, they're only reported as events, see
+		/// Device::poll_event().
+		bool m_dataflow_exceptions = true;
+
+		/// @brief Scheduling of the USB thread handling transfers of all devices.
+		/// Applied by apply_thread_config(), e.g. to pin the thread to an
+		/// isolated CPU and raise it to a real-time priority so other load
+		/// can't delay transfer handling long enough to drop samples.
+		ThreadConfig m_usb_thread_config;
+
+		/// @brief Scheduling of the session executor threads.
+		/// Applied by apply_thread_config().
+		ThreadConfig m_executor_thread_config;
+
+		/// @brief Apply the scheduling settings to the library threads.
+		/// Called by configure(), call it directly to change scheduling of a
+		/// running session. Threads are named smu-usb and smu-exec-N on
+		/// Linux. Settings that can't be applied are skipped, leaving the
+		/// related threads with their previous scheduling.
+		/// @return On success, 0 is returned.
+		/// @return On error, the negative errno code of the first setting
+		/// that couldn't be applied is returned, e.g. -EPERM if real-time
+		/// scheduling isn't permitted or -ENOSYS if the platform doesn't
+		/// support a setting.
+		int apply_thread_config();
+
+		/// @brief Get the memory used by the sample queues of all devices in the session.
+		/// @return The number of bytes allocated for sample queues.
+		size_t queue_memory();
+
+		/// @brief Get the combined data flow counters of all devices in the session.
+		/// Counts are summed, high-water marks and timings cover all devices.
+		DataflowStats stats();
+
+		/// @brief Reset the data flow counters of all devices in the session.
+		void reset_stats();
+
 		/// @private
 		unsigned m_samples;
 
 		/// @brief Scan system for all supported devices.
 		/// Updates the list of available, supported devices for the session
-		/// (m_available_devices).
+		/// (m_available_devices). Where libusb supports hotplug events the
+		/// list is kept up to date as devices are plugged in and removed, so
+		/// scanning is only needed once.
 		/// @return On success, the number of devices found is returned.
 		/// @return On error, a negative errno code is returned.
 		int scan();
 
+		/// @brief Get a copy of the devices that are present on the system.
+		/// Safe to call while hotplug events update m_available_devices.
+		std::vector<Device*> available_devices();
+
+		/// @brief Register a callback run when a supported device is plugged
+		/// into the system.
+		/// The callback runs on the session executor once the new device has
+		/// been probed and added to m_available_devices. Exceptions thrown by
+		/// the callback are rethrown by the next end() call.
+		/// @param func Callback taking the attached device.
+		void hotplug_attach(std::function<void(Device* device)> func);
+
+		/// @brief Register a callback run when a supported device is removed
+		/// from the system.
+		/// The callback runs on the session executor once the device has been
+		/// removed from m_available_devices. Devices that are part of the
+		/// session stay in m_devices until removed with remove(device, true).
+		/// Exceptions thrown by the callback are rethrown by the next end() call.
+		/// @param func Callback taking the detached device.
+		void hotplug_detach(std::function<void(Device* device)> func);
+
 		/// @brief Add a device to the session.
-		/// This method may not be called while the session is active.
+		/// Devices added while a continuous session is running join it
+		/// without stopping the other devices: they're configured with the
+		/// session's sample rate, start sampling on a USB frame of the
+		/// running timebase and line up with the other devices in read().
+		/// This method may not be called while a noncontinuous session is active.
 		/// @param device The device to be added to the session.
 		/// @return On success, 0 is returned.
 		/// @return On error, a negative errno code is returned.
 		int add(Device* device);
 
 		/// @brief Shim to scan and add all available devices to a session.
-		/// This method may not be called while the session is active.
+		/// This method may not be called while a noncontinuous session is active.
 		/// @return On success, the number of devices added to the session is returned.
 		/// @return On error, a negative errno code is returned.
 		int add_all();
 
+		/// @brief Create virtual devices and add them to the session.
+		/// Virtual devices emulate the ADALM1000 firmware in software,
+		/// including its control requests, packet formats, sample timing and
+		/// channel modes, allowing sessions to run without hardware attached.
+		/// They're kept in the available list across scans.
+		/// This method may not be called while a noncontinuous session is active.
+		/// @param count Number of devices to create.
+		/// @param config Settings used for the new devices.
+		/// @return On success, the number of devices added to the session is returned.
+		/// @return On error, a negative errno code is returned.
+		int add_virtual(unsigned count = 1, const VirtualConfig& config = VirtualConfig());
+
+		/// @brief Create a device replaying a recording and add it to the session.
+		/// The device reports the versions, serial number and calibration
+		/// of the recorded device and feeds the recorded sample transfers
+		/// through the regular input path, see Device::record(). Output
+		/// written to the device is accepted but doesn't affect the samples.
+		/// It's kept in the available list across scans.
+		/// This method may not be called while a noncontinuous session is active.
+		/// @param path Recording to replay.
+		/// @param realtime Whether samples are delivered at the configured
+		/// sample rate (the default) or as fast as they're read.
+		/// @param loop Whether to restart at the end of the recording. If
+		/// false (the default), the session stops with an error once the
+		/// recording is exhausted, as if the device was detached.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		int add_replay(const std::string& path, bool realtime = true, bool loop = false);
+
 		/// @brief Remove a device from the session.
 		/// @param device A device to be removed from the session.
 		/// @param detached True if the device has already been detached from
 		/// the system (defaults to false).
-		/// This method may not be called while the session is active.
+		/// Devices removed while a continuous session is running are
+		/// stopped while the other devices keep streaming.
+		/// This method may not be called while a noncontinuous session is active.
 		/// @return On success, 0 is returned.
 		/// @return On error, a negative errno code is returned.
 		int remove(Device* device, bool detached = false);
@@ -205,7 +579,8 @@ namespace smu {
 		/// the request amount of samples.
 		///
 		/// Once started, the only allowed Session methods are cancel() and end()
-		/// until the session has stopped.
+		/// until the session has stopped, plus add() and remove() for
+		/// continuous sessions.
 		///
 		/// @return On success, 0 is returned.
 		/// @return On error, a negative errno code is returned.
@@ -229,6 +604,116 @@ namespace smu {
 		/// @brief Flush the read and write queues for all devices in a session.
 		void flush();
 
+		/// @brief Read sample-aligned frames from all devices in the session.
+		/// All devices are started on the same USB frame (see Device::sync())
+		/// so samples with the same index across devices were captured at
+		/// the same time. Devices whose streams were consumed at different
+		/// rates (e.g. via Device::read()) are realigned by dropping samples
+		/// from the devices that are behind.
+		///
+		/// Devices that joined a running continuous session are padded with
+		/// NaN samples up to the first sample they captured. Devices that
+		/// were detached while streaming are padded with NaN samples once
+		/// their remaining samples have been read so they don't stall the
+		/// other devices until they're removed.
+		/// @param buf Buffer to store samples into. It holds one vector per
+		/// session device, in m_devices order, each with the same number of
+		/// samples formatted as in Device::read().
+		/// @param samples Number of samples to read from every device.
+		/// @param timeout Amount of time in milliseconds to wait for samples
+		/// to be available on all devices. If 0 (the default), return
+		/// immediately. If -1, block indefinitely until the requested number
+		/// of samples is available.
+		/// @return On success, the number of samples read per device.
+		/// @return On error, a negative errno code is returned.
+		/// @throws std::system_error of EBUSY if sample overflows have occurred.
+		ssize_t read(std::vector<std::vector<std::array<float, 4>>>& buf, size_t samples, int timeout = 0);
+
+		/// @brief Measure the residual sample skew between session devices.
+		/// Drives a square wave from the given channel of the source device
+		/// in SVMI mode while every other device captures in HI_Z mode. The
+		/// source channel's output must be wired to the same channel on all
+		/// other devices. The integer and fractional sample offset of each
+		/// device relative to the source is estimated by cross-correlating
+		/// the edges of the captured voltage signals and stored in m_skew,
+		/// which read() uses to realign samples.
+		/// @param source Device driving the calibration waveform.
+		/// @param channel Channel used to drive and capture the waveform.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		/// This method may not be called while the session is active.
+		int calibrate_skew(Device* source, unsigned channel = 0);
+
+		/// @brief Sample offsets of devices as measured by calibrate_skew().
+		/// Positive values mean the device captures events that many samples
+		/// later than the calibration source. Devices without an entry are
+		/// assumed to have no skew. Clear this to disable realignment.
+		std::map<Device*, double> m_skew;
+
+		/// @brief Read sample-aligned frames from all devices into a flat buffer.
+		/// @param buf Buffer to store samples into, formatted according to layout.
+		/// @param samples Number of samples to read from every device.
+		/// @param timeout Amount of time in milliseconds to wait, see the
+		/// vector based read() for details.
+		/// @param layout Ordering of the samples in the buffer.
+		/// @return On success, the number of samples read per device.
+		/// @return On error, a negative errno code is returned.
+		/// @throws std::system_error of EBUSY if sample overflows have occurred.
+		ssize_t read(std::vector<float>& buf, size_t samples, int timeout = 0,
+			FrameLayout layout = FRAME_INTERLEAVED);
+
+		/// @brief Start capturing the samples of all session devices to a file.
+		/// A capture thread consumes sample-aligned frames as read() does and
+		/// writes them to disk as 32-bit floats in large aligned blocks,
+		/// bypassing the page cache where supported. The file starts with a
+		/// header describing the sample rate, ADC mux setting, and the
+		/// serial number, versions, channel modes and calibration of every
+		/// device (see libsmu/capture.hpp). Samples may not be read by other means
+		/// while capturing. The capture can be started before or after the
+		/// session is started; if the session is unconfigured, the default
+		/// sample rate is configured.
+		/// @param path File to capture to.
+		/// @param block_size Size in bytes of the blocks written to disk,
+		/// rounded up to a multiple of 4096.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		int start_capture(const std::string& path, size_t block_size = 1 << 20);
+
+		/// @brief Stop capturing after writing all queued samples to disk.
+		/// @return On success, the number of samples captured per device is returned.
+		/// @return On error, a negative errno code is returned.
+		int64_t stop_capture();
+
+		/// @brief Start tracing the USB and sample pipeline.
+		/// Transfer submissions and completions, sample decoding and
+		/// encoding, output queue feeding, underrun waits and device reads
+		/// and writes are recorded by the threads running them, including
+		/// those of other sessions in the process. Each thread keeps its
+		/// newest events in its own buffer.
+		/// @param events_per_thread Number of events kept per thread.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned, -ENOSYS if
+		/// libsmu was built without tracing.
+		int start_trace(size_t events_per_thread = 1 << 16);
+
+		/// @brief Stop tracing and write the events in Chrome trace event
+		/// JSON format, viewable with chrome://tracing or Perfetto.
+		/// @param path File to write the trace to.
+		/// @return On success, the number of events written is returned.
+		/// @return On error, a negative errno code is returned.
+		int64_t stop_trace(const std::string& path);
+
+		/// @brief Get the CPU time spent in each processing stage of the
+		/// session since it was created or the profile was reset.
+		/// Decoding, encoding, input queue reads, output queue feeding and
+		/// user callbacks are timed by the threads running them.
+		/// @return The profile of each stage in ProfileStage order, empty if
+		/// libsmu was built without profiling (the WITH_PROFILING option).
+		std::vector<StageProfile> profile();
+
+		/// @brief Reset the profile of the session.
+		void reset_profile();
+
 		/// @brief Scan system for devices in SAM-BA mode.
 		/// @param samba_devs Vector of libusb devices in SAM-BA mode. 
 		/// @return On success, the number of devices found is returned.
@@ -246,23 +731,37 @@ namespace smu {
 		/// internal: Called by devices on the USB thread when they are complete.
 		void completion();
 		/// internal: Called by devices on the USB thread when a device encounters an error.
-		void handle_error(int status, const char * tag);
-		/// internal: Called by device attach events on the USB thread.
+		/// Devices detached from a continuous session with other streaming
+		/// devices are dropped from the stream instead of cancelling it.
+		void handle_error(int status, const char * tag, Device* device = NULL);
+		/// internal: Called by devices on the USB thread when new samples are queued.
+		void samples_queued();
+		/// internal: Called by device attach events on the USB thread, the
+		/// device is probed on the session executor.
 		void attached(libusb_device* usb_dev);
 		/// internal: Called by device detach events on the USB thread.
 		void detached(libusb_device* usb_dev);
+		/// internal: Called on the session executor to add a probed device to
+		/// m_available_devices and run the attach callbacks.
+		void device_attached(Device* dev);
+		/// internal: Called on the session executor to remove a detached
+		/// device from m_available_devices and run the detach callbacks.
+		void device_detached(Device* dev);
 
 		/// @brief For noncontinuous sessions, block until all devices have completed,
 		/// then turn off the devices. Continuous sessions don't wait for completion
 		/// and instead proceed with turning off the devices after canceling the session.
 		/// @return On success, 0 is returned.
 		/// @return On error, a negative errno code is returned.
+		/// @throws The first exception thrown by a completion, hotplug or
+		/// device event callback since the last call.
 		int end();
 
-		/// @brief Callback run via the USB thread on session completion.
+		/// @brief Callback run via the session executor on session completion.
 		/// Called with the current value of m_cancellation as an argument,
 		/// i.e. if the parameter is non-zero we are waiting to complete a
-		/// cancelled session.
+		/// cancelled session. Exceptions thrown by the callback are rethrown
+		/// by the next end() call.
 		std::function<void(unsigned)> m_completion_callback;
 
 		/// @brief Session sample rate.
@@ -273,7 +772,7 @@ namespace smu {
 
 	protected:
 		/// @brief Flag used to cancel all pending USB transactions for devices in a session.
-		unsigned m_cancellation = 0;
+		std::atomic<unsigned> m_cancellation{0};
 
 		/// @brief Flag for controlling USB event handling.
 		/// USB event handling loop will be run while m_usb_thread_loop is true.
@@ -281,8 +780,22 @@ namespace smu {
 		/// @brief USB thread handling pending events in blocking mode.
 		std::thread m_usb_thread;
 
+		/// @brief Threads running background work for all session devices.
+		/// Replaced by configure() when resized, USB event handlers submit
+		/// to it under m_executor_lock.
+		Executor* m_executor = NULL;
+		/// @brief Lock for replacing m_executor while hotplug events and
+		/// callbacks may be submitted to it.
+		std::mutex m_executor_lock;
+
+		/// @brief CPU time spent in the processing stages of the session.
+		Profiler* m_profiler = NULL;
+
 		/// @brief Lock for session completion.
 		std::mutex m_lock;
+		/// @brief Lock for changes to m_devices, m_skew and m_skew_history
+		/// by add() and remove() while the session is running.
+		std::mutex m_devices_lock;
 		/// @brief Lock for the available device list.
 		/// All code that references m_available_devices needs to acquire this lock
 		/// before accessing it.
@@ -290,37 +803,90 @@ namespace smu {
 		/// @brief Blocks on m_lock until session completion is finished.
 		std::condition_variable m_completion;
 
+		/// @brief Most recent raw sample read from each device, used for
+		/// fractional skew interpolation.
+		std::map<Device*, std::array<float, 4>> m_skew_history;
+
+		/// @brief Active capture started by start_capture(), NULL if not capturing.
+		Capture* m_capture = NULL;
+
+		/// @brief Lock for waiting on incoming samples.
+		std::mutex m_samples_lock;
+		/// @brief Signaled on m_samples_lock when devices queue new samples.
+		std::condition_variable m_samples_cv;
+
 		/// @brief libusb context related with a session.
 		/// This allows for segregating libusb usage so external users can
 		/// also use libusb without interfering with internal usage.
 		libusb_context* m_usb_ctx;
 
-		/// @brief libusb hotplug callback handle.
+		/// @brief libusb hotplug callback handle, registered if m_hotplug is set.
 		libusb_hotplug_callback_handle m_usb_cb;
-
-		/// @brief Callbacks called on the USB thread when a device is removed from the system.
+		/// @brief Whether hotplug events are handled, cleared on destruction.
+		std::atomic<bool> m_hotplug{false};
+		/// @brief Handles hotplug events on the session executor in the order
+		/// they occurred.
+		Strand* m_hotplug_strand = NULL;
+		/// @brief Serializes probing devices by scan() and hotplug events,
+		/// including access to m_deviceHandles.
+		std::mutex m_probe_lock;
+
+		/// @brief Callbacks called on the session executor when a device is
+		/// plugged into the system, guarded by m_callback_lock.
 		std::vector<std::function<void(Device* device)>> m_hotplug_attach_callbacks;
-		/// @brief Callbacks called on the USB thread when a device is plugged into the system.
+		/// @brief Callbacks called on the session executor when a device is
+		/// removed from the system, guarded by m_callback_lock.
 		std::vector<std::function<void(Device* device)>> m_hotplug_detach_callbacks;
 
+		/// @brief First exception thrown by a completion, hotplug or device
+		/// event callback since the last end() call, guarded by m_callback_lock.
+		std::exception_ptr m_callback_exception;
+		std::mutex m_callback_lock;
+
+		/// @brief Run a user callback on the executor, storing the first
+		/// exception it throws for end() to rethrow.
+		/// @param strand If set, run the callback in order with the other
+		/// tasks queued on the strand.
+		void submit_callback(std::function<void()> callback, Strand* strand = NULL);
+
 		/// @brief Identify devices supported by libsmu.
 		/// @param usb_dev libusb device
 		/// @return If the usb device relates to a supported device the Device is returned,
 		/// otherwise NULL is returned.
 		Device* probe_device(libusb_device* usb_dev);
 
+		/// @brief Resize the sample queues of all devices in the session.
+		/// Queue sizes are determined from the explicit device queue sizes,
+		/// m_queue_size or m_queue_time, and m_queue_memory_budget.
+		/// @param only Resize only this device's queues, e.g. one joining a
+		/// running session.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		int size_queues(Device* only = NULL);
+
+		/// @brief Start a device added to a running continuous session.
+		/// @param device Device to start, already part of m_devices.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		int join(Device* device);
+
+		/// @brief Copy of m_devices taken under m_devices_lock.
+		std::vector<Device*> devices();
+
 		/// @brief Find an existing, available device.
 		/// @param usb_dev libusb device
 		/// @return If the usb device relates to an existing,
 		/// available device the Device is returned,
 		/// otherwise NULL is returned.
 		Device* find_existing_device(libusb_device* usb_dev);
+
+		friend class Device;
 	};
 
 	/// @brief Generic device class.
 	class Device {
 	public:
-		virtual ~Device() {};
+		virtual ~Device();
 
 		/// @brief Get the descriptor for the device.
 		virtual const sl_device_info* info() const = 0;
@@ -398,6 +964,22 @@ namespace smu {
 		/// @throws std::system_error of EBUSY if sample underflows have occurred.
 		virtual int write(std::vector<float>& buf, unsigned channel, bool cyclic = false) = 0;
 
+		/// @brief Set the sample queue sizes for the device.
+		/// @param in_size Number of samples the input queue holds. If 0 (the
+		/// default), the size is determined by the session.
+		/// @param out_size Number of samples the output queue of each channel
+		/// holds. If 0 (the default), the size is determined by the session.
+		/// The sizes are applied on the next Session::configure() call. Note
+		/// that resizing a queue drops any samples it currently holds.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		/// This method may not be called while the session is active.
+		virtual int set_queue_size(unsigned in_size = 0, unsigned out_size = 0);
+
+		/// @brief Get the memory used by the device's sample queues.
+		/// @return The number of bytes allocated for the input and output sample queues.
+		virtual size_t queue_memory() const = 0;
+
 		/// @brief Flush the read and selected channel write queue for a device.
 		/// @param channel Channel to flush the write queues for. If -1, skip flushing write queues.
 		/// @param read Whether to flush the incoming read queue as well.
@@ -424,12 +1006,12 @@ namespace smu {
 		virtual int sync() = 0;
 
 		/// @brief Lock the device's mutex.
-		/// This prevents this device's transfers from being processed. Hold
-		/// only briefly, while modifying signal state.
+		/// This serializes changes to the device's transfers, such as
+		/// cancelling them. Completed transfers are processed without
+		/// taking it so holding it doesn't delay streaming.
 		virtual void lock() { m_state.lock(); }
 
 		/// @brief Unlock the device's mutex.
-		/// Allows this device's transfers to be processed.
 		virtual void unlock() { m_state.unlock(); }
 
 		/// @brief Write the device calibration data into the EEPROM.
@@ -447,10 +1029,129 @@ namespace smu {
 		/// @param cal A vector of vectors containing calibration values.
 		virtual void calibration(std::vector<std::vector<float>>* cal) = 0;
 
+		/// @brief Record the device's raw USB traffic to a file.
+		/// Completed sample transfers and control requests are appended to
+		/// the file along with the device's versions, serial number and
+		/// calibration until recording is stopped or the device is
+		/// destroyed. Recordings can be replayed with Session::add_replay().
+		/// Records are written to disk by a separate thread, a failed write
+		/// stops the recording and is reported as an EVENT_RECORD_ERROR.
+		/// @param path File to record to, an empty string (the default) stops recording.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned, including the
+		/// first failed write of the recording being stopped.
+		/// This method may not be called while the session is active.
+		virtual int record(const std::string& path = "") = 0;
+
+		/// @brief Keep a compressed history of the device's samples.
+		/// Raw ADC codes are compressed losslessly in fixed size chunks as
+		/// they arrive, typically to a few bits per sample for quasi-static
+		/// signals, and decompressed with the current calibration applied on
+		/// read_history(). Samples are indexed from 0 for the first sample
+		/// received after the history is enabled. Changing the history
+		/// settings discards it.
+		/// @param max_bytes Memory budget of the history, the oldest samples
+		/// are dropped once exceeded. If 0, the history is disabled.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		/// This method may not be called while the session is active.
+		virtual int set_history(size_t max_bytes) = 0;
+
+		/// @brief Read samples from the device's history.
+		/// Unlike read(), this doesn't consume samples and can be used
+		/// concurrently with streaming.
+		/// @param buf Buffer to store samples into, formatted as in read().
+		/// @param start Index of the first sample to read.
+		/// @param samples Number of samples to read.
+		/// @return On success, the number of samples read is returned, which
+		/// may be less than requested if the history doesn't hold them yet.
+		/// @return On error, a negative errno code is returned, -ERANGE if
+		/// the first sample has been dropped or not been received yet and
+		/// -ENODATA if the history is disabled.
+		virtual ssize_t read_history(std::vector<std::array<float, 4>>& buf, uint64_t start, size_t samples) = 0;
+
+		/// @brief Get the range of samples held in the device's history.
+		/// @param first Set to the index of the oldest sample.
+		/// @param end Set to one past the index of the newest sample.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		virtual int history_range(uint64_t& first, uint64_t& end) = 0;
+
+		/// @brief Get the memory used by the device's history in bytes.
+		virtual size_t history_memory() = 0;
+
+		/// @brief Keep a multi-resolution summary of the device's samples.
+		/// Samples are summarized into a Pyramid as they arrive so long
+		/// streams can be plotted at any zoom using read_summary() without
+		/// reading the samples. Samples are indexed from 0 for the first
+		/// sample received after the summary is enabled. Changing the summary
+		/// settings discards it.
+		/// @param max_bins Number of bins kept per pyramid level, with 1024
+		/// bins level 0 spans the last 16384 samples and every further level
+		/// spans 16 times longer. If 0, the summary is disabled.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		/// This method may not be called while the session is active.
+		virtual int set_summary(size_t max_bins) = 0;
+
+		/// @brief Summarize a range of the device's samples for plotting.
+		/// This can be used concurrently with streaming, see Pyramid::query().
+		/// Queries never delay the USB completions, samples arriving while a
+		/// query runs are summarized by the next query or transfer.
+		/// @param signal Signal to summarize, indexed as in read() frames.
+		/// @param start Index of the first sample.
+		/// @param end One past the index of the last sample.
+		/// @param pixels Maximum number of pixels.
+		/// @param stats Statistics of each pixel, in order.
+		/// @return On success, the number of samples covered by each pixel is returned.
+		/// @return On error, a negative errno code is returned, -ENODATA if
+		/// the summary is disabled.
+		virtual int64_t read_summary(unsigned signal, uint64_t start, uint64_t end, size_t pixels,
+			std::vector<SignalStats>& stats) = 0;
+
+		/// @brief Get the range of samples that can be summarized.
+		/// @param first Set to the index of the oldest sample.
+		/// @param end Set to one past the index of the newest sample.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		virtual int summary_range(uint64_t& first, uint64_t& end) = 0;
+
 		/// @brief Session this device is associated with.
 		/// @brief Overcurrent status for the most recent data request.
 		///   Is 1 if an overcurrent event occurred in the most recent data request, 0 otherwise.
 		int m_overcurrent = 0;
+
+		/// @brief Number of times the output queue of a sourcing channel ran
+		/// empty while the device was waiting to send samples.
+		std::atomic<uint64_t> m_underruns{0};
+
+		/// @brief Get the oldest pending data flow event of the device.
+		/// Events are queued without locks or allocations by the threads
+		/// handling the device's transfers, up to 256 events are held.
+		/// @param event Set to the event.
+		/// @return True if an event was pending, false otherwise.
+		bool poll_event(DeviceEvent& event);
+
+		/// @brief Subscribe to the data flow events of the device.
+		/// Subscribed events are passed to the callback on the session
+		/// executor instead of being queued for poll_event(), one at a time
+		/// in the order they occurred. Exceptions thrown by the callback are
+		/// rethrown by the next Session::end() call.
+		/// @param callback Function called for every event, pass an empty
+		/// function to queue events again.
+		void set_event_callback(std::function<void(const DeviceEvent&)> callback);
+
+		/// @brief Number of events discarded since the event queue was full.
+		uint64_t events_dropped() const { return m_events_dropped; }
+
+		/// @brief Get a snapshot of the device's data flow counters.
+		/// Counters are always maintained, accumulate across sessions and
+		/// are updated with relaxed atomics so values of a snapshot taken
+		/// while streaming may be a transfer apart from each other.
+		DataflowStats stats() const;
+
+		/// @brief Reset the device's data flow counters, including m_underruns.
+		void reset_stats();
 		
 		/// @brief Set the leds states for device.
         /// @param leds value between [0, 7], each bit of the value represents the state of an LED (1-on 0-off) in this order (RGB or DS3,DS2,DS1 on rev F hardware)
@@ -463,7 +1164,8 @@ namespace smu {
 
 	protected:
 		/// @brief Device constructor.
-		Device(Session* s, libusb_device* usb_dev, libusb_device_handle* usb_handle,
+		/// The device takes ownership of the transport.
+		Device(Session* s, libusb_device* usb_dev, Transport* transport,
 			const char* hw_version, const char* fw_version, const char* serial);
 
 		/// @brief Device claiming and initialization when a session adds this device.
@@ -492,6 +1194,20 @@ namespace smu {
 		/// @return On error, a negative errno code is returned.
 		virtual int off() = 0;
 
+		/// @brief Number of samples available to be read without waiting.
+		virtual size_t read_available() = 0;
+
+		/// @brief Minimum number of samples a queue has to hold to maintain
+		/// data flow at the configured sample rate.
+		virtual unsigned min_queue_size() const { return 0; }
+
+		/// @brief Reallocate the sample queues if their sizes changed.
+		/// @param in_size Number of samples the input queue holds.
+		/// @param out_size Number of samples the output queue of each channel holds.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		virtual int resize_queues(unsigned in_size, unsigned out_size) = 0;
+
 		/// @brief Make the device start sampling.
 		/// @param samples Number of samples to run before stopping.
 		/// @return On success, 0 is returned.
@@ -504,28 +1220,78 @@ namespace smu {
 		/// @return On error, a negative errno code is returned.
 		virtual int cancel() = 0;
 
+		/// @brief Prepare joining a running session in sync with a streaming device.
+		/// Like sync(), and sets m_sample_offset to the index of the first
+		/// sample in the reference device's stream.
+		/// @param device Streaming device of the session to sync to.
+		/// @return On success, 0 is returned.
+		/// @return On error, a negative errno code is returned.
+		virtual int sync_to(Device* device) = 0;
+
+		/// @brief Whether the device has USB transfers in flight.
+		virtual bool streaming() const = 0;
+
 		/// @brief Session this device is associated with.
 		Session* const m_session;
 
 		/// @brief Underlying libusb device.
 		libusb_device* const m_usb_dev = NULL;
-		/// @brief Underlying libusb device handle.
+		/// @brief Underlying libusb device handle, NULL for virtual devices.
 		libusb_device_handle* m_usb = NULL;
+		/// @brief Transport used for control requests and sample transfers.
+		Transport* const m_transport;
+		/// @brief Active recording of the device's traffic, NULL when not recording.
+		Recorder* m_recorder = NULL;
 
 		/// Cumulative sample number being handled for input.
-		uint64_t m_requested_sampleno = 0;
+		std::atomic<uint64_t> m_requested_sampleno{0};
 		/// Current sample number being handled for input.
 		uint64_t m_in_sampleno = 0;
 		/// Current sample number being submitted for output.
 		uint64_t m_out_sampleno = 0;
+		/// Number of input samples consumed by reads or flushes.
+		uint64_t m_read_sampleno = 0;
+		/// Index of the device's first sample in the session's stream,
+		/// nonzero for devices that joined a running session.
+		uint64_t m_sample_offset = 0;
+		/// Set if the device was detached while streaming in a session that
+		/// kept running without it.
+		std::atomic<bool> m_detached{false};
+
+		/// Requested input queue size in samples, 0 lets the session decide.
+		unsigned m_in_queue_size = 0;
+		/// Requested output queue size in samples per channel, 0 lets the session decide.
+		unsigned m_out_queue_size = 0;
 
 		/// @brief Amount of time in milliseconds to wait before timing out write
 		/// operations, defaults to 100 ms and is based on the configured sample rate.
 		double m_write_timeout = 100;
 
-		/// Lock for transfer state.
+		/// Lock for changes to the transfers, not taken on completions.
 		std::recursive_mutex m_state;
 
+		/// @brief Queue a data flow event or pass it to the subscribed callback.
+		/// Safe to call from any thread, never waits for the callback.
+		void report(EventKind kind, int channel, uint64_t sample, uint64_t count, int error);
+
+		/// @brief Throw the first data flow error reported since the last call.
+		/// The error is only cleared if Session::m_dataflow_exceptions is disabled.
+		/// @throws std::system_error of EBUSY if sample underflows/overflows have occurred.
+		void raise_dataflow_error();
+
+		/// Data flow counters.
+		std::unique_ptr<DataflowCounters> m_counters;
+
+		/// Pending events.
+		std::unique_ptr<EventQueue> m_events;
+		std::atomic<uint64_t> m_events_dropped{0};
+		/// Subscribed event callback, accessed atomically.
+		std::shared_ptr<std::function<void(const DeviceEvent&)>> m_event_callback;
+		/// Delivers the events of the device to the callback in order.
+		std::unique_ptr<Strand> m_event_strand;
+		/// Kind of the first data flow error not yet thrown, plus one, or 0 if none.
+		std::atomic<unsigned> m_dataflow_error{0};
+
 		friend class Session;
 	};
 
@@ -0,0 +1,106 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+/// @file pyramid.hpp
+/// @brief Multi-resolution signal summaries for plotting long streams.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <deque>
+#include <vector>
+
+/// Number of bins of a level combined into one bin of the next level.
+#define PYRAMID_DECIMATION 16
+
+namespace smu {
+	/// @brief Statistics of a signal over a range of samples.
+	struct SignalStats {
+		float min;
+		float max;
+		float mean;
+	};
+
+	/// @brief Rolling min/max/mean pyramid of the four signals of a device.
+	/// Level 0 summarizes every PYRAMID_DECIMATION samples and each following
+	/// level summarizes PYRAMID_DECIMATION bins of the previous one. Levels
+	/// are added as the stream grows and bins are completed incrementally as
+	/// samples are appended, so the cost per sample is constant. Ranges at
+	/// any zoom are summarized from the coarsest bins fitting them, reading
+	/// a bounded number of bins per requested pixel.
+	///
+	/// This class isn't thread safe, callers have to serialize appending and
+	/// querying.
+	class Pyramid {
+	public:
+		/// @brief Create a pyramid.
+		/// @param max_bins Number of bins kept per level, the oldest bins are
+		/// dropped once exceeded so coarser levels span further back in time.
+		/// If 0, all bins are kept.
+		Pyramid(size_t max_bins = 0);
+
+		/// @brief Summarize consecutive samples.
+		/// @param frames Samples to append, formatted as in Device::read().
+		/// @param count Number of samples to append.
+		/// @param stride Distance between consecutive samples in frames, for
+		/// summarizing one device of interleaved multi-device frames.
+		void append(const std::array<float, 4>* frames, size_t count, size_t stride = 1);
+
+		/// @brief Discard all bins.
+		void clear();
+
+		/// @brief Get the range of samples that can be summarized.
+		/// Only samples in completed level 0 bins are included.
+		/// @param first Set to the index of the oldest sample.
+		/// @param end Set to one past the index of the newest sample.
+		void range(uint64_t& first, uint64_t& end) const;
+
+		/// @brief Number of samples appended.
+		uint64_t samples() const { return m_samples; }
+
+		/// @brief Summarize a range of samples of a signal.
+		/// The range is split into equally sized pixels, each summarized
+		/// from bins of the coarsest levels fitting within it. Pixel
+		/// boundaries are rounded to level 0 bins; where level 0 bins have
+		/// been dropped they're rounded to the finest level still holding
+		/// the samples.
+		/// @param signal Signal to summarize, indexed as in Device::read() frames.
+		/// @param start Index of the first sample.
+		/// @param end One past the index of the last sample, clipped to the
+		/// available samples.
+		/// @param pixels Maximum number of pixels, fewer are returned if the
+		/// range holds fewer level 0 bins.
+		/// @param stats Statistics of each pixel, in order.
+		/// @return On success, the number of samples covered by each pixel is returned.
+		/// @return On error, a negative errno code is returned, -ERANGE if
+		/// the first sample has been dropped or not been summarized yet.
+		int64_t query(unsigned signal, uint64_t start, uint64_t end, size_t pixels,
+			std::vector<SignalStats>& stats) const;
+
+	private:
+		struct Accumulator {
+			std::array<float, 4> min;
+			std::array<float, 4> max;
+			std::array<double, 4> sum;
+			unsigned count;
+		};
+
+		struct Level {
+			// Index of the first bin held.
+			uint64_t first;
+			std::deque<std::array<SignalStats, 4>> bins;
+			// Bin in progress.
+			Accumulator acc;
+		};
+
+		void add(size_t level, const std::array<float, 4>& min, const std::array<float, 4>& max,
+			const std::array<double, 4>& sum);
+
+		size_t m_max_bins;
+		std::vector<Level> m_levels;
+		uint64_t m_samples = 0;
+	};
+}
@@ -0,0 +1,132 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc
+
+#include "buffer.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "log.hpp"
+
+// Huge page size used when rounding up locked allocations.
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// Mapped sizes of locked buffers, required to unmap them.
+static std::map<void*, size_t> locked_buffers;
+static std::mutex locked_buffers_mtx;
+
+static size_t round_up(size_t size, size_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+#ifdef _WIN32
+static void* locked_map(size_t& size)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	size = round_up(size, info.dwPageSize);
+
+	void* buf = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (!buf)
+		return NULL;
+	if (!VirtualLock(buf, size))
+		SMU_LOG(smu::LOG_LEVEL_WARNING, "%s: failed locking %zu byte buffer\n", __func__, size);
+	return buf;
+}
+
+static void locked_unmap(void* buf, size_t size)
+{
+	VirtualUnlock(buf, size);
+	VirtualFree(buf, 0, MEM_RELEASE);
+}
+#else
+static void* locked_map(size_t& size)
+{
+	void* buf = MAP_FAILED;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+
+#ifdef MAP_HUGETLB
+	// try explicit huge pages first, these need to be reserved by the admin
+	if (size >= HUGE_PAGE_SIZE / 2) {
+		size_t huge_size = round_up(size, HUGE_PAGE_SIZE);
+		buf = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+		if (buf != MAP_FAILED)
+			size = huge_size;
+	}
+#endif
+
+	if (buf == MAP_FAILED) {
+		size = round_up(size, sysconf(_SC_PAGESIZE));
+		buf = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (buf == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		// fall back to transparent huge pages
+		if (size >= HUGE_PAGE_SIZE)
+			madvise(buf, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	// Locking is best effort, it commonly fails due to RLIMIT_MEMLOCK.
+	if (mlock(buf, size) != 0)
+		SMU_LOG(smu::LOG_LEVEL_WARNING, "%s: failed locking %zu byte buffer\n", __func__, size);
+	return buf;
+}
+
+static void locked_unmap(void* buf, size_t size)
+{
+	munlock(buf, size);
+	munmap(buf, size);
+}
+#endif
+
+void* buffer_alloc(size_t size, bool locked)
+{
+	if (!locked)
+		return calloc(1, size);
+
+	size_t mapped_size = size;
+	void* buf = locked_map(mapped_size);
+	if (!buf)
+		return NULL;
+
+	// prefault all pages in case they weren't populated on mapping
+	memset(buf, 0, mapped_size);
+
+	std::lock_guard<std::mutex> lock(locked_buffers_mtx);
+	locked_buffers[buf] = mapped_size;
+	return buf;
+}
+
+void buffer_free(void* buf, bool locked)
+{
+	if (!buf)
+		return;
+
+	if (!locked) {
+		free(buf);
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(locked_buffers_mtx);
+	auto it = locked_buffers.find(buf);
+	if (it != locked_buffers.end()) {
+		locked_unmap(buf, it->second);
+		locked_buffers.erase(it);
+	}
+}
@@ -0,0 +1,56 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+// Allocate a zeroed buffer of at least the given size in bytes.
+// If locked is true the buffer is backed by huge pages where available,
+// locked into RAM, and prefaulted so accessing it from the USB thread never
+// causes a page fault. If huge pages or locking aren't permitted the buffer
+// falls back to regular, possibly unlocked pages.
+// @return Pointer to the buffer on success, NULL on failure.
+void* buffer_alloc(size_t size, bool locked);
+
+// Free a buffer allocated with buffer_alloc().
+void buffer_free(void* buf, bool locked);
+
+// Allocator for sample queues using buffer_alloc().
+template <typename T>
+class BufferAllocator {
+	public:
+		typedef T value_type;
+		typedef T* pointer;
+		typedef const T* const_pointer;
+		typedef T& reference;
+		typedef const T& const_reference;
+		typedef size_t size_type;
+		typedef ptrdiff_t difference_type;
+
+		template <typename U>
+		struct rebind { typedef BufferAllocator<U> other; };
+
+		BufferAllocator(bool locked = false): m_locked(locked) {}
+		template <typename U>
+		BufferAllocator(const BufferAllocator<U>& other): m_locked(other.m_locked) {}
+
+		T* allocate(size_t n) {
+			void* buf = buffer_alloc(n * sizeof(T), m_locked);
+			if (!buf)
+				throw std::bad_alloc();
+			return static_cast<T*>(buf);
+		}
+
+		void deallocate(T* buf, size_t) { buffer_free(buf, m_locked); }
+
+		template <typename U>
+		bool operator==(const BufferAllocator<U>& other) const { return m_locked == other.m_locked; }
+		template <typename U>
+		bool operator!=(const BufferAllocator<U>& other) const { return m_locked != other.m_locked; }
+
+		// Whether allocations use locked, prefaulted memory.
+		bool m_locked;
+};
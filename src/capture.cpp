@@ -0,0 +1,384 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "capture.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "buffer.hpp"
+#include "log.hpp"
+#include <libsmu/libsmu.hpp>
+
+using namespace smu;
+
+extern int ADC_MUX_Mode;
+
+static_assert(sizeof(CaptureHeader) == 72, "unexpected capture header layout");
+static_assert(sizeof(CaptureDeviceInfo) == 200, "unexpected capture device layout");
+static_assert(sizeof(CaptureIndexEntry) == 24, "unexpected capture index layout");
+
+static size_t round_up(size_t size, size_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+void smu::capture_stats(const std::array<float, 4>* frames, uint64_t samples,
+	unsigned num_devices, CaptureStats* stats)
+{
+	std::vector<double> sums(num_devices * 4, 0);
+	for (unsigned i = 0; i < num_devices * 4; i++)
+		stats[i] = samples ? CaptureStats{frames[i / 4][i % 4], frames[i / 4][i % 4], 0} : CaptureStats{0, 0, 0};
+
+	for (uint64_t n = 0; n < samples; n++) {
+		for (unsigned dev_i = 0; dev_i < num_devices; dev_i++) {
+			const std::array<float, 4>& frame = frames[n * num_devices + dev_i];
+			for (unsigned sig_i = 0; sig_i < 4; sig_i++) {
+				CaptureStats& stat = stats[dev_i * 4 + sig_i];
+				stat.min = std::min(stat.min, frame[sig_i]);
+				stat.max = std::max(stat.max, frame[sig_i]);
+				sums[dev_i * 4 + sig_i] += frame[sig_i];
+			}
+		}
+	}
+
+	for (unsigned i = 0; i < num_devices * 4; i++)
+		stats[i].mean = samples ? sums[i] / samples : 0;
+}
+
+Capture::~Capture()
+{
+	stop();
+}
+
+int Capture::write_at(const void* buf, size_t len, uint64_t offset)
+{
+	const char* data = static_cast<const char*>(buf);
+	while (len) {
+#ifdef _WIN32
+		if (_lseeki64(m_fd, offset, SEEK_SET) < 0)
+			return -errno;
+		int ret = _write(m_fd, data, len);
+#else
+		ssize_t ret = pwrite(m_fd, data, len, offset);
+#endif
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		data += ret;
+		offset += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+void Capture::update_header()
+{
+	std::memset(m_header_buf, 0, m_header.header_size);
+	std::memcpy(m_header_buf, &m_header, sizeof(m_header));
+	std::memcpy(static_cast<char*>(m_header_buf) + sizeof(m_header), m_devices.data(),
+		m_devices.size() * sizeof(CaptureDeviceInfo));
+}
+
+int Capture::start(const std::string& path, size_t block_size)
+{
+	if (m_fd >= 0)
+		return -EBUSY;
+	if (m_session->m_devices.empty())
+		return -ENODEV;
+
+	m_devices.clear();
+	for (Device* dev: m_session->m_devices) {
+		CaptureDeviceInfo info = {};
+		std::strncpy(info.serial, dev->m_serial.c_str(), sizeof(info.serial) - 1);
+		std::strncpy(info.hwver, dev->m_hwver.c_str(), sizeof(info.hwver) - 1);
+		std::strncpy(info.fwver, dev->m_fwver.c_str(), sizeof(info.fwver) - 1);
+		for (unsigned ch = 0; ch < 2; ch++)
+			info.mode[ch] = dev->get_mode(ch);
+		std::vector<std::vector<float>> cal;
+		dev->calibration(&cal);
+		for (unsigned i = 0; i < cal.size() && i < 8; i++) {
+			for (unsigned j = 0; j < cal[i].size() && j < 3; j++)
+				info.cal[i][j] = cal[i][j];
+		}
+		m_devices.push_back(info);
+	}
+
+	size_t frame_size = m_devices.size() * sizeof(std::array<float, 4>);
+	block_size = round_up(std::max(block_size, frame_size), CAPTURE_ALIGNMENT);
+
+	m_header = {};
+	std::memcpy(m_header.magic, CAPTURE_MAGIC, sizeof(m_header.magic));
+	m_header.version = CAPTURE_VERSION;
+	m_header.header_size = round_up(sizeof(CaptureHeader) +
+		m_devices.size() * sizeof(CaptureDeviceInfo), CAPTURE_ALIGNMENT);
+	m_header.block_size = block_size;
+	m_header.frames_per_block = block_size / frame_size;
+	m_header.num_devices = m_devices.size();
+	m_header.format = CAPTURE_FLOAT32;
+	m_header.sample_rate = m_session->m_sample_rate;
+	m_header.adc_mux = ::ADC_MUX_Mode;
+
+	// Locked buffers are page aligned as required for O_DIRECT and can't
+	// be paged out while capturing.
+	m_header_buf = buffer_alloc(m_header.header_size, true);
+	m_blocks[0] = buffer_alloc(block_size, true);
+	m_blocks[1] = buffer_alloc(block_size, true);
+	if (!m_header_buf || !m_blocks[0] || !m_blocks[1]) {
+		stop();
+		return -ENOMEM;
+	}
+
+#ifdef _WIN32
+	m_fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+	m_fd = open(path.c_str(), flags | O_DIRECT, 0644);
+	// not all filesystems support direct I/O (e.g. tmpfs)
+	if (m_fd < 0 && errno == EINVAL)
+#endif
+		m_fd = open(path.c_str(), flags, 0644);
+#endif
+	if (m_fd < 0) {
+		int ret = -errno;
+		stop();
+		return ret;
+	}
+
+	update_header();
+	int ret = write_at(m_header_buf, m_header.header_size, 0);
+	if (ret < 0) {
+		stop();
+		return ret;
+	}
+
+	m_fill = 0;
+	m_fill_frames = 0;
+	m_pending = -1;
+	m_block_no = 0;
+	m_index.clear();
+	m_error = 0;
+	m_exit = false;
+	m_stop = false;
+	m_write_thread = std::thread(&Capture::write_loop, this);
+	m_read_thread = std::thread(&Capture::read_loop, this);
+	return 0;
+}
+
+int Capture::submit()
+{
+	std::unique_lock<std::mutex> lk(m_lock);
+	// wait for the other block to finish writing
+	m_cv.wait(lk, [&]{ return m_pending < 0; });
+	if (m_error)
+		return m_error;
+
+	// zero the unused tail so blocks never contain stale samples
+	size_t used = m_fill_frames * m_devices.size() * sizeof(std::array<float, 4>);
+	std::memset(static_cast<char*>(m_blocks[m_fill]) + used, 0, m_header.block_size - used);
+
+	m_pending = m_fill;
+	m_pending_frames = m_fill_frames;
+	m_fill ^= 1;
+	m_fill_frames = 0;
+	m_cv.notify_all();
+	return 0;
+}
+
+int Capture::append(size_t samples)
+{
+	size_t num_devices = m_frames.size();
+	size_t pos = 0;
+
+	while (pos < samples) {
+		size_t count = std::min<size_t>(samples - pos, m_header.frames_per_block - m_fill_frames);
+		std::array<float, 4>* block = static_cast<std::array<float, 4>*>(m_blocks[m_fill]);
+		for (size_t i = 0; i < count; i++) {
+			for (size_t dev_i = 0; dev_i < num_devices; dev_i++)
+				block[(m_fill_frames + i) * num_devices + dev_i] = m_frames[dev_i][pos + i];
+		}
+		m_fill_frames += count;
+		pos += count;
+
+		if (m_fill_frames == m_header.frames_per_block) {
+			int ret = submit();
+			if (ret < 0)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+void Capture::read_loop()
+{
+	uint64_t overflows = 0;
+
+	while (true) {
+		// Check for the stop request before reading so all samples queued
+		// up to that point are drained.
+		bool stopping = m_stop;
+		ssize_t ret;
+		try {
+			ret = m_session->read(m_frames, m_header.frames_per_block - m_fill_frames,
+				stopping ? 0 : 100);
+		} catch (const std::system_error& e) {
+			overflows++;
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_header.overflows = overflows;
+			continue;
+		}
+		if (ret < 0) {
+			SMU_LOG(LOG_LEVEL_ERROR, "%s: failed reading samples: %zd\n", __func__, ret);
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_error = ret;
+			break;
+		}
+		if (append(ret) < 0)
+			break;
+		if (stopping && ret == 0)
+			break;
+	}
+
+	// write out the final partial block
+	if (m_fill_frames)
+		submit();
+}
+
+void Capture::index_block(const void* block, uint32_t frames)
+{
+	size_t num_stats = m_devices.size() * 4;
+	size_t entry_size = sizeof(CaptureIndexEntry) + num_stats * sizeof(CaptureStats);
+	size_t pos = m_index.size();
+	m_index.resize(pos + entry_size);
+
+	CaptureIndexEntry entry = {};
+	entry.first_sample = m_header.num_samples;
+	entry.offset = m_header.header_size + m_block_no * m_header.block_size;
+	entry.num_samples = frames;
+	std::memcpy(&m_index[pos], &entry, sizeof(entry));
+
+	std::vector<CaptureStats> stats(num_stats);
+	capture_stats(static_cast<const std::array<float, 4>*>(block), frames,
+		m_devices.size(), stats.data());
+	std::memcpy(&m_index[pos + sizeof(entry)], stats.data(), num_stats * sizeof(CaptureStats));
+}
+
+int Capture::write_index()
+{
+	uint64_t offset = m_header.header_size + m_block_no * m_header.block_size;
+	size_t size = round_up(16 + m_index.size(), CAPTURE_ALIGNMENT);
+	void* buf = buffer_alloc(size, true);
+	if (!buf)
+		return -ENOMEM;
+
+	std::memcpy(buf, CAPTURE_INDEX_MAGIC, 8);
+	std::memcpy(static_cast<char*>(buf) + 8, &m_block_no, sizeof(m_block_no));
+	std::memcpy(static_cast<char*>(buf) + 16, m_index.data(), m_index.size());
+	int ret = write_at(buf, size, offset);
+	buffer_free(buf, true);
+	if (ret < 0)
+		return ret;
+
+	// only reference the index once it's on disk
+	m_header.index_offset = offset;
+	update_header();
+	return write_at(m_header_buf, m_header.header_size, 0);
+}
+
+void Capture::write_loop()
+{
+	std::unique_lock<std::mutex> lk(m_lock);
+
+	while (true) {
+		m_cv.wait(lk, [&]{ return m_pending >= 0 || m_exit; });
+		if (m_pending < 0)
+			break;
+
+		void* block = m_blocks[m_pending];
+		uint64_t offset = m_header.header_size + m_block_no * m_header.block_size;
+		lk.unlock();
+		index_block(block, m_pending_frames);
+		int ret = write_at(block, m_header.block_size, offset);
+		lk.lock();
+
+		if (ret < 0) {
+			SMU_LOG(LOG_LEVEL_ERROR, "%s: failed writing capture block: %s\n", __func__, std::strerror(-ret));
+			m_error = ret;
+		} else {
+			// Publish the new sample count so readers of the growing file
+			// only see complete blocks.
+			m_block_no++;
+			m_header.num_samples += m_pending_frames;
+			update_header();
+			lk.unlock();
+			ret = write_at(m_header_buf, m_header.header_size, 0);
+			lk.lock();
+			if (ret < 0)
+				m_error = ret;
+		}
+		m_pending = -1;
+		m_cv.notify_all();
+	}
+}
+
+int64_t Capture::stop()
+{
+	int64_t ret;
+
+	if (m_read_thread.joinable()) {
+		m_stop = true;
+		m_read_thread.join();
+	}
+	if (m_write_thread.joinable()) {
+		std::unique_lock<std::mutex> lk(m_lock);
+		m_cv.wait(lk, [&]{ return m_pending < 0; });
+		m_exit = true;
+		m_cv.notify_all();
+		lk.unlock();
+		m_write_thread.join();
+	}
+
+	if (m_fd >= 0 && !m_error) {
+		int err = write_index();
+		if (err < 0) {
+			SMU_LOG(LOG_LEVEL_ERROR, "%s: failed writing capture index: %s\n", __func__, std::strerror(-err));
+			m_error = err;
+		}
+	}
+
+	ret = m_error ? m_error : m_header.num_samples;
+	if (m_fd >= 0) {
+#ifdef _WIN32
+		_close(m_fd);
+#else
+		close(m_fd);
+#endif
+		m_fd = -1;
+	}
+
+	buffer_free(m_header_buf, true);
+	buffer_free(m_blocks[0], true);
+	buffer_free(m_blocks[1], true);
+	m_header_buf = NULL;
+	m_blocks[0] = m_blocks[1] = NULL;
+	return ret;
+}
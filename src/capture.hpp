@@ -0,0 +1,95 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libsmu/capture.hpp>
+#include <libsmu/libsmu.hpp>
+
+namespace smu {
+	// Compute the statistics of all signals over consecutive frames.
+	// @param stats Statistics ordered as [device][signal], num_devices * 4 entries.
+	void capture_stats(const std::array<float, 4>* frames, uint64_t samples,
+		unsigned num_devices, CaptureStats* stats);
+
+	// Writes the samples of all session devices to a capture file.
+	//
+	// A capture thread consumes sample-aligned frames via Session::read()
+	// and fills one of two aligned block buffers while an I/O thread writes
+	// the other to disk, bypassing the page cache via O_DIRECT where
+	// supported. The USB thread is never involved beyond queuing samples
+	// as usual. The I/O thread also collects the statistics of each block
+	// for the index written once capturing stops.
+	class Capture {
+	public:
+		Capture(Session* session): m_session(session) {}
+		~Capture();
+
+		// Create the capture file and start capturing.
+		// @return On success, 0 is returned.
+		// @return On error, a negative errno code is returned.
+		int start(const std::string& path, size_t block_size);
+
+		// Stop capturing after writing all queued samples.
+		// @return On success, the number of samples captured per device.
+		// @return On error, a negative errno code is returned.
+		int64_t stop();
+
+	private:
+		// Consume frames from the session into block buffers.
+		void read_loop();
+		// Write submitted blocks to disk.
+		void write_loop();
+		// Append frames to the block being filled.
+		int append(size_t samples);
+		// Hand the block being filled to the I/O thread.
+		int submit();
+		int write_at(const void* buf, size_t len, uint64_t offset);
+		// Serialize the header into the header buffer.
+		void update_header();
+		// Add the index entry of the block being written.
+		void index_block(const void* block, uint32_t frames);
+		// Append the index after the last block.
+		int write_index();
+
+		Session* const m_session;
+		int m_fd = -1;
+
+		// Header and device information, padded to header_size.
+		CaptureHeader m_header = {};
+		std::vector<CaptureDeviceInfo> m_devices;
+		void* m_header_buf = NULL;
+
+		// Double buffered blocks, one being filled while the other is written.
+		void* m_blocks[2] = {NULL, NULL};
+		unsigned m_fill = 0;
+		uint32_t m_fill_frames = 0;
+		// Block queued for or being written, -1 if none.
+		int m_pending = -1;
+		uint32_t m_pending_frames = 0;
+		uint64_t m_block_no = 0;
+
+		// Index entries of the written blocks.
+		std::vector<unsigned char> m_index;
+
+		std::vector<std::vector<std::array<float, 4>>> m_frames;
+		std::atomic<bool> m_stop;
+		bool m_exit = false;
+		int m_error = 0;
+
+		std::mutex m_lock;
+		std::condition_variable m_cv;
+		std::thread m_read_thread;
+		std::thread m_write_thread;
+	};
+}
@@ -0,0 +1,302 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "capture.hpp"
+#include <libsmu/capture.hpp>
+
+using namespace smu;
+
+CaptureReader::~CaptureReader()
+{
+	close();
+}
+
+int CaptureReader::open(const std::string& path)
+{
+	close();
+
+#ifdef _WIN32
+	m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_file == INVALID_HANDLE_VALUE) {
+		m_file = NULL;
+		return GetLastError() == ERROR_FILE_NOT_FOUND ? -ENOENT : -EIO;
+	}
+#else
+	m_fd = ::open(path.c_str(), O_RDONLY);
+	if (m_fd < 0)
+		return -errno;
+#endif
+
+	int ret = refresh();
+	if (ret < 0)
+		close();
+	return ret;
+}
+
+void CaptureReader::close()
+{
+	unmap();
+#ifdef _WIN32
+	if (m_file)
+		CloseHandle(m_file);
+	m_file = NULL;
+#else
+	if (m_fd >= 0)
+		::close(m_fd);
+	m_fd = -1;
+#endif
+	m_header = {};
+	m_devices.clear();
+	m_block_stats.clear();
+	m_block_stats_valid.clear();
+}
+
+int CaptureReader::map()
+{
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_file, &size))
+		return -EIO;
+	if ((uint64_t)size.QuadPart == m_size)
+		return 0;
+	unmap();
+	if (!size.QuadPart)
+		return 0;
+	m_mapping = CreateFileMapping(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!m_mapping)
+		return -EIO;
+	m_data = static_cast<const unsigned char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+	if (!m_data) {
+		CloseHandle(m_mapping);
+		m_mapping = NULL;
+		return -ENOMEM;
+	}
+	m_size = size.QuadPart;
+#else
+	struct stat st;
+	if (fstat(m_fd, &st) < 0)
+		return -errno;
+	if ((uint64_t)st.st_size == m_size)
+		return 0;
+	unmap();
+	if (!st.st_size)
+		return 0;
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, m_fd, 0);
+	if (data == MAP_FAILED)
+		return -errno;
+	m_data = static_cast<const unsigned char*>(data);
+	m_size = st.st_size;
+#endif
+	return 0;
+}
+
+void CaptureReader::unmap()
+{
+	if (m_data) {
+#ifdef _WIN32
+		UnmapViewOfFile(m_data);
+		CloseHandle(m_mapping);
+		m_mapping = NULL;
+#else
+		munmap(const_cast<unsigned char*>(m_data), m_size);
+#endif
+	}
+	m_data = NULL;
+	m_size = 0;
+	m_index = NULL;
+}
+
+int CaptureReader::refresh()
+{
+	// The file only grows while it's written, remap it to cover new blocks.
+	int ret = map();
+	if (ret < 0)
+		return ret;
+
+	CaptureHeader header;
+	if (m_size < sizeof(header))
+		return -EINVAL;
+	std::memcpy(&header, m_data, sizeof(header));
+	if (std::memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) ||
+			header.version != CAPTURE_VERSION ||
+			header.format != CAPTURE_FLOAT32 ||
+			!header.num_devices || !header.frames_per_block ||
+			(uint64_t)header.frames_per_block * header.num_devices * sizeof(std::array<float, 4>) > header.block_size ||
+			header.header_size < sizeof(header) + header.num_devices * sizeof(CaptureDeviceInfo) ||
+			header.header_size > m_size)
+		return -EINVAL;
+
+	// Don't trust the sample count beyond the mapped blocks, the header may
+	// be written before the file size is visible.
+	uint64_t mapped_blocks = (m_size - header.header_size) / header.block_size;
+	header.num_samples = std::min<uint64_t>(header.num_samples, mapped_blocks * header.frames_per_block);
+
+	m_header = header;
+	m_devices.resize(header.num_devices);
+	std::memcpy(m_devices.data(), m_data + sizeof(header), m_devices.size() * sizeof(CaptureDeviceInfo));
+
+	// load the index of completed captures
+	m_index = NULL;
+	size_t entry_size = sizeof(CaptureIndexEntry) + header.num_devices * 4 * sizeof(CaptureStats);
+	if (header.index_offset && header.index_offset + 16 <= m_size) {
+		const unsigned char* index = m_data + header.index_offset;
+		uint64_t entries;
+		std::memcpy(&entries, index + 8, sizeof(entries));
+		if (!std::memcmp(index, CAPTURE_INDEX_MAGIC, 8) && entries == blocks() &&
+				header.index_offset + 16 + entries * entry_size <= m_size)
+			m_index = index + 16;
+	}
+	return 0;
+}
+
+uint64_t CaptureReader::blocks() const
+{
+	if (!m_header.frames_per_block)
+		return 0;
+	return (m_header.num_samples + m_header.frames_per_block - 1) / m_header.frames_per_block;
+}
+
+int64_t CaptureReader::view(uint64_t start, uint64_t count, std::vector<CaptureSpan>& spans) const
+{
+	spans.clear();
+	if (!m_data)
+		return -EBADF;
+	if (start > m_header.num_samples)
+		return -EINVAL;
+
+	count = std::min(count, m_header.num_samples - start);
+	uint64_t pos = start;
+	while (pos < start + count) {
+		uint64_t block = pos / m_header.frames_per_block;
+		uint64_t frame = pos % m_header.frames_per_block;
+		uint64_t len = std::min<uint64_t>(start + count - pos, m_header.frames_per_block - frame);
+
+		const unsigned char* data = m_data + m_header.header_size + block * m_header.block_size;
+		CaptureSpan span;
+		span.first_sample = pos;
+		span.num_samples = len;
+		span.num_devices = m_header.num_devices;
+		span.frames = reinterpret_cast<const std::array<float, 4>*>(data) + frame * m_header.num_devices;
+		spans.push_back(span);
+		pos += len;
+	}
+	return count;
+}
+
+const CaptureStats* CaptureReader::block_stats(uint64_t block) const
+{
+	size_t num_stats = m_header.num_devices * 4;
+	if (m_index) {
+		size_t entry_size = sizeof(CaptureIndexEntry) + num_stats * sizeof(CaptureStats);
+		const unsigned char* entry = m_index + block * entry_size;
+		return reinterpret_cast<const CaptureStats*>(entry + sizeof(CaptureIndexEntry));
+	}
+
+	if (m_block_stats_valid.size() < blocks()) {
+		m_block_stats_valid.resize(blocks(), false);
+		m_block_stats.resize(blocks() * num_stats);
+	}
+	CaptureStats* stats = &m_block_stats[block * num_stats];
+	if (!m_block_stats_valid[block]) {
+		std::vector<CaptureSpan> spans;
+		view(block * m_header.frames_per_block, m_header.frames_per_block, spans);
+		capture_stats(spans[0].frames, spans[0].num_samples, m_header.num_devices, stats);
+		m_block_stats_valid[block] = true;
+	}
+	return stats;
+}
+
+int CaptureReader::stats(uint64_t block, std::vector<CaptureStats>& stats) const
+{
+	if (!m_data)
+		return -EBADF;
+	if (block >= blocks())
+		return -EINVAL;
+
+	const CaptureStats* block_stats = this->block_stats(block);
+	stats.assign(block_stats, block_stats + m_header.num_devices * 4);
+	return 0;
+}
+
+int64_t CaptureReader::summary(unsigned device, unsigned signal, uint64_t start, uint64_t end,
+	size_t pixels, std::vector<SignalStats>& stats) const
+{
+	stats.clear();
+	if (!m_data)
+		return -EBADF;
+	if (device >= m_header.num_devices || signal >= 4 || !pixels || end <= start)
+		return -EINVAL;
+	if (start >= m_header.num_samples)
+		return -ERANGE;
+	end = std::min(end, m_header.num_samples);
+
+	uint64_t frames = m_header.frames_per_block;
+	size_t s = device * 4 + signal;
+	if ((end - start + pixels - 1) / pixels >= frames) {
+		// work in blocks, weighting the means by the samples they hold
+		uint64_t a = start / frames;
+		uint64_t b = (end + frames - 1) / frames;
+		uint64_t width = (b - a + pixels - 1) / pixels;
+		stats.reserve((b - a + width - 1) / width);
+		for (uint64_t p = a; p < b; p += width) {
+			float min = std::numeric_limits<float>::infinity();
+			float max = -std::numeric_limits<float>::infinity();
+			double sum = 0;
+			uint64_t weight = 0;
+			for (uint64_t block = p; block < std::min(p + width, b); block++) {
+				const CaptureStats& stat = block_stats(block)[s];
+				uint64_t samples = std::min(frames, m_header.num_samples - block * frames);
+				min = std::min(min, stat.min);
+				max = std::max(max, stat.max);
+				sum += (double)stat.mean * samples;
+				weight += samples;
+			}
+			stats.push_back({min, max, (float)(sum / weight)});
+		}
+		return width * frames;
+	}
+
+	uint64_t a = start / PYRAMID_DECIMATION * PYRAMID_DECIMATION;
+	uint64_t b = (end + PYRAMID_DECIMATION - 1) / PYRAMID_DECIMATION * PYRAMID_DECIMATION;
+	uint64_t width = ((b - a) / PYRAMID_DECIMATION + pixels - 1) / pixels * PYRAMID_DECIMATION;
+	std::vector<CaptureSpan> spans;
+	stats.reserve((b - a + width - 1) / width);
+	for (uint64_t p = a; p < end; p += width) {
+		float min = std::numeric_limits<float>::infinity();
+		float max = -std::numeric_limits<float>::infinity();
+		double sum = 0;
+		uint64_t weight = 0;
+		view(p, width, spans);
+		for (const CaptureSpan& span: spans) {
+			for (uint64_t i = 0; i < span.num_samples; i++) {
+				float v = span.at(i, device)[signal];
+				min = std::min(min, v);
+				max = std::max(max, v);
+				sum += v;
+			}
+			weight += span.num_samples;
+		}
+		stats.push_back({min, max, (float)(sum / weight)});
+	}
+	return width;
+}
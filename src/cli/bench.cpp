@@ -0,0 +1,553 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+// Host capability measurement: timed continuous and noncontinuous captures
+// on all session devices, sweeping sample rate and USB transfer sizing.
+
+#ifdef USE_CUSTOM_GETOPT
+#include "getopt_internal.h"
+#else
+#include <getopt.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/syscall.h>
+#endif
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "bench.hpp"
+#include <libsmu/libsmu.hpp>
+
+using std::cerr;
+using std::endl;
+
+using namespace smu;
+
+typedef std::chrono::steady_clock Clock;
+
+struct ThreadUsage {
+	std::string name;
+	// CPU time as a fraction of a single core
+	double cpu;
+};
+
+struct BenchResult {
+	bool continuous;
+	unsigned rate;
+	double transfer_time;
+	double samples_per_second;
+	// samples dropped due to full input queues
+	uint64_t drops;
+	uint64_t underruns;
+	double latency_p50;
+	double latency_p90;
+	double latency_p99;
+	double latency_max;
+	std::vector<ThreadUsage> threads;
+	// CPU time per processing stage, empty if libsmu wasn't built with profiling
+	std::vector<StageProfile> profile;
+	std::string error;
+};
+
+struct BenchOptions {
+	std::vector<unsigned> rates = {10000, 50000, 100000};
+	// 0 uses the library default
+	std::vector<double> transfer_times = {0.005, 0.02, 0.05};
+	double duration = 5;
+	unsigned block = 1000;
+	bool continuous = true;
+	bool noncontinuous = true;
+	// JSON output file, "-" for stdout
+	std::string json;
+};
+
+static double ms_since(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static double percentile(std::vector<double>& values, double p)
+{
+	if (values.empty())
+		return 0;
+	std::sort(values.begin(), values.end());
+	size_t i = std::min<size_t>(values.size() - 1, p * values.size());
+	return values[i];
+}
+
+// CPU time in seconds used by each thread of the process, keyed by thread
+// name. Only Linux exposes per-thread usage, elsewhere the process total is
+// reported.
+static std::map<std::string, double> thread_times()
+{
+	std::map<std::string, double> times;
+#ifdef __linux__
+	long ticks = sysconf(_SC_CLK_TCK);
+	pid_t self = syscall(SYS_gettid);
+	DIR* dir = opendir("/proc/self/task");
+	if (!dir)
+		return times;
+	while (struct dirent* entry = readdir(dir)) {
+		if (entry->d_name[0] == '.')
+			continue;
+		std::ifstream file(std::string("/proc/self/task/") + entry->d_name + "/stat");
+		std::string stat((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		size_t open = stat.find('('), close = stat.rfind(')');
+		if (open == std::string::npos || close == std::string::npos)
+			continue;
+
+		// utime and stime are the 14th and 15th fields, the fields
+		// following the name start at the 3rd
+		std::istringstream fields(stat.substr(close + 2));
+		std::string field;
+		unsigned long utime = 0, stime = 0;
+		for (unsigned i = 3; i <= 15 && fields >> field; i++) {
+			if (i == 14)
+				utime = std::strtoul(field.c_str(), NULL, 10);
+			else if (i == 15)
+				stime = std::strtoul(field.c_str(), NULL, 10);
+		}
+
+		std::string name = stat.substr(open + 1, close - open - 1);
+		pid_t tid = std::atoi(entry->d_name);
+		name += (tid == self) ? " (main)" : " (" + std::string(entry->d_name) + ")";
+		times[name] = (double)(utime + stime) / ticks;
+	}
+	closedir(dir);
+#elif defined(_WIN32)
+	FILETIME create, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &create, &exit, &kernel, &user);
+	auto to_sec = [](FILETIME t) {
+		return (((uint64_t)t.dwHighDateTime << 32) | t.dwLowDateTime) * 1e-7;
+	};
+	times["process"] = to_sec(kernel) + to_sec(user);
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	times["process"] = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+		usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+#endif
+	return times;
+}
+
+static std::vector<ThreadUsage> thread_usage(const std::map<std::string, double>& start,
+	const std::map<std::string, double>& end, double elapsed)
+{
+	std::vector<ThreadUsage> usage;
+	for (const auto& thread: end) {
+		auto prev = start.find(thread.first);
+		double cpu = thread.second - (prev != start.end() ? prev->second : 0);
+		usage.push_back({thread.first, cpu / elapsed});
+	}
+	return usage;
+}
+
+static uint64_t underruns(Session* session)
+{
+	uint64_t total = 0;
+	for (Device* dev: session->m_devices)
+		total += dev->m_underruns;
+	return total;
+}
+
+// Source a cyclic waveform on channel A of every device, underruns then
+// show the write threads failing to keep the output queues fed.
+static void source(Session* session)
+{
+	std::vector<float> out;
+	for (Device* dev: session->m_devices) {
+		if (out.empty())
+			dev->signal(0, 0)->sine(out, 1000, 0.5, 4.5, 1000, 0);
+		dev->flush(0, true);
+		dev->write(out, 0, true);
+	}
+}
+
+// Stream continuously, reading blocks of samples from all devices.
+static int bench_continuous(Session* session, const BenchOptions& options, BenchResult& result)
+{
+	unsigned rate = session->m_sample_rate;
+	std::vector<std::vector<std::array<float, 4>>> frames;
+	std::vector<double> arrivals;
+	uint64_t samples = 0;
+	int ret;
+
+	source(session);
+	uint64_t underruns_start = underruns(session);
+	uint64_t drops_start = session->stats().samples_dropped;
+
+	ret = session->start(0);
+	if (ret < 0)
+		return ret;
+
+	auto times_start = thread_times();
+	auto read_start = Clock::now();
+	while (ms_since(read_start) < options.duration * 1000) {
+		ret = session->read(frames, options.block, 1000);
+		if (ret < 0)
+			break;
+		if (ret == 0 && session->cancelled()) {
+			ret = -EIO;
+			break;
+		}
+		samples += ret;
+		// arrival time of the block minus the time its last sample was taken
+		arrivals.push_back(ms_since(read_start) - samples * 1000.0 / rate);
+	}
+	double elapsed = ms_since(read_start) / 1000;
+	auto times_end = thread_times();
+
+	result.drops = session->stats().samples_dropped - drops_start;
+
+	session->cancel();
+	session->end();
+	if (ret < 0)
+		return ret;
+
+	result.samples_per_second = samples / elapsed;
+	result.underruns = underruns(session) - underruns_start;
+	result.threads = thread_usage(times_start, times_end, elapsed);
+
+	// Latency is measured relative to the earliest block arrival since the
+	// exact time sampling started on the devices isn't known.
+	if (!arrivals.empty()) {
+		double base = *std::min_element(arrivals.begin(), arrivals.end());
+		for (auto& a: arrivals)
+			a -= base;
+	}
+	result.latency_max = arrivals.empty() ? 0 : *std::max_element(arrivals.begin(), arrivals.end());
+	result.latency_p50 = percentile(arrivals, 0.50);
+	result.latency_p90 = percentile(arrivals, 0.90);
+	result.latency_p99 = percentile(arrivals, 0.99);
+	return 0;
+}
+
+// Run back to back fixed length captures of 100ms each, latency being the
+// time each capture takes beyond its nominal duration.
+static int bench_noncontinuous(Session* session, const BenchOptions& options, BenchResult& result)
+{
+	unsigned rate = session->m_sample_rate;
+	unsigned capture = std::max(rate / 10, 1u);
+	std::vector<std::vector<std::array<float, 4>>> frames;
+	std::vector<double> overheads;
+	uint64_t samples = 0;
+	int ret = 0;
+
+	source(session);
+	uint64_t underruns_start = underruns(session);
+	uint64_t drops_start = session->stats().samples_dropped;
+
+	auto times_start = thread_times();
+	auto bench_start = Clock::now();
+	while (ms_since(bench_start) < options.duration * 1000) {
+		auto capture_start = Clock::now();
+		ret = session->start(capture);
+		if (ret < 0)
+			break;
+		// dropped samples never arrive, making the capture come up short
+		ret = session->read(frames, capture, 1000 + capture * 2000 / rate);
+		session->end();
+		if (ret < 0)
+			break;
+		if (ret == 0) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+		samples += ret;
+		overheads.push_back(ms_since(capture_start) - capture * 1000.0 / rate);
+	}
+	double elapsed = ms_since(bench_start) / 1000;
+	auto times_end = thread_times();
+	result.drops = session->stats().samples_dropped - drops_start;
+	if (ret < 0)
+		return ret;
+
+	result.samples_per_second = samples / elapsed;
+	result.underruns = underruns(session) - underruns_start;
+	result.threads = thread_usage(times_start, times_end, elapsed);
+	result.latency_max = overheads.empty() ? 0 : *std::max_element(overheads.begin(), overheads.end());
+	result.latency_p50 = percentile(overheads, 0.50);
+	result.latency_p90 = percentile(overheads, 0.90);
+	result.latency_p99 = percentile(overheads, 0.99);
+	return 0;
+}
+
+static void write_json(std::ostream& out, Session* session, const BenchOptions& options,
+	const std::vector<BenchResult>& results)
+{
+	out << "{\n";
+	out << "  \"devices\": [";
+	unsigned i = 0;
+	for (Device* dev: session->m_devices) {
+		out << (i++ ? ", " : "") << "{\"serial\": \"" << dev->m_serial
+			<< "\", \"fwver\": \"" << dev->m_fwver
+			<< "\", \"hwver\": \"" << dev->m_hwver << "\"}";
+	}
+	out << "],\n";
+	out << "  \"duration\": " << options.duration << ",\n";
+	out << "  \"block\": " << options.block << ",\n";
+	out << "  \"results\": [\n";
+	for (i = 0; i < results.size(); i++) {
+		const BenchResult& r = results[i];
+		out << "    {\"mode\": \"" << (r.continuous ? "continuous" : "noncontinuous") << "\""
+			<< ", \"rate\": " << r.rate
+			<< ", \"transfer_time\": " << r.transfer_time;
+		if (!r.error.empty()) {
+			out << ", \"error\": \"" << r.error << "\"}";
+		} else {
+			out << ", \"samples_per_second\": " << r.samples_per_second
+				<< ", \"samples_dropped\": " << r.drops
+				<< ", \"underruns\": " << r.underruns
+				<< ", \"latency_ms\": {\"p50\": " << r.latency_p50
+				<< ", \"p90\": " << r.latency_p90
+				<< ", \"p99\": " << r.latency_p99
+				<< ", \"max\": " << r.latency_max << "}"
+				<< ", \"cpu\": {";
+			for (size_t j = 0; j < r.threads.size(); j++)
+				out << (j ? ", " : "") << "\"" << r.threads[j].name << "\": " << r.threads[j].cpu;
+			out << "}";
+			if (!r.profile.empty()) {
+				out << ", \"profile\": {";
+				for (size_t j = 0; j < r.profile.size(); j++) {
+					const StageProfile& stage = r.profile[j];
+					out << (j ? ", " : "") << "\"" << stage.name << "\": {\"calls\": " << stage.calls
+						<< ", \"ns_per_sample\": " << stage.per_sample * 1e9
+						<< ", \"us_per_transfer\": " << stage.per_transfer * 1e6 << "}";
+				}
+				out << "}";
+			}
+			out << "}";
+		}
+		out << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n";
+	out << "}\n";
+}
+
+static void write_table(const std::vector<BenchResult>& results)
+{
+	printf("%-13s %8s %8s %12s %6s %9s %9s %9s %9s  %s\n",
+		"mode", "rate", "transfer", "samples/s", "drops", "underruns",
+		"p50 ms", "p99 ms", "max ms", "cpu per thread");
+	for (const BenchResult& r: results) {
+		printf("%-13s %8u %7.0fms", r.continuous ? "continuous" : "noncontinuous",
+			r.rate, r.transfer_time * 1000);
+		if (!r.error.empty()) {
+			printf(" %s\n", r.error.c_str());
+			continue;
+		}
+		printf(" %12.0f %6llu %9llu %9.2f %9.2f %9.2f ",
+			r.samples_per_second, (unsigned long long)r.drops, (unsigned long long)r.underruns,
+			r.latency_p50, r.latency_p99, r.latency_max);
+		for (const ThreadUsage& thread: r.threads) {
+			if (thread.cpu >= 0.001)
+				printf(" %s: %.1f%%", thread.name.c_str(), thread.cpu * 100);
+		}
+		printf("\n");
+	}
+
+	// CPU time per stage, for builds with profiling
+	bool profiled = false;
+	for (const BenchResult& r: results) {
+		if (r.profile.empty())
+			continue;
+		if (!profiled) {
+			printf("\n%-13s %8s %8s  %s\n", "mode", "rate", "transfer",
+				"stage: ns/sample, us/transfer");
+			profiled = true;
+		}
+		printf("%-13s %8u %7.0fms ", r.continuous ? "continuous" : "noncontinuous",
+			r.rate, r.transfer_time * 1000);
+		for (const StageProfile& stage: r.profile) {
+			if (stage.calls)
+				printf(" %s: %.1f, %.1f", stage.name.c_str(), stage.per_sample * 1e9, stage.per_transfer * 1e6);
+		}
+		printf("\n");
+	}
+}
+
+static void display_usage(void)
+{
+	printf("smu bench: measure whether this host sustains streaming from the attached devices\n"
+		"\n"
+		" -h, --help                   print this help message and exit\n"
+		" -r, --rates <list>           comma separated sample rates (default: 10000,50000,100000)\n"
+		" -x, --transfer-times <list>  comma separated USB transfer times in seconds, 0 for the\n"
+		"                              library default (default: 0.005,0.02,0.05)\n"
+		" -t, --duration <seconds>     time spent per configuration and mode (default: 5)\n"
+		" -b, --block <samples>        samples per read in continuous mode (default: 1000)\n"
+		" -c, --continuous             only run continuous captures\n"
+		" -N, --noncontinuous          only run noncontinuous captures\n"
+		" -j, --json <file>            write JSON results to a file, - for stdout\n"
+		"     --virtual <count>        add virtual devices to the session\n");
+}
+
+int bench_main(Session* session, int argc, char** argv)
+{
+	BenchOptions options;
+	int opt;
+	int option_index = 0;
+	static struct option long_options[] = {
+		{"help",           no_argument,       0, 'h'},
+		{"rates",          required_argument, 0, 'r'},
+		{"transfer-times", required_argument, 0, 'x'},
+		{"duration",       required_argument, 0, 't'},
+		{"block",          required_argument, 0, 'b'},
+		{"continuous",     no_argument,       0, 'c'},
+		{"noncontinuous",  no_argument,       0, 'N'},
+		{"json",           required_argument, 0, 'j'},
+		{"virtual",        required_argument, 0, 'V'},
+		{0, 0, 0, 0}
+	};
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "hr:x:t:b:cNj:",
+			long_options, &option_index)) != -1) {
+		switch (opt) {
+			case 'r': {
+				options.rates.clear();
+				std::istringstream list(optarg);
+				std::string rate;
+				while (std::getline(list, rate, ','))
+					options.rates.push_back(std::strtoul(rate.c_str(), NULL, 10));
+				break;
+			}
+			case 'x': {
+				options.transfer_times.clear();
+				std::istringstream list(optarg);
+				std::string time;
+				while (std::getline(list, time, ','))
+					options.transfer_times.push_back(std::atof(time.c_str()));
+				break;
+			}
+			case 't':
+				options.duration = std::atof(optarg);
+				break;
+			case 'b':
+				options.block = std::strtoul(optarg, NULL, 10);
+				break;
+			case 'c':
+				options.noncontinuous = false;
+				break;
+			case 'N':
+				options.continuous = false;
+				break;
+			case 'j':
+				options.json = optarg;
+				break;
+			case 'V':
+				if (session->add_virtual(std::strtoul(optarg, NULL, 10)) < 0) {
+					perror("smu: failed adding virtual devices");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'h':
+				display_usage();
+				return EXIT_SUCCESS;
+			default:
+				display_usage();
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (options.rates.empty() || options.transfer_times.empty() || !options.block ||
+			(!options.continuous && !options.noncontinuous)) {
+		display_usage();
+		return EXIT_FAILURE;
+	}
+	if (session->m_devices.empty()) {
+		cerr << "smu: no supported devices plugged in" << endl;
+		return EXIT_FAILURE;
+	}
+
+	// overflows are counted in samples from the device stats instead of
+	// being thrown by reads
+	session->m_dataflow_exceptions = false;
+
+	// source on channel A and measure on channel B of every device
+	for (Device* dev: session->m_devices) {
+		dev->set_mode(0, SVMI);
+		dev->set_mode(1, HI_Z);
+	}
+
+	std::vector<BenchResult> results;
+	for (unsigned rate: options.rates) {
+		for (double transfer_time: options.transfer_times) {
+			for (bool continuous: {true, false}) {
+				if ((continuous && !options.continuous) || (!continuous && !options.noncontinuous))
+					continue;
+
+				BenchResult result = BenchResult();
+				result.continuous = continuous;
+				result.transfer_time = transfer_time;
+				session->m_transfer_time = transfer_time;
+				int ret = session->configure(rate);
+				result.rate = session->m_sample_rate;
+				session->reset_profile();
+				if (ret >= 0) {
+					try {
+						if (continuous)
+							ret = bench_continuous(session, options, result);
+						else
+							ret = bench_noncontinuous(session, options, result);
+					} catch (const std::exception& e) {
+						result.error = e.what();
+					}
+					result.profile = session->profile();
+				}
+				if (ret < 0)
+					result.error = std::system_category().message(-ret);
+				if (!result.error.empty())
+					cerr << "smu: " << (continuous ? "continuous" : "noncontinuous") << " capture at "
+						<< rate << " samples/s failed: " << result.error << endl;
+				results.push_back(result);
+			}
+		}
+	}
+
+	for (Device* dev: session->m_devices)
+		dev->set_mode(0, HI_Z);
+
+	if (options.json.empty()) {
+		write_table(results);
+	} else if (options.json == "-") {
+		write_json(std::cout, session, options, results);
+	} else {
+		std::ofstream out(options.json);
+		write_json(out, session, options, results);
+		if (!out) {
+			cerr << "smu: failed writing " << options.json << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (const BenchResult& result: results) {
+		if (!result.error.empty())
+			return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,13 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#pragma once
+
+#include <libsmu/libsmu.hpp>
+
+// Run the `smu bench` subcommand on the devices of a session.
+// @param argc Argument count starting at the subcommand.
+// @param argv Arguments starting at the subcommand.
+// @return Exit status of the subcommand.
+int bench_main(smu::Session* session, int argc, char** argv);
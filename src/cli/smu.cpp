@@ -10,26 +10,21 @@
 #include <getopt.h>
 #endif
 
-#if _WIN32
-#include <io.h>
-#else
-#include <unistd.h>
-#endif
-
+#include <algorithm>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <chrono>
 #include <iostream>
+#include <string>
 #include <vector>
 #include <system_error>
 #include <thread>
 
+#include "bench.hpp"
+#include "stream.hpp"
 #include <libsmu/libsmu.hpp>
 
-#ifndef _WIN32
-int (*_isatty)(int) = &isatty;
-#endif
-
 using std::cout;
 using std::cerr;
 using std::endl;
@@ -49,56 +44,56 @@ static void list_devices(Session* session)
 	}
 }
 
+// Add devices to the session as they're plugged in and remove them as
+// they're unplugged, until interrupted.
+static void simple_hotplug(Session* session)
+{
+	session->hotplug_detach([=](Device* dev) {
+		if (!session->remove(dev, true)) {
+			printf("removed device: %s: serial %s : fw %s : hw %s\n",
+					dev->info()->label, dev->m_serial.c_str(),
+					dev->m_fwver.c_str(), dev->m_hwver.c_str());
+		}
+	});
+	session->hotplug_attach([=](Device* dev) {
+		if (!session->add(dev)) {
+			printf("added device: %s: serial %s : fw %s : hw %s\n",
+					dev->info()->label, dev->m_serial.c_str(),
+					dev->m_fwver.c_str(), dev->m_hwver.c_str());
+		}
+	});
+
+	cout << "waiting for hotplug events..." << endl;
+	while (true)
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+}
+
 static void display_usage(void)
 {
 	printf("smu: utility for managing M1K devices\n"
+		"\n"
+		"usage: smu [options]\n"
+		"       smu bench [options]    measure sustained streaming on this host, see smu bench --help\n"
 		"\n"
 		" -h, --help                   print this help message and exit\n"
 		" --version                    show libsmu version\n"
 		" -l, --list-devices           list supported devices currently attached to the system\n"
 		" -p, --hotplug-devices        simple session device hotplug testing\n"
-		" -s, --stream-samples         stream samples to stdout from a single attached device\n"
+		" -s, --stream                 stream samples from all attached devices\n"
+		"     --format <text|float32|int16> output format of streamed samples, binary formats\n"
+		"                              start with a header describing the stream (default: text)\n"
+		" -n, --samples <count>        number of samples to stream per device (default: until interrupted)\n"
+		" -R, --rate <rate>            sample rate (default: device default)\n"
+		" -D, --device <serial>        stream from the given device, can be repeated (default: all)\n"
+		" -o, --output <file>          write streamed samples to a file instead of stdout\n"
+		"     --virtual <count>        add virtual devices to the session\n"
+		"     --trace <file>           record a Chrome trace of the USB and sample pipeline while streaming\n"
 		" -d, --display-calibration    display calibration data from all attached devices\n"
 		" -r, --reset-calibration      reset calibration data to the defaults on all attached devices\n"
 		" -w, --write-calibration <cal file> write calibration data to a single attached device\n"
 		" -f, --flash <firmware image> flash firmware image to a single attached device\n");
 }
 
-static void stream_samples(Session* session)
-{
-	auto dev = *(session->m_devices.begin());
-	auto dev_info = dev->info();
-	for (unsigned ch_i = 0; ch_i < dev_info->channel_count; ch_i++) {
-		dev->set_mode(ch_i, HI_Z);
-	}
-
-	session->configure(dev->get_default_rate());
-	session->start(0);
-	std::vector<std::array<float, 4>> buf;
-	unsigned dev_index;
-
-	while (true) {
-		dev_index = 0;
-		for (auto dev: session->m_devices) {
-			try {
-				dev->read(buf, 1000, -1);
-			} catch (const std::runtime_error& e) {
-				// Only error out if stdout isn't a tty, otherwise it usually
-				// can't keep up anyway.
-				if (!_isatty(1)) {
-					cerr << "smu: stopping stream: " << e.what() << endl;
-					return;
-				}
-			}
-
-			for (auto x: buf) {
-				printf("dev %u: %f %f %f %f\n", dev_index, x[0], x[1], x[2], x[3]);
-			}
-			dev_index++;
-		}
-	};
-}
-
 int write_calibration(Session* session, const char *file)
 {
 	int ret;
@@ -163,6 +158,10 @@ int main(int argc, char **argv)
 {
 	int opt;
 	int option_index = 0;
+	bool stream = false;
+	StreamOptions stream_options;
+	std::vector<std::string> serials;
+	char* end;
 
 	// display usage info if no arguments are specified
 	if (argc == 1) {
@@ -177,12 +176,26 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if (!strcmp(argv[1], "bench")) {
+		int ret = bench_main(session, argc - 1, argv + 1);
+		delete session;
+		return ret;
+	}
+
 	// map long options to short ones
 	static struct option long_options[] = {
 		{"help",     no_argument, 0, 'a'},
         {"version",     no_argument, 0, 'v'},
 		{"list",     no_argument, 0, 'l'},
+		{"hotplug-devices", no_argument, 0, 'p'},
 		{"stream",   no_argument, 0, 's'},
+		{"format",   required_argument, 0, 'F'},
+		{"samples",  required_argument, 0, 'n'},
+		{"rate",     required_argument, 0, 'R'},
+		{"device",   required_argument, 0, 'D'},
+		{"output",   required_argument, 0, 'o'},
+		{"virtual",  required_argument, 0, 'V'},
+		{"trace",    required_argument, 0, 'T'},
 		{"display-calibration", no_argument, 0, 'd'},
 		{"reset-calibration", no_argument, 0, 'r'},
 		{"write-calibration", required_argument, 0, 'w'},
@@ -190,19 +203,59 @@ int main(int argc, char **argv)
 		{0, 0, 0, 0}
 	};
 
-	while ((opt = getopt_long(argc, argv, "hvplsdrw:f:",
+	while ((opt = getopt_long(argc, argv, "hvplsdrw:f:n:R:D:o:",
 			long_options, &option_index)) != -1) {
 		switch (opt) {
 			case 'l':
 				// list attached device info
 				list_devices(session);
 				break;
+			case 'p':
+				// handle device hotplugging until interrupted
+				simple_hotplug(session);
+				break;
 			case 's':
-				// stream samples from an attached device to stdout
-				if (!session->m_devices.empty()) {
-					stream_samples(session);
+				// stream samples once all options are parsed
+				stream = true;
+				break;
+			case 'F':
+				if (!strcmp(optarg, "text")) {
+					stream_options.format = STREAM_TEXT;
+				} else if (!strcmp(optarg, "float32")) {
+					stream_options.format = STREAM_FLOAT32;
+				} else if (!strcmp(optarg, "int16")) {
+					stream_options.format = STREAM_INT16;
 				} else {
-					cerr << "smu: no supported devices plugged in" << endl;
+					cerr << "smu: invalid stream format: " << optarg << endl;
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'n':
+				stream_options.samples = strtoull(optarg, &end, 10);
+				if (*end || !*optarg) {
+					cerr << "smu: invalid sample count: " << optarg << endl;
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'R':
+				stream_options.sample_rate = strtoul(optarg, &end, 10);
+				if (*end || !stream_options.sample_rate) {
+					cerr << "smu: invalid sample rate: " << optarg << endl;
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'D':
+				serials.push_back(optarg);
+				break;
+			case 'o':
+				stream_options.output = optarg;
+				break;
+			case 'T':
+				stream_options.trace = optarg;
+				break;
+			case 'V':
+				if (session->add_virtual(strtoul(optarg, NULL, 10)) < 0) {
+					perror("smu: failed adding virtual devices");
 					return EXIT_FAILURE;
 				}
 				break;
@@ -258,6 +311,27 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (stream) {
+		// restrict the session to the requested devices
+		if (!serials.empty()) {
+			std::vector<Device*> devices(session->m_devices.begin(), session->m_devices.end());
+			for (auto dev: devices) {
+				if (std::find(serials.begin(), serials.end(), dev->m_serial) == serials.end())
+					session->remove(dev);
+			}
+			if (session->m_devices.size() != serials.size()) {
+				cerr << "smu: requested devices not found" << endl;
+				return EXIT_FAILURE;
+			}
+		}
+		if (session->m_devices.empty()) {
+			cerr << "smu: no supported devices plugged in" << endl;
+			return EXIT_FAILURE;
+		}
+		if (stream_samples(session, stream_options) < 0)
+			return EXIT_FAILURE;
+	}
+
 	delete session;
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,228 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#if _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "stream.hpp"
+#include <libsmu/libsmu.hpp>
+
+using std::cerr;
+using std::endl;
+
+using namespace smu;
+
+// Size of the output buffer, flushed once full.
+static const size_t stream_buffer_size = 1 << 20;
+
+static volatile std::sig_atomic_t stream_interrupted = 0;
+
+static void stream_interrupt(int)
+{
+	stream_interrupted = 1;
+}
+
+// Format a value as printf("%f") does, using 6 decimals. Values out of the
+// range of any signal fall back to printf("%g").
+static inline char* format_float(char* p, float value)
+{
+	if (!(std::fabs(value) < 1e9f))
+		return p + sprintf(p, "%g", value);
+
+	double v = value;
+	if (v < 0) {
+		*p++ = '-';
+		v = -v;
+	}
+	uint64_t fixed = (uint64_t)(v * 1e6 + 0.5);
+	uint64_t integer = fixed / 1000000;
+	uint32_t fraction = fixed % 1000000;
+
+	char digits[20];
+	int n = 0;
+	do {
+		digits[n++] = '0' + integer % 10;
+		integer /= 10;
+	} while (integer);
+	while (n)
+		*p++ = digits[--n];
+
+	*p++ = '.';
+	for (int i = 5; i >= 0; i--) {
+		p[i] = '0' + fraction % 10;
+		fraction /= 10;
+	}
+	return p + 6;
+}
+
+int stream_samples(Session* session, const StreamOptions& options)
+{
+	int ret;
+	FILE* out = stdout;
+
+	// configure all devices to measure only
+	for (auto dev: session->m_devices) {
+		for (unsigned ch_i = 0; ch_i < dev->info()->channel_count; ch_i++)
+			dev->set_mode(ch_i, HI_Z);
+	}
+	ret = session->configure(options.sample_rate);
+	if (ret < 0) {
+		cerr << "smu: failed configuring session: " << strerror(-ret) << endl;
+		return ret;
+	}
+
+	if (!options.trace.empty()) {
+		ret = session->start_trace();
+		if (ret < 0) {
+			cerr << "smu: failed starting trace: " << strerror(-ret) << endl;
+			return ret;
+		}
+	}
+
+	if (!options.output.empty()) {
+		out = fopen(options.output.c_str(), options.format == STREAM_TEXT ? "w" : "wb");
+		if (!out) {
+			ret = -errno;
+			cerr << "smu: failed opening " << options.output << ": " << strerror(errno) << endl;
+			return ret;
+		}
+	}
+#if _WIN32
+	else if (options.format != STREAM_TEXT) {
+		_setmode(_fileno(stdout), _O_BINARY);
+	}
+#endif
+	setvbuf(out, NULL, _IOFBF, stream_buffer_size);
+
+	unsigned num_devices = session->m_devices.size();
+	StreamHeader header = {};
+	if (options.format != STREAM_TEXT) {
+		std::memcpy(header.magic, STREAM_MAGIC, sizeof(header.magic));
+		header.version = STREAM_VERSION;
+		header.header_size = sizeof(header) + num_devices * 32;
+		header.format = options.format;
+		header.num_devices = num_devices;
+		header.sample_rate = session->m_sample_rate;
+		auto dev = *(session->m_devices.begin());
+		for (unsigned sig_i = 0; sig_i < 4; sig_i++) {
+			const sl_signal_info* info = dev->signal(sig_i / 2, sig_i % 2)->info();
+			header.scale[sig_i] = (info->max - info->min) / 65535;
+			header.offset[sig_i] = (info->max + info->min) / 2;
+		}
+		fwrite(&header, sizeof(header), 1, out);
+		for (auto dev: session->m_devices) {
+			char serial[32] = {};
+			strncpy(serial, dev->m_serial.c_str(), sizeof(serial) - 1);
+			fwrite(serial, sizeof(serial), 1, out);
+		}
+	}
+
+	// read roughly 10ms worth of samples at a time
+	size_t chunk = std::max<size_t>(session->m_sample_rate / 100, 256);
+	std::vector<float> buf;
+	std::vector<int16_t> codes;
+	// worst case text line length per device: four signed values with
+	// 6 decimals and separators
+	std::vector<char> text(chunk * num_devices * 4 * 24 + 1);
+
+	auto handler = std::signal(SIGINT, stream_interrupt);
+	stream_interrupted = 0;
+
+	uint64_t total = 0;
+	uint64_t overflows = 0;
+	ret = session->start(options.samples);
+	if (ret < 0)
+		cerr << "smu: failed starting session: " << strerror(-ret) << endl;
+
+	while (!ret && !stream_interrupted && (!options.samples || total < options.samples)) {
+		size_t samples = chunk;
+		if (options.samples)
+			samples = std::min<uint64_t>(samples, options.samples - total);
+
+		ssize_t read;
+		try {
+			read = session->read(buf, samples, 100);
+		} catch (const std::system_error& e) {
+			// Keep streaming, the session realigns devices after overflows.
+			overflows++;
+			cerr << "smu: " << e.what() << " (" << overflows << " overflows)" << endl;
+			continue;
+		}
+		if (read < 0) {
+			ret = read;
+			cerr << "smu: failed reading samples: " << strerror(-ret) << endl;
+			break;
+		} else if (!read && session->cancelled()) {
+			ret = -EIO;
+			cerr << "smu: session stopped streaming" << endl;
+			break;
+		}
+
+		size_t values = read * num_devices * 4;
+		bool written = false;
+		switch (options.format) {
+			case STREAM_FLOAT32:
+				written = fwrite(buf.data(), sizeof(float), values, out) == values;
+				break;
+			case STREAM_INT16:
+				codes.resize(values);
+				for (size_t i = 0; i < values; i++) {
+					unsigned sig_i = i % 4;
+					float code = std::round((buf[i] - header.offset[sig_i]) / header.scale[sig_i]);
+					codes[i] = std::max(-32768.0f, std::min(32767.0f, code));
+				}
+				written = fwrite(codes.data(), sizeof(int16_t), values, out) == values;
+				break;
+			default: {
+				char* p = text.data();
+				for (size_t i = 0; i < values; i++) {
+					p = format_float(p, buf[i]);
+					*p++ = (i % (num_devices * 4) == num_devices * 4 - 1) ? '\n' : ' ';
+				}
+				size_t len = p - text.data();
+				written = fwrite(text.data(), 1, len, out) == len;
+				break;
+			}
+		}
+		if (!written) {
+			ret = -EIO;
+			cerr << "smu: failed writing samples: " << strerror(errno) << endl;
+			break;
+		}
+		total += read;
+	}
+
+	std::signal(SIGINT, handler);
+	session->end();
+
+	if (!options.trace.empty()) {
+		int64_t events = session->stop_trace(options.trace);
+		if (events < 0)
+			cerr << "smu: failed writing trace: " << strerror(-events) << endl;
+	}
+
+	if (fflush(out) && !ret) {
+		ret = -EIO;
+		cerr << "smu: failed writing samples: " << strerror(errno) << endl;
+	}
+	if (out != stdout)
+		fclose(out);
+	if (overflows)
+		cerr << "smu: streamed " << total << " samples with " << overflows << " overflows" << endl;
+	return ret;
+}
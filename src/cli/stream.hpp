@@ -0,0 +1,57 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <libsmu/libsmu.hpp>
+
+#define STREAM_MAGIC "SMUSTRM\0"
+#define STREAM_VERSION 1
+
+// Output formats of streamed samples.
+enum StreamFormat : uint32_t {
+	// One line per sample holding the four signals of every device.
+	STREAM_TEXT = 0,
+	// StreamHeader followed by frames of 32-bit floats ordered as
+	// [sample][device][signal].
+	STREAM_FLOAT32 = 1,
+	// StreamHeader followed by frames of 16-bit signed integers ordered as
+	// [sample][device][signal], scaled as described by the header.
+	STREAM_INT16 = 2,
+};
+
+// Header preceding binary streams, followed by a 32 byte serial number per
+// device. All values are in host byte order.
+struct StreamHeader {
+	char magic[8];
+	uint32_t version;
+	// Offset of the first frame.
+	uint32_t header_size;
+	uint32_t format;
+	uint32_t num_devices;
+	uint64_t sample_rate;
+	// Signals of int16 streams are stored as (value - offset) / scale,
+	// rounded and clamped so the signal's range spans the int16 range.
+	float scale[4];
+	float offset[4];
+};
+
+struct StreamOptions {
+	StreamFormat format = STREAM_TEXT;
+	// Number of samples per device, 0 streams until interrupted.
+	uint64_t samples = 0;
+	// Sample rate, 0 uses the default rate of the devices.
+	uint32_t sample_rate = 0;
+	// Output file, stdout if empty.
+	std::string output;
+	// Chrome trace file of the USB and sample pipeline, not traced if empty.
+	std::string trace;
+};
+
+// Stream samples from all session devices.
+// @return 0 on success, a negative errno code on error.
+int stream_samples(smu::Session* session, const StreamOptions& options);
@@ -4,21 +4,112 @@
 //   Kevin Mehall <km@kevinmehall.net>
 //   Ian Daniher <itdaniher@gmail.com>
 
+#include <cerrno>
+#include <system_error>
+
 #include <libusb.h>
 
-#include "debug.hpp"
+#include "events.hpp"
+#include "executor.hpp"
+#include "log.hpp"
+#include "replay.hpp"
+#include "stats.hpp"
+#include "transport.hpp"
 
 #include <libsmu/libsmu.hpp>
 
 using namespace smu;
 
-Device::Device(Session* s, libusb_device* d, libusb_device_handle *h,
+Device::Device(Session* s, libusb_device* d, Transport* transport,
 	const char* hwver, const char* fwver, const char* serial):
-	m_hwver(hwver), m_fwver(fwver), m_serial(serial), m_session(s), m_usb_dev(d), m_usb(h)
+	m_hwver(hwver), m_fwver(fwver), m_serial(serial), m_session(s), m_usb_dev(d),
+	m_usb(transport->handle()), m_transport(transport), m_counters(new DataflowCounters), m_events(new EventQueue),
+	m_event_strand(new Strand)
+{
+}
+
+Device::~Device()
 {
+	// finish the recording first as it may still report a write error
+	delete m_recorder;
+	// wait for event callbacks still queued on the executor
+	m_event_strand->drain();
+	delete m_transport;
 }
 
 int Device::ctrl_transfer(unsigned bmRequestType, unsigned bRequest, unsigned wValue, unsigned wIndex, unsigned char *data, unsigned wLength, unsigned timeout)
 {
-	return libusb_control_transfer(m_usb, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
+	int ret = m_transport->control_transfer(bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
+	if (m_recorder)
+		m_recorder->control(bmRequestType, bRequest, wValue, wIndex, wLength, data, ret);
+	return ret;
+}
+
+void Device::report(EventKind kind, int channel, uint64_t sample, uint64_t count, int error)
+{
+	DeviceEvent event = {kind, this, channel, sample, count, error};
+
+	// remember the first overflow or underflow for the next read() or write()
+	if (kind == EVENT_OVERFLOW || kind == EVENT_UNDERFLOW) {
+		unsigned expected = 0;
+		m_dataflow_error.compare_exchange_strong(expected, kind + 1);
+	}
+
+	auto callback = std::atomic_load(&m_event_callback);
+	if (callback) {
+		m_session->submit_callback([=]() { (*callback)(event); }, m_event_strand.get());
+	} else if (!m_events->push(event)) {
+		m_events_dropped++;
+	}
+}
+
+bool Device::poll_event(DeviceEvent& event)
+{
+	return m_events->pop(event);
+}
+
+void Device::set_event_callback(std::function<void(const DeviceEvent&)> callback)
+{
+	std::shared_ptr<std::function<void(const DeviceEvent&)>> ptr;
+	if (callback)
+		ptr = std::make_shared<std::function<void(const DeviceEvent&)>>(callback);
+	std::atomic_store(&m_event_callback, ptr);
+}
+
+DataflowStats Device::stats() const
+{
+	DataflowStats stats = m_counters->snapshot();
+	stats.underruns = m_underruns;
+	return stats;
+}
+
+void Device::reset_stats()
+{
+	m_counters->reset();
+	m_underruns = 0;
+}
+
+void Device::raise_dataflow_error()
+{
+	unsigned error = m_dataflow_error.exchange(0);
+	if (!m_session->m_dataflow_exceptions)
+		return;
+
+	switch (error) {
+		case EVENT_OVERFLOW + 1:
+			throw std::system_error(EBUSY, std::system_category(), "data sample dropped");
+		case EVENT_UNDERFLOW + 1:
+			throw std::system_error(EBUSY, std::system_category(), "data write timeout, no available fallback sample");
+	}
+}
+
+int Device::set_queue_size(unsigned in_size, unsigned out_size)
+{
+	// This method may not be called while the session is active.
+	if (m_session->m_active_devices)
+		return -EBUSY;
+
+	m_in_queue_size = in_size;
+	m_out_queue_size = out_size;
+	return 0;
 }
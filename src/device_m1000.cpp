@@ -25,11 +25,19 @@
 #include <thread>
 #include <vector>
 
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
 #include <boost/algorithm/string.hpp> // boost::split
 #include <boost/lockfree/spsc_queue.hpp>
 #include <libusb.h>
 
-#include "debug.hpp"
+#include "log.hpp"
+#include "profile.hpp"
+#include "replay.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 #include "usb.hpp"
 #include <libsmu/libsmu.hpp>
 
@@ -51,9 +59,6 @@ const double BUFFER_TIME = 0.050;
 const double BUFFER_TIME = 0.020;
 #endif
 
-// Exception pointer to help move exceptions between USB and main threads.
-std::exception_ptr e_ptr = nullptr;
-
 using namespace smu;
 
 static const sl_device_info m1000_info = {"ADALM1000", 2};
@@ -67,22 +72,14 @@ int ADC_MUX_Mode = 0; // global variable for selecting ADC MUX modes
 
 M1000_Device::~M1000_Device()
 {
-	// Stop channel write threads.
-	for (unsigned ch_i = 0; ch_i < info()->channel_count; ch_i++) {
-		if (m_out_samples_thr[ch_i].joinable()) {
-			m_out_samples_stop[ch_i] = -1;
-			m_out_samples_cv[ch_i].notify_one();
-			m_out_samples_thr[ch_i].join();
-		}
-	}
-
-	// release and close USB interface
-	if (m_usb) {
-		libusb_release_interface(m_usb, 0);
-		libusb_close(m_usb);
-	}
-
-	// free USB transfers
+	// Free USB transfers once the transport stops handling them and no
+	// executor tasks refer to them, zero-copy buffers require an open device
+	// handle so the transport is closed afterwards.
+	m_cancelled = true;
+	join_out_prefill();
+	m_transport->shutdown();
+	m_usb_strand.drain();
+	m_feed_strand.drain();
 	m_in_transfers.clear();
 	m_out_transfers.clear();
 	unlock();
@@ -103,14 +100,14 @@ int M1000_Device::get_default_rate()
 int M1000_Device::claim()
 {
 	int ret = 0;
-	ret = libusb_claim_interface(m_usb, 0);
+	ret = m_transport->claim_interface(0);
 	return -libusb_to_errno(ret);
 }
 
 int M1000_Device::release()
 {
 	int ret = 0;
-	ret = libusb_release_interface(m_usb, 0);
+	ret = m_transport->release_interface(0);
 	return -libusb_to_errno(ret);
 }
 
@@ -177,6 +174,139 @@ void M1000_Device::calibration(std::vector<std::vector<float>>* cal)
 	}
 }
 
+int M1000_Device::record(const std::string& path)
+{
+	// This method may not be called while the session is active.
+	if (m_session->m_active_devices)
+		return -EBUSY;
+
+	int ret = 0;
+	if (m_recorder) {
+		ret = m_recorder->close();
+		delete m_recorder;
+		m_recorder = NULL;
+	}
+	if (path.empty())
+		return ret;
+
+	Recorder* recorder = new Recorder([this](int error) {
+		report(EVENT_RECORD_ERROR, -1, 0, 0, error);
+	});
+	ret = recorder->open(path, m_hwver, m_fwver, m_serial, m_cal);
+	if (ret < 0) {
+		delete recorder;
+		return ret;
+	}
+	m_recorder = recorder;
+	return 0;
+}
+
+int M1000_Device::set_history(size_t max_bytes)
+{
+	// This method may not be called while the session is active.
+	if (m_session->m_active_devices)
+		return -EBUSY;
+
+	m_history.reset(max_bytes ? new History(max_bytes) : NULL);
+	m_history_codes.clear();
+	m_history_codes.shrink_to_fit();
+	return 0;
+}
+
+ssize_t M1000_Device::read_history(std::vector<std::array<float, 4>>& buf, uint64_t start, size_t samples)
+{
+	std::vector<std::array<uint16_t, 4>> codes;
+	std::vector<int> mux;
+	std::vector<size_t> transfers;
+	size_t lead;
+
+	buf.clear();
+	if (!m_history)
+		return -ENODATA;
+
+	ssize_t ret = m_history->read(start, samples, codes, mux, lead, transfers);
+	if (ret < 0)
+		return ret;
+
+	// decode the same way as the transfers the samples were received in
+	buf.resize(ret - lead);
+	std::array<float, 4> sample = {};
+	auto transfer = transfers.begin();
+	for (ssize_t i = 0; i < ret; i++) {
+		if (transfer != transfers.end() && *transfer == (size_t)i) {
+			sample = {};
+			++transfer;
+		}
+		decode_sample(codes[i], mux[i], sample);
+		if ((size_t)i >= lead)
+			buf[i - lead] = sample;
+	}
+	return ret - lead;
+}
+
+int M1000_Device::history_range(uint64_t& first, uint64_t& end)
+{
+	if (!m_history)
+		return -ENODATA;
+	m_history->range(first, end);
+	return 0;
+}
+
+size_t M1000_Device::history_memory()
+{
+	return m_history ? m_history->memory() : 0;
+}
+
+void M1000_Device::flush_summary()
+{
+	if (!m_summary)
+		return;
+
+	// swap buffers so completions only wait for the swap
+	{
+		std::lock_guard<std::mutex> lock(m_summary_pending_lock);
+		m_summary_flush.swap(m_summary_pending);
+	}
+	m_summary->append(m_summary_flush.data(), m_summary_flush.size());
+	m_summary_flush.clear();
+}
+
+int M1000_Device::set_summary(size_t max_bins)
+{
+	// This method may not be called while the session is active.
+	if (m_session->m_active_devices)
+		return -EBUSY;
+
+	std::lock_guard<std::mutex> lock(m_summary_lock);
+	m_summary.reset(max_bins ? new Pyramid(max_bins) : NULL);
+	m_summary_samples.clear();
+	m_summary_samples.shrink_to_fit();
+	m_summary_pending.clear();
+	m_summary_flush.clear();
+	return 0;
+}
+
+int64_t M1000_Device::read_summary(unsigned signal, uint64_t start, uint64_t end, size_t pixels,
+	std::vector<SignalStats>& stats)
+{
+	std::lock_guard<std::mutex> lock(m_summary_lock);
+	stats.clear();
+	if (!m_summary)
+		return -ENODATA;
+	flush_summary();
+	return m_summary->query(signal, start, end, pixels, stats);
+}
+
+int M1000_Device::summary_range(uint64_t& first, uint64_t& end)
+{
+	std::lock_guard<std::mutex> lock(m_summary_lock);
+	if (!m_summary)
+		return -ENODATA;
+	flush_summary();
+	m_summary->range(first, end);
+	return 0;
+}
+
 int M1000_Device::write_calibration(const char* cal_file_name)
 {
 	int cal_records_no = 0;
@@ -269,26 +399,42 @@ extern "C" void LIBUSB_CALL m1000_in_completion(libusb_transfer *t)
 
 void M1000_Device::in_completion(libusb_transfer *t)
 {
-	std::lock_guard<std::recursive_mutex> lock(m_state);
-	m_in_transfers.num_active--;
+	if (t->status == LIBUSB_TRANSFER_COMPLETED)
+		m_counters->in_completed(DataflowCounters::clock::now());
+	trace_instant("in_complete", this, "status", t->status);
+
+	if (m_session->m_decode_offload)
+		m_usb_strand.submit(m_session->executor(), [=]() { complete_in_transfer(t); });
+	else
+		complete_in_transfer(t);
+}
 
+// Completions don't take any locks so they can't be delayed by application
+// calls. Resubmitted transfers are counted before the completed one is
+// released so the active transfer count only drops to zero once streaming ends.
+void M1000_Device::complete_in_transfer(libusb_transfer *t)
+{
+	TraceScope trace("in_transfer", this);
 	if (t->status == LIBUSB_TRANSFER_COMPLETED) {
-		// Store exceptions to rethrow them in the main thread in read()/write().
-		try {
-			handle_in_transfer(t);
-		} catch (...) {
-			e_ptr = std::current_exception();
-		}
-
-		if (!m_session->cancelled()) {
+		auto clk_start = DataflowCounters::clock::now();
+		DataflowCounters::add(m_counters->transfers_completed, 1);
+		DataflowCounters::add(m_counters->bytes_in, t->actual_length);
+		profile_transfer(m_session->profiler());
+		if (m_recorder)
+			m_recorder->in_transfer(t);
+		handle_in_transfer(t);
+		m_session->samples_queued();
+
+		if (!cancelled()) {
 			submit_in_transfer(t);
 		}
+		m_counters->callback_duration.add(DataflowCounters::clock::now() - clk_start);
 	} else if (t->status != LIBUSB_TRANSFER_CANCELLED) {
-		m_session->handle_error(t->status, "M1000_Device::in_completion");
-	}
-	if (m_out_transfers.num_active == 0 && m_in_transfers.num_active == 0) {
-		m_session->completion();
+		report(EVENT_TRANSFER_ERROR, -1, m_in_sampleno, 0, -libusb_transfer_to_errno(t->status));
+		m_session->handle_error(t->status, "M1000_Device::in_completion", this);
 	}
+	m_in_transfers.num_active--;
+	release_transfer();
 }
 
 // Runs in USB thread
@@ -305,20 +451,36 @@ extern "C" void LIBUSB_CALL m1000_out_completion(libusb_transfer *t)
 
 void M1000_Device::out_completion(libusb_transfer *t)
 {
-	std::lock_guard<std::recursive_mutex> lock(m_state);
-	m_out_transfers.num_active--;
-
+	TraceScope trace("out_transfer", this);
+	trace.arg("status", t->status);
 	if (t->status == LIBUSB_TRANSFER_COMPLETED) {
-		// Store exceptions to rethrow them in the main thread in read()/write().
-		if (!m_session->cancelled())
+		auto clk_start = DataflowCounters::clock::now();
+		DataflowCounters::add(m_counters->transfers_completed, 1);
+		DataflowCounters::add(m_counters->bytes_out, t->actual_length);
+		profile_transfer(m_session->profiler());
+		if (!cancelled() && !prepare_out_transfer(t))
 			submit_out_transfer(t);
-
+		m_counters->callback_duration.add(DataflowCounters::clock::now() - clk_start);
 	} else if (t->status != LIBUSB_TRANSFER_CANCELLED) {
-		 m_session->handle_error(t->status, "M1000_Device::out_completion");
+		report(EVENT_TRANSFER_ERROR, -1, m_out_sampleno, 0, -libusb_transfer_to_errno(t->status));
+		m_session->handle_error(t->status, "M1000_Device::out_completion", this);
 	}
-	if (m_out_transfers.num_active == 0 && m_in_transfers.num_active == 0) {
+	m_out_transfers.num_active--;
+	release_transfer();
+}
+
+void M1000_Device::cancel_if_cancelled(libusb_transfer* t)
+{
+	// Session::cancel() can run between checking for cancellation and
+	// submitting a transfer, cancel it here in case it was missed.
+	if (cancelled())
+		m_transport->cancel_transfer(t);
+}
+
+void M1000_Device::release_transfer()
+{
+	if (--m_active_transfers == 0)
 		m_session->completion();
-	}
 }
 
 int M1000_Device::configure(uint32_t sampleRate)
@@ -349,15 +511,18 @@ int M1000_Device::configure(uint32_t sampleRate)
 	set_sample_rate = round((1.0 / sample_time) / 2.0);
 
     unsigned transfers = 2;
-	m_packets_per_transfer = ceil(BUFFER_TIME / (sample_time * chunk_size) / transfers);
+	double buffer_time = m_session->m_transfer_time > 0 ? m_session->m_transfer_time : BUFFER_TIME;
+	m_packets_per_transfer = ceil(buffer_time / (sample_time * chunk_size) / transfers);
 	m_samples_per_transfer = m_packets_per_transfer * IN_SAMPLES_PER_PACKET;
 
-	ret = m_in_transfers.alloc(transfers, m_usb, EP_IN, LIBUSB_TRANSFER_TYPE_BULK,
-		m_packets_per_transfer * in_packet_size, 10000, m1000_in_completion, this);
+	bool locked = m_session->m_locked_buffers;
+	bool zerocopy = m_session->m_zerocopy_transfers;
+	ret = m_in_transfers.alloc(transfers, m_transport, EP_IN, LIBUSB_TRANSFER_TYPE_BULK,
+		m_packets_per_transfer * in_packet_size, 10000, m1000_in_completion, this, locked, zerocopy);
 	if (ret)
 		return ret;
-	ret = m_out_transfers.alloc(transfers, m_usb, EP_OUT, LIBUSB_TRANSFER_TYPE_BULK,
-		m_packets_per_transfer * out_packet_size, 10000, m1000_out_completion, this);
+	ret = m_out_transfers.alloc(transfers, m_transport, EP_OUT, LIBUSB_TRANSFER_TYPE_BULK,
+		m_packets_per_transfer * out_packet_size, 10000, m1000_out_completion, this, locked, zerocopy);
 	m_in_transfers.num_active = m_out_transfers.num_active = 0;
 
 	if (ret < 0)
@@ -386,16 +551,37 @@ uint16_t M1000_Device::encode_out(unsigned channel, bool peek)
 		if (m_sample_count == 0 || m_out_samples_avail[channel] > 0) {
 			if (!std::isnan(m_next_output[channel])) {
 				val = m_next_output[channel];
-			} else {
-				auto clk_start = std::chrono::high_resolution_clock::now();
-				while (!m_out_samples_q[channel]->pop(val)) {
-					auto clk_end = std::chrono::high_resolution_clock::now();
-					auto clk_diff = std::chrono::duration_cast<std::chrono::milliseconds>(clk_end - clk_start);
-					if (clk_diff.count() > m_write_timeout) {
-						DEBUG("%s: waited %i ms for samples to write\n", __func__, (int)m_write_timeout);
-						clk_start = std::chrono::high_resolution_clock::now();
+			} else if (!m_out_samples_q[channel]->pop(val)) {
+				// Top up the queue directly if the executor hasn't yet.
+				feed(channel, false);
+				if (!m_out_samples_q[channel]->pop(val)) {
+					// Queues are fed along with the transfer kickoff so
+					// waiting for the first samples of a run isn't an underrun.
+					if (m_out_sampleno) {
+						m_underruns++;
+						report(EVENT_UNDERRUN, channel, m_out_sampleno, 0, -EAGAIN);
+					}
+					TraceScope trace("underrun_wait", this);
+					trace.arg("channel", channel);
+					auto clk_start = std::chrono::high_resolution_clock::now();
+					while (!m_out_samples_q[channel]->pop(val)) {
+						auto clk_end = std::chrono::high_resolution_clock::now();
+						auto clk_diff = std::chrono::duration_cast<std::chrono::milliseconds>(clk_end - clk_start);
+						if (clk_diff.count() > m_write_timeout) {
+							SMU_LOG(LOG_LEVEL_DEBUG, "%s: waited %i ms for samples to write\n", __func__, (int)m_write_timeout);
+							clk_start = std::chrono::high_resolution_clock::now();
+						}
+						// stop waiting for samples that won't be written
+						if (cancelled())
+							throw std::system_error(ECANCELED, std::system_category(), "data write cancelled");
+						std::this_thread::sleep_for(std::chrono::microseconds(1));
+						// flush() waits for flushes to be handled
+						for (unsigned ch_i = 0; ch_i < info()->channel_count; ch_i++) {
+							if (m_out_samples_flush[ch_i])
+								drop_out_samples(ch_i);
+						}
+						feed(channel, false);
 					}
-					std::this_thread::sleep_for(std::chrono::microseconds(1));
 				}
 			}
 
@@ -417,6 +603,7 @@ uint16_t M1000_Device::encode_out(unsigned channel, bool peek)
 			if (std::isnan(m_previous_output[channel])) {
 				// Throw exception if trying to use fallback values without
 				// writing any data first.
+				report(EVENT_UNDERFLOW, channel, m_out_sampleno, 1, -EBUSY);
 				throw std::system_error(EBUSY, std::system_category(), "data write timeout, no available fallback sample");
 			} else {
 				val = m_previous_output[channel];
@@ -446,6 +633,11 @@ void M1000_Device::handle_out_transfer(libusb_transfer* t)
 {
 	uint16_t a, b;
 
+	for (unsigned ch_i = 0; ch_i < info()->channel_count; ch_i++) {
+		if (m_out_samples_flush[ch_i])
+			drop_out_samples(ch_i);
+	}
+
 	for (unsigned p = 0; p < m_packets_per_transfer; p++) {
 		uint8_t* buf = (uint8_t*) (t->buffer + p * out_packet_size);
 		for (unsigned i = 0; i < chunk_size; i++) {
@@ -475,52 +667,83 @@ void M1000_Device::handle_out_transfer(libusb_transfer* t)
 	}
 }
 
+int M1000_Device::prepare_out_transfer(libusb_transfer* t)
+{
+	if (m_sample_count > 0 && m_out_sampleno >= m_sample_count)
+		return -1;
+
+	// Underflows are reported as events and thrown from read(), write() or
+	// off() (for noncontinuous sessions) in the main thread.
+	TraceScope trace("encode", this);
+	ProfileScope profile(m_session->profiler(), PROFILE_ENCODE);
+	uint64_t sampleno = m_out_sampleno;
+	try {
+		handle_out_transfer(t);
+	} catch (const std::system_error&) {
+		if (m_sample_count == 0 || m_out_sampleno < m_sample_count)
+			return -1;
+	}
+	DataflowCounters::add(m_counters->samples_encoded, m_out_sampleno - sampleno);
+	trace.arg("samples", m_out_sampleno - sampleno);
+	profile.samples(m_out_sampleno - sampleno);
+
+	// refill the output queues drained by the transfer
+	schedule_feed(CHAN_A);
+	schedule_feed(CHAN_B);
+	return 0;
+}
+
 int M1000_Device::submit_out_transfer(libusb_transfer* t)
 {
-	int ret;
-	if (m_sample_count == 0 || m_out_sampleno < m_sample_count) {
-		// Store exceptions to rethrow them in the main thread in run().
-		try {
-			handle_out_transfer(t);
-		} catch (...) {
-			// Throw exception if we're not done writing all required
-			// samples or are in continuous mode.
-			if (m_sample_count == 0 || m_out_sampleno < m_sample_count) {
-				e_ptr = std::current_exception();
-				return -1;
-			}
-		}
-		ret = libusb_submit_transfer(t);
-		if (ret != 0) {
-			m_out_transfers.failed(t);
-			m_session->handle_error(ret, "M1000_Device::submit_out_transfer");
-			return ret;
-		}
-		m_out_transfers.num_active++;
-		return 0;
+	// count the transfer before it can complete
+	m_active_transfers++;
+	m_out_transfers.num_active++;
+	int ret = m_transport->submit_transfer(t);
+	if (ret != 0) {
+		// callers hold a reference so this doesn't complete the device
+		m_out_transfers.num_active--;
+		m_active_transfers--;
+		m_out_transfers.failed(t);
+		report(EVENT_TRANSFER_ERROR, -1, m_out_sampleno, 0, -libusb_to_errno(ret));
+		m_session->handle_error(ret, "M1000_Device::submit_out_transfer", this);
+		return ret;
 	}
-	return -1;
+	DataflowCounters::add(m_counters->transfers_submitted, 1);
+	trace_instant("out_submit", this, "sample", m_out_sampleno);
+	cancel_if_cancelled(t);
+	return 0;
 }
 
 int M1000_Device::submit_in_transfer(libusb_transfer* t)
 {
-	int ret;
-	if (m_sample_count == 0 || m_requested_sampleno < m_sample_count) {
-		ret = libusb_submit_transfer(t);
-		if (ret != 0) {
-			m_in_transfers.failed(t);
-			m_session->handle_error(ret, "M1000_Device::submit_in_transfer");
-			return ret;
-		}
-		m_in_transfers.num_active++;
-		m_requested_sampleno += m_samples_per_transfer;
-		return 0;
+	// Reserve the samples first, the kickoff and completions of previous
+	// transfers can submit concurrently.
+	uint64_t requested = m_requested_sampleno.fetch_add(m_samples_per_transfer);
+	if (m_sample_count > 0 && requested >= m_sample_count)
+		return -1;
+
+	// count the transfer before it can complete
+	m_active_transfers++;
+	m_in_transfers.num_active++;
+	int ret = m_transport->submit_transfer(t);
+	if (ret != 0) {
+		// callers hold a reference so this doesn't complete the device
+		m_in_transfers.num_active--;
+		m_active_transfers--;
+		m_in_transfers.failed(t);
+		report(EVENT_TRANSFER_ERROR, -1, requested, 0, -libusb_to_errno(ret));
+		m_session->handle_error(ret, "M1000_Device::submit_in_transfer", this);
+		return ret;
 	}
-	return -1;
+	DataflowCounters::add(m_counters->transfers_submitted, 1);
+	trace_instant("in_submit", this, "sample", requested);
+	cancel_if_cancelled(t);
+	return 0;
 }
 
 ssize_t M1000_Device::read(std::vector<std::array<float, 4>>& buf, size_t samples, int timeout,bool skipsamples)
 {
+	TraceScope trace("read", this);
 	buf.clear();
 	std::array<float, 4> sample = {};
 	uint32_t remaining_samples = samples;
@@ -529,9 +752,10 @@ ssize_t M1000_Device::read(std::vector<std::array<float, 4>>& buf, size_t sample
 		if(m_in_samples_avail > samples){
 			int s = m_in_samples_avail-samples;
         	for(int i=0;i<s;i++){
-           		m_in_samples_q.pop(sample);
+           		m_in_samples_q->pop(sample);
         	}
 			m_in_samples_avail -= s;
+			m_read_sampleno += s;
 		}
     }
 	
@@ -544,11 +768,16 @@ ssize_t M1000_Device::read(std::vector<std::array<float, 4>>& buf, size_t sample
 			samples = remaining_samples;
 
 		// copy samples to the output buffer
-		for (uint32_t i = 0; i < samples; i++) {
-			m_in_samples_q.pop(sample);
-			m_in_samples_avail--;
-			buf.push_back(sample);
+		if (samples) {
+			ProfileScope profile(m_session->profiler(), PROFILE_QUEUE);
+			profile.samples(samples);
+			for (uint32_t i = 0; i < samples; i++) {
+				m_in_samples_q->pop(sample);
+				m_in_samples_avail--;
+				buf.push_back(sample);
+			}
 		}
+		m_read_sampleno += samples;
 
 		// stop acquiring samples if we've fulfilled the requested number
 		remaining_samples -= samples;
@@ -563,35 +792,28 @@ ssize_t M1000_Device::read(std::vector<std::array<float, 4>>& buf, size_t sample
 
 		// briefly wait if no samples are available
 		if (m_in_samples_avail == 0) {
-			DEBUG("%s: waiting %i ms for incoming samples: requested: %lu, available: %u\n",
+			SMU_LOG(LOG_LEVEL_DEBUG, "%s: waiting %i ms for incoming samples: requested: %lu, available: %u\n",
 					__func__, timeout, samples, m_in_samples_avail.load());
 			std::this_thread::sleep_for(std::chrono::milliseconds(1));
 		}
 
-		if (e_ptr) {
-			// copy exception pointer for throwing and reset it
-			std::exception_ptr new_e_ptr = e_ptr;
-			e_ptr = nullptr;
-			std::rethrow_exception(new_e_ptr);
-		}
+		raise_dataflow_error();
 	}
 
-	// If a data flow exception occurred in the USB thread, rethrow the
-	// exception here in the main thread. This allows users to just wrap
-	// read()/write() in addition to session.run() in order to catch and/or act
-	// on data flow issues.
-	if (e_ptr) {
-		// copy exception pointer for throwing and reset it
-		std::exception_ptr new_e_ptr = e_ptr;
-		e_ptr = nullptr;
-		std::rethrow_exception(new_e_ptr);
-	}
+	// If a data flow error was reported by the USB thread, throw it here in
+	// the main thread. This allows users to just wrap read()/write() in
+	// addition to session.run() in order to catch and/or act on data flow
+	// issues.
+	raise_dataflow_error();
 
+	trace.arg("samples", buf.size());
 	return buf.size();
 }
 
 int M1000_Device::write(std::vector<float>& buf, unsigned channel, bool cyclic)
 {
+	TraceScope trace("write", this);
+	trace.arg("samples", buf.size());
 	// bad channel
 	if (channel != CHAN_A && channel != CHAN_B)
 		return -ENODEV;
@@ -614,22 +836,17 @@ int M1000_Device::write(std::vector<float>& buf, unsigned channel, bool cyclic)
 	m_out_samples_avail[channel] += buf.size();
 
 	std::unique_lock<std::mutex> lk(m_out_samples_mtx[channel]);
-	std::condition_variable& cv = m_out_samples_cv[channel];
 	m_out_samples_buf[channel] = buf;
 	m_out_samples_buf_cyclic[channel] = cyclic;
+	m_out_samples_pos[channel] = 0;
 	lk.unlock();
-	cv.notify_one();
-
-	// If a data flow exception occurred in the USB thread, rethrow the
-	// exception here in the main thread. This allows users to just wrap
-	// read()/write() in addition to session.run() in order to catch and/or act
-	// on data flow issues.
-	if (e_ptr) {
-		// copy exception pointer for throwing and reset it
-		std::exception_ptr new_e_ptr = e_ptr;
-		e_ptr = nullptr;
-		std::rethrow_exception(new_e_ptr);
-	}
+	schedule_feed(channel);
+
+	// If a data flow error was reported by the USB thread, throw it here in
+	// the main thread. This allows users to just wrap read()/write() in
+	// addition to session.run() in order to catch and/or act on data flow
+	// issues.
+	raise_dataflow_error();
 
 	return 0;
 }
@@ -637,118 +854,201 @@ int M1000_Device::write(std::vector<float>& buf, unsigned channel, bool cyclic)
 void M1000_Device::flush(int channel, bool read)
 {
 	auto flush_read_queue = [=](std::array<float, 4>) { return; };
+
+	if (channel == CHAN_A || channel == CHAN_B) {
+		// drop the write buffer, pending feed tasks find nothing to queue
+		std::unique_lock<std::mutex> lk(m_out_samples_mtx[channel]);
+		m_out_samples_buf[channel].clear();
+		m_out_samples_pos[channel] = 0;
+		lk.unlock();
+
+		// Output queues are consumed by the transfer handling while
+		// streaming, have it flush the queue and wait until it has.
+		m_out_samples_flush[channel] = true;
+		while (m_out_samples_flush[channel] && m_active_transfers > 0)
+			std::this_thread::sleep_for(std::chrono::microseconds(10));
+		if (m_out_samples_flush[channel])
+			drop_out_samples(channel);
+	}
+
+	// Flush the read queue, consumed by the calling thread.
+	if (read) {
+		size_t flushed = m_in_samples_q->consume_all(flush_read_queue);
+		m_read_sampleno += flushed;
+		m_in_samples_avail -= flushed;
+	}
+}
+
+void M1000_Device::drop_out_samples(unsigned channel)
+{
 	auto flush_write_queue = [=](float sample) { return; };
+	m_out_samples_q[channel]->consume_all(flush_write_queue);
+	m_out_samples_avail[channel] = 0;
+	m_out_samples_flush[channel] = false;
+}
 
-	// make sure USB transfers aren't being processed concurrently
-	std::lock_guard<std::recursive_mutex> lock(m_state);
+size_t M1000_Device::read_available()
+{
+	return m_in_samples_avail;
+}
 
-	if (channel == CHAN_A || channel == CHAN_B) {
-		// notify write threads to stop
-		m_out_samples_stop[channel] = 1;
-		m_out_samples_cv[channel].notify_one();
+size_t M1000_Device::queue_memory() const
+{
+	// spsc_queue allocates one extra element to distinguish full from empty
+	size_t in_bytes = (m_in_queue_capacity + 1) * sizeof(std::array<float, 4>);
+	size_t out_bytes = (m_out_queue_capacity + 1) * sizeof(float);
+	return in_bytes + info()->channel_count * out_bytes;
+}
 
-		// wait for write threads to stop
-		std::unique_lock<std::mutex> lk(m_out_samples_mtx[channel]);
+int M1000_Device::resize_queues(unsigned in_size, unsigned out_size)
+{
+	unsigned min_size = min_queue_size();
+	in_size = std::max(in_size, min_size);
+	out_size = std::max(out_size, min_size);
+
+	// Locked queues are prefaulted on allocation so switching memory types
+	// requires reallocating them.
+	bool locked = m_session->m_locked_buffers;
+	bool relock = locked != m_queues_locked;
 
-		// flush the write queues
-		m_out_samples_q[channel]->consume_all(flush_write_queue);
-		m_out_samples_avail[channel] = 0;
+	try {
+		// queues are only resized while the device isn't streaming
+		if (in_size != m_in_queue_capacity || relock) {
+			m_in_samples_q.reset();
+			m_in_samples_avail = 0;
+			m_in_samples_q.reset(new InSampleQueue(in_size, BufferAllocator<std::array<float, 4>>(locked)));
+			m_in_queue_capacity = in_size;
+		}
+
+		if (out_size != m_out_queue_capacity || relock) {
+			for (unsigned ch_i = 0; ch_i < info()->channel_count; ch_i++) {
+				// stop feeding the current queue
+				flush(ch_i, false);
+				std::lock_guard<std::mutex> lk(m_out_samples_mtx[ch_i]);
+				m_out_samples_q[ch_i].reset();
+				m_out_samples_q[ch_i].reset(new OutSampleQueue(out_size, BufferAllocator<float>(locked)));
+			}
+			m_out_queue_capacity = out_size;
+		}
+	} catch (const std::bad_alloc&) {
+		return -ENOMEM;
 	}
 
-	// flush read queue
-	if (read) {
-		m_in_samples_q.consume_all(flush_read_queue);
-		m_in_samples_avail = 0;
+	m_queues_locked = locked;
+	return 0;
+}
+
+void M1000_Device::decode_sample(const std::array<uint16_t, 4>& codes, int mux, std::array<float, 4>& samples) const
+{
+	auto voltage = [&](uint16_t code, unsigned cal) -> float {
+		float v = code * m1000_signal_info[0].resolution;
+		return (v - m_cal.offset[cal]) * m_cal.gain_p[cal];
+	};
+	// The gain of current signals is chosen by the sign of the previous
+	// sample of the signal, passed in through samples.
+	const std::array<float, 4> prev = samples;
+	auto current = [&](uint16_t code, unsigned cal, unsigned s) -> float {
+		float v = ((code * m1000_signal_info[1].resolution) - 0.195) * 1.25;
+		return (v - m_cal.offset[cal]) * (prev[s] > 0 ? m_cal.gain_p[cal] : m_cal.gain_n[cal]);
+	};
+
+	switch (mux) {
+		case 0: // default 4 channel measurement
+			samples = {voltage(codes[0], 0), current(codes[1], 1, 1), voltage(codes[2], 4), current(codes[3], 5, 3)};
+			break;
+		case 1: // 2 channel voltage only measurement: A odd, B odd, B even, A even
+			samples = {voltage(codes[0], 0), voltage(codes[1], 4), voltage(codes[2], 4), voltage(codes[3], 0)};
+			break;
+		case 2: // 2 channel current only measurement: B odd, A odd, A even, B even
+			samples = {current(codes[0], 5, 0), current(codes[1], 1, 1), current(codes[2], 1, 2), current(codes[3], 5, 3)};
+			break;
+		case 4: // measure CHA Voltage and Current: V odd, I odd, I even, V even
+			samples = {voltage(codes[0], 0), current(codes[1], 1, 1), current(codes[2], 1, 2), voltage(codes[3], 0)};
+			break;
+		case 5: // measure CHB Voltage and Current: I odd, V odd, V even, I even
+			samples = {current(codes[0], 5, 0), voltage(codes[1], 4), voltage(codes[2], 4), current(codes[3], 5, 3)};
+			break;
+		case 7: // Return Raw un-calibrated data scaled by 4096/65536
+			for (unsigned i = 0; i < 4; i++)
+				samples[i] = codes[i] * 0.0625;
+			break;
+		default:
+			samples = {};
 	}
 }
 
 void M1000_Device::handle_in_transfer(libusb_transfer* t)
 {
-	float v;
+	std::array<uint16_t, 4> codes;
 	std::array<float, 4> samples = {};
+	// M1K firmware versions >= 2.00 use an interleaved data format.
+	bool interleaved = std::atof(m_fwver.c_str()) >= 2;
+	// the legacy format always holds all four signals
+	int mux = interleaved ? ::ADC_MUX_Mode : 0;
+	size_t queued = 0;
+	// samples dropped from the transfer due to a full input queue
+	uint64_t dropped = 0;
+	uint64_t first_dropped = 0;
+	uint64_t sampleno = m_in_sampleno;
+	TraceScope trace("decode", this);
+	ProfileScope profile(m_session->profiler(), PROFILE_DECODE);
+
+	if (m_history)
+		m_history_codes.resize(m_samples_per_transfer);
+	if (m_summary)
+		m_summary_samples.resize(m_samples_per_transfer);
 
 	for (unsigned p = 0; p < m_packets_per_transfer; p++) {
 		uint8_t* buf = (uint8_t*) (t->buffer + p * in_packet_size);
 
 		for (unsigned i = 0; i < chunk_size; i++) {
-			// M1K firmware versions >= 2.00 use an interleaved data format.
-			if (std::atof(m_fwver.c_str()) >= 2) {
-				if (::ADC_MUX_Mode == 0) { // default 4 channel measurement
-					v = (buf[i*8+0] << 8 | buf[i*8+1]) * m_signals[0][0].info()->resolution;
-					samples[0] = (v - m_cal.offset[0]) * m_cal.gain_p[0];
-					v = (((buf[i*8+2] << 8 | buf[i*8+3]) * m_signals[0][1].info()->resolution) - 0.195)*1.25;
-					samples[1] = (v - m_cal.offset[1]) * (samples[1] > 0 ? m_cal.gain_p[1] : m_cal.gain_n[1]);
-					v = (buf[i*8+4] << 8 | buf[i*8+5]) * m_signals[1][0].info()->resolution;
-					samples[2] = (v - m_cal.offset[4]) * m_cal.gain_p[4];
-					v = (((buf[i*8+6] << 8 | buf[i*8+7]) * m_signals[1][1].info()->resolution) - 0.195)*1.25;
-					samples[3] = (v - m_cal.offset[5]) * (samples[3] > 0 ? m_cal.gain_p[5] : m_cal.gain_n[5]);
-				}
-				if (::ADC_MUX_Mode == 1) { // 2 channel voltage only measurement
-					v = (buf[i*8+0] << 8 | buf[i*8+1]) * m_signals[0][0].info()->resolution; // channel A odd sample
-					samples[0] = (v - m_cal.offset[0]) * m_cal.gain_p[0];
-					v = (buf[i*8+2] << 8 | buf[i*8+3]) * m_signals[1][0].info()->resolution; // channel B odd sample
-					samples[1] = (v - m_cal.offset[4]) * m_cal.gain_p[4];
-					v = (buf[i*8+4] << 8 | buf[i*8+5]) * m_signals[1][0].info()->resolution; // channel B even sample
-					samples[2] = (v - m_cal.offset[4]) * m_cal.gain_p[4];
-					v = (buf[i*8+6] << 8 | buf[i*8+7]) * m_signals[0][0].info()->resolution; // channel A even sample
-					samples[3] = (v - m_cal.offset[0]) * m_cal.gain_p[0];
-				}
-				if (::ADC_MUX_Mode == 2) { // 2  channel current only measurement
-					v = (((buf[i*8+0] << 8 | buf[i*8+1]) * m_signals[1][1].info()->resolution) - 0.195)*1.25;
-					samples[0] = (v - m_cal.offset[5]) * (samples[0] > 0 ? m_cal.gain_p[5] : m_cal.gain_n[5]);
-					v = (((buf[i*8+2] << 8 | buf[i*8+3]) * m_signals[0][1].info()->resolution) - 0.195)*1.25;
-					samples[1] = (v - m_cal.offset[1]) * (samples[1] > 0 ? m_cal.gain_p[1] : m_cal.gain_n[1]);
-					v = (((buf[i*8+4] << 8 | buf[i*8+5]) * m_signals[0][1].info()->resolution) - 0.195)*1.25;
-					samples[2] = (v - m_cal.offset[1]) * (samples[2] > 0 ? m_cal.gain_p[1] : m_cal.gain_n[1]);
-					v = (((buf[i*8+6] << 8 | buf[i*8+7]) * m_signals[1][1].info()->resolution) - 0.195)*1.25;
-					samples[3] = (v - m_cal.offset[5]) * (samples[3] > 0 ? m_cal.gain_p[5] : m_cal.gain_n[5]);
-				}
-				if (::ADC_MUX_Mode == 4) { // measure CHA Voltage and Current
-					v = (buf[i*8+0] << 8 | buf[i*8+1]) * m_signals[0][0].info()->resolution; // channel A V odd sample
-					samples[0] = (v - m_cal.offset[0]) * m_cal.gain_p[0];
-					v = (((buf[i*8+2] << 8 | buf[i*8+3]) * m_signals[0][1].info()->resolution) - 0.195)*1.25;
-					samples[1] = (v - m_cal.offset[1]) * (samples[1] > 0 ? m_cal.gain_p[1] : m_cal.gain_n[1]);
-					v = (((buf[i*8+4] << 8 | buf[i*8+5]) * m_signals[0][1].info()->resolution) - 0.195)*1.25;
-					samples[2] = (v - m_cal.offset[1]) * (samples[2] > 0 ? m_cal.gain_p[1] : m_cal.gain_n[1]);
-					v = (buf[i*8+6] << 8 | buf[i*8+7]) * m_signals[0][0].info()->resolution; // channel A V even sample
-					samples[3] = (v - m_cal.offset[0]) * m_cal.gain_p[0];
-				}
-				if (::ADC_MUX_Mode == 5) { // measure CHB Voltage and Current
-					v = (((buf[i*8+0] << 8 | buf[i*8+1]) * m_signals[1][1].info()->resolution) - 0.195)*1.25;
-					samples[0] = (v - m_cal.offset[5]) * (samples[0] > 0 ? m_cal.gain_p[5] : m_cal.gain_n[5]);
-					v = ((buf[i*8+2] << 8 | buf[i*8+3]) * m_signals[1][0].info()->resolution);
-					samples[1] = (v - m_cal.offset[4]) * m_cal.gain_p[4];
-					v = ((buf[i*8+4] << 8 | buf[i*8+5]) * m_signals[1][0].info()->resolution);
-					samples[2] = (v - m_cal.offset[4]) * m_cal.gain_p[4];
-					v = (((buf[i*8+6] << 8 | buf[i*8+7]) * m_signals[1][1].info()->resolution) - 0.195)*1.25;
-					samples[3] = (v - m_cal.offset[5]) * (samples[3] > 0 ? m_cal.gain_p[5] : m_cal.gain_n[5]);
-				}
-				if (::ADC_MUX_Mode == 7) { // Return Raw un-calibrated data scaled by 4096/65536
-					samples[0] = ((buf[i*8+0] << 8 | buf[i*8+1]) * 0.0625);
-					samples[1] = ((buf[i*8+2] << 8 | buf[i*8+3]) * 0.0625);
-					samples[2] = ((buf[i*8+4] << 8 | buf[i*8+5]) * 0.0625);
-					samples[3] = ((buf[i*8+6] << 8 | buf[i*8+7]) * 0.0625);
-				}
-			} else {
-				v = (buf[(i+chunk_size*0)*2] << 8 | buf[(i+chunk_size*0)*2+1]) * m_signals[0][0].info()->resolution;
-				samples[0] = (v - m_cal.offset[0]) * m_cal.gain_p[0];
-				v = (((buf[(i+chunk_size*1)*2] << 8 | buf[(i+chunk_size*1)*2+1]) * m_signals[0][1].info()->resolution) - 0.195)*1.25;
-				samples[1] = (v - m_cal.offset[1]) * (samples[1] > 0 ? m_cal.gain_p[1] : m_cal.gain_n[1]);
-				v = (buf[(i+chunk_size*2)*2] << 8 | buf[(i+chunk_size*2)*2+1]) * m_signals[1][0].info()->resolution;
-				samples[2] = (v - m_cal.offset[4]) * m_cal.gain_p[4];
-				v = (((buf[(i+chunk_size*3)*2] << 8 | buf[(i+chunk_size*3)*2+1]) * m_signals[1][1].info()->resolution) - 0.195)*1.25;
-				samples[3] = (v - m_cal.offset[5]) * (samples[3] > 0 ? m_cal.gain_p[5] : m_cal.gain_n[5]);
+			for (unsigned s = 0; s < 4; s++) {
+				unsigned offset = interleaved ? (i * 4 + s) * 2 : (i + chunk_size * s) * 2;
+				codes[s] = buf[offset] << 8 | buf[offset + 1];
 			}
+			decode_sample(codes, mux, samples);
+
 			m_in_sampleno++;
 			if (m_sample_count == 0 || m_in_sampleno <= m_sample_count) {
-				if (!m_in_samples_q.push(samples)) {
-					throw std::system_error(EBUSY, std::system_category(), "data sample dropped");
+				if (m_history)
+					m_history_codes[queued] = codes;
+				if (m_summary)
+					m_summary_samples[queued] = samples;
+				queued++;
+				if (!m_in_samples_q->push(samples)) {
+					if (!dropped++)
+						first_dropped = m_in_sampleno - 1;
 				} else {
 					m_in_samples_avail++;
 				}
 			}
 		}
 	}
+
+	// archive the samples of the transfer, if enabled
+	if (m_history)
+		m_history->append(m_history_codes.data(), queued, mux);
+	if (m_summary) {
+		// Completions don't wait for summary queries, the samples are
+		// handed over and summarized by the query or a later transfer.
+		{
+			std::lock_guard<std::mutex> lock(m_summary_pending_lock);
+			m_summary_pending.insert(m_summary_pending.end(),
+				m_summary_samples.begin(), m_summary_samples.begin() + queued);
+		}
+		std::unique_lock<std::mutex> lock(m_summary_lock, std::try_to_lock);
+		if (lock.owns_lock())
+			flush_summary();
+	}
+
+	DataflowCounters::add(m_counters->samples_decoded, m_in_sampleno - sampleno);
+	trace.arg("queued", queued);
+	profile.samples(m_in_sampleno - sampleno);
+	raise_mark(m_counters->in_queue_high_water, m_in_samples_avail);
+	if (dropped) {
+		DataflowCounters::add(m_counters->samples_dropped, dropped);
+		report(EVENT_OVERFLOW, -1, first_dropped, dropped, -EBUSY);
+	}
 }
 
 const sl_device_info* M1000_Device::info() const
@@ -895,7 +1195,7 @@ int M1000_Device::fwver_sem(std::array<unsigned, 3>& components)
 int M1000_Device::on()
 {
 	int ret = 0;
-	ret = libusb_set_interface_alt_setting(m_usb, 0, 1);
+	ret = m_transport->set_interface_alt_setting(0, 1);
 	if (ret < 0)
 		return -libusb_to_errno(ret);
 
@@ -928,6 +1228,32 @@ int M1000_Device::sync()
 	return libusb_errno_or_zero(ret);
 }
 
+int M1000_Device::sync_to(Device* device)
+{
+	M1000_Device* ref = dynamic_cast<M1000_Device*>(device);
+	if (!ref)
+		return -EINVAL;
+
+	int ret = sync();
+	if (ret)
+		return ret;
+
+	// Microframes between the starts of both devices, the counter wraps
+	// every 16384 microframes (~2 s). The wraps are resolved using the
+	// reference's progress, the device starts a bit after the reference's
+	// latest requested sample.
+	const double uframes_per_sec = 8000;
+	const double wrap = 0x4000;
+	double delta = (m_sof_start - ref->m_sof_start) & 0x3FFF;
+	double elapsed = ref->m_requested_sampleno * uframes_per_sec / m_session->m_sample_rate;
+	double wraps = std::max(0.0, std::round((elapsed - delta) / wrap));
+	double uframes = delta + wraps * wrap;
+
+	m_sample_offset = ref->m_sample_offset +
+		std::llround(uframes * m_session->m_sample_rate / uframes_per_sec);
+	return 0;
+}
+
 int M1000_Device::run(uint64_t samples)
 {
 	// tell device to start sampling
@@ -935,114 +1261,114 @@ int M1000_Device::run(uint64_t samples)
 	if (ret < 0)
 		return -libusb_to_errno(ret);
 
+	join_out_prefill();
 	m_sample_count = samples;
-	m_requested_sampleno = m_in_sampleno = m_out_sampleno = 0;
-
-	// Method to kick off USB transfers.
-	auto start_usb_transfers = [=](M1000_Device* dev) {
-		std::unique_lock<std::recursive_mutex> lk(dev->m_state);
-		for (auto t: dev->m_in_transfers) {
-			if (dev->submit_in_transfer(t)) break;
+	m_requested_sampleno = m_in_sampleno = m_out_sampleno = m_read_sampleno = 0;
+	m_cancelled = false;
+	m_detached = false;
+	m_counters->restart();
+
+	// Kick off USB transfers on the session executor. Its threads outlive
+	// the transfers, which is required on Windows where libusb aborts
+	// transfers (error 995, ERROR_OPERATION_ABORTED) once the thread that
+	// submitted them exits.
+	//
+	// The kickoff holds a reference to the active transfers so the device
+	// can't complete before all transfers are submitted. Incoming transfers
+	// are submitted first so samples are received even if the app reads
+	// before it writes.
+	m_active_transfers = 1;
+	m_usb_strand.submit(m_session->executor(), [this]() {
+		for (auto t: m_in_transfers) {
+			if (submit_in_transfer(t)) break;
 		}
-		for (auto t: dev->m_out_transfers) {
-			if (dev->submit_out_transfer(t)) break;
+	});
+
+	// Filling outgoing transfers waits until the app writes samples, which
+	// would tie up an executor worker, so it's done on a separate thread.
+	// All of them are filled before any is submitted as completions refill
+	// them concurrently.
+	m_out_prefill = std::thread([this]() {
+#ifdef __linux__
+		pthread_setname_np(pthread_self(), "smu-prefill");
+#endif
+		std::vector<libusb_transfer*> out_transfers;
+		for (auto t: m_out_transfers) {
+			if (prepare_out_transfer(t)) break;
+			out_transfers.push_back(t);
 		}
+		m_usb_strand.submit(m_session->executor(), [this, out_transfers]() {
+			for (auto t: out_transfers) {
+				if (submit_out_transfer(t)) break;
+			}
+			release_transfer();
+		});
+	});
 
-#ifdef _WIN32
-		// Keep the thread alive on Windows otherwise the libusb event
-		// callbacks return 995 (ERROR_OPERATION_ABORTED) due to this thread
-		// exiting before the completion callbacks are finished for the
-		// transfers that were kicked off.
-		dev->m_usb_cv.wait(lk, [=]{ return (
-			dev->m_in_transfers.num_active == 0 && dev->m_out_transfers.num_active == 0 ); });
-#endif
-	};
+	// Queue samples written before the run.
+	for (unsigned ch_i = 0; ch_i < info()->channel_count; ch_i++)
+		schedule_feed(ch_i);
 
-	// Run the USB transfers within their own thread.
-	std::thread(start_usb_transfers, this).detach();
-
-	// Method to queue samples being sent to the device.
-	auto write_samples = [=](M1000_Device* dev, unsigned channel) {
-		boost::lockfree::spsc_queue<float>& q = *(dev->m_out_samples_q[channel]);
-		std::vector<float>& buf = dev->m_out_samples_buf[channel];
-		std::mutex& mtx = dev->m_out_samples_mtx[channel];
-		std::mutex& state_mtx = dev->m_out_samples_state_mtx[channel];
-		std::condition_variable& cv = dev->m_out_samples_cv[channel];
-		std::atomic<int>& stop = dev->m_out_samples_stop[channel];
-		std::atomic<uint32_t>& samples_available = dev->m_out_samples_avail[channel];
-		bool& cyclic = dev->m_out_samples_buf_cyclic[channel];
-
-		std::vector<float>::iterator it;
-		std::unique_lock<std::mutex> lk(mtx, std::defer_lock);
-		std::unique_lock<std::mutex> lk_state(state_mtx);
-
-		while (true) {
-			lk.lock();
-			// only wake up if we have a new buffer or were signaled to exit
-			cv.wait(lk, [&buf,&stop]{ return (buf.size() || stop < 0); });
-
-			// signaled to exit
-			if (stop < 0) {
-				lk.unlock();
-				return;
-			}
-			stop = 0;
-start:
-			it = buf.begin();
-			while (it != buf.end()) {
-				// push all the values that can fit at once
-				it = q.push(it, buf.end());
-
-				if (stop == 2) {
-					// signaled to pause
-					cv.wait(lk_state, [&stop]{ return stop != 2; });
-				} else if (stop) {
-					// signaled to stop
-					goto end;
-				}
+	return 0;
+}
 
-				// wait a bit for space if unable to queue the entire buffer
-				if (it != buf.end())
-					std::this_thread::sleep_for(std::chrono::microseconds(1));
-			}
+void M1000_Device::feed(unsigned channel, bool wait)
+{
+	std::unique_lock<std::mutex> lk(m_out_samples_mtx[channel], std::defer_lock);
+	if (wait)
+		lk.lock();
+	else if (!lk.try_lock())
+		return;
 
-			// if the buffer is cyclic continue pushing values from the beginning
-			if (cyclic) {
-				samples_available += buf.size();
-				goto start;
-			}
-end:
-			// either signaled to stop or done writing so wipe the buffer
-			if (stop || !cyclic)
-				buf.clear();
-
-			// notify waiting write() calls that the buffer is ready to be swapped
-			lk.unlock();
-			cv.notify_one();
-		}
-	};
+	std::vector<float>& buf = m_out_samples_buf[channel];
+	size_t& pos = m_out_samples_pos[channel];
+	// queues can be reallocated between runs so grab the current one
+	OutSampleQueue& q = *m_out_samples_q[channel];
+	if (!buf.size())
+		return;
 
-	// Kick off channel write threads or restart write process.
-	for (unsigned ch_i = 0; ch_i < info()->channel_count; ch_i++) {
-		// Don't restart threads on multiple run() calls.
-		if (!m_out_samples_thr[ch_i].joinable()) {
-			std::thread t(write_samples, this, ch_i);
-			std::swap(t, m_out_samples_thr[ch_i]);
-		} else {
-			// Threads already exist, make sure they're running if paused.
-			if (m_out_samples_stop[ch_i] == 2) {
-				m_out_samples_stop[ch_i] = 0;
-				m_out_samples_cv[ch_i].notify_one();
-			}
+	TraceScope trace("feed", this);
+	ProfileScope profile(m_session->profiler(), PROFILE_FEED);
+	size_t total = 0;
+	while (buf.size()) {
+		// push all the values that can fit at once
+		size_t pushed = q.push(buf.data() + pos, buf.size() - pos);
+		pos += pushed;
+		total += pushed;
+		trace.arg("samples", total);
+		profile.samples(total);
+		if (pushed)
+			raise_mark(m_counters->out_queue_high_water, m_out_queue_capacity - q.write_available());
+		if (pos < buf.size())
+			return;
+
+		// done writing, wipe the buffer so write() can swap it
+		pos = 0;
+		if (!m_out_samples_buf_cyclic[channel]) {
+			buf.clear();
+			return;
 		}
-    }
 
-	return 0;
+		// if the buffer is cyclic continue pushing values from the beginning
+		m_out_samples_avail[channel] += buf.size();
+	}
+}
+
+void M1000_Device::schedule_feed(unsigned channel)
+{
+	// one pending task per channel is enough, it queues all it can
+	if (m_out_samples_feeding[channel].exchange(true))
+		return;
+	m_feed_strand.submit(m_session->executor(), [=]() {
+		m_out_samples_feeding[channel] = false;
+		feed(channel);
+	});
 }
 
 int M1000_Device::cancel()
 {
 	lock();
+	m_cancelled = true;
 
 	int ret_in = m_in_transfers.cancel();
 	int ret_out = m_out_transfers.cancel();
@@ -1054,10 +1380,20 @@ int M1000_Device::cancel()
 	return 0;
 }
 
+void M1000_Device::join_out_prefill()
+{
+	if (m_out_prefill.joinable())
+		m_out_prefill.join();
+}
+
 int M1000_Device::off()
 {
 	int ret = 0;
 
+	// stop waiting for samples to send if the session timed out
+	m_cancelled = true;
+	join_out_prefill();
+
 	// determine if an overcurrent event occurred during the run
 	int overcurrent = read_adm1177();
 	// ignore errors if they occur
@@ -1076,23 +1412,18 @@ int M1000_Device::off()
 	// tell device to stop sampling
 	ret = ctrl_transfer(0x40, 0xC5, 0, 0, 0, 0, 100);
 
-	// pause writing samples, writing will resume on the next run() call
-	m_out_samples_stop[CHAN_A] = 2;
-	m_out_samples_stop[CHAN_B] = 2;
-
-	// signal usb transfer thread to exit
-	m_usb_cv.notify_one();
-
-	// If a data flow exception occurred while submitting transfers, rethrow
-	// the exception here for non-continuous sessions. This can be caught by
-	// wrapping session.run().
-	if (e_ptr && m_sample_count > 0) {
-		// copy exception pointer for throwing and reset it
-		std::exception_ptr new_e_ptr = e_ptr;
-		e_ptr = nullptr;
-		std::rethrow_exception(new_e_ptr);
+	// summarize samples left over by completions racing with queries
+	{
+		std::lock_guard<std::mutex> lock(m_summary_lock);
+		flush_summary();
 	}
 
+	// If a data flow error was reported while submitting transfers, throw
+	// it here for non-continuous sessions. This can be caught by wrapping
+	// session.run().
+	if (m_sample_count > 0)
+		raise_dataflow_error();
+
 	return libusb_errno_or_zero(ret);
 }
 
@@ -11,6 +11,7 @@
 #include <array>
 #include <atomic>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
@@ -19,7 +20,10 @@
 #include <boost/lockfree/spsc_queue.hpp>
 #include <libusb.h>
 
-#include "debug.hpp"
+#include "buffer.hpp"
+#include "executor.hpp"
+#include "history.hpp"
+#include "transport.hpp"
 #include "usb.hpp"
 #include <libsmu/libsmu.hpp>
 
@@ -39,6 +43,12 @@ struct EEPROM_cal {
 };
 
 namespace smu {
+	// Sample queues allocated via BufferAllocator so they can be locked into RAM.
+	typedef boost::lockfree::spsc_queue<std::array<float, 4>,
+		boost::lockfree::allocator<BufferAllocator<std::array<float, 4>>>> InSampleQueue;
+	typedef boost::lockfree::spsc_queue<float,
+		boost::lockfree::allocator<BufferAllocator<float>>> OutSampleQueue;
+
 	extern "C" void LIBUSB_CALL m1000_in_completion(libusb_transfer *t);
 	extern "C" void LIBUSB_CALL m1000_out_completion(libusb_transfer *t);
 
@@ -60,10 +70,20 @@ namespace smu {
 		ssize_t read(std::vector<std::array<float, 4>>& buf, size_t samples, int timeout,bool skipsamples) override;
 		int write(std::vector<float>& buf, unsigned channel, bool cyclic) override;
 		void flush(int channel, bool read) override;
+		size_t queue_memory() const override;
 		int sync() override;
 		int write_calibration(const char* cal_file_name) override;
 		int read_calibration() override;
 		void calibration(std::vector<std::vector<float>>* cal) override;
+		int record(const std::string& path) override;
+		int set_history(size_t max_bytes) override;
+		ssize_t read_history(std::vector<std::array<float, 4>>& buf, uint64_t start, size_t samples) override;
+		int history_range(uint64_t& first, uint64_t& end) override;
+		size_t history_memory() override;
+		int set_summary(size_t max_bins) override;
+		int64_t read_summary(unsigned signal, uint64_t start, uint64_t end, size_t pixels,
+			std::vector<SignalStats>& stats) override;
+		int summary_range(uint64_t& first, uint64_t& end) override;
 		int samba_mode() override;
 		int set_led(unsigned leds) override;
 		int set_adc_mux(unsigned adc_mux); // New function added;
@@ -82,7 +102,13 @@ namespace smu {
 		// Queue with ~100ms worth of incoming sample values at the default rate.
 		// The sample values are formatted in arrays of four values,
 		// specifically in the following order: <ChanA voltage, ChanA current, ChanB voltage, ChanB current>.
-		boost::lockfree::spsc_queue<std::array<float, 4>> m_in_samples_q;
+		std::unique_ptr<InSampleQueue> m_in_samples_q;
+
+		// Number of samples the input and each output queue can hold.
+		unsigned m_in_queue_capacity;
+		unsigned m_out_queue_capacity;
+		// Whether the queues use locked memory.
+		bool m_queues_locked = false;
 
 		// Number of samples available for reading/writing.
 		// TODO: Drop this when stable distros contain >= boost-1.57 with
@@ -91,58 +117,109 @@ namespace smu {
 		std::atomic<uint32_t> m_out_samples_avail[2] = {};
 
 		// Queues with ~100ms worth of outgoing sample values for both channels at the default rate.
-		boost::lockfree::spsc_queue<float> _out_samples_a_q;
-		boost::lockfree::spsc_queue<float> _out_samples_b_q;
-
-		// Reference the queues above via an array.
-		boost::lockfree::spsc_queue<float>* m_out_samples_q[2] = {&_out_samples_a_q, &_out_samples_b_q};
+		std::unique_ptr<OutSampleQueue> m_out_samples_q[2];
 
 		// Write buffers, one for each channel.
 		std::vector<float> m_out_samples_buf[2];
 		bool m_out_samples_buf_cyclic[2]{false,false};
+		// Index of the next sample of each write buffer to queue.
+		size_t m_out_samples_pos[2] = {};
 		std::mutex m_out_samples_mtx[2];
-		std::mutex m_out_samples_state_mtx[2];
-		std::condition_variable m_out_samples_cv[2];
 
-		// Used for write thread signaling, initialized to zero. If greater
-		// than zero the related write thread will stop using its current
-		// buffer and wait for another to be submitted. If less than zero, the
-		// write thread will return -- used to signal the thread to exit.
-		std::atomic<int> m_out_samples_stop[2] = {};
+		// Whether a task feeding the related output queue is pending.
+		std::atomic<bool> m_out_samples_feeding[2] = {};
+
+		// Set by flush() while streaming so the transfer handling, the only
+		// consumer of the output queues, drops their samples.
+		std::atomic<bool> m_out_samples_flush[2] = {};
 
-		// Threads used to write outgoing samples values to the queues above.
-		std::thread m_out_samples_thr[2];
+		// Number of transfers in flight, plus one while they're being
+		// kicked off. The device is complete once it drops to zero.
+		std::atomic<int> m_active_transfers{0};
 
-		// Used to keep initial USB transfer kickoff thread alive on Windows
-		// until off() is called.
-		std::condition_variable_any m_usb_cv;
+		// Set by cancel() to stop resubmitting transfers of this device
+		// alone and by off() to stop filling them, cleared by run().
+		std::atomic<bool> m_cancelled{false};
 
-		M1000_Device(Session* s, libusb_device* d, libusb_device_handle* h,
+		// Serializes feeding the output queues on the session executor.
+		Strand m_feed_strand;
+		// Serializes USB transfer handling on the session executor, i.e.
+		// the initial submission of transfers and, with decode offload,
+		// completed incoming transfers.
+		Strand m_usb_strand;
+		// Fills the outgoing transfers of a run, which waits for samples to
+		// be written and so is kept off the executor.
+		std::thread m_out_prefill;
+
+		// Wait for the outgoing transfers of the last run to be filled,
+		// stopping early if the device is cancelled.
+		void join_out_prefill();
+
+		M1000_Device(Session* s, libusb_device* d, Transport* transport,
 				const char* hw_version, const char* fw_version, const char* serial):
-			Device(s, d, h, hw_version, fw_version, serial),
+			Device(s, d, transport, hw_version, fw_version, serial),
 			m_signals {
 				{Signal(&m1000_signal_info[0]), Signal(&m1000_signal_info[1])},
 				{Signal(&m1000_signal_info[0]), Signal(&m1000_signal_info[1])},
 			},
 			m_mode{HI_Z,HI_Z},
-			m_in_samples_q{s->m_queue_size},
+			m_in_samples_q{new InSampleQueue(s->m_queue_size)},
+			m_in_queue_capacity{s->m_queue_size},
+			m_out_queue_capacity{s->m_queue_size},
 			m_in_samples_avail{0},
-			_out_samples_a_q{s->m_queue_size},
-			_out_samples_b_q{s->m_queue_size}
+			m_out_samples_q{
+				std::unique_ptr<OutSampleQueue>(new OutSampleQueue(s->m_queue_size)),
+				std::unique_ptr<OutSampleQueue>(new OutSampleQueue(s->m_queue_size))}
 			{}
 
+		// Process a completed incoming transfer and resubmit it.
+		void complete_in_transfer(libusb_transfer* t);
+
 		// Reformat received data, performs integer to float conversion.
 		void handle_in_transfer(libusb_transfer* t);
 
+		// Convert the raw ADC codes of a sample into calibrated values
+		// according to the ADC mux mode the sample was captured with.
+		// @param samples Holds the previous sample on entry, which selects
+		// the gains of current signals.
+		void decode_sample(const std::array<uint16_t, 4>& codes, int mux, std::array<float, 4>& samples) const;
+
 		// Reformat outgoing data, performs float to integer conversion.
 		void handle_out_transfer(libusb_transfer* t);
 
+		// Fill an outgoing transfer with the next samples to write.
+		// @return 0 if the transfer should be submitted, -1 otherwise.
+		int prepare_out_transfer(libusb_transfer* t);
+
 		// Submit data transfers to usb thread, from host to device.
 		int submit_out_transfer(libusb_transfer* t);
 
 		// Submit data transfers to usb thread, from device to host.
 		int submit_in_transfer(libusb_transfer* t);
 
+		// Whether the session or the device alone was cancelled.
+		bool cancelled() const { return m_session->cancelled() || m_cancelled; }
+
+		// Cancel a submitted transfer if the session or the device was
+		// cancelled meanwhile.
+		void cancel_if_cancelled(libusb_transfer* t);
+
+		// Drop a reference to the active transfers, completing the device
+		// if it was the last one.
+		void release_transfer();
+
+		// Drop the queued samples of a channel on behalf of flush().
+		void drop_out_samples(unsigned channel);
+
+		// Move samples from the write buffer of a channel to its output
+		// queue. Samples that don't fit are queued by later calls.
+		// @param wait Wait for write() or flush() to release the buffer,
+		// otherwise return right away if it's in use.
+		void feed(unsigned channel, bool wait = true);
+
+		// Feed the output queue of a channel on the session executor.
+		void schedule_feed(unsigned channel);
+
 		// Encode output samples.
 		// @param chan Target channel index.
 		// @param peek Use the first element from the write queue without discarding it.
@@ -181,6 +258,27 @@ namespace smu {
 		// Device calibration data.
 		EEPROM_cal m_cal;
 
+		// Compressed history of raw samples, NULL if disabled.
+		std::unique_ptr<History> m_history;
+		// Codes of the transfer being handled, appended to the history at once.
+		std::vector<std::array<uint16_t, 4>> m_history_codes;
+
+		// Summary of the samples, NULL if disabled.
+		std::unique_ptr<Pyramid> m_summary;
+		// Taken by queries and by completions, which only try to take it.
+		std::mutex m_summary_lock;
+		// Samples of the transfer being handled.
+		std::vector<std::array<float, 4>> m_summary_samples;
+		// Samples handed over by completions that weren't summarized yet,
+		// the lock is only held to append or swap them.
+		std::mutex m_summary_pending_lock;
+		std::vector<std::array<float, 4>> m_summary_pending;
+		// Pending samples being summarized, guarded by m_summary_lock.
+		std::vector<std::array<float, 4>> m_summary_flush;
+
+		// Summarize the pending samples, m_summary_lock must be held.
+		void flush_summary();
+
 		// Number of requested samples.
 		uint64_t m_sample_count = 0;
 
@@ -193,6 +291,13 @@ namespace smu {
 		int off() override;
 		int cancel() override;
 		int run(uint64_t samples) override;
+		int sync_to(Device* device) override;
+		bool streaming() const override { return m_active_transfers > 0; }
+		size_t read_available() override;
+		// Queues must be able to hold at least a couple transfers worth of
+		// samples otherwise data flow can't be maintained.
+		unsigned min_queue_size() const override { return 2 * m_samples_per_transfer; }
+		int resize_queues(unsigned in_size, unsigned out_size) override;
 	};
 
 }
@@ -0,0 +1,553 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "emulator.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+
+#include <libusb.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#include <libsmu/libsmu.hpp>
+
+using namespace smu;
+
+// Timer clock of the sample period for firmware versions after 023314a.
+static const double timer_clock = 48e6;
+static const unsigned samples_per_packet = 256;
+static const unsigned in_packet_size = samples_per_packet * 4 * 2;
+static const unsigned out_packet_size = samples_per_packet * 2 * 2;
+
+// Reference point for the USB frame counter shared by all emulated devices
+// as if they were attached to the same bus.
+static const std::chrono::steady_clock::time_point bus_epoch = std::chrono::steady_clock::now();
+
+// Wire connecting the same channel of all devices using VIRTUAL_WIRE. The
+// driving device publishes the voltage of each of its samples, devices
+// measuring the wire look them up by the time they're taken.
+struct VirtualWire {
+	std::mutex lock;
+	std::condition_variable cv;
+	// Device driving the wire, NULL while floating.
+	const M1000_Emulator* driver = NULL;
+	// Time of the driver's first sample and its sample period in seconds.
+	std::chrono::steady_clock::time_point start;
+	double sample_time = 0;
+	// Sample number of the oldest voltage held.
+	uint64_t first = 0;
+	std::deque<double> voltages;
+	// Set while the driver isn't producing samples as the host isn't reading.
+	bool idle = false;
+};
+static VirtualWire wires[2];
+
+// Convert a voltage into an uncalibrated ADC code.
+static uint16_t encode_voltage(double v)
+{
+	double code = std::round(v * 65536 / 5.0);
+	return std::min(std::max(code, 0.0), 65535.0);
+}
+
+// Convert a current into an uncalibrated ADC code.
+static uint16_t encode_current(double i)
+{
+	double code = std::round((i / 1.25 + 0.195) * 65536 / 0.4);
+	return std::min(std::max(code, 0.0), 65535.0);
+}
+
+M1000_Emulator::M1000_Emulator(const VirtualConfig& config):
+	m_config(config),
+	m_interleaved(std::atof(config.fwver.c_str()) >= 2)
+{
+}
+
+M1000_Emulator::~M1000_Emulator()
+{
+	shutdown();
+}
+
+void M1000_Emulator::shutdown()
+{
+	std::unique_lock<std::mutex> lk(m_lock);
+	m_exit = true;
+	release_wires();
+	interrupt_wires();
+	m_in_pending.clear();
+	m_out_pending.clear();
+	m_cancelled.clear();
+	lk.unlock();
+	m_cv.notify_all();
+
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+uint16_t M1000_Emulator::microframe()
+{
+	auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - bus_epoch);
+	return (elapsed.count() / 125) & 0x3FFF;
+}
+
+M1000_Emulator::clock::time_point M1000_Emulator::microframe_time(uint16_t frame)
+{
+	// start of the frame on the bus so devices started on the same frame
+	// start simultaneously
+	auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - bus_epoch);
+	uint64_t current = elapsed.count() / 125;
+	unsigned delta = (frame - current) & 0x3FFF;
+	return bus_epoch + std::chrono::microseconds((current + delta) * 125);
+}
+
+void M1000_Emulator::claim_wires()
+{
+	for (unsigned ch = 0; ch < 2; ch++) {
+		m_wire_stalled[ch] = UINT64_MAX;
+		if (m_mode[ch] != SVMI)
+			continue;
+		VirtualWire& wire = wires[ch];
+		std::lock_guard<std::mutex> lock(wire.lock);
+		wire.driver = this;
+		wire.start = m_start;
+		wire.sample_time = m_sample_time;
+		wire.first = 0;
+		wire.voltages.clear();
+		wire.idle = false;
+		wire.cv.notify_all();
+	}
+}
+
+void M1000_Emulator::drive_wire(unsigned ch, double v)
+{
+	VirtualWire& wire = wires[ch];
+	std::lock_guard<std::mutex> lock(wire.lock);
+	// (re)start the wire's history when taking it over or restarting
+	if (wire.driver != this || wire.first + wire.voltages.size() != m_sampleno) {
+		wire.driver = this;
+		wire.start = m_start;
+		wire.sample_time = m_sample_time;
+		wire.first = m_sampleno;
+		wire.voltages.clear();
+	}
+	wire.voltages.push_back(v);
+	wire.idle = false;
+	// keep around a second of samples for devices measuring the wire
+	if (wire.voltages.size() * m_sample_time > 1) {
+		wire.voltages.pop_front();
+		wire.first++;
+	}
+	wire.cv.notify_all();
+}
+
+// Position of a sample between the samples of a wire's driver.
+static double wire_position(const VirtualWire& wire, std::chrono::steady_clock::time_point start,
+	double sample_time, uint64_t sampleno)
+{
+	return (std::chrono::duration<double>(start - wire.start).count() +
+		sampleno * sample_time) / wire.sample_time;
+}
+
+bool M1000_Emulator::wait_wires(std::unique_lock<std::mutex>& lk, unsigned samples)
+{
+	if (m_config.load != VIRTUAL_WIRE || !m_config.realtime)
+		return false;
+
+	for (unsigned ch = 0; ch < 2; ch++) {
+		if (m_mode[ch] == SVMI || m_mode[ch] == SIMV)
+			continue;
+		VirtualWire& wire = wires[ch];
+		std::unique_lock<std::mutex> wire_lk(wire.lock);
+		if (!wire.driver || wire.driver == this)
+			continue;
+
+		// The driver produces whole transfers of samples on its own thread,
+		// wait unless it stopped producing samples without releasing the
+		// wire. The latest voltage is held then until it produces more.
+		double next = std::floor(wire_position(wire, m_start, m_sample_time, m_sampleno + samples - 1)) + 1;
+		uint64_t produced = wire.first + wire.voltages.size();
+		if (next < produced || produced == m_wire_stalled[ch])
+			continue;
+		if (wire.idle) {
+			m_wire_stalled[ch] = produced;
+			continue;
+		}
+
+		const M1000_Emulator* driver = wire.driver;
+		m_wire_interrupt = false;
+		lk.unlock();
+		wire.cv.wait_for(wire_lk, std::chrono::seconds(1), [&]{
+			return wire.driver != driver || wire.idle || m_wire_interrupt ||
+				next < wire.first + wire.voltages.size();
+		});
+		if (next >= wire.first + wire.voltages.size() && !m_wire_interrupt)
+			m_wire_stalled[ch] = wire.first + wire.voltages.size();
+		wire_lk.unlock();
+		lk.lock();
+		return true;
+	}
+	return false;
+}
+
+double M1000_Emulator::measure_wire(unsigned ch)
+{
+	VirtualWire& wire = wires[ch];
+	std::lock_guard<std::mutex> lock(wire.lock);
+	if (!wire.driver || wire.driver == this || wire.voltages.empty())
+		return 0;
+
+	double pos = wire_position(wire, m_start, m_sample_time, m_sampleno);
+	uint64_t last = wire.first + wire.voltages.size() - 1;
+	if (pos <= wire.first)
+		return wire.voltages.front();
+	if (pos >= last)
+		return wire.voltages.back();
+	size_t i = std::floor(pos) - wire.first;
+	double frac = pos - std::floor(pos);
+	return wire.voltages[i] * (1 - frac) + wire.voltages[i + 1] * frac;
+}
+
+void M1000_Emulator::interrupt_wires()
+{
+	for (VirtualWire& wire: wires) {
+		std::lock_guard<std::mutex> lock(wire.lock);
+		m_wire_interrupt = true;
+		wire.cv.notify_all();
+	}
+}
+
+void M1000_Emulator::idle_wires()
+{
+	for (VirtualWire& wire: wires) {
+		std::lock_guard<std::mutex> lock(wire.lock);
+		if (wire.driver == this && !wire.idle) {
+			wire.idle = true;
+			wire.cv.notify_all();
+		}
+	}
+}
+
+void M1000_Emulator::release_wires()
+{
+	for (VirtualWire& wire: wires) {
+		std::lock_guard<std::mutex> lock(wire.lock);
+		if (wire.driver == this) {
+			wire.driver = NULL;
+			wire.voltages.clear();
+			wire.cv.notify_all();
+		}
+	}
+}
+
+int M1000_Emulator::control_transfer(uint8_t bmRequestType, uint8_t bRequest,
+	uint16_t wValue, uint16_t wIndex, unsigned char* data, uint16_t wLength,
+	unsigned timeout)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_exit)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	switch (bRequest) {
+		case 0x00: {
+			// hardware or firmware version string
+			const std::string& version = wIndex ? m_config.fwver : m_config.hwver;
+			uint16_t len = std::min<size_t>(version.size() + 1, wLength);
+			std::memcpy(data, version.c_str(), len);
+			return len;
+		}
+		case 0x01: {
+			// read calibration
+			uint16_t len = std::min<size_t>(sizeof(m_cal), wLength);
+			std::memcpy(data, &m_cal, len);
+			return len;
+		}
+		case 0x02: {
+			// write calibration
+			uint16_t len = std::min<size_t>(sizeof(m_cal), wLength);
+			std::memcpy(&m_cal, data, len);
+			return len;
+		}
+		case 0x53:
+			// channel mode
+			if (wValue > 1)
+				return LIBUSB_ERROR_PIPE;
+			m_mode[wValue] = wIndex;
+			if (m_config.load == VIRTUAL_WIRE && m_mode[wValue] != SVMI)
+				release_wires();
+			return 0;
+		case 0x6F: {
+			// current USB microframe
+			uint16_t frame = microframe();
+			uint16_t len = std::min<size_t>(sizeof(frame), wLength);
+			std::memcpy(data, &frame, len);
+			return len;
+		}
+		case 0xC5:
+			// start or stop sampling, starting at the given microframe if set
+			m_sam_per = wValue;
+			if (m_sam_per) {
+				m_sample_time = 2 * m_sam_per / timer_clock;
+				m_sampleno = 0;
+				m_out_fifo.clear();
+				m_start = (wIndex && m_config.realtime) ?
+					microframe_time(wIndex + m_config.start_delay) : clock::now();
+				if (m_config.load == VIRTUAL_WIRE)
+					claim_wires();
+			} else if (m_config.load == VIRTUAL_WIRE) {
+				release_wires();
+			}
+			m_cv.notify_all();
+			return 0;
+		case 0x17:
+			// ADM1177 status, overcurrent events never occur
+			if (wLength < 1)
+				return LIBUSB_ERROR_OVERFLOW;
+			data[0] = 0;
+			return 1;
+		case 0x05:
+			// custom serial number, accepted but not persisted
+			return wLength;
+		case 0x03: // LEDs
+		case 0x20: // ADC mux settings
+		case 0x21:
+		case 0x22:
+		case 0x23:
+		case 0x51: // GPIO pins
+		case 0x59: // digital potentiometers
+		case 0xCC: // hardware configuration
+			return 0;
+		default:
+			// unsupported requests, including SAM-BA mode, stall
+			return LIBUSB_ERROR_PIPE;
+	}
+}
+
+int M1000_Emulator::submit_transfer(libusb_transfer* t)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_exit)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	auto& pending = (t->endpoint & LIBUSB_ENDPOINT_IN) ? m_in_pending : m_out_pending;
+	if (std::find(pending.begin(), pending.end(), t) != pending.end())
+		return LIBUSB_ERROR_BUSY;
+	pending.push_back(t);
+	if (!m_thread.joinable())
+		m_thread = std::thread(&M1000_Emulator::run, this);
+	m_cv.notify_all();
+	return 0;
+}
+
+int M1000_Emulator::cancel_transfer(libusb_transfer* t)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	for (auto pending: {&m_in_pending, &m_out_pending}) {
+		auto it = std::find(pending->begin(), pending->end(), t);
+		if (it != pending->end()) {
+			pending->erase(it);
+			m_cancelled.push_back(t);
+			m_cv.notify_all();
+			if (m_config.load == VIRTUAL_WIRE)
+				interrupt_wires();
+			return 0;
+		}
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+std::array<uint16_t, 4> M1000_Emulator::step()
+{
+	std::array<uint16_t, 4> codes;
+
+	// apply the next output values if the host has sent them, otherwise hold
+	if (!m_out_fifo.empty()) {
+		m_out_code[0] = m_out_fifo.front().first;
+		m_out_code[1] = m_out_fifo.front().second;
+		m_out_fifo.pop_front();
+	}
+
+	for (unsigned ch = 0; ch < 2; ch++) {
+		double v = 0, i = 0;
+		double v_set = m_out_code[ch] * 5.0 / 65536;
+		double i_set = (m_out_code[ch] / 65536.0 - 0.4) / 1.6;
+
+		if (m_config.load == VIRTUAL_LOOPBACK) {
+			if (m_mode[ch] == SVMI)
+				v = v_set;
+			else if (m_mode[ch] == SIMV)
+				i = i_set;
+		} else if (m_config.load == VIRTUAL_WIRE) {
+			if (m_mode[ch] == SVMI) {
+				v = v_set;
+				drive_wire(ch, v);
+			} else if (m_mode[ch] == SIMV) {
+				i = i_set;
+			} else {
+				v = measure_wire(ch);
+			}
+		} else {
+			double r = m_config.resistance;
+			double c = m_config.capacitance;
+			double& v_cap = m_cap_voltage[ch];
+
+			if (m_mode[ch] == SVMI) {
+				v = v_set;
+				i = (v - v_cap) / r;
+				// exact step response keeps small time constants stable
+				if (c > 0)
+					v_cap = v - (v - v_cap) * std::exp(-m_sample_time / (r * c));
+			} else if (m_mode[ch] == SIMV) {
+				i = i_set;
+				v = v_cap + i * r;
+				// limit to the voltage compliance of the channel
+				if (v > 5 || v < 0) {
+					v = std::min(std::max(v, 0.0), 5.0);
+					i = (v - v_cap) / r;
+				}
+				if (c > 0)
+					v_cap += i * m_sample_time / c;
+			} else {
+				v = v_cap;
+			}
+			if (c <= 0)
+				v_cap = 0;
+		}
+
+		codes[ch * 2] = encode_voltage(v);
+		codes[ch * 2 + 1] = encode_current(i);
+	}
+
+	m_sampleno++;
+	return codes;
+}
+
+libusb_transfer_status M1000_Emulator::fill_in_transfer(libusb_transfer* t, unsigned samples)
+{
+	for (unsigned n = 0; n < samples; n++) {
+		std::array<uint16_t, 4> codes = step();
+		if (!t)
+			continue;
+
+		unsigned i = n % samples_per_packet;
+		uint8_t* buf = t->buffer + (n / samples_per_packet) * in_packet_size;
+		for (unsigned s = 0; s < 4; s++) {
+			// firmware versions >= 2.00 interleave the signals of each sample
+			unsigned offset = m_interleaved ? (i * 4 + s) * 2 : (i + samples_per_packet * s) * 2;
+			buf[offset] = codes[s] >> 8;
+			buf[offset + 1] = codes[s] & 0xff;
+		}
+	}
+
+	if (t)
+		t->actual_length = samples * 8;
+	return LIBUSB_TRANSFER_COMPLETED;
+}
+
+void M1000_Emulator::drain_out_transfer(libusb_transfer* t)
+{
+	unsigned samples = t->length / 4;
+	for (unsigned n = 0; n < samples; n++) {
+		unsigned i = n % samples_per_packet;
+		uint8_t* buf = t->buffer + (n / samples_per_packet) * out_packet_size;
+		uint16_t a, b;
+		if (m_interleaved) {
+			a = buf[i * 4 + 0] << 8 | buf[i * 4 + 1];
+			b = buf[i * 4 + 2] << 8 | buf[i * 4 + 3];
+		} else {
+			a = buf[i * 2] << 8 | buf[i * 2 + 1];
+			b = buf[(i + samples_per_packet) * 2] << 8 | buf[(i + samples_per_packet) * 2 + 1];
+		}
+		m_out_fifo.emplace_back(a, b);
+	}
+	t->actual_length = t->length;
+}
+
+void M1000_Emulator::run()
+{
+#ifdef __linux__
+	// started from whichever thread submits first, don't inherit its name
+	pthread_setname_np(pthread_self(), "smu-virtual");
+#endif
+	std::unique_lock<std::mutex> lk(m_lock);
+	// time at which to stop waiting for output from the host in fast mode
+	bool out_waiting = false;
+	clock::time_point out_deadline;
+
+	while (!m_exit) {
+		libusb_transfer* t = NULL;
+
+		if (!m_cancelled.empty()) {
+			t = m_cancelled.front();
+			m_cancelled.pop_front();
+			t->actual_length = 0;
+			t->status = LIBUSB_TRANSFER_CANCELLED;
+		} else if (!m_out_pending.empty() &&
+				m_out_fifo.size() < (unsigned)m_out_pending.front()->length / 4) {
+			// accept output data while the device's buffer has room
+			t = m_out_pending.front();
+			m_out_pending.pop_front();
+			drain_out_transfer(t);
+			t->status = LIBUSB_TRANSFER_COMPLETED;
+		} else if (m_sam_per && (!m_in_pending.empty() || !m_out_pending.empty())) {
+			// Sample while the host is reading or while output data is
+			// waiting on the buffer to drain.
+			unsigned samples = m_in_pending.empty() ?
+				samples_per_packet : m_in_pending.front()->length / 8;
+
+			if (m_config.realtime) {
+				auto deadline = m_start + std::chrono::duration_cast<clock::duration>(
+					std::chrono::duration<double>((m_sampleno + samples) * m_sample_time));
+				if (clock::now() < deadline) {
+					m_cv.wait_until(lk, deadline);
+					continue;
+				}
+				if (wait_wires(lk, samples))
+					continue;
+			} else if (m_out_fifo.size() < samples && m_out_pending.empty()) {
+				// In fast mode the sample clock follows the output from the
+				// host, holding the last value if none arrives in time.
+				if (!out_waiting) {
+					out_waiting = true;
+					out_deadline = clock::now() + std::chrono::milliseconds(100);
+				}
+				if (clock::now() < out_deadline) {
+					m_cv.wait_until(lk, out_deadline);
+					continue;
+				}
+			}
+			out_waiting = false;
+
+			if (m_in_pending.empty()) {
+				// replays stop sampling once the recording ends
+				if (fill_in_transfer(NULL, samples) != LIBUSB_TRANSFER_COMPLETED)
+					m_cv.wait(lk);
+				continue;
+			}
+			t = m_in_pending.front();
+			m_in_pending.pop_front();
+			t->status = fill_in_transfer(t, samples);
+		} else {
+			if (m_config.load == VIRTUAL_WIRE)
+				idle_wires();
+			m_cv.wait(lk);
+			continue;
+		}
+
+		// run completion callbacks unlocked so they can resubmit transfers
+		lk.unlock();
+		t->callback(t);
+		lk.lock();
+	}
+}
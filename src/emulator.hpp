@@ -0,0 +1,127 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <libusb.h>
+
+#include "device_m1000.hpp"
+#include "transport.hpp"
+#include <libsmu/libsmu.hpp>
+
+namespace smu {
+	// Software ADALM1000 implementing the firmware's side of the transport.
+	//
+	// Control requests are answered synchronously while bulk transfers are
+	// queued and completed from a dedicated thread, started once the first
+	// transfer is submitted, matching the asynchronous behavior of libusb
+	// where callbacks never run from within submission.
+	// Each sample applies the latest output codes from the host to a load
+	// model and encodes the measured voltage and current of both channels
+	// using the uncalibrated ADC scaling.
+	class M1000_Emulator: public Transport {
+	public:
+		M1000_Emulator(const VirtualConfig& config);
+		~M1000_Emulator();
+
+		int claim_interface(int iface) override { return 0; }
+		int release_interface(int iface) override { return 0; }
+		int set_interface_alt_setting(int iface, int alt_setting) override { return 0; }
+		int control_transfer(uint8_t bmRequestType, uint8_t bRequest,
+			uint16_t wValue, uint16_t wIndex, unsigned char* data, uint16_t wLength,
+			unsigned timeout) override;
+		int submit_transfer(libusb_transfer* t) override;
+		int cancel_transfer(libusb_transfer* t) override;
+		void shutdown() override;
+
+		const VirtualConfig m_config;
+
+	protected:
+		typedef std::chrono::steady_clock clock;
+
+		// Process submitted transfers until shutdown.
+		void run();
+
+		// Produce the samples for an incoming transfer, a NULL transfer
+		// discards the generated samples.
+		// @return The status the transfer completes with.
+		virtual libusb_transfer_status fill_in_transfer(libusb_transfer* t, unsigned samples);
+		// Queue the output codes of an outgoing transfer.
+		void drain_out_transfer(libusb_transfer* t);
+		// Simulate one sample period, returning the ADC codes of the
+		// measured signals: <ChanA voltage, ChanA current, ChanB voltage, ChanB current>.
+		std::array<uint16_t, 4> step();
+
+		// Current USB microframe number, shared across all emulated devices.
+		static uint16_t microframe();
+		// Time at which the given microframe number next occurs.
+		static clock::time_point microframe_time(uint16_t frame);
+
+		// Start driving the wires of sourcing channels as sampling starts so
+		// devices measuring them wait for the first samples.
+		void claim_wires();
+		// Publish the voltage driven onto a channel's wire by the current sample.
+		void drive_wire(unsigned ch, double v);
+		// Wait for the voltages measured by the next samples to be driven
+		// onto the wires, releasing the lock while waiting.
+		// @return True if waited, the state has to be checked again.
+		bool wait_wires(std::unique_lock<std::mutex>& lk, unsigned samples);
+		// Voltage of a channel's wire at the time of the current sample,
+		// holding the latest voltage driven if it isn't available yet.
+		double measure_wire(unsigned ch);
+		// Stop driving the wires of both channels, leaving them floating.
+		void release_wires();
+		// Let devices measuring the driven wires know no samples are coming
+		// until the host reads again.
+		void idle_wires();
+		// Wake the thread if it's waiting for wires, e.g. to handle cancellations.
+		void interrupt_wires();
+
+		// Whether the firmware uses the interleaved packet format.
+		bool m_interleaved;
+
+		std::mutex m_lock;
+		std::condition_variable m_cv;
+		std::thread m_thread;
+		bool m_exit = false;
+
+		std::deque<libusb_transfer*> m_in_pending;
+		std::deque<libusb_transfer*> m_out_pending;
+		std::deque<libusb_transfer*> m_cancelled;
+
+		// Output codes received from the host not yet applied.
+		std::deque<std::pair<uint16_t, uint16_t>> m_out_fifo;
+		// Most recently applied output codes.
+		uint16_t m_out_code[2] = {0, 0};
+
+		// Channel modes as set by the host.
+		unsigned m_mode[2] = {HI_Z, HI_Z};
+		// Capacitor voltage of the RC load on each channel.
+		double m_cap_voltage[2] = {0, 0};
+		// Samples published on each channel's wire when waiting for its
+		// driver last timed out, waits are skipped until it publishes more.
+		uint64_t m_wire_stalled[2] = {UINT64_MAX, UINT64_MAX};
+		// Set by interrupt_wires(), protected by the wire locks.
+		bool m_wire_interrupt = false;
+
+		// Sampling state, m_sam_per is zero when stopped.
+		unsigned m_sam_per = 0;
+		double m_sample_time = 0;
+		uint64_t m_sampleno = 0;
+		clock::time_point m_start;
+
+		// Calibration data stored in the emulated EEPROM.
+		EEPROM_cal m_cal = {};
+	};
+}
@@ -0,0 +1,16 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#pragma once
+
+#include <boost/lockfree/queue.hpp>
+
+#include <libsmu/libsmu.hpp>
+
+namespace smu {
+	// Fixed-size queue of data flow events. Events are pushed from the USB
+	// thread and the executor while the application polls them so the queue
+	// is multi-producer and never allocates once constructed.
+	class EventQueue: public boost::lockfree::queue<DeviceEvent, boost::lockfree::capacity<256>> {};
+}
@@ -0,0 +1,159 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "executor.hpp"
+
+#include <algorithm>
+#include <string>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#include "threads.hpp"
+
+using namespace smu;
+
+// Executor and worker index of the current thread, used to queue tasks
+// submitted from a worker on its own deque.
+static thread_local Executor* current_executor = NULL;
+static thread_local unsigned current_worker = 0;
+
+Executor::Executor(unsigned threads)
+{
+	threads = std::max(threads, 1u);
+	for (unsigned i = 0; i < threads; i++)
+		m_workers.emplace_back(new Worker);
+	for (unsigned i = 0; i < threads; i++)
+		m_workers[i]->thread = std::thread(&Executor::work, this, i);
+}
+
+Executor::~Executor()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_exit = true;
+	}
+	m_cv.notify_all();
+	for (auto& worker: m_workers)
+		worker->thread.join();
+}
+
+void Executor::submit(std::function<void()> task)
+{
+	unsigned index;
+	if (current_executor == this)
+		index = current_worker;
+	else
+		index = m_next++ % m_workers.size();
+
+	Worker& worker = *m_workers[index];
+	{
+		std::lock_guard<std::mutex> lock(worker.lock);
+		worker.tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_queued++;
+	}
+	m_cv.notify_one();
+}
+
+int Executor::configure(const ThreadConfig& config)
+{
+	int ret = 0;
+	for (auto& worker: m_workers) {
+		int err = configure_thread(worker->thread, config);
+		if (err && !ret)
+			ret = err;
+	}
+	return ret;
+}
+
+bool Executor::pop(unsigned index, std::function<void()>& task)
+{
+	// newest task of the worker's own deque first
+	{
+		Worker& worker = *m_workers[index];
+		std::lock_guard<std::mutex> lock(worker.lock);
+		if (!worker.tasks.empty()) {
+			task = std::move(worker.tasks.back());
+			worker.tasks.pop_back();
+			return true;
+		}
+	}
+
+	// then the oldest task of the other workers
+	for (unsigned i = 1; i < m_workers.size(); i++) {
+		Worker& victim = *m_workers[(index + i) % m_workers.size()];
+		std::lock_guard<std::mutex> lock(victim.lock);
+		if (!victim.tasks.empty()) {
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void Executor::work(unsigned index)
+{
+#ifdef __linux__
+	std::string name = "smu-exec-" + std::to_string(index);
+	pthread_setname_np(pthread_self(), name.c_str());
+#endif
+	current_executor = this;
+	current_worker = index;
+
+	std::function<void()> task;
+	while (true) {
+		if (pop(index, task)) {
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_queued--;
+			}
+			task();
+			task = nullptr;
+			continue;
+		}
+
+		// Tasks can be taken by other workers before they're counted so
+		// m_queued may briefly be off, sleeping is only skipped then.
+		std::unique_lock<std::mutex> lock(m_lock);
+		if (m_exit && m_queued <= 0)
+			break;
+		m_cv.wait(lock, [this]{ return m_queued > 0 || m_exit; });
+	}
+}
+
+void Strand::submit(Executor* executor, std::function<void()> task)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_tasks.push_back(std::move(task));
+	if (!m_running) {
+		m_running = true;
+		executor->submit([this]{ run(); });
+	}
+}
+
+void Strand::run()
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+	while (!m_tasks.empty()) {
+		std::function<void()> task = std::move(m_tasks.front());
+		m_tasks.pop_front();
+		lock.unlock();
+		task();
+		lock.lock();
+	}
+	m_running = false;
+	m_idle.notify_all();
+}
+
+void Strand::drain()
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+	m_idle.wait(lock, [this]{ return !m_running; });
+}
@@ -0,0 +1,93 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <libsmu/libsmu.hpp>
+
+namespace smu {
+	// Fixed-size pool of worker threads shared by all devices of a session.
+	//
+	// Each worker owns a deque of tasks. Tasks submitted from a worker go to
+	// the back of its own deque and are run from there (most recent first,
+	// while their data is still cached), other tasks are spread over the
+	// workers round-robin. Idle workers steal from the front of the other
+	// deques before going to sleep.
+	//
+	// Tasks must not throw or block waiting on other tasks, the pool doesn't
+	// grow.
+	class Executor {
+	public:
+		// Start the worker threads.
+		// @param threads Number of workers, at least one is always started.
+		Executor(unsigned threads);
+
+		// Run all queued tasks and stop the worker threads.
+		~Executor();
+
+		// Number of worker threads.
+		unsigned threads() const { return m_workers.size(); }
+
+		// Queue a task to be run on one of the workers.
+		void submit(std::function<void()> task);
+
+		// Apply scheduling settings to all worker threads.
+		// @return 0 on success, otherwise the error of the first failure.
+		int configure(const ThreadConfig& config);
+
+	private:
+		struct Worker {
+			std::mutex lock;
+			std::deque<std::function<void()>> tasks;
+			std::thread thread;
+		};
+
+		// Worker thread loop.
+		void work(unsigned index);
+
+		// Get a task from the worker's own deque or steal one from another.
+		bool pop(unsigned index, std::function<void()>& task);
+
+		std::vector<std::unique_ptr<Worker>> m_workers;
+		// Next worker receiving tasks submitted from other threads.
+		std::atomic<unsigned> m_next{0};
+
+		// Idle workers sleep on m_cv until tasks are queued.
+		std::mutex m_lock;
+		std::condition_variable m_cv;
+		// Number of queued tasks not yet taken by a worker.
+		int m_queued = 0;
+		bool m_exit = false;
+	};
+
+	// Runs tasks on an executor one at a time in submission order, e.g. to
+	// serialize work on a single device without dedicating a thread to it.
+	class Strand {
+	public:
+		// Queue a task, it's run after all previously queued tasks have finished.
+		void submit(Executor* executor, std::function<void()> task);
+
+		// Block until all queued tasks have finished.
+		void drain();
+
+	private:
+		// Run queued tasks until none are left.
+		void run();
+
+		std::mutex m_lock;
+		std::condition_variable m_idle;
+		std::deque<std::function<void()>> m_tasks;
+		// Whether a run() call is queued or running on the executor.
+		bool m_running = false;
+	};
+}
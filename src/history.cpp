@@ -0,0 +1,229 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "history.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace smu;
+
+// Number of samples compressed together, decompression granularity for reads.
+static const size_t history_chunk_size = 4096;
+// Number of deltas sharing a bit width.
+static const size_t history_group_size = 128;
+
+static inline uint32_t zigzag(int32_t v)
+{
+	return (uint32_t)(v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t v)
+{
+	return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+void History::compress(const std::array<uint16_t, 4>* codes, size_t count, std::vector<uint8_t>& data)
+{
+	std::vector<uint32_t> deltas(history_group_size);
+
+	for (unsigned sig = 0; sig < 4; sig++) {
+		int32_t prev = 0;
+		for (size_t group = 0; group < count; group += history_group_size) {
+			size_t n = std::min(history_group_size, count - group);
+			uint32_t bits = 0;
+			for (size_t i = 0; i < n; i++) {
+				int32_t code = codes[group + i][sig];
+				deltas[i] = zigzag(code - prev);
+				bits |= deltas[i];
+				prev = code;
+			}
+
+			unsigned width = 0;
+			while (bits >> width)
+				width++;
+			data.push_back(width);
+			if (!width)
+				continue;
+
+			// pack LSB first into a byte stream
+			uint64_t acc = 0;
+			unsigned acc_bits = 0;
+			for (size_t i = 0; i < n; i++) {
+				acc |= (uint64_t)deltas[i] << acc_bits;
+				acc_bits += width;
+				while (acc_bits >= 8) {
+					data.push_back(acc & 0xff);
+					acc >>= 8;
+					acc_bits -= 8;
+				}
+			}
+			if (acc_bits)
+				data.push_back(acc & 0xff);
+		}
+	}
+}
+
+void History::decompress(const Chunk& chunk, std::array<uint16_t, 4>* codes)
+{
+	const uint8_t* data = chunk.data.data();
+
+	for (unsigned sig = 0; sig < 4; sig++) {
+		int32_t prev = 0;
+		for (size_t group = 0; group < chunk.count; group += history_group_size) {
+			size_t n = std::min<size_t>(history_group_size, chunk.count - group);
+			unsigned width = *data++;
+			uint64_t mask = (1ULL << width) - 1;
+			uint64_t acc = 0;
+			unsigned acc_bits = 0;
+			for (size_t i = 0; i < n; i++) {
+				while (acc_bits < width) {
+					acc |= (uint64_t)*data++ << acc_bits;
+					acc_bits += 8;
+				}
+				prev += unzigzag(acc & mask);
+				acc >>= width;
+				acc_bits -= width;
+				codes[group + i][sig] = prev;
+			}
+		}
+	}
+}
+
+void History::flush()
+{
+	if (m_staging.empty())
+		return;
+
+	std::shared_ptr<Chunk> chunk(new Chunk());
+	chunk->first = m_end - m_staging.size();
+	chunk->count = m_staging.size();
+	chunk->mux = m_staging_mux;
+	compress(m_staging.data(), m_staging.size(), chunk->data);
+	chunk->data.shrink_to_fit();
+	m_staging.clear();
+
+	m_bytes += chunk->data.size();
+	m_chunks.push_back(chunk);
+	while (m_bytes > m_max_bytes && !m_chunks.empty()) {
+		m_bytes -= m_chunks.front()->data.size();
+		m_chunks.pop_front();
+	}
+
+	// keep the start of the transfer the oldest sample held belongs to
+	uint64_t first = m_chunks.empty() ? m_end - m_staging.size() : m_chunks.front()->first;
+	while (m_transfers.size() > 1 && m_transfers[1] <= first) {
+		m_bytes -= sizeof(uint64_t);
+		m_transfers.pop_front();
+	}
+}
+
+void History::append(const std::array<uint16_t, 4>* codes, size_t count, int mux)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	// chunks hold samples of a single mux mode
+	if (mux != m_staging_mux)
+		flush();
+	m_staging_mux = mux;
+	m_staging.reserve(history_chunk_size);
+	if (count) {
+		m_transfers.push_back(m_end);
+		m_bytes += sizeof(uint64_t);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		m_staging.push_back(codes[i]);
+		m_end++;
+		if (m_staging.size() == history_chunk_size)
+			flush();
+	}
+}
+
+void History::range(uint64_t& first, uint64_t& end)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	end = m_end;
+	first = m_chunks.empty() ? m_end - m_staging.size() : m_chunks.front()->first;
+}
+
+size_t History::memory()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_bytes + m_staging.size() * sizeof(m_staging[0]);
+}
+
+ssize_t History::read(uint64_t start, size_t count, std::vector<std::array<uint16_t, 4>>& codes,
+	std::vector<int>& mux, size_t& lead, std::vector<size_t>& transfers)
+{
+	std::vector<std::shared_ptr<const Chunk>> chunks;
+	std::vector<std::array<uint16_t, 4>> staged;
+	uint64_t staged_first;
+	int staged_mux;
+
+	codes.clear();
+	mux.clear();
+	transfers.clear();
+	lead = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		uint64_t first = m_chunks.empty() ? m_end - m_staging.size() : m_chunks.front()->first;
+		if (start < first || (start >= m_end && count))
+			return -ERANGE;
+		count = std::min<uint64_t>(count, m_end - start);
+
+		// read from the start of the transfer holding the first sample
+		auto t = std::upper_bound(m_transfers.begin(), m_transfers.end(), start);
+		if (t != m_transfers.begin())
+			lead = start - std::max(first, *std::prev(t));
+		start -= lead;
+		count += lead;
+		for (t = std::lower_bound(m_transfers.begin(), m_transfers.end(), start);
+				t != m_transfers.end() && *t < start + count; ++t)
+			transfers.push_back(*t - start);
+
+		// chunks are contiguous, find the one holding the first sample
+		auto it = std::upper_bound(m_chunks.begin(), m_chunks.end(), start,
+			[](uint64_t sample, const std::shared_ptr<const Chunk>& chunk) { return sample < chunk->first; });
+		if (it != m_chunks.begin())
+			--it;
+		for (; it != m_chunks.end() && (*it)->first < start + count; ++it)
+			chunks.push_back(*it);
+
+		staged_first = m_end - m_staging.size();
+		if (staged_first < start + count)
+			staged.assign(m_staging.begin(), m_staging.end());
+		staged_mux = m_staging_mux;
+	}
+
+	codes.reserve(count);
+	mux.reserve(count);
+	std::vector<std::array<uint16_t, 4>> buf(history_chunk_size);
+	for (const auto& chunk: chunks) {
+		decompress(*chunk, buf.data());
+		uint64_t begin = std::max(start, chunk->first) - chunk->first;
+		uint64_t end = std::min<uint64_t>(start + count - chunk->first, chunk->count);
+		if (begin >= end)
+			continue;
+		codes.insert(codes.end(), buf.begin() + begin, buf.begin() + end);
+		mux.insert(mux.end(), end - begin, chunk->mux);
+	}
+	if (!staged.empty()) {
+		uint64_t begin = std::max(start, staged_first) - staged_first;
+		uint64_t end = std::min<uint64_t>(start + count - staged_first, staged.size());
+		if (begin < end) {
+			codes.insert(codes.end(), staged.begin() + begin, staged.begin() + end);
+			mux.insert(mux.end(), end - begin, staged_mux);
+		}
+	}
+
+	return codes.size();
+}
@@ -0,0 +1,83 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <libsmu/libsmu.hpp>
+
+namespace smu {
+	// Compressed store of raw ADC codes.
+	//
+	// Samples are staged until a chunk of history_chunk_size samples is
+	// complete, then each signal of the chunk is delta encoded and the
+	// zigzag mapped deltas are bit-packed in groups of history_group_size
+	// using the smallest width fitting the group. Quasi-static signals
+	// compress to a few bits per sample while noisy ones stay close to
+	// their raw size. The oldest chunks are dropped once the compressed size
+	// exceeds the memory budget.
+	//
+	// Appending is done on the USB thread once per transfer; readers
+	// copy references to the chunks they need while holding the lock and
+	// decompress them without it.
+	class History {
+	public:
+		History(size_t max_bytes): m_max_bytes(max_bytes) {}
+
+		// Append the consecutive samples of a transfer captured with the
+		// given ADC mux mode.
+		void append(const std::array<uint16_t, 4>* codes, size_t count, int mux);
+
+		// Get the codes of consecutive samples along with the mux mode each
+		// sample was captured with. Reading begins at the first sample of the
+		// transfer holding the requested one, or the oldest sample held, so
+		// the samples can be decoded as they were when received.
+		// @param lead Set to the number of samples read before start.
+		// @param transfers Set to the offsets of samples starting a transfer.
+		// @return The number of samples read including the lead, fewer than
+		// requested if the history doesn't hold them, or -ERANGE if the
+		// first sample was dropped or not yet received.
+		ssize_t read(uint64_t start, size_t count, std::vector<std::array<uint16_t, 4>>& codes,
+			std::vector<int>& mux, size_t& lead, std::vector<size_t>& transfers);
+
+		// Get the indices of the oldest and one past the newest sample held.
+		void range(uint64_t& first, uint64_t& end);
+
+		// Get the number of bytes used by compressed and staged samples.
+		size_t memory();
+
+	private:
+		struct Chunk {
+			uint64_t first;
+			uint32_t count;
+			int mux;
+			std::vector<uint8_t> data;
+		};
+
+		// Compress the staged samples into a new chunk.
+		void flush();
+		static void compress(const std::array<uint16_t, 4>* codes, size_t count, std::vector<uint8_t>& data);
+		static void decompress(const Chunk& chunk, std::array<uint16_t, 4>* codes);
+
+		const size_t m_max_bytes;
+		std::mutex m_lock;
+
+		std::deque<std::shared_ptr<const Chunk>> m_chunks;
+		size_t m_bytes = 0;
+		// Index of the first sample of each transfer held.
+		std::deque<uint64_t> m_transfers;
+
+		std::vector<std::array<uint16_t, 4>> m_staging;
+		int m_staging_mux = 0;
+		// Index of the next sample appended.
+		uint64_t m_end = 0;
+	};
+}
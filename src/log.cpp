@@ -0,0 +1,279 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "log.hpp"
+
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#include <boost/lockfree/spsc_queue.hpp>
+
+using namespace smu;
+
+namespace {
+	struct LogRecord {
+		uint64_t time;
+		LogLevel level;
+		const char* fmt;
+		LogFormatter format;
+		alignas(8) unsigned char args[log_args_size];
+	};
+
+	// Messages of one thread, pushed by it and popped by the log thread.
+	struct LogBuffer {
+		boost::lockfree::spsc_queue<LogRecord, boost::lockfree::capacity<256>> records;
+		// Messages dropped since the buffer was full.
+		std::atomic<uint64_t> dropped{0};
+		// Set once the owning thread exits, the buffer is pruned when drained.
+		std::atomic<bool> exited{false};
+	};
+
+	// Formats and writes the messages of all threads in the background.
+	class Logger {
+	public:
+		~Logger() {
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_exit = true;
+			}
+			m_cv.notify_all();
+			if (m_thread.joinable())
+				m_thread.join();
+		}
+
+		// Register the buffer of the calling thread, starting the log thread
+		// on first use.
+		void add(std::shared_ptr<LogBuffer> buf) {
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_buffers.push_back(buf);
+			if (!m_thread.joinable() && !m_exit)
+				m_thread = std::thread(&Logger::run, this);
+		}
+
+		// Wake the log thread if it's idle, called after queueing a message.
+		void notify() {
+			// pairs with the fence in run() so either the log thread sees the
+			// message before sleeping or we see it sleeping
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (m_sleeping.load(std::memory_order_relaxed) && m_sleeping.exchange(false)) {
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_cv.notify_one();
+			}
+		}
+
+		void set_handler(std::function<void(LogLevel, const char*)> handler) {
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_handler = handler;
+		}
+
+		// Block until all messages queued before the call have been handled.
+		void flush() {
+			std::unique_lock<std::mutex> lock(m_lock);
+			if (!m_thread.joinable())
+				return;
+			uint64_t target = m_pass + 2;
+			m_flush_pass = std::max(m_flush_pass, target);
+			m_cv.notify_all();
+			m_flushed.wait(lock, [&]{ return m_pass >= target || m_exit; });
+		}
+
+	private:
+		void run() {
+#ifdef __linux__
+			pthread_setname_np(pthread_self(), "smu-log");
+#endif
+			std::vector<LogRecord> records;
+			std::unique_lock<std::mutex> lock(m_lock);
+			while (true) {
+				bool exit = m_exit;
+				auto buffers = m_buffers;
+				auto handler = m_handler;
+				lock.unlock();
+
+				// merge the messages of all threads in time order
+				LogRecord record;
+				uint64_t dropped = 0;
+				std::vector<LogBuffer*> exited;
+				for (auto& buf: buffers) {
+					// checked first so the last messages of the thread are drained
+					if (buf->exited.load(std::memory_order_acquire))
+						exited.push_back(buf.get());
+					while (buf->records.pop(record))
+						records.push_back(record);
+					dropped += buf->dropped.exchange(0);
+				}
+				std::stable_sort(records.begin(), records.end(),
+					[](const LogRecord& a, const LogRecord& b) { return a.time < b.time; });
+
+				char message[512];
+				for (auto& r: records) {
+					int len = r.format(message, sizeof(message), r.fmt, r.args);
+					// handlers get messages without the trailing newline
+					len = std::min<int>(len, sizeof(message) - 1);
+					if (len > 0 && message[len - 1] == '\n')
+						message[len - 1] = '\0';
+					write(handler, r.level, message);
+				}
+				if (dropped) {
+					snprintf(message, sizeof(message), "%llu log messages dropped", (unsigned long long)dropped);
+					write(handler, LOG_LEVEL_WARNING, message);
+				}
+				records.clear();
+
+				lock.lock();
+				if (!exited.empty()) {
+					m_buffers.erase(std::remove_if(m_buffers.begin(), m_buffers.end(),
+						[&](const std::shared_ptr<LogBuffer>& buf) {
+							return std::find(exited.begin(), exited.end(), buf.get()) != exited.end();
+						}), m_buffers.end());
+				}
+				m_pass++;
+				m_flushed.notify_all();
+				if (exit)
+					break;
+
+				// sleep until a message is queued, a flush is requested or the
+				// logger is destroyed
+				m_sleeping = true;
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (!pending())
+					m_cv.wait(lock, [&]{ return !m_sleeping || m_exit || m_pass < m_flush_pass; });
+				m_sleeping = false;
+			}
+		}
+
+		// Whether any buffer has messages to handle, called with m_lock held.
+		bool pending() {
+			for (auto& buf: m_buffers) {
+				if (buf->records.read_available() || buf->dropped.load())
+					return true;
+			}
+			return false;
+		}
+
+		static void write(const std::function<void(LogLevel, const char*)>& handler, LogLevel level, const char* message) {
+			if (handler)
+				handler(level, message);
+			else
+				fprintf(stderr, "%s\n", message);
+		}
+
+		std::mutex m_lock;
+		std::condition_variable m_cv;
+		std::condition_variable m_flushed;
+		std::vector<std::shared_ptr<LogBuffer>> m_buffers;
+		std::function<void(LogLevel, const char*)> m_handler;
+		std::thread m_thread;
+		// Number of times the log thread drained the buffers.
+		uint64_t m_pass = 0;
+		// Pass a flush is waiting for.
+		uint64_t m_flush_pass = 0;
+		// Whether the log thread is idle, waiting to be notified.
+		std::atomic<bool> m_sleeping{false};
+		bool m_exit = false;
+	};
+}
+
+static Logger& logger()
+{
+	static Logger logger;
+	return logger;
+}
+
+// Initial log level, from the SMU_LOG_LEVEL environment variable if set.
+static int initial_log_level()
+{
+	const char* env = std::getenv("SMU_LOG_LEVEL");
+	if (env) {
+		const char* names[] = {"none", "error", "warning", "info", "debug"};
+		for (int i = LOG_LEVEL_NONE; i <= LOG_LEVEL_DEBUG; i++) {
+			if (!strcmp(env, names[i]))
+				return i;
+		}
+		return std::max<int>(LOG_LEVEL_NONE, std::min<int>(LOG_LEVEL_DEBUG, std::atoi(env)));
+	}
+#ifdef DEBUG_BUILD
+	return LOG_LEVEL_DEBUG;
+#else
+	return LOG_LEVEL_NONE;
+#endif
+}
+
+std::atomic<int> smu::log_threshold{initial_log_level()};
+
+namespace {
+	// Buffer of the current thread, kept alive by the logger after the thread
+	// exits until its remaining messages are handled.
+	struct ThreadLog {
+		std::shared_ptr<LogBuffer> buf;
+		~ThreadLog() {
+			if (buf)
+				buf->exited.store(true, std::memory_order_release);
+		}
+	};
+}
+
+static thread_local ThreadLog thread_log;
+
+void smu::log_push(LogLevel level, const char* fmt, LogFormatter format, const void* args, size_t size)
+{
+	if (!thread_log.buf) {
+		thread_log.buf = std::make_shared<LogBuffer>();
+		logger().add(thread_log.buf);
+	}
+
+	LogRecord record;
+	record.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	record.level = level;
+	record.fmt = fmt;
+	record.format = format;
+	if (size)
+		std::memcpy(record.args, args, size);
+	if (!thread_log.buf->records.push(record))
+		thread_log.buf->dropped++;
+	logger().notify();
+}
+
+// Formatter of messages without arguments.
+static int log_copy(char* out, size_t size, const char* fmt, const void*)
+{
+	return snprintf(out, size, "%s", fmt);
+}
+
+void smu::log_record(LogLevel level, const char* fmt)
+{
+	log_push(level, fmt, &log_copy, NULL, 0);
+}
+
+void smu::set_log_level(LogLevel level)
+{
+	log_threshold = level;
+}
+
+LogLevel smu::log_level()
+{
+	return static_cast<LogLevel>(log_threshold.load());
+}
+
+void smu::set_log_handler(std::function<void(LogLevel level, const char* message)> handler)
+{
+	logger().set_handler(handler);
+}
+
+void smu::flush_log()
+{
+	logger().flush();
+}
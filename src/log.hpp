@@ -0,0 +1,127 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+
+#include <libsmu/libsmu.hpp>
+
+// Log a printf-style message if its level is enabled, e.g.
+// SMU_LOG(LOG_LEVEL_DEBUG, "%s: failed: %i\n", __func__, ret);
+//
+// Messages are recorded as raw arguments into a lock-free ring buffer of the
+// calling thread and formatted and written by a background thread, so
+// logging never allocates on the calling thread after its first message and
+// only takes a lock to wake the background thread when it's idle. Strings
+// are copied, truncated to 31 characters; other pointer arguments must
+// outlive the message. Messages are dropped if a thread logs faster than the
+// background thread drains its buffer.
+#define SMU_LOG(level, ...) do { \
+	if (false) smu::log_check_format(__VA_ARGS__); \
+	if (smu::log_enabled(level)) smu::log_record(level, __VA_ARGS__); \
+} while (0)
+
+namespace smu {
+	extern std::atomic<int> log_threshold;
+
+	// Whether messages of the given level are logged.
+	static inline bool log_enabled(LogLevel level)
+	{
+		return level != LOG_LEVEL_NONE && level <= log_threshold.load(std::memory_order_relaxed);
+	}
+
+	// Only used for compile-time format checking.
+#ifdef __GNUC__
+	__attribute__((format(printf, 1, 2)))
+#endif
+	static inline void log_check_format(const char*, ...) {}
+
+	// String argument copied into a log record.
+	struct LogString {
+		char str[32];
+	};
+
+	// Storage type of a log argument.
+	template<typename T> struct LogArg {
+		typedef T type;
+		static T store(T value) { return value; }
+	};
+
+	template<> struct LogArg<const char*> {
+		typedef LogString type;
+		static LogString store(const char* value) {
+			LogString s;
+			std::strncpy(s.str, value ? value : "(null)", sizeof(s.str) - 1);
+			s.str[sizeof(s.str) - 1] = '\0';
+			return s;
+		}
+	};
+
+	template<> struct LogArg<char*>: LogArg<const char*> {};
+
+	// Value passed to printf for a stored argument.
+	template<typename T> static inline T log_unwrap(const T& value) { return value; }
+	static inline const char* log_unwrap(const LogString& value) { return value.str; }
+
+	// Trivially copyable argument list, unlike std::tuple.
+	template<typename... T> struct LogPack {};
+	template<typename H, typename... T> struct LogPack<H, T...> {
+		H head;
+		LogPack<T...> tail;
+	};
+
+	template<typename... Done>
+	static inline int log_apply(char* out, size_t size, const char* fmt, const LogPack<>&, Done... done)
+	{
+		return snprintf(out, size, fmt, done...);
+	}
+
+	template<typename H, typename... T, typename... Done>
+	static inline int log_apply(char* out, size_t size, const char* fmt, const LogPack<H, T...>& pack, Done... done)
+	{
+		return log_apply(out, size, fmt, pack.tail, done..., log_unwrap(pack.head));
+	}
+
+	static inline LogPack<> log_pack() { return LogPack<>(); }
+
+	template<typename H, typename... T>
+	static inline LogPack<typename LogArg<H>::type, typename LogArg<T>::type...> log_pack(H head, T... tail)
+	{
+		LogPack<typename LogArg<H>::type, typename LogArg<T>::type...> pack;
+		pack.head = LogArg<H>::store(head);
+		pack.tail = log_pack(tail...);
+		return pack;
+	}
+
+	// Formats the arguments of a record.
+	typedef int (*LogFormatter)(char* out, size_t size, const char* fmt, const void* args);
+
+	template<typename Pack>
+	static int log_format(char* out, size_t size, const char* fmt, const void* args)
+	{
+		return log_apply(out, size, fmt, *static_cast<const Pack*>(args));
+	}
+
+	// Maximum size of the arguments of a message.
+	const size_t log_args_size = 128;
+
+	// Queue a message with its packed arguments.
+	void log_push(LogLevel level, const char* fmt, LogFormatter format, const void* args, size_t size);
+
+	// Queue a message without arguments.
+	void log_record(LogLevel level, const char* fmt);
+
+	template<typename... Args>
+	static inline void log_record(LogLevel level, const char* fmt, Args... args)
+	{
+		auto pack = log_pack(args...);
+		static_assert(sizeof(pack) <= log_args_size, "too many log arguments");
+		log_push(level, fmt, &log_format<decltype(pack)>, &pack, sizeof(pack));
+	}
+}
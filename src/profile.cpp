@@ -0,0 +1,48 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "profile.hpp"
+
+using namespace smu;
+
+static const char* stage_names[PROFILE_STAGES] = {
+	"decode", "encode", "queue", "feed", "callback",
+};
+
+std::vector<StageProfile> Profiler::snapshot() const
+{
+	uint64_t transfers = m_transfers.load(std::memory_order_relaxed);
+
+	std::vector<StageProfile> profile;
+	for (unsigned i = 0; i < PROFILE_STAGES; i++) {
+		const Stage& s = m_stages[i];
+		StageProfile stage = {};
+		stage.stage = static_cast<ProfileStage>(i);
+		stage.name = stage_names[i];
+		stage.calls = s.calls.load(std::memory_order_relaxed);
+		stage.samples = s.samples.load(std::memory_order_relaxed);
+		stage.transfers = transfers;
+		stage.total = s.total.load(std::memory_order_relaxed) * 1e-9;
+		if (stage.samples)
+			stage.per_sample = stage.total / stage.samples;
+		if (stage.transfers)
+			stage.per_transfer = stage.total / stage.transfers;
+		for (auto& count: s.histogram)
+			stage.histogram.push_back(count.load(std::memory_order_relaxed));
+		profile.push_back(stage);
+	}
+	return profile;
+}
+
+void Profiler::reset()
+{
+	for (auto& s: m_stages) {
+		s.calls = 0;
+		s.samples = 0;
+		s.total = 0;
+		for (auto& count: s.histogram)
+			count = 0;
+	}
+	m_transfers = 0;
+}
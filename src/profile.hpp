@@ -0,0 +1,106 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include <libsmu/libsmu.hpp>
+
+namespace smu {
+	// CPU time spent in the processing stages of a session.
+	//
+	// Stages are timed by scopes in the hot paths, recording the steady clock
+	// (clock_gettime(CLOCK_MONOTONIC) on Linux) when entered and left and
+	// aggregating the durations into relaxed atomic counters and power of two
+	// histograms, so timing doesn't take locks or allocate. Builds without
+	// WITH_PROFILING compile the scopes out entirely.
+	class Profiler {
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		// Number of histogram buckets, the last one collects all longer durations.
+		static const unsigned buckets = 32;
+
+		// Record a call of a stage that took the given time and processed
+		// the given number of samples.
+		void add(ProfileStage stage, clock::duration duration, uint64_t samples) {
+			uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+			Stage& s = m_stages[stage];
+			s.calls.fetch_add(1, std::memory_order_relaxed);
+			s.samples.fetch_add(samples, std::memory_order_relaxed);
+			s.total.fetch_add(ns, std::memory_order_relaxed);
+			s.histogram[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+		}
+
+		// Count a completed USB transfer.
+		void transfer() {
+			m_transfers.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		std::vector<StageProfile> snapshot() const;
+		void reset();
+
+		// Histogram bucket of a duration in nanoseconds, bucket i holds
+		// durations of at least 2^(i-1) and below 2^i ns.
+		static unsigned bucket(uint64_t ns) {
+			unsigned i = 0;
+			while (ns && i < buckets - 1) {
+				ns >>= 1;
+				i++;
+			}
+			return i;
+		}
+
+	private:
+		struct Stage {
+			std::atomic<uint64_t> calls{0};
+			std::atomic<uint64_t> samples{0};
+			// nanoseconds
+			std::atomic<uint64_t> total{0};
+			std::atomic<uint64_t> histogram[buckets] = {};
+		};
+
+		Stage m_stages[PROFILE_STAGES];
+		std::atomic<uint64_t> m_transfers{0};
+	};
+
+	// Times the scope as a call of a processing stage.
+	class ProfileScope {
+	public:
+#ifdef WITH_PROFILING
+		ProfileScope(Profiler* profiler, ProfileStage stage):
+			m_profiler(profiler), m_stage(stage), m_start(Profiler::clock::now()) {}
+
+		~ProfileScope() {
+			m_profiler->add(m_stage, Profiler::clock::now() - m_start, m_samples);
+		}
+
+		// Set the number of samples processed by the call.
+		void samples(uint64_t samples) { m_samples = samples; }
+
+	private:
+		Profiler* m_profiler;
+		ProfileStage m_stage;
+		Profiler::clock::time_point m_start;
+		uint64_t m_samples = 0;
+#else
+		ProfileScope(Profiler*, ProfileStage) {}
+		void samples(uint64_t) {}
+#endif
+	};
+
+	// Count a completed USB transfer if profiling.
+	static inline void profile_transfer(Profiler* profiler)
+	{
+#ifdef WITH_PROFILING
+		profiler->transfer();
+#else
+		(void)profiler;
+#endif
+	}
+}
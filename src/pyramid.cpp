@@ -0,0 +1,180 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include <cerrno>
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <vector>
+
+#include <libsmu/pyramid.hpp>
+
+using namespace smu;
+
+// Highest level, keeping the samples per bin within 64 bits.
+static const size_t pyramid_max_levels = 15;
+
+// Number of samples summarized by a bin of the given level.
+static inline uint64_t bin_samples(size_t level)
+{
+	uint64_t samples = PYRAMID_DECIMATION;
+	while (level--)
+		samples *= PYRAMID_DECIMATION;
+	return samples;
+}
+
+// Coarser levels have to reach the bins still held by the finer ones for
+// queries to cover the whole range, requiring more than a full bin of
+// each level to be kept.
+Pyramid::Pyramid(size_t max_bins):
+	m_max_bins(max_bins ? std::max<size_t>(max_bins, 2 * PYRAMID_DECIMATION) : 0)
+{
+}
+
+void Pyramid::clear()
+{
+	m_levels.clear();
+	m_samples = 0;
+}
+
+void Pyramid::add(size_t level, const std::array<float, 4>& min, const std::array<float, 4>& max,
+	const std::array<double, 4>& sum)
+{
+	if (level == m_levels.size()) {
+		m_levels.push_back(Level());
+		m_levels[level].first = 0;
+		m_levels[level].acc.count = 0;
+	}
+
+	Accumulator& acc = m_levels[level].acc;
+	if (!acc.count) {
+		acc.min = min;
+		acc.max = max;
+		acc.sum = sum;
+	} else {
+		for (unsigned s = 0; s < 4; s++) {
+			acc.min[s] = std::min(acc.min[s], min[s]);
+			acc.max[s] = std::max(acc.max[s], max[s]);
+			acc.sum[s] += sum[s];
+		}
+	}
+	if (++acc.count < PYRAMID_DECIMATION)
+		return;
+
+	// complete the bin
+	Level& l = m_levels[level];
+	double samples = bin_samples(level);
+	std::array<SignalStats, 4> bin;
+	for (unsigned s = 0; s < 4; s++)
+		bin[s] = {acc.min[s], acc.max[s], (float)(acc.sum[s] / samples)};
+	l.bins.push_back(bin);
+	if (m_max_bins && l.bins.size() > m_max_bins) {
+		l.bins.pop_front();
+		l.first++;
+	}
+	acc.count = 0;
+
+	// Levels may be added by the recursion, don't use references into
+	// m_levels after it.
+	if (level + 1 < pyramid_max_levels) {
+		Accumulator done = acc;
+		add(level + 1, done.min, done.max, done.sum);
+	}
+}
+
+void Pyramid::append(const std::array<float, 4>* frames, size_t count, size_t stride)
+{
+	std::array<double, 4> sum;
+	for (size_t i = 0; i < count; i++) {
+		const std::array<float, 4>& frame = frames[i * stride];
+		for (unsigned s = 0; s < 4; s++)
+			sum[s] = frame[s];
+		add(0, frame, frame, sum);
+	}
+	m_samples += count;
+}
+
+void Pyramid::range(uint64_t& first, uint64_t& end) const
+{
+	first = end = 0;
+	if (m_levels.empty())
+		return;
+
+	end = (m_levels[0].first + m_levels[0].bins.size()) * PYRAMID_DECIMATION;
+	first = end;
+	for (size_t level = 0; level < m_levels.size(); level++) {
+		const Level& l = m_levels[level];
+		if (!l.bins.empty())
+			first = std::min(first, l.first * bin_samples(level));
+	}
+}
+
+int64_t Pyramid::query(unsigned signal, uint64_t start, uint64_t end, size_t pixels,
+	std::vector<SignalStats>& stats) const
+{
+	stats.clear();
+	if (signal >= 4 || !pixels || end <= start)
+		return -EINVAL;
+
+	uint64_t first, last;
+	range(first, last);
+	if (start < first || start >= last)
+		return -ERANGE;
+	end = std::min(end, last);
+
+	// work in level 0 bins, level n bins spanning DECIMATION^n of them
+	uint64_t a = start / PYRAMID_DECIMATION;
+	uint64_t b = (end + PYRAMID_DECIMATION - 1) / PYRAMID_DECIMATION;
+	uint64_t width = (b - a + pixels - 1) / pixels;
+
+	stats.reserve((b - a + width - 1) / width);
+	for (uint64_t p = a; p < b; p += width) {
+		uint64_t q = std::min(p + width, b);
+		float min = std::numeric_limits<float>::infinity();
+		float max = -std::numeric_limits<float>::infinity();
+		double sum = 0;
+		uint64_t weight = 0;
+
+		// Walk the pixel using the coarsest aligned bins that fit, at most
+		// 2 * DECIMATION bins per level.
+		uint64_t pos = p;
+		while (pos < q) {
+			const SignalStats* bin = NULL;
+			uint64_t size = 0;
+			uint64_t idx = 0;
+			for (size_t level = m_levels.size(); level-- > 0 && !bin;) {
+				size = bin_samples(level) / PYRAMID_DECIMATION;
+				idx = pos / size;
+				const Level& l = m_levels[level];
+				if (pos % size == 0 && pos + size <= q && idx >= l.first && idx < l.first + l.bins.size())
+					bin = &l.bins[idx - l.first][signal];
+			}
+			// Fine bins of old samples may have been dropped, fall back to
+			// the finest bin holding the position.
+			for (size_t level = 0; level < m_levels.size() && !bin; level++) {
+				size = bin_samples(level) / PYRAMID_DECIMATION;
+				idx = pos / size;
+				const Level& l = m_levels[level];
+				if (idx >= l.first && idx < l.first + l.bins.size())
+					bin = &l.bins[idx - l.first][signal];
+			}
+			if (!bin)
+				break;
+
+			min = std::min(min, bin->min);
+			max = std::max(max, bin->max);
+			sum += (double)bin->mean * size;
+			weight += size;
+			pos = (idx + 1) * size;
+		}
+
+		if (weight)
+			stats.push_back({min, max, (float)(sum / weight)});
+		else
+			stats.push_back({0, 0, 0});
+	}
+
+	return width * PYRAMID_DECIMATION;
+}
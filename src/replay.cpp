@@ -0,0 +1,309 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "replay.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <libusb.h>
+
+#include "log.hpp"
+#include <libsmu/libsmu.hpp>
+
+using namespace smu;
+
+static_assert(sizeof(RecordingHeader) == 212, "unexpected recording header layout");
+static_assert(sizeof(RecordHeader) == 16, "unexpected record header layout");
+static_assert(sizeof(RecordedControl) == 12, "unexpected control record layout");
+
+// Stream buffer size, large enough to hold around 50ms of samples.
+static const size_t recorder_buffer_size = 1 << 20;
+// Limit of the records waiting for the writer thread. Exceeding it fails the
+// recording rather than letting a stalled disk exhaust memory.
+static const size_t recorder_queue_size = 64 << 20;
+
+Recorder::~Recorder()
+{
+	close();
+}
+
+int Recorder::open(const std::string& path, const std::string& hwver,
+	const std::string& fwver, const std::string& serial, const EEPROM_cal& cal)
+{
+	RecordingHeader header = {};
+	std::memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+	header.version = RECORDING_VERSION;
+	header.header_size = sizeof(header);
+	std::strncpy(header.hwver, hwver.c_str(), sizeof(header.hwver) - 1);
+	std::strncpy(header.fwver, fwver.c_str(), sizeof(header.fwver) - 1);
+	std::strncpy(header.serial, serial.c_str(), sizeof(header.serial) - 1);
+	header.cal = cal;
+
+	m_file = fopen(path.c_str(), "wb");
+	if (!m_file)
+		return -errno;
+	m_buffer.resize(recorder_buffer_size);
+	setvbuf(m_file, m_buffer.data(), _IOFBF, m_buffer.size());
+
+	if (fwrite(&header, sizeof(header), 1, m_file) != 1) {
+		int ret = -errno;
+		fclose(m_file);
+		m_file = NULL;
+		return ret ? ret : -EIO;
+	}
+	m_start = std::chrono::steady_clock::now();
+	m_write_thread = std::thread(&Recorder::write_loop, this);
+	return 0;
+}
+
+int Recorder::close()
+{
+	if (!m_file)
+		return m_error;
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_exit = true;
+	}
+	m_cv.notify_one();
+	m_write_thread.join();
+
+	errno = 0;
+	if (fclose(m_file) && !m_error)
+		fail(errno ? -errno : -EIO);
+	m_file = NULL;
+	return m_error;
+}
+
+void Recorder::fail(int error)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (m_error)
+			return;
+		m_error = error;
+		m_queue.clear();
+		m_queued_bytes = 0;
+	}
+	SMU_LOG(LOG_LEVEL_ERROR, "%s: failed writing recording: %s\n", __func__, std::strerror(-error));
+	m_on_error(error);
+}
+
+void Recorder::write_record(RecordType type, const void* buf1, size_t len1,
+	const void* buf2, size_t len2)
+{
+	RecordHeader record = {};
+	record.type = type;
+	record.length = len1 + len2;
+	record.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - m_start).count();
+
+	std::vector<unsigned char> buf(sizeof(record) + len1 + len2);
+	std::memcpy(buf.data(), &record, sizeof(record));
+	if (len1)
+		std::memcpy(buf.data() + sizeof(record), buf1, len1);
+	if (len2)
+		std::memcpy(buf.data() + sizeof(record) + len1, buf2, len2);
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (m_error)
+			return;
+		if (m_queued_bytes + buf.size() <= recorder_queue_size) {
+			m_queued_bytes += buf.size();
+			m_queue.push_back(std::move(buf));
+			m_cv.notify_one();
+			return;
+		}
+	}
+	// the disk isn't keeping up with the device
+	fail(-ENOBUFS);
+}
+
+void Recorder::write_loop()
+{
+	std::unique_lock<std::mutex> lk(m_lock);
+
+	while (true) {
+		m_cv.wait(lk, [&]{ return !m_queue.empty() || m_exit; });
+		if (m_queue.empty())
+			break;
+
+		std::vector<std::vector<unsigned char>> records;
+		records.swap(m_queue);
+		m_queued_bytes = 0;
+		lk.unlock();
+
+		int ret = 0;
+		errno = 0;
+		for (const auto& buf: records) {
+			if (fwrite(buf.data(), buf.size(), 1, m_file) != 1) {
+				ret = errno ? -errno : -EIO;
+				break;
+			}
+		}
+		if (ret < 0)
+			fail(ret);
+		lk.lock();
+	}
+}
+
+void Recorder::control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+	uint16_t wIndex, uint16_t wLength, const unsigned char* data, int ret)
+{
+	RecordedControl control = {bmRequestType, bRequest, wValue, wIndex, wLength, ret};
+	// only the responses of device-to-host requests are recorded
+	size_t len = ((bmRequestType & LIBUSB_ENDPOINT_IN) && ret > 0) ? ret : 0;
+	write_record(RECORD_CONTROL, &control, sizeof(control), data, len);
+}
+
+void Recorder::in_transfer(const libusb_transfer* t)
+{
+	write_record(RECORD_IN, t->buffer, t->actual_length);
+}
+
+int M1000_Replay::open(const std::string& path, bool realtime, bool loop, M1000_Replay** replay)
+{
+	RecordingHeader header;
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+		return -errno;
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+			std::memcmp(header.magic, RECORDING_MAGIC, sizeof(header.magic)) ||
+			header.version != RECORDING_VERSION ||
+			header.header_size < sizeof(header) ||
+			fseek(file, header.header_size, SEEK_SET)) {
+		fclose(file);
+		return -EINVAL;
+	}
+	header.hwver[sizeof(header.hwver) - 1] = '\0';
+	header.fwver[sizeof(header.fwver) - 1] = '\0';
+	header.serial[sizeof(header.serial) - 1] = '\0';
+
+	VirtualConfig config;
+	config.realtime = realtime;
+	config.hwver = header.hwver;
+	config.fwver = header.fwver;
+	*replay = new M1000_Replay(file, header, config, loop);
+	return 0;
+}
+
+M1000_Replay::M1000_Replay(FILE* file, const RecordingHeader& header,
+	const VirtualConfig& config, bool loop):
+	M1000_Emulator(config),
+	m_header(header),
+	m_file(file),
+	m_loop(loop),
+	m_data_offset(header.header_size)
+{
+	m_cal = header.cal;
+	// Load the control responses recorded before streaming started and
+	// check that there's something to replay.
+	m_has_samples = next_payload();
+}
+
+M1000_Replay::~M1000_Replay()
+{
+	// stop the emulator thread before the recording is closed
+	shutdown();
+	fclose(m_file);
+}
+
+int M1000_Replay::control_transfer(uint8_t bmRequestType, uint8_t bRequest,
+	uint16_t wValue, uint16_t wIndex, unsigned char* data, uint16_t wLength,
+	unsigned timeout)
+{
+	// Versions and calibration come from the recording header and the
+	// microframe number must follow the host's clock, other device-to-host
+	// requests are answered as recorded.
+	if ((bmRequestType & LIBUSB_ENDPOINT_IN) &&
+			bRequest != 0x00 && bRequest != 0x01 && bRequest != 0x6F) {
+		std::lock_guard<std::mutex> lock(m_lock);
+		auto it = m_responses.find(std::make_tuple(bRequest, wValue, wIndex));
+		if (it != m_responses.end()) {
+			int ret = it->second.first;
+			if (ret > 0) {
+				ret = std::min<size_t>(ret, wLength);
+				std::memcpy(data, it->second.second.data(), ret);
+			}
+			return ret;
+		}
+	}
+	return M1000_Emulator::control_transfer(bmRequestType, bRequest, wValue,
+		wIndex, data, wLength, timeout);
+}
+
+bool M1000_Replay::next_payload()
+{
+	RecordHeader record;
+	bool rewound = false;
+
+	while (true) {
+		if (fread(&record, sizeof(record), 1, m_file) != 1) {
+			// a truncated recording ends at its last complete record
+			if (!m_loop || !m_has_samples || rewound)
+				return false;
+			fseek(m_file, m_data_offset, SEEK_SET);
+			rewound = true;
+			continue;
+		}
+
+		std::vector<uint8_t> payload(record.length);
+		if (record.length && fread(payload.data(), record.length, 1, m_file) != 1)
+			continue;
+
+		if (record.type == RECORD_IN && record.length) {
+			m_payload.swap(payload);
+			m_payload_pos = 0;
+			return true;
+		} else if (record.type == RECORD_CONTROL && record.length >= sizeof(RecordedControl)) {
+			RecordedControl control;
+			std::memcpy(&control, payload.data(), sizeof(control));
+			if (control.bmRequestType & LIBUSB_ENDPOINT_IN) {
+				auto& response = m_responses[std::make_tuple(control.bRequest, control.wValue, control.wIndex)];
+				response.first = control.ret;
+				response.second.assign(payload.begin() + sizeof(control), payload.end());
+			}
+		}
+		// unknown record types are skipped
+	}
+}
+
+libusb_transfer_status M1000_Replay::fill_in_transfer(libusb_transfer* t, unsigned samples)
+{
+	size_t length = samples * 8;
+	size_t pos = 0;
+
+	while (pos < length) {
+		if (m_payload_pos == m_payload.size() && !next_payload())
+			// the recording ended, as if the device was detached
+			return LIBUSB_TRANSFER_NO_DEVICE;
+
+		size_t len = std::min(length - pos, m_payload.size() - m_payload_pos);
+		if (t)
+			std::memcpy(t->buffer + pos, m_payload.data() + m_payload_pos, len);
+		m_payload_pos += len;
+		pos += len;
+	}
+
+	// output from the host is consumed at the sample rate but doesn't
+	// affect the recorded samples
+	m_out_fifo.erase(m_out_fifo.begin(),
+		m_out_fifo.begin() + std::min<size_t>(samples, m_out_fifo.size()));
+	m_sampleno += samples;
+	if (t)
+		t->actual_length = length;
+	return LIBUSB_TRANSFER_COMPLETED;
+}
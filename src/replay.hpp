@@ -0,0 +1,174 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <libusb.h>
+
+#include "device_m1000.hpp"
+#include "emulator.hpp"
+#include <libsmu/libsmu.hpp>
+
+#define RECORDING_MAGIC "SMUREC\0\0"
+#define RECORDING_VERSION 1
+
+namespace smu {
+	// Header at the start of a recording, stored in host byte order.
+	struct RecordingHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t header_size;
+		char hwver[32];
+		char fwver[32];
+		char serial[32];
+		EEPROM_cal cal;
+	};
+
+	// Record types following the header.
+	enum RecordType : uint8_t {
+		// Control request, followed by a RecordedControl and the response
+		// data of successful device-to-host requests.
+		RECORD_CONTROL = 1,
+		// Raw payload of a completed bulk in transfer.
+		RECORD_IN = 2,
+	};
+
+	// Header of each record, followed by length bytes of payload.
+	struct RecordHeader {
+		uint8_t type;
+		uint8_t reserved[3];
+		uint32_t length;
+		// Time since the start of the recording in nanoseconds.
+		uint64_t timestamp;
+	};
+
+	struct RecordedControl {
+		uint8_t bmRequestType;
+		uint8_t bRequest;
+		uint16_t wValue;
+		uint16_t wIndex;
+		uint16_t wLength;
+		int32_t ret;
+	};
+
+	// Writes the raw traffic of a device to a recording.
+	//
+	// Records are copied into a queue drained by a writer thread so the USB
+	// thread only pays for a copy on each completed transfer, never for a
+	// disk write. Control requests come from the caller's thread while
+	// transfers complete on the USB thread, both are serialized by the queue.
+	// The first failed write stops the recording and is passed to the error
+	// callback, later records are discarded.
+	class Recorder {
+	public:
+		// @param on_error Called with a negative errno code from the writer
+		// thread or the thread adding records once recording fails.
+		Recorder(std::function<void(int)> on_error): m_on_error(on_error) {}
+		~Recorder();
+
+		// Create a recording, writing its header, and start the writer thread.
+		// @return On success, 0 is returned.
+		// @return On error, a negative errno code is returned.
+		int open(const std::string& path, const std::string& hwver,
+			const std::string& fwver, const std::string& serial, const EEPROM_cal& cal);
+
+		// Write all queued records and close the recording.
+		// @return On success, 0 is returned.
+		// @return On error, the negative errno code of the first failed write.
+		int close();
+
+		void control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+			uint16_t wIndex, uint16_t wLength, const unsigned char* data, int ret);
+		void in_transfer(const libusb_transfer* t);
+
+	private:
+		void write_record(RecordType type, const void* buf1, size_t len1,
+			const void* buf2 = NULL, size_t len2 = 0);
+		// Write queued records to the file until closed.
+		void write_loop();
+		// Stop recording on the first error, called without m_lock held.
+		void fail(int error);
+
+		const std::function<void(int)> m_on_error;
+		FILE* m_file = NULL;
+		std::vector<char> m_buffer;
+		std::chrono::steady_clock::time_point m_start;
+
+		// Serialized records waiting for the writer thread.
+		std::vector<std::vector<unsigned char>> m_queue;
+		size_t m_queued_bytes = 0;
+		bool m_exit = false;
+		int m_error = 0;
+
+		std::mutex m_lock;
+		std::condition_variable m_cv;
+		std::thread m_write_thread;
+	};
+
+	// Virtual device replaying a recording made with Device::record().
+	//
+	// The recorded bulk in payloads are treated as a byte stream that fills
+	// each submitted in transfer, so they're decoded by the regular
+	// M1000_Device input path regardless of the transfer sizes used while
+	// recording. Sample timing, output handling and cancellation are
+	// inherited from the emulator; recorded control responses answer the
+	// device-to-host requests the emulator doesn't model from the recording.
+	class M1000_Replay: public M1000_Emulator {
+	public:
+		~M1000_Replay();
+
+		// Open a recording for replay.
+		// @param path Recording to replay.
+		// @param realtime Whether to pace samples at the configured rate.
+		// @param loop Whether to restart at the end of the recording,
+		// otherwise transfers fail once it's exhausted.
+		// @param replay Set to the new transport on success.
+		// @return On success, 0 is returned.
+		// @return On error, a negative errno code is returned.
+		static int open(const std::string& path, bool realtime, bool loop, M1000_Replay** replay);
+
+		int control_transfer(uint8_t bmRequestType, uint8_t bRequest,
+			uint16_t wValue, uint16_t wIndex, unsigned char* data, uint16_t wLength,
+			unsigned timeout) override;
+
+		const RecordingHeader m_header;
+
+	protected:
+		M1000_Replay(FILE* file, const RecordingHeader& header, const VirtualConfig& config, bool loop);
+
+		libusb_transfer_status fill_in_transfer(libusb_transfer* t, unsigned samples) override;
+
+		// Load the next recorded in payload into m_payload.
+		// @return True if a payload is available, false at the end of the recording.
+		bool next_payload();
+
+		FILE* const m_file;
+		const bool m_loop;
+		// Offset of the first record after the header.
+		long m_data_offset;
+		// Whether the recording contains any in payloads.
+		bool m_has_samples = false;
+
+		std::vector<uint8_t> m_payload;
+		size_t m_payload_pos = 0;
+
+		// Most recently replayed responses of device-to-host control
+		// requests, keyed by request, value and index.
+		std::map<std::tuple<uint8_t, uint16_t, uint16_t>,
+			std::pair<int, std::vector<unsigned char>>> m_responses;
+	};
+}
@@ -4,25 +4,62 @@
 //   Kevin Mehall <km@kevinmehall.net>
 //   Ian Daniher <itdaniher@gmail.com>
 
+#include <cmath>
+#include <cstdint>
 #include <ctime>
 #include <algorithm>
+#include <array>
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <functional>
 #include <string.h>
+#include <thread>
 
 #include <libusb.h>
 
-#include "debug.hpp"
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#include "capture.hpp"
 #include "device_m1000.hpp"
+#include "emulator.hpp"
+#include "executor.hpp"
+#include "log.hpp"
+#include "profile.hpp"
+#include "replay.hpp"
+#include "threads.hpp"
+#include "trace.hpp"
+#include "transport.hpp"
 #include "usb.hpp"
 #include <libsmu/libsmu.hpp>
 
-extern std::exception_ptr e_ptr;
-
 using namespace std::placeholders;  // for _1, _2, _3...
 using namespace smu;
 
+// Get the number of executor threads to use for a requested count.
+static unsigned executor_threads(unsigned threads)
+{
+	if (threads)
+		return threads;
+	unsigned cpus = std::thread::hardware_concurrency();
+	return std::min(std::max(cpus, 1u), 4u);
+}
+
+// Runs in USB thread
+extern "C" int LIBUSB_CALL session_hotplug(libusb_context*, libusb_device* usb_dev,
+	libusb_hotplug_event event, void* user_data)
+{
+	Session* session = (Session*) user_data;
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		session->attached(usb_dev);
+	else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+		session->detached(usb_dev);
+	// stay registered
+	return 0;
+}
+
 Session::Session()
 {
 	m_active_devices = 0;
@@ -30,7 +67,7 @@ Session::Session()
 
 	ret = libusb_init(&m_usb_ctx);
 	if (ret != 0) {
-		DEBUG("%s: libusb init failed: %s\n", __func__, libusb_error_name(ret));
+		SMU_LOG(LOG_LEVEL_ERROR, "%s: libusb init failed: %s\n", __func__, libusb_error_name(ret));
 		abort();
 	}
 
@@ -41,11 +78,31 @@ Session::Session()
 	// Spawn a thread to handle pending USB events.
 	m_usb_thread_loop = true;
 	m_usb_thread = std::thread([=]() {
+#ifdef __linux__
+		pthread_setname_np(pthread_self(), "smu-usb");
+#endif
 		while (m_usb_thread_loop) {
 			libusb_handle_events_timeout_completed(m_usb_ctx, const_cast<timeval *>(&zero_tv), NULL);
 		}
 	});
 
+	m_profiler = new Profiler;
+	m_executor = new Executor(executor_threads(m_executor_threads));
+	m_hotplug_strand = new Strand;
+
+	// Track devices as they're plugged in and removed instead of relying on
+	// scan() being called periodically.
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		ret = libusb_hotplug_register_callback(m_usb_ctx,
+			(libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+			(libusb_hotplug_flag)0, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, session_hotplug, this, &m_usb_cb);
+		if (ret == 0)
+			m_hotplug = true;
+		else
+			SMU_LOG(LOG_LEVEL_WARNING, "%s: failed registering hotplug callback: %s\n", __func__, libusb_error_name(ret));
+	}
+
 	// Enable libusb debugging if LIBUSB_DEBUG is set in the environment.
 	if (getenv("LIBUSB_DEBUG")) {
 		libusb_set_debug(m_usb_ctx, 4);
@@ -54,6 +111,14 @@ Session::Session()
 
 Session::~Session()
 {
+	// Stop capturing before the devices it reads from go away.
+	stop_capture();
+
+	// Stop handling hotplug events, events already queued are skipped.
+	if (m_hotplug.exchange(false))
+		libusb_hotplug_deregister_callback(m_usb_ctx, m_usb_cb);
+	m_hotplug_strand->drain();
+
 	std::lock_guard<std::mutex> lock(m_lock_devlist);
 
 	// Cancel all outstanding transfers.
@@ -70,6 +135,11 @@ Session::~Session()
 	m_devices.clear();
 	m_available_devices.clear();
 
+	// Run pending callbacks and stop the executor threads.
+	delete m_executor;
+	delete m_hotplug_strand;
+	delete m_profiler;
+
 	// Stop USB thread loop. This must be called right before libusb_exit() so
 	// all USB events, including closing devices, are handled properly. Certain
 	// events (such as those triggered by libusb_close()) can cause hangs
@@ -82,49 +152,123 @@ Session::~Session()
 	libusb_exit(m_usb_ctx);
 }
 
-void Session::set_off(Device* dev)
+// Check whether a USB device is supported by libsmu, without opening it.
+static bool supported_device(libusb_device* usb_dev)
 {
-	M1000_Device *m_dev = dynamic_cast<M1000_Device*>(dev);
-	// signal usb transfer thread to exit
-#ifdef _WIN32
-	m_dev->m_usb_cv.notify_one();
-#endif
+	libusb_device_descriptor usb_desc;
+	if (libusb_get_device_descriptor(usb_dev, &usb_desc) != 0)
+		return false;
+	std::vector<uint16_t> device_id = {usb_desc.idVendor, usb_desc.idProduct};
+	return std::find(SUPPORTED_DEVICES.begin(), SUPPORTED_DEVICES.end(), device_id)
+		!= SUPPORTED_DEVICES.end();
+}
+
+void Session::hotplug_attach(std::function<void(Device* device)> func)
+{
+	std::lock_guard<std::mutex> lock(m_callback_lock);
+	m_hotplug_attach_callbacks.push_back(func);
+}
+
+void Session::hotplug_detach(std::function<void(Device* device)> func)
+{
+	std::lock_guard<std::mutex> lock(m_callback_lock);
+	m_hotplug_detach_callbacks.push_back(func);
 }
 
 void Session::attached(libusb_device *usb_dev)
 {
-	if (!m_hotplug_attach_callbacks.empty()) {
-		Device* dev = probe_device(usb_dev);
-		if (dev) {
-			std::lock_guard<std::mutex> lock(m_lock_devlist);
-			m_available_devices.push_back(dev);
-			for (auto callback: m_hotplug_attach_callbacks) {
-				// Store exceptions to rethrow them in the main thread in read()/write().
-				try {
-					callback(dev);
-				} catch (...) {
-					e_ptr = std::current_exception();
-				}
-			}
+	if (!m_hotplug || !supported_device(usb_dev))
+		return;
+
+	// Probing talks to the device, which can't be done from the USB thread
+	// handling the event. Only the new device is probed, the other available
+	// devices are left as they are.
+	libusb_ref_device(usb_dev);
+	std::lock_guard<std::mutex> executor_lock(m_executor_lock);
+	m_hotplug_strand->submit(m_executor, [=]() {
+		if (m_hotplug) {
+			std::lock_guard<std::mutex> probe_lock(m_probe_lock);
+			Device* dev = find_existing_device(usb_dev) ? NULL : probe_device(usb_dev);
+			if (dev)
+				device_attached(dev);
 		}
-	}
+		libusb_unref_device(usb_dev);
+	});
+}
+
+void Session::device_attached(Device* dev)
+{
+	m_lock_devlist.lock();
+	m_available_devices.push_back(dev);
+	m_lock_devlist.unlock();
+
+	std::unique_lock<std::mutex> lock(m_callback_lock);
+	auto callbacks = m_hotplug_attach_callbacks;
+	lock.unlock();
+	for (auto callback: callbacks)
+		submit_callback([=]() { callback(dev); });
+}
+
+void Session::device_detached(Device* dev)
+{
+	m_lock_devlist.lock();
+	m_available_devices.erase(std::remove(m_available_devices.begin(),
+		m_available_devices.end(), dev), m_available_devices.end());
+	m_lock_devlist.unlock();
+
+	std::unique_lock<std::mutex> lock(m_callback_lock);
+	auto callbacks = m_hotplug_detach_callbacks;
+	lock.unlock();
+	for (auto callback: callbacks)
+		submit_callback([=]() { callback(dev); });
+}
+
+std::vector<Device*> Session::available_devices()
+{
+	std::lock_guard<std::mutex> lock(m_lock_devlist);
+	return m_available_devices;
+}
+
+void Session::submit_callback(std::function<void()> callback, Strand* strand)
+{
+	auto task = [=]() {
+		ProfileScope profile(m_profiler, PROFILE_CALLBACK);
+		try {
+			callback();
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(m_callback_lock);
+			if (!m_callback_exception)
+				m_callback_exception = std::current_exception();
+		}
+	};
+
+	std::lock_guard<std::mutex> executor_lock(m_executor_lock);
+	if (strand)
+		strand->submit(m_executor, task);
+	else
+		m_executor->submit(task);
 }
 
 void Session::detached(libusb_device *usb_dev)
 {
-	if (!m_hotplug_detach_callbacks.empty()) {
-		Device* dev = find_existing_device(usb_dev);
-		if (dev) {
-			for (auto callback: m_hotplug_detach_callbacks) {
-				// Store exceptions to rethrow them in the main thread in read()/write().
-				try {
-					callback(dev);
-				} catch (...) {
-					e_ptr = std::current_exception();
-				}
+	if (!m_hotplug)
+		return;
+
+	// handled in order with attach events of the same device
+	libusb_ref_device(usb_dev);
+	std::lock_guard<std::mutex> executor_lock(m_executor_lock);
+	m_hotplug_strand->submit(m_executor, [=]() {
+		if (m_hotplug) {
+			std::lock_guard<std::mutex> probe_lock(m_probe_lock);
+			Device* dev = find_existing_device(usb_dev);
+			if (dev) {
+				// libusb can reuse the pointer for a device plugged in later
+				m_deviceHandles.erase(usb_dev);
+				device_detached(dev);
 			}
 		}
-	}
+		libusb_unref_device(usb_dev);
+	});
 }
 
 // Internal function to write raw SAM-BA commands to a libusb handle.
@@ -288,6 +432,8 @@ int Session::flash_firmware(std::string file, std::vector<Device*> devices)
 			{
 				remove(dev);
 			}
+			// drop it before its detach event is handled
+			destroy(dev);
 			dev->samba_mode();
 			delete dev;
 		}
@@ -303,21 +449,19 @@ int Session::flash_firmware(std::string file, std::vector<Device*> devices)
 		throw std::runtime_error("failed forcing devices into SAM-BA mode");
 
 	// flash all devices in SAM-BA mode
+	std::exception_ptr flash_error = nullptr;
 	#pragma omp parallel for
 	for (int i = 0; i < device_count; i++) {
 		try {
 			flash_device(samba_devs[i]);
 		} catch (...) {
-			e_ptr = std::current_exception();
+			#pragma omp critical
+			flash_error = std::current_exception();
 		}
 	}
 
-	if (e_ptr) {
-		// copy exception pointer for throwing and reset it
-		std::exception_ptr new_e_ptr = e_ptr;
-		e_ptr = nullptr;
-		std::rethrow_exception(new_e_ptr);
-	}
+	if (flash_error)
+		std::rethrow_exception(flash_error);
 
 	return device_count;
 }
@@ -344,9 +488,13 @@ int Session::scan()
 {
 	int device_count = 0;
 	int devices_found = 0;
+	std::lock_guard<std::mutex> probe_lock(m_probe_lock);
 
+	// Virtual devices aren't attached to the system so keep them available.
 	m_lock_devlist.lock();
-	m_available_devices.clear();
+	m_available_devices.erase(std::remove_if(m_available_devices.begin(), m_available_devices.end(),
+		[](Device* dev) { return dev->m_usb_dev != NULL; }), m_available_devices.end());
+	devices_found = m_available_devices.size();
 	m_lock_devlist.unlock();
 	libusb_device **usb_devs;
 	device_count = libusb_get_device_list(m_usb_ctx, &usb_devs);
@@ -377,7 +525,7 @@ Device* Session::probe_device(libusb_device* usb_dev)
 	libusb_device_descriptor usb_desc;
 	ret = libusb_get_device_descriptor(usb_dev, &usb_desc);
 	if (ret != 0) {
-		DEBUG("%s: error %i in get_device_descriptor\n", __func__, ret);
+		SMU_LOG(LOG_LEVEL_WARNING, "%s: error %i in get_device_descriptor\n", __func__, ret);
 		return NULL;
 	}
 
@@ -435,7 +583,7 @@ Device* Session::probe_device(libusb_device* usb_dev)
 		if (ret <= 0 || (strncmp(fwver, "", 1) == 0))
 			return NULL;
 
-		dev = new M1000_Device(this, usb_dev, usb_handle, hwver, fwver, serial);
+		dev = new M1000_Device(this, usb_dev, new USB_Transport(usb_handle), hwver, fwver, serial);
 		dev->set_usb_device_addr(usb_id_addr);
 		dev->read_calibration();
 		return dev;
@@ -458,37 +606,93 @@ int Session::add(Device* device)
 {
 	int ret = -1;
 
-	// This method may not be called while the session is active.
-	if (m_active_devices)
+	// This method may not be called while a noncontinuous session is active.
+	if (m_active_devices && !m_continuous)
 		return -EBUSY;
 
 	if (device) {
 		ret = device->claim();
 		if (!ret)
 		{
+			Device* replaced = NULL;
 			for (auto it : m_devices)
 			{
 				if (it->m_serial.compare(device->m_serial) == 0)
 				{
-					m_devices.erase(it);
+					replaced = it;
 					break;
 				}
 			}
 
+			// a running device with the same serial is stopped first
+			if (replaced && m_continuous && replaced != device)
+				remove(replaced, true);
+
+			std::unique_lock<std::mutex> lock(m_devices_lock);
+			if (replaced)
+				m_devices.erase(replaced);
 			m_devices.insert(device);
+			lock.unlock();
+
+			if (m_continuous && !device->streaming()) {
+				ret = join(device);
+				if (ret)
+					remove(device, true);
+			}
 		}
 	}
 
 	return ret;
 }
 
+int Session::join(Device* device)
+{
+	// Use a device that is still streaming as the timebase.
+	Device* ref = NULL;
+	{
+		std::lock_guard<std::mutex> lock(m_devices_lock);
+		for (Device* dev: m_devices) {
+			if (dev != device && dev->streaming() && !dev->m_detached) {
+				ref = dev;
+				break;
+			}
+		}
+	}
+
+	int ret = device->configure(m_sample_rate);
+	if (ret < 0)
+		return ret;
+	ret = size_queues(device);
+	if (ret < 0)
+		return ret;
+	ret = device->on();
+	if (ret)
+		return ret;
+
+	// Start on a USB frame of the running devices' timebase so samples
+	// line up with theirs, devices restarted without any other streaming
+	// device start a new timebase.
+	device->m_sample_offset = 0;
+	if (ref) {
+		ret = device->sync_to(ref);
+		if (ret)
+			return ret;
+	}
+
+	m_active_devices++;
+	ret = device->run(0);
+	if (ret)
+		m_active_devices--;
+	return ret;
+}
+
 int Session::add_all()
 {
 	int ret;
 	int num_devices = 0;
 
-	// This method may not be called while the session is active.
-	if (m_active_devices)
+	// This method may not be called while a noncontinuous session is active.
+	if (m_active_devices && !m_continuous)
 		return -EBUSY;
 
 	ret = scan();
@@ -508,23 +712,96 @@ int Session::add_all()
 	return num_devices;
 }
 
+int Session::add_virtual(unsigned count, const VirtualConfig& config)
+{
+	static std::atomic<unsigned> virtual_devices(0);
+	int ret;
+	int num_devices = 0;
+
+	// This method may not be called while a noncontinuous session is active.
+	if (m_active_devices && !m_continuous)
+		return -EBUSY;
+
+	for (unsigned i = 0; i < count; i++) {
+		char serial[32];
+		snprintf(serial, sizeof(serial), "VIRTUAL%024u", virtual_devices++);
+
+		Device* dev = new M1000_Device(this, NULL, new M1000_Emulator(config),
+			config.hwver.c_str(), config.fwver.c_str(), serial);
+		dev->read_calibration();
+
+		m_lock_devlist.lock();
+		m_available_devices.push_back(dev);
+		m_lock_devlist.unlock();
+
+		ret = add(dev);
+		if (ret)
+			return ret;
+		num_devices++;
+	}
+
+	return num_devices;
+}
+
+int Session::add_replay(const std::string& path, bool realtime, bool loop)
+{
+	M1000_Replay* replay;
+	int ret;
+
+	// This method may not be called while a noncontinuous session is active.
+	if (m_active_devices && !m_continuous)
+		return -EBUSY;
+
+	ret = M1000_Replay::open(path, realtime, loop, &replay);
+	if (ret < 0)
+		return ret;
+
+	Device* dev = new M1000_Device(this, NULL, replay, replay->m_header.hwver,
+		replay->m_header.fwver, replay->m_header.serial);
+	dev->read_calibration();
+
+	m_lock_devlist.lock();
+	m_available_devices.push_back(dev);
+	m_lock_devlist.unlock();
+
+	return add(dev);
+}
+
 int Session::remove(Device* device, bool detached)
 {
 	int ret = -1;
 
-	// This method may not be called while the session is active.
-	if (m_active_devices)
+	// This method may not be called while a noncontinuous session is active.
+	if (m_active_devices && !m_continuous)
 		return -EBUSY;
 
 	if (device) {
+		// Stop a device streaming in a running session, waiting up to a
+		// second for its transfers to complete.
+		if (m_continuous && device->streaming()) {
+			device->cancel();
+			std::unique_lock<std::mutex> lk(m_lock);
+			auto res = m_completion.wait_for(lk, std::chrono::seconds(1), [&]{ return !device->streaming(); });
+			lk.unlock();
+			if (!res)
+				SMU_LOG(LOG_LEVEL_WARNING, "%s: timed out waiting for completion\n", __func__);
+			ret = device->off();
+			if (ret && ret != -ENODEV)
+				return ret;
+		}
+
 		ret = device->release();
 
 		// device has already been detached from the system
 		if (detached && (ret == -19))
 			ret = 0;
 
-		if (!ret)
+		if (!ret) {
+			std::lock_guard<std::mutex> lock(m_devices_lock);
 			m_devices.erase(device);
+			m_skew.erase(device);
+			m_skew_history.erase(device);
+		}
 	}
 	return ret;
 }
@@ -537,6 +814,22 @@ int Session::configure(uint32_t sampleRate)
 	if (m_active_devices)
 		return -EBUSY;
 
+	// Resize the executor, queued work is finished before the old one
+	// stops. Hotplug events can arrive at any time so the new one is swapped
+	// in under the lock they submit with.
+	unsigned threads = executor_threads(m_executor_threads);
+	if (threads != m_executor->threads()) {
+		Executor* executor = new Executor(threads);
+		{
+			std::lock_guard<std::mutex> executor_lock(m_executor_lock);
+			std::swap(executor, m_executor);
+		}
+		delete executor;
+	}
+
+	// Scheduling that isn't permitted falls back to the defaults.
+	apply_thread_config();
+
 	// Nothing to configure if the session has no devices.
 	if (m_devices.size() == 0)
 		return ret;
@@ -554,12 +847,136 @@ int Session::configure(uint32_t sampleRate)
 			break;
 	}
 
-	if (ret > 0)
+	if (ret > 0) {
 		m_sample_rate = ret;
+		int queue_ret = size_queues();
+		if (queue_ret < 0)
+			return queue_ret;
+	}
 
 	return ret;
 }
 
+int Session::apply_thread_config()
+{
+	int ret = configure_thread(m_usb_thread, m_usb_thread_config);
+	int executor_ret = m_executor->configure(m_executor_thread_config);
+	return ret ? ret : executor_ret;
+}
+
+int Session::size_queues(Device* only)
+{
+	// default size for queues without explicit sizes
+	unsigned queue_size = m_queue_size;
+	if (m_queue_time > 0)
+		queue_size = std::ceil(m_queue_time * m_sample_rate);
+
+	// Queue sizes of a device if the session sizes its queues to the given
+	// number of samples, applying explicit sizes and the device's minimum.
+	auto sizes = [](Device* dev, unsigned size, unsigned& in_size, unsigned& out_size) {
+		in_size = std::max(dev->m_in_queue_size ? dev->m_in_queue_size : size, dev->min_queue_size());
+		out_size = std::max(dev->m_out_queue_size ? dev->m_out_queue_size : size, dev->min_queue_size());
+	};
+
+	// Devices whose queues are resized. The queues of streaming devices
+	// can't be resized, a device joining a running session only gets the
+	// budget they leave.
+	std::vector<Device*> resized;
+	size_t other_mem = 0;
+	for (Device* dev: devices()) {
+		if (!only || dev == only)
+			resized.push_back(dev);
+		else
+			other_mem += dev->queue_memory();
+	}
+
+	// Memory used by the queues of all devices for a given session size,
+	// spsc_queue allocates one extra element to distinguish full from empty.
+	auto memory = [&](unsigned size) {
+		size_t bytes = other_mem;
+		for (Device* dev: resized) {
+			unsigned in_size, out_size;
+			sizes(dev, size, in_size, out_size);
+			bytes += (in_size + 1) * sizeof(std::array<float, 4>);
+			bytes += dev->info()->channel_count * (out_size + 1) * sizeof(float);
+		}
+		return bytes;
+	};
+
+	// Shrink session sized queues to the largest size fitting within the
+	// memory budget, the memory used grows with the size.
+	if (m_queue_memory_budget && memory(queue_size) > m_queue_memory_budget) {
+		if (memory(0) > m_queue_memory_budget)
+			return -ENOMEM;
+		unsigned low = 0, high = queue_size;
+		while (low < high) {
+			unsigned mid = low + (high - low + 1) / 2;
+			if (memory(mid) <= m_queue_memory_budget)
+				low = mid;
+			else
+				high = mid - 1;
+		}
+		queue_size = low;
+	}
+
+	for (Device* dev: resized) {
+		unsigned in_size, out_size;
+		sizes(dev, queue_size, in_size, out_size);
+		int ret = dev->resize_queues(in_size, out_size);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+size_t Session::queue_memory()
+{
+	size_t bytes = 0;
+	for (Device* dev: devices())
+		bytes += dev->queue_memory();
+	return bytes;
+}
+
+// Combine the timings of multiple devices.
+static void merge_timing(TimingStats& total, const TimingStats& stats)
+{
+	if (!stats.count)
+		return;
+	if (!total.count || stats.min < total.min)
+		total.min = stats.min;
+	total.max = std::max(total.max, stats.max);
+	total.mean = (total.mean * total.count + stats.mean * stats.count) / (total.count + stats.count);
+	total.count += stats.count;
+}
+
+DataflowStats Session::stats()
+{
+	DataflowStats total = {};
+	for (Device* dev: devices()) {
+		DataflowStats stats = dev->stats();
+		total.transfers_submitted += stats.transfers_submitted;
+		total.transfers_completed += stats.transfers_completed;
+		total.bytes_in += stats.bytes_in;
+		total.bytes_out += stats.bytes_out;
+		total.samples_decoded += stats.samples_decoded;
+		total.samples_encoded += stats.samples_encoded;
+		total.samples_dropped += stats.samples_dropped;
+		total.underruns += stats.underruns;
+		total.in_queue_high_water = std::max(total.in_queue_high_water, stats.in_queue_high_water);
+		total.out_queue_high_water = std::max(total.out_queue_high_water, stats.out_queue_high_water);
+		merge_timing(total.completion_interval, stats.completion_interval);
+		merge_timing(total.callback_duration, stats.callback_duration);
+	}
+	return total;
+}
+
+void Session::reset_stats()
+{
+	for (Device* dev: devices())
+		dev->reset_stats();
+}
+
 int Session::run(uint64_t samples)
 {
 	int ret;
@@ -600,10 +1017,10 @@ int Session::end()
 
 	auto res = m_completion.wait_until(lk, now + std::chrono::seconds(waitTime), [&]{ return m_active_devices == 0; });
 	if (!res) {
-		DEBUG("%s: timed out waiting for completion\n", __func__);
+		SMU_LOG(LOG_LEVEL_WARNING, "%s: timed out waiting for completion\n", __func__);
 	}
 
-	for (Device* dev: m_devices) {
+	for (Device* dev: devices()) {
 		ret = dev->off();
 		if (ret == -ENODEV) {
 			// the device has already been detached
@@ -613,6 +1030,14 @@ int Session::end()
 			break;
 		}
 	}
+
+	std::unique_lock<std::mutex> callback_lock(m_callback_lock);
+	std::exception_ptr callback_exception = m_callback_exception;
+	m_callback_exception = nullptr;
+	callback_lock.unlock();
+	if (callback_exception)
+		std::rethrow_exception(callback_exception);
+
 	return ret;
 }
 
@@ -625,6 +1050,356 @@ void Session::flush()
 	}
 }
 
+ssize_t Session::read(std::vector<std::vector<std::array<float, 4>>>& buf, size_t samples, int timeout)
+{
+	// Devices and skews can change while a continuous session is running.
+	std::vector<Device*> devs;
+	std::vector<double> skews;
+	{
+		std::lock_guard<std::mutex> lock(m_devices_lock);
+		for (Device* dev: m_devices) {
+			auto skew = m_skew.find(dev);
+			devs.push_back(dev);
+			skews.push_back(skew != m_skew.end() ? skew->second : 0);
+		}
+	}
+
+	buf.resize(devs.size());
+	for (auto& dev_buf: buf)
+		dev_buf.clear();
+	if (devs.empty())
+		return 0;
+
+	// Split measured skews relative to the earliest device into the number
+	// of samples each device is read ahead and the fractional part used to
+	// interpolate between consecutive samples.
+	double min_skew = 0;
+	for (double skew: skews)
+		min_skew = std::min(min_skew, skew);
+	std::vector<int64_t> offsets;
+	std::vector<float> fractions;
+	for (double skew: skews) {
+		double rel_skew = skew - min_skew;
+		int64_t offset = std::floor(rel_skew);
+		float fraction = rel_skew - offset;
+		if (fraction > 0)
+			offset++;
+		offsets.push_back(offset);
+		fractions.push_back(fraction);
+	}
+
+	// Position of each device in the session's stream. Devices that joined
+	// a running session start ahead of the others until samples up to
+	// their first one have been read.
+	std::vector<int64_t> positions;
+	for (unsigned i = 0; i < devs.size(); i++)
+		positions.push_back((int64_t)(devs[i]->m_sample_offset + devs[i]->m_read_sampleno) - offsets[i]);
+
+	// Samples each device has to drop to line up with the device that is
+	// furthest along in its stream, not counting joined devices ahead of
+	// their first sample unless all of them are.
+	int64_t position = INT64_MIN;
+	for (unsigned i = 0; i < devs.size(); i++) {
+		if (!devs[i]->m_sample_offset || devs[i]->m_read_sampleno)
+			position = std::max(position, positions[i]);
+	}
+	if (position == INT64_MIN)
+		position = *std::min_element(positions.begin(), positions.end());
+	std::vector<uint64_t> behind;
+	std::vector<uint64_t> ahead;
+	for (int64_t pos: positions) {
+		behind.push_back(pos < position ? position - pos : 0);
+		ahead.push_back(pos > position ? pos - position : 0);
+	}
+
+	// Determine the number of aligned samples available across all
+	// devices, detached devices are padded so they don't limit it.
+	auto aligned_available = [&]() {
+		size_t available = SIZE_MAX;
+		for (unsigned i = 0; i < devs.size(); i++) {
+			if (devs[i]->m_detached)
+				continue;
+			size_t dev_available = devs[i]->read_available();
+			dev_available = (dev_available > behind[i]) ? dev_available - behind[i] : 0;
+			available = std::min(available, dev_available + ahead[i]);
+		}
+		return available == SIZE_MAX ? 0 : available;
+	};
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+	std::unique_lock<std::mutex> lk(m_samples_lock);
+	size_t available = aligned_available();
+	while (available < samples) {
+		if (timeout == 0)
+			break;
+		if (timeout < 0)
+			m_samples_cv.wait(lk);
+		else if (m_samples_cv.wait_until(lk, deadline) == std::cv_status::timeout)
+			timeout = 0;
+		available = aligned_available();
+	}
+	lk.unlock();
+	samples = std::min(samples, available);
+
+	const float nan = std::nanf("");
+	const std::array<float, 4> nan_sample = {{nan, nan, nan, nan}};
+	std::vector<std::array<float, 4>> dropped;
+	std::vector<std::array<float, 4>> dev_samples;
+	for (unsigned i = 0; i < devs.size(); i++) {
+		Device* dev = devs[i];
+		ssize_t ret;
+		uint64_t drop = std::min<uint64_t>(behind[i], dev->read_available());
+		if (drop) {
+			ret = dev->read(dropped, drop, 0);
+			if (ret < 0)
+				return ret;
+			if (!dropped.empty()) {
+				std::lock_guard<std::mutex> lock(m_devices_lock);
+				m_skew_history[dev] = dropped.back();
+			}
+		}
+
+		// pad joined devices up to their first sample
+		std::vector<std::array<float, 4>>& dev_buf = buf[i];
+		size_t pad = std::min<uint64_t>(ahead[i], samples);
+		dev_buf.assign(pad, nan_sample);
+
+		size_t count = samples - pad;
+		if (dev->m_detached)
+			count = std::min(count, dev->read_available());
+		dev_samples.clear();
+		if (count) {
+			ret = dev->read(dev_samples, count, 0);
+			if (ret < 0)
+				return ret;
+		}
+
+		// Interpolate between consecutive samples to correct fractional skew.
+		float fraction = fractions[i];
+		if (fraction > 0 && !dev_samples.empty()) {
+			std::lock_guard<std::mutex> lock(m_devices_lock);
+			auto history = m_skew_history.find(dev);
+			std::array<float, 4> prev = (history != m_skew_history.end()) ? history->second : dev_samples[0];
+			for (auto& sample: dev_samples) {
+				std::array<float, 4> raw = sample;
+				for (unsigned sig_i = 0; sig_i < 4; sig_i++)
+					sample[sig_i] = prev[sig_i] * (1 - fraction) + raw[sig_i] * fraction;
+				prev = raw;
+			}
+			m_skew_history[dev] = prev;
+		}
+		dev_buf.insert(dev_buf.end(), dev_samples.begin(), dev_samples.end());
+
+		// pad detached devices that ran out of samples
+		if (dev->m_detached)
+			dev_buf.resize(samples, nan_sample);
+	}
+
+	return samples;
+}
+
+ssize_t Session::read(std::vector<float>& buf, size_t samples, int timeout, FrameLayout layout)
+{
+	std::vector<std::vector<std::array<float, 4>>> frames;
+	ssize_t ret = read(frames, samples, timeout);
+	if (ret < 0)
+		return ret;
+
+	size_t num_samples = ret;
+	size_t num_devices = frames.size();
+	buf.resize(num_samples * num_devices * 4);
+	for (size_t dev_i = 0; dev_i < num_devices; dev_i++) {
+		for (size_t sample_i = 0; sample_i < num_samples; sample_i++) {
+			for (size_t sig_i = 0; sig_i < 4; sig_i++) {
+				size_t index;
+				if (layout == FRAME_TENSOR)
+					index = (dev_i * 4 + sig_i) * num_samples + sample_i;
+				else
+					index = (sample_i * num_devices + dev_i) * 4 + sig_i;
+				buf[index] = frames[dev_i][sample_i][sig_i];
+			}
+		}
+	}
+
+	return ret;
+}
+
+int Session::start_capture(const std::string& path, size_t block_size)
+{
+	if (m_capture)
+		return -EBUSY;
+
+	// if session is unconfigured, use device default sample rate
+	if (m_sample_rate == 0) {
+		int ret = configure(0);
+		if (ret < 0)
+			return ret;
+	}
+
+	Capture* capture = new Capture(this);
+	int ret = capture->start(path, block_size);
+	if (ret < 0) {
+		delete capture;
+		return ret;
+	}
+	m_capture = capture;
+	return 0;
+}
+
+int64_t Session::stop_capture()
+{
+	if (!m_capture)
+		return 0;
+
+	int64_t ret = m_capture->stop();
+	delete m_capture;
+	m_capture = NULL;
+	return ret;
+}
+
+int Session::start_trace(size_t events_per_thread)
+{
+#ifdef WITH_TRACING
+	trace_start(events_per_thread);
+	return 0;
+#else
+	return -ENOSYS;
+#endif
+}
+
+int64_t Session::stop_trace(const std::string& path)
+{
+	return trace_stop(path);
+}
+
+std::vector<StageProfile> Session::profile()
+{
+#ifdef WITH_PROFILING
+	return m_profiler->snapshot();
+#else
+	return {};
+#endif
+}
+
+void Session::reset_profile()
+{
+	m_profiler->reset();
+}
+
+void Session::samples_queued()
+{
+	// Acquire the lock so the notification can't slip in between a reader
+	// checking sample availability and waiting.
+	{
+		std::lock_guard<std::mutex> lock(m_samples_lock);
+	}
+	m_samples_cv.notify_all();
+}
+
+// Estimate the delay in samples of a signal relative to a reference by
+// cross-correlating their first differences, refining the integer peak with
+// parabolic interpolation.
+static double estimate_delay(const std::vector<float>& ref, const std::vector<float>& sig, int max_lag)
+{
+	std::vector<float> ref_diff, sig_diff;
+	for (size_t i = 1; i < ref.size(); i++)
+		ref_diff.push_back(ref[i] - ref[i - 1]);
+	for (size_t i = 1; i < sig.size(); i++)
+		sig_diff.push_back(sig[i] - sig[i - 1]);
+
+	int len = std::min(ref_diff.size(), sig_diff.size());
+	std::vector<double> corr(2 * max_lag + 1, 0);
+	for (int lag = -max_lag; lag <= max_lag; lag++) {
+		double sum = 0;
+		// correlate over the same reference span for every lag
+		for (int i = max_lag; i < len - max_lag; i++)
+			sum += ref_diff[i] * sig_diff[i + lag];
+		corr[lag + max_lag] = sum;
+	}
+
+	int peak = std::max_element(corr.begin(), corr.end()) - corr.begin();
+	double delay = peak - max_lag;
+	if (peak > 0 && peak < 2 * max_lag) {
+		double prev = corr[peak - 1], cur = corr[peak], next = corr[peak + 1];
+		double denom = prev - 2 * cur + next;
+		if (denom != 0)
+			delay += 0.5 * (prev - next) / denom;
+	}
+	return delay;
+}
+
+int Session::calibrate_skew(Device* source, unsigned channel)
+{
+	// number of captured samples and half period of the calibration waveform
+	const unsigned samples = 20000;
+	const unsigned half_period = 1000;
+	// maximum offset in samples searched for
+	const int max_lag = 100;
+	int ret;
+
+	// This method may not be called while the session is active.
+	if (m_active_devices)
+		return -EBUSY;
+	if (!source || m_devices.find(source) == m_devices.end() || channel > 1)
+		return -EINVAL;
+
+	// Drive the waveform from the source, all other devices only capture.
+	std::map<Device*, int> modes;
+	for (Device* dev: m_devices) {
+		modes[dev] = dev->get_mode(channel);
+		ret = dev->set_mode(channel, dev == source ? SVMI : HI_Z);
+		if (ret < 0)
+			goto restore;
+	}
+
+	{
+		std::vector<float> waveform;
+		for (unsigned i = 0; i < samples; i++)
+			waveform.push_back((i / half_period) % 2 ? 4.0 : 1.0);
+
+		m_skew.clear();
+		m_skew_history.clear();
+		flush();
+		source->write(waveform, channel);
+		ret = run(samples);
+		if (ret < 0)
+			goto restore;
+
+		std::vector<std::vector<std::array<float, 4>>> frames;
+		ret = read(frames, samples, 1000);
+		if (ret < 0)
+			goto restore;
+		if ((unsigned)ret < samples) {
+			ret = -EIO;
+			goto restore;
+		}
+
+		// Use the voltage captured on the selected channel of each device.
+		std::vector<std::vector<float>> voltages(frames.size());
+		std::vector<float> ref;
+		unsigned dev_i = 0;
+		for (Device* dev: m_devices) {
+			for (auto& sample: frames[dev_i])
+				voltages[dev_i].push_back(sample[channel * 2]);
+			if (dev == source)
+				ref = voltages[dev_i];
+			dev_i++;
+		}
+
+		dev_i = 0;
+		for (Device* dev: m_devices) {
+			m_skew[dev] = (dev == source) ? 0 : estimate_delay(ref, voltages[dev_i], max_lag);
+			dev_i++;
+		}
+		ret = 0;
+	}
+
+restore:
+	for (auto mode: modes)
+		mode.first->set_mode(channel, mode.second);
+	return ret;
+}
+
 int Session::start(uint64_t samples)
 {
 	int ret = 0;
@@ -636,30 +1411,42 @@ int Session::start(uint64_t samples)
 		configure(0);
 
 	for (Device* dev: m_devices) {
+		dev->m_sample_offset = 0;
 		ret = dev->on();
 		if (ret)
 			break;
-		// make sure all devices are synchronized
-		if (m_devices.size() > 1) {
+		// make sure all devices are synchronized, including devices
+		// joining continuous sessions later on
+		if (m_devices.size() > 1 || m_continuous) {
 			ret = dev->sync();
 			if (ret)
 				break;
 		}
+		// count the device first, its transfers can complete before run() returns
+		m_active_devices++;
 		ret = dev->run(samples);
-		if (ret)
+		if (ret) {
+			m_active_devices--;
 			break;
-		m_active_devices++;
+		}
 	}
 	return ret;
 }
 
+// Copy the session devices, add() and remove() can change them while the
+// session is running.
+std::vector<Device*> Session::devices()
+{
+	std::lock_guard<std::mutex> lock(m_devices_lock);
+	return std::vector<Device*>(m_devices.begin(), m_devices.end());
+}
+
 int Session::cancel()
 {
 	int ret = 0;
 
 	m_cancellation = LIBUSB_TRANSFER_CANCELLED;
-	for (Device* dev: m_devices) {
-		set_off(dev);
+	for (Device* dev: devices()) {
 		ret = dev->cancel();
 
 		if (ret)
@@ -668,30 +1455,45 @@ int Session::cancel()
 	return ret;
 }
 
-void Session::handle_error(int status, const char * tag)
+void Session::handle_error(int status, const char * tag, Device* device)
 {
-	std::lock_guard<std::mutex> lock(m_lock);
 	// a canceled transfer completing is not an error...
-	if ((m_cancellation == 0) && (status != LIBUSB_TRANSFER_CANCELLED) ) {
-		DEBUG("%s: error condition at %s: %s\n", __func__, tag, libusb_error_name(status));
-		m_cancellation = status;
+	if (status == LIBUSB_TRANSFER_CANCELLED)
+		return;
+
+	// Continuous sessions keep running without a detached device as long
+	// as other devices are streaming.
+	bool no_device = (status == LIBUSB_TRANSFER_NO_DEVICE || status == LIBUSB_ERROR_NO_DEVICE);
+	if (device && no_device && m_continuous && (device->m_detached || m_active_devices > 1)) {
+		if (!device->m_detached.exchange(true)) {
+			SMU_LOG(LOG_LEVEL_WARNING, "%s: device detached at %s\n", __func__, tag);
+			device->cancel();
+		}
+		return;
+	}
+
+	// only the first error cancels the session
+	unsigned expected = 0;
+	if (m_cancellation.compare_exchange_strong(expected, status)) {
+		SMU_LOG(LOG_LEVEL_ERROR, "%s: error condition at %s: %s\n", __func__, tag, libusb_error_name(status));
 		cancel();
 	}
 }
 
 void Session::completion()
 {
-	// on USB thread
-	m_active_devices -= 1;
-
-	// don't lock for cancelled sessions
-	if (m_cancellation == 0)
-		std::unique_lock<std::mutex> lock(m_lock);
-
-	if (m_active_devices == 0) {
-		if (m_completion_callback) {
-			m_completion_callback(m_cancellation);
-		}
-		m_completion.notify_all();
+	// on the USB thread or the executor, the last device runs the
+	// completion callback
+	if (--m_active_devices == 0 && m_completion_callback) {
+		// Keep user code off the USB thread.
+		auto callback = m_completion_callback;
+		unsigned cancellation = m_cancellation;
+		submit_callback([=]() { callback(cancellation); });
 	}
+
+	// Every device notifies waiters as remove() waits for single devices.
+	// Lock so end() and remove() can't miss the notification between
+	// checking for completion and waiting.
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_completion.notify_all();
 }
@@ -8,7 +8,6 @@
 #include <cmath>
 #include <vector>
 
-#include "debug.hpp"
 #include <libsmu/libsmu.hpp>
 #include <boost/math/constants/constants.hpp>
 
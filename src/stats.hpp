@@ -0,0 +1,136 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+
+#include <libsmu/libsmu.hpp>
+
+namespace smu {
+	// Raise a high-water mark to the given level if it's higher.
+	static inline void raise_mark(std::atomic<uint64_t>& mark, uint64_t level)
+	{
+		uint64_t current = mark.load(std::memory_order_relaxed);
+		while (level > current && !mark.compare_exchange_weak(current, level, std::memory_order_relaxed));
+	}
+
+	// Lower a low-water mark to the given level if it's lower.
+	static inline void lower_mark(std::atomic<uint64_t>& mark, uint64_t level)
+	{
+		uint64_t current = mark.load(std::memory_order_relaxed);
+		while (level < current && !mark.compare_exchange_weak(current, level, std::memory_order_relaxed));
+	}
+
+	// Running minimum, mean and maximum of a duration, updated without locks.
+	class TimingCounter {
+	public:
+		void add(std::chrono::steady_clock::duration duration) {
+			uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+			m_count.fetch_add(1, std::memory_order_relaxed);
+			m_total.fetch_add(ns, std::memory_order_relaxed);
+			lower_mark(m_min, ns);
+			raise_mark(m_max, ns);
+		}
+
+		TimingStats snapshot() const {
+			TimingStats stats = {};
+			stats.count = m_count.load(std::memory_order_relaxed);
+			if (stats.count) {
+				stats.min = m_min.load(std::memory_order_relaxed) * 1e-9;
+				stats.mean = m_total.load(std::memory_order_relaxed) * 1e-9 / stats.count;
+				stats.max = m_max.load(std::memory_order_relaxed) * 1e-9;
+			}
+			return stats;
+		}
+
+		void reset() {
+			m_count = 0;
+			m_total = 0;
+			m_min = UINT64_MAX;
+			m_max = 0;
+		}
+
+	private:
+		// durations in nanoseconds
+		std::atomic<uint64_t> m_count{0};
+		std::atomic<uint64_t> m_total{0};
+		std::atomic<uint64_t> m_min{UINT64_MAX};
+		std::atomic<uint64_t> m_max{0};
+	};
+
+	// Always-on data flow counters of a device. Updated with relaxed atomics
+	// by the threads handling transfers, mostly once per transfer.
+	class DataflowCounters {
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		// Count an added number of items.
+		static void add(std::atomic<uint64_t>& counter, uint64_t count) {
+			counter.fetch_add(count, std::memory_order_relaxed);
+		}
+
+		// Record the completion of an incoming transfer at the given time.
+		void in_completed(clock::time_point now) {
+			int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+				now.time_since_epoch()).count();
+			int64_t last = m_last_completion.exchange(now_ns, std::memory_order_relaxed);
+			if (last)
+				completion_interval.add(std::chrono::nanoseconds(now_ns - last));
+		}
+
+		// Stop measuring completion intervals until the next completion,
+		// e.g. between sessions.
+		void restart() { m_last_completion = 0; }
+
+		DataflowStats snapshot() const {
+			DataflowStats stats = {};
+			stats.transfers_submitted = transfers_submitted.load(std::memory_order_relaxed);
+			stats.transfers_completed = transfers_completed.load(std::memory_order_relaxed);
+			stats.bytes_in = bytes_in.load(std::memory_order_relaxed);
+			stats.bytes_out = bytes_out.load(std::memory_order_relaxed);
+			stats.samples_decoded = samples_decoded.load(std::memory_order_relaxed);
+			stats.samples_encoded = samples_encoded.load(std::memory_order_relaxed);
+			stats.samples_dropped = samples_dropped.load(std::memory_order_relaxed);
+			stats.in_queue_high_water = in_queue_high_water.load(std::memory_order_relaxed);
+			stats.out_queue_high_water = out_queue_high_water.load(std::memory_order_relaxed);
+			stats.completion_interval = completion_interval.snapshot();
+			stats.callback_duration = callback_duration.snapshot();
+			return stats;
+		}
+
+		void reset() {
+			transfers_submitted = 0;
+			transfers_completed = 0;
+			bytes_in = 0;
+			bytes_out = 0;
+			samples_decoded = 0;
+			samples_encoded = 0;
+			samples_dropped = 0;
+			in_queue_high_water = 0;
+			out_queue_high_water = 0;
+			completion_interval.reset();
+			callback_duration.reset();
+			restart();
+		}
+
+		std::atomic<uint64_t> transfers_submitted{0};
+		std::atomic<uint64_t> transfers_completed{0};
+		std::atomic<uint64_t> bytes_in{0};
+		std::atomic<uint64_t> bytes_out{0};
+		std::atomic<uint64_t> samples_decoded{0};
+		std::atomic<uint64_t> samples_encoded{0};
+		std::atomic<uint64_t> samples_dropped{0};
+		std::atomic<uint64_t> in_queue_high_water{0};
+		std::atomic<uint64_t> out_queue_high_water{0};
+		TimingCounter completion_interval;
+		TimingCounter callback_duration;
+
+	private:
+		// Time of the last incoming transfer completion in nanoseconds, 0 if none.
+		std::atomic<int64_t> m_last_completion{0};
+	};
+}
@@ -0,0 +1,115 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "threads.hpp"
+
+#include <cerrno>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "log.hpp"
+
+using namespace smu;
+
+#ifdef _WIN32
+
+static int set_affinity(HANDLE thread, const std::vector<unsigned>& cpus)
+{
+	DWORD_PTR mask = 0;
+	for (unsigned cpu: cpus) {
+		if (cpu >= sizeof(mask) * 8)
+			return -EINVAL;
+		mask |= (DWORD_PTR)1 << cpu;
+	}
+	if (!SetThreadAffinityMask(thread, mask))
+		return -EINVAL;
+	return 0;
+}
+
+static int set_policy(HANDLE thread, ThreadPolicy policy, int priority)
+{
+	// Windows has no real-time policies for threads, use the highest
+	// priority for both instead.
+	int level = policy == THREAD_DEFAULT ? THREAD_PRIORITY_NORMAL : THREAD_PRIORITY_TIME_CRITICAL;
+	if (!SetThreadPriority(thread, level))
+		return -EPERM;
+	return 0;
+}
+
+#else
+
+static int set_affinity(pthread_t thread, const std::vector<unsigned>& cpus)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (unsigned cpu: cpus) {
+		if (cpu >= CPU_SETSIZE)
+			return -EINVAL;
+		CPU_SET(cpu, &set);
+	}
+	return -pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+	// no affinity API (e.g. OS X only supports affinity hints)
+	return -ENOSYS;
+#endif
+}
+
+static int set_policy(pthread_t thread, ThreadPolicy policy, int priority)
+{
+	int sched_policy;
+	switch (policy) {
+		case THREAD_FIFO:
+			sched_policy = SCHED_FIFO;
+			break;
+		case THREAD_RR:
+			sched_policy = SCHED_RR;
+			break;
+		default:
+			sched_policy = SCHED_OTHER;
+			break;
+	}
+
+	sched_param param = {};
+	if (sched_policy != SCHED_OTHER) {
+		priority = std::max(priority, sched_get_priority_min(sched_policy));
+		priority = std::min(priority, sched_get_priority_max(sched_policy));
+		param.sched_priority = priority;
+	}
+	return -pthread_setschedparam(thread, sched_policy, &param);
+}
+
+#endif
+
+int smu::configure_thread(std::thread& thread, const ThreadConfig& config)
+{
+	int ret = 0;
+	int err;
+
+	if (!thread.joinable())
+		return -EINVAL;
+
+	if (!config.cpus.empty()) {
+		err = set_affinity(thread.native_handle(), config.cpus);
+		if (err) {
+			SMU_LOG(LOG_LEVEL_WARNING, "%s: failed pinning thread: %i\n", __func__, err);
+			ret = err;
+		}
+	}
+
+	err = set_policy(thread.native_handle(), config.policy, config.priority);
+	if (err) {
+		SMU_LOG(LOG_LEVEL_WARNING, "%s: failed setting thread scheduling: %i\n", __func__, err);
+		if (!ret)
+			ret = err;
+	}
+
+	return ret;
+}
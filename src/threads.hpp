@@ -0,0 +1,20 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#pragma once
+
+#include <thread>
+
+#include <libsmu/libsmu.hpp>
+
+namespace smu {
+	// Pin a thread to CPUs and set its scheduling policy.
+	// Affinity and scheduling are applied independently, if one fails the
+	// other is still applied and the thread keeps its previous setting for
+	// the failed one.
+	// @return 0 on success, otherwise the negative errno code of the first
+	// failure: -EPERM if not permitted, -EINVAL for invalid CPUs, or
+	// -ENOSYS if unsupported on the platform.
+	int configure_thread(std::thread& thread, const ThreadConfig& config);
+}
@@ -0,0 +1,177 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "trace.hpp"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+using namespace smu;
+
+namespace {
+	struct TraceEvent {
+		const char* name;
+		const void* device;
+		uint64_t start;
+		int64_t duration;
+		const char* arg_name;
+		int64_t arg;
+	};
+
+	// Ring buffer of the events of one thread, written only by that thread.
+	struct TraceBuffer {
+		TraceBuffer(size_t capacity, unsigned generation, unsigned tid):
+			events(capacity), generation(generation), tid(tid) {}
+
+		std::vector<TraceEvent> events;
+		// Number of events recorded, the newest are kept.
+		std::atomic<uint64_t> head{0};
+		// Trace the buffer was allocated for.
+		unsigned generation;
+		unsigned tid;
+		std::string thread_name;
+	};
+}
+
+std::atomic<bool> smu::trace_enabled{false};
+
+// Buffers of all threads recording the current trace, guarded by trace_lock.
+static std::mutex trace_lock;
+static std::vector<std::shared_ptr<TraceBuffer>> trace_buffers;
+static size_t trace_capacity = 0;
+static uint64_t trace_start_time = 0;
+// Incremented for every trace so threads allocate new buffers.
+static std::atomic<unsigned> trace_generation{0};
+
+// Buffer of the current thread, kept alive by trace_buffers until exported
+// even if the thread exits.
+static thread_local std::shared_ptr<TraceBuffer> thread_buffer;
+
+uint64_t smu::trace_now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Allocate the trace buffer of the current thread.
+static TraceBuffer* trace_buffer(unsigned generation)
+{
+	std::lock_guard<std::mutex> lock(trace_lock);
+	if (!trace_enabled || generation != trace_generation)
+		return NULL;
+
+	thread_buffer = std::make_shared<TraceBuffer>(trace_capacity, generation, trace_buffers.size() + 1);
+#ifdef __linux__
+	char name[16] = {};
+	if (!pthread_getname_np(pthread_self(), name, sizeof(name)))
+		thread_buffer->thread_name = name;
+#endif
+	if (thread_buffer->thread_name.empty())
+		thread_buffer->thread_name = "thread " + std::to_string(thread_buffer->tid);
+	trace_buffers.push_back(thread_buffer);
+	return thread_buffer.get();
+}
+
+void smu::trace_record(const char* name, const void* device, uint64_t start,
+	int64_t duration, const char* arg_name, int64_t arg)
+{
+	unsigned generation = trace_generation.load(std::memory_order_acquire);
+	TraceBuffer* buf = thread_buffer.get();
+	if (!buf || buf->generation != generation) {
+		buf = trace_buffer(generation);
+		if (!buf)
+			return;
+	}
+
+	uint64_t head = buf->head.load(std::memory_order_relaxed);
+	buf->events[head % buf->events.size()] = {name, device, start, duration, arg_name, arg};
+	buf->head.store(head + 1, std::memory_order_release);
+}
+
+void smu::trace_start(size_t events_per_thread)
+{
+	std::lock_guard<std::mutex> lock(trace_lock);
+	trace_buffers.clear();
+	trace_capacity = std::max<size_t>(events_per_thread, 1);
+	trace_start_time = trace_now();
+	trace_generation++;
+	trace_enabled = true;
+}
+
+// Copy the events of a buffer that weren't overwritten while copying.
+static std::vector<TraceEvent> trace_events(const TraceBuffer& buf)
+{
+	size_t capacity = buf.events.size();
+	uint64_t head = buf.head.load(std::memory_order_acquire);
+	uint64_t first = head > capacity ? head - capacity : 0;
+
+	std::vector<TraceEvent> events;
+	for (uint64_t i = first; i < head; i++)
+		events.push_back(buf.events[i % capacity]);
+
+	// Threads that passed the tracing check before it was stopped can still
+	// be recording, drop the oldest events they may have overwritten.
+	uint64_t end = buf.head.load(std::memory_order_acquire);
+	uint64_t overwritten = end > first + capacity ? end - first - capacity : 0;
+	events.erase(events.begin(), events.begin() + std::min<uint64_t>(overwritten, events.size()));
+	return events;
+}
+
+int64_t smu::trace_stop(const std::string& path)
+{
+	trace_enabled = false;
+
+	std::lock_guard<std::mutex> lock(trace_lock);
+	trace_generation++;
+	std::vector<std::shared_ptr<TraceBuffer>> buffers;
+	buffers.swap(trace_buffers);
+
+	FILE* out = fopen(path.c_str(), "w");
+	if (!out)
+		return -errno;
+
+	int64_t count = 0;
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"libsmu\"}}");
+	for (auto& buf: buffers) {
+		fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+			buf->tid, buf->thread_name.c_str());
+
+		for (auto& event: trace_events(*buf)) {
+			// spans started before the trace
+			if (event.start < trace_start_time)
+				continue;
+
+			double ts = (event.start - trace_start_time) / 1e3;
+			if (event.duration < 0) {
+				fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"smu\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f",
+					event.name, buf->tid, ts);
+			} else {
+				fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"smu\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+					event.name, buf->tid, ts, event.duration / 1e3);
+			}
+			fprintf(out, ",\"args\":{\"device\":\"%p\"", event.device);
+			if (event.arg_name)
+				fprintf(out, ",\"%s\":%" PRId64, event.arg_name, event.arg);
+			fprintf(out, "}}");
+			count++;
+		}
+	}
+	fprintf(out, "\n]}\n");
+
+	if (fclose(out))
+		return -errno;
+	return count;
+}
@@ -0,0 +1,88 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <string>
+
+namespace smu {
+	// Process-wide event tracing of the USB and sample pipeline.
+	//
+	// Tracepoints record into a ring buffer owned by the recording thread so
+	// they never take locks or allocate, except once per thread and trace to
+	// set up its buffer. While tracing is stopped a tracepoint costs a relaxed
+	// atomic load, builds without WITH_TRACING compile them out entirely.
+
+	// Start tracing, keeping the newest events of each thread.
+	void trace_start(size_t events_per_thread);
+
+	// Stop tracing and write the recorded events as Chrome trace event JSON.
+	// @return On success, the number of events written is returned.
+	// @return On error, a negative errno code is returned.
+	int64_t trace_stop(const std::string& path);
+
+	extern std::atomic<bool> trace_enabled;
+
+	// Whether tracepoints should record.
+	static inline bool tracing()
+	{
+#ifdef WITH_TRACING
+		return trace_enabled.load(std::memory_order_relaxed);
+#else
+		return false;
+#endif
+	}
+
+	// Current time in nanoseconds on the trace clock.
+	uint64_t trace_now();
+
+	// Record an event of the calling thread.
+	// @param name Event name, must be a string literal.
+	// @param device Device the event relates to, NULL if none.
+	// @param start Start time on the trace clock.
+	// @param duration Duration in nanoseconds, negative for instant events.
+	// @param arg_name Name of the event argument, must be a string literal or NULL.
+	// @param arg Event argument.
+	void trace_record(const char* name, const void* device, uint64_t start,
+		int64_t duration, const char* arg_name, int64_t arg);
+
+	// Record an instant event if tracing.
+	static inline void trace_instant(const char* name, const void* device,
+		const char* arg_name = NULL, int64_t arg = 0)
+	{
+		if (tracing())
+			trace_record(name, device, trace_now(), -1, arg_name, arg);
+	}
+
+	// Records the lifetime of the scope as a span if tracing was running
+	// when it was entered.
+	class TraceScope {
+	public:
+		TraceScope(const char* name, const void* device):
+			m_name(name), m_device(device), m_traced(tracing()),
+			m_start(m_traced ? trace_now() : 0) {}
+
+		~TraceScope() {
+			if (m_traced)
+				trace_record(m_name, m_device, m_start, trace_now() - m_start, m_arg_name, m_arg);
+		}
+
+		// Set the argument recorded with the span.
+		void arg(const char* name, int64_t value) {
+			m_arg_name = name;
+			m_arg = value;
+		}
+
+	private:
+		const char* m_name;
+		const void* m_device;
+		bool m_traced;
+		uint64_t m_start;
+		const char* m_arg_name = NULL;
+		int64_t m_arg = 0;
+	};
+}
@@ -0,0 +1,66 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "transport.hpp"
+
+#include <libusb.h>
+
+using namespace smu;
+
+USB_Transport::~USB_Transport()
+{
+	if (m_handle) {
+		libusb_release_interface(m_handle, 0);
+		libusb_close(m_handle);
+	}
+}
+
+int USB_Transport::claim_interface(int iface)
+{
+	return libusb_claim_interface(m_handle, iface);
+}
+
+int USB_Transport::release_interface(int iface)
+{
+	return libusb_release_interface(m_handle, iface);
+}
+
+int USB_Transport::set_interface_alt_setting(int iface, int alt_setting)
+{
+	return libusb_set_interface_alt_setting(m_handle, iface, alt_setting);
+}
+
+int USB_Transport::control_transfer(uint8_t bmRequestType, uint8_t bRequest,
+	uint16_t wValue, uint16_t wIndex, unsigned char* data, uint16_t wLength,
+	unsigned timeout)
+{
+	return libusb_control_transfer(m_handle, bmRequestType, bRequest, wValue,
+		wIndex, data, wLength, timeout);
+}
+
+int USB_Transport::submit_transfer(libusb_transfer* t)
+{
+	return libusb_submit_transfer(t);
+}
+
+int USB_Transport::cancel_transfer(libusb_transfer* t)
+{
+	return libusb_cancel_transfer(t);
+}
+
+unsigned char* USB_Transport::dev_mem_alloc(size_t size)
+{
+#if LIBUSB_API_VERSION >= 0x01000105
+	return libusb_dev_mem_alloc(m_handle, size);
+#else
+	return NULL;
+#endif
+}
+
+void USB_Transport::dev_mem_free(unsigned char* buf, size_t size)
+{
+#if LIBUSB_API_VERSION >= 0x01000105
+	libusb_dev_mem_free(m_handle, buf, size);
+#endif
+}
@@ -0,0 +1,76 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <libusb.h>
+
+namespace smu {
+	// Communication channel used by a device for control requests and bulk
+	// sample transfers. Return values follow libusb conventions: negative
+	// libusb error codes on failure, zero or a byte count on success.
+	class Transport {
+	public:
+		virtual ~Transport() {}
+
+		// Claim and release an interface of the device.
+		virtual int claim_interface(int iface) = 0;
+		virtual int release_interface(int iface) = 0;
+
+		// Activate an alternate setting for an interface.
+		virtual int set_interface_alt_setting(int iface, int alt_setting) = 0;
+
+		// Perform a synchronous control transfer.
+		// @return On success, the number of bytes transferred.
+		virtual int control_transfer(uint8_t bmRequestType, uint8_t bRequest,
+			uint16_t wValue, uint16_t wIndex, unsigned char* data, uint16_t wLength,
+			unsigned timeout) = 0;
+
+		// Submit an asynchronous bulk transfer, its callback is run once it
+		// completes, fails, or is cancelled.
+		virtual int submit_transfer(libusb_transfer* t) = 0;
+
+		// Cancel a submitted transfer, LIBUSB_ERROR_NOT_FOUND is returned if
+		// the transfer isn't pending.
+		virtual int cancel_transfer(libusb_transfer* t) = 0;
+
+		// Allocate transfer buffers from device memory, NULL is returned if
+		// unsupported.
+		virtual unsigned char* dev_mem_alloc(size_t size) { return NULL; }
+		virtual void dev_mem_free(unsigned char* buf, size_t size) {}
+
+		// Stop processing submitted transfers, called before the transfers
+		// are freed. Pending transfers are dropped without running their callbacks.
+		virtual void shutdown() {}
+
+		// Underlying libusb device handle, NULL for software transports.
+		virtual libusb_device_handle* handle() { return NULL; }
+	};
+
+	// Transport for physical devices using libusb.
+	class USB_Transport: public Transport {
+	public:
+		USB_Transport(libusb_device_handle* handle): m_handle(handle) {}
+		// Closes the device handle.
+		~USB_Transport();
+
+		int claim_interface(int iface) override;
+		int release_interface(int iface) override;
+		int set_interface_alt_setting(int iface, int alt_setting) override;
+		int control_transfer(uint8_t bmRequestType, uint8_t bRequest,
+			uint16_t wValue, uint16_t wIndex, unsigned char* data, uint16_t wLength,
+			unsigned timeout) override;
+		int submit_transfer(libusb_transfer* t) override;
+		int cancel_transfer(libusb_transfer* t) override;
+		unsigned char* dev_mem_alloc(size_t size) override;
+		void dev_mem_free(unsigned char* buf, size_t size) override;
+		libusb_device_handle* handle() override { return m_handle; }
+
+	private:
+		libusb_device_handle* m_handle;
+	};
+}
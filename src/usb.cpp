@@ -15,7 +15,9 @@
 
 #include <libusb.h>
 
-#include "debug.hpp"
+#include "buffer.hpp"
+#include "log.hpp"
+#include "transport.hpp"
 
 // Mapping of libusb error codes to system errnos.
 static std::map<int, int> libusb_to_errno_map = {
@@ -47,6 +49,22 @@ unsigned int libusb_to_errno(int libusb_err)
 		return EIO;
 }
 
+unsigned int libusb_transfer_to_errno(int status)
+{
+	switch (status) {
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return ETIMEDOUT;
+		case LIBUSB_TRANSFER_STALL:
+			return EPIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return ENODEV;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return EOVERFLOW;
+		default:
+			return EIO;
+	}
+}
+
 int libusb_errno_or_zero(int ret)
 {
 	if (ret < 0)
@@ -55,35 +73,116 @@ int libusb_errno_or_zero(int ret)
 		return 0;
 }
 
-int Transfers::alloc(unsigned count, libusb_device_handle* handle,
+int Transfers::alloc(unsigned count, smu::Transport* transport,
 			unsigned char endpoint, unsigned char type, size_t buf_size,
-			unsigned timeout, libusb_transfer_cb_fn callback, void* user_data) {
+			unsigned timeout, libusb_transfer_cb_fn callback, void* user_data,
+			bool locked, bool zerocopy) {
+	// Reuse the existing transfers and their buffers if the layout is
+	// unchanged, failed allocations are cleared so all of them are valid.
+	if (m_transfers.size() == count && num_active == 0 && m_transport == transport &&
+			m_handle == transport->handle() && m_endpoint == endpoint && m_type == type &&
+			m_buf_size == buf_size && m_locked == locked && m_zerocopy_requested == zerocopy) {
+		for (auto t: m_transfers) {
+			t->timeout = timeout;
+			t->callback = callback;
+			t->user_data = user_data;
+		}
+		return 0;
+	}
+
 	clear();
+	m_transport = transport;
+	m_handle = transport->handle();
+	m_endpoint = endpoint;
+	m_type = type;
+	m_buf_size = buf_size;
+	m_locked = locked;
+	m_zerocopy_requested = zerocopy;
+	m_zerocopy = zerocopy;
 	m_transfers.resize(count, NULL);
 	for (size_t i = 0; i < count; i++) {
 		auto t = m_transfers[i] = libusb_alloc_transfer(0);
-		if (!t)
+		if (!t) {
+			clear();
 			return -ENOMEM;
-		t->dev_handle = handle;
-		t->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		}
+		t->dev_handle = transport->handle();
+		t->flags = 0;
 		t->endpoint = endpoint;
 		t->type = type;
 		t->timeout = timeout;
 		t->length = buf_size;
 		t->callback = callback;
 		t->user_data = user_data;
-		t->buffer = (uint8_t*) malloc(buf_size);
-		if (!t->buffer)
+		t->buffer = buffer_alloc();
+		if (!t->buffer) {
+			clear();
 			return -ENOMEM;
+		}
 	}
 	return 0;
 }
 
+unsigned char* Transfers::buffer_alloc()
+{
+	if (m_zerocopy) {
+		unsigned char* buf = m_transport->dev_mem_alloc(m_buf_size);
+		if (buf)
+			return buf;
+
+		// The kernel or driver doesn't support mapped device memory, fall
+		// back to regular buffers for all transfers in the collection. All
+		// fallback buffers are allocated before any is swapped in so the
+		// collection never mixes both kinds.
+		SMU_LOG(smu::LOG_LEVEL_WARNING, "%s: zero-copy transfer buffers unsupported, falling back\n", __func__);
+		std::vector<unsigned char*> fallback_bufs;
+		for (auto t: m_transfers) {
+			if (!t || !t->buffer)
+				continue;
+			unsigned char* fallback_buf = (unsigned char*) ::buffer_alloc(m_buf_size, m_locked);
+			if (!fallback_buf) {
+				for (auto b: fallback_bufs)
+					::buffer_free(b, m_locked);
+				return NULL;
+			}
+			fallback_bufs.push_back(fallback_buf);
+		}
+
+		size_t i = 0;
+		for (auto t: m_transfers) {
+			if (!t || !t->buffer)
+				continue;
+			m_transport->dev_mem_free(t->buffer, m_buf_size);
+			t->buffer = fallback_bufs[i++];
+		}
+	}
+
+	m_zerocopy = false;
+	return (unsigned char*) ::buffer_alloc(m_buf_size, m_locked);
+}
+
+void Transfers::buffer_free(unsigned char* buf)
+{
+	if (m_zerocopy) {
+		if (buf)
+			m_transport->dev_mem_free(buf, m_buf_size);
+		return;
+	}
+	::buffer_free(buf, m_locked);
+}
+
+void Transfers::free_transfer(libusb_transfer* t)
+{
+	if (t)
+		buffer_free(t->buffer);
+	libusb_free_transfer(t);
+}
+
 void Transfers::failed(libusb_transfer* t)
 {
 	for (int i = m_transfers.size(); i == 0; i--) {
 		if (m_transfers[i] == t) {
-			libusb_free_transfer(t);
+			free_transfer(t);
 			m_transfers.erase(m_transfers.begin()+i);
 		}
 	}
@@ -92,10 +191,10 @@ void Transfers::failed(libusb_transfer* t)
 void Transfers::clear()
 {
 	for (auto i: m_transfers) {
-		libusb_free_transfer(i);
+		free_transfer(i);
 	}
 	if (num_active != 0)
-		DEBUG("%s: num_active after free: %i\n", __func__, num_active);
+		SMU_LOG(smu::LOG_LEVEL_DEBUG, "%s: num_active after free: %i\n", __func__, num_active.load());
 	m_transfers.clear();
 }
 
@@ -103,11 +202,11 @@ int Transfers::cancel()
 {
 	int ret = 0;
 	for (auto i: m_transfers) {
-		if (num_active > 1) {
-			ret = libusb_cancel_transfer(i);
+		if (num_active > 0) {
+			ret = m_transport->cancel_transfer(i);
 			if (ret != 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
 				// abort if a transfer is not successfully cancelled
-				DEBUG("%s: usb transfer cancelled with status: %s\n", __func__, libusb_error_name(ret));
+				SMU_LOG(smu::LOG_LEVEL_DEBUG, "%s: usb transfer cancelled with status: %s\n", __func__, libusb_error_name(ret));
 				return -libusb_to_errno(ret);
 			}
 		}
@@ -9,14 +9,21 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <atomic>
 #include <vector>
 
 #include <libusb.h>
 
+namespace smu { class Transport; }
+
 // Map libusb error codes to system errnos.
 // If there is no match, EIO is returned.
 unsigned int libusb_to_errno(int libusb_err);
 
+// Map libusb transfer statuses of failed transfers to system errnos.
+// If there is no match, EIO is returned.
+unsigned int libusb_transfer_to_errno(int status);
+
 // Map libusb error codes to negative system errnos and positive return values
 // (relating to the byte count of successful calls) to zero.
 int libusb_errno_or_zero(int libusb_err);
@@ -30,11 +37,18 @@ class Transfers {
 		std::vector<libusb_transfer*> m_transfers;
 
 		// Allocate a new collection of libusb transfers.
+		// If the existing transfers match the requested layout they're reused
+		// instead of being reallocated, keeping buffers pooled across runs.
+		// @param locked Back the transfer buffers with locked, prefaulted memory.
+		// @param zerocopy Try to allocate transfer buffers from device memory
+		// via the transport, falling back to regular buffers if unsupported.
 		// @return 0 if transfer allocation successful.
-		// @return 1 if transfer allocation failed.
-		int alloc(unsigned count, libusb_device_handle* handle,
+		// @return -ENOMEM if transfer allocation failed, the collection is
+		// left empty.
+		int alloc(unsigned count, smu::Transport* transport,
 				unsigned char endpoint, unsigned char type, size_t buf_size,
-				unsigned timeout, libusb_transfer_cb_fn callback, void* user_data);
+				unsigned timeout, libusb_transfer_cb_fn callback, void* user_data,
+				bool locked = false, bool zerocopy = false);
 
 		// Remove a transfer that was not successfully submitted from the
 		// collection of pending transfers.
@@ -61,5 +75,29 @@ class Transfers {
 		const_iterator end() const { return m_transfers.end(); }
 
 		// Current number of pending transfers.
-		int32_t num_active = 0;
+		std::atomic<int32_t> num_active{0};
+
+		// Whether transfer buffers are mapped device memory (zero-copy).
+		bool zerocopy() const { return m_zerocopy; }
+
+	private:
+		// Layout of the current transfers used to determine if they can be reused.
+		smu::Transport* m_transport = NULL;
+		libusb_device_handle* m_handle = NULL;
+		unsigned char m_endpoint = 0;
+		unsigned char m_type = 0;
+		size_t m_buf_size = 0;
+
+		// Whether transfer buffers use locked memory.
+		bool m_locked = false;
+		// Whether zero-copy buffers were requested and were allocated.
+		bool m_zerocopy_requested = false;
+		bool m_zerocopy = false;
+
+		// Allocate a transfer buffer.
+		unsigned char* buffer_alloc();
+		// Free a transfer buffer.
+		void buffer_free(unsigned char* buf);
+		// Free a transfer and its buffer.
+		void free_transfer(libusb_transfer* t);
 };
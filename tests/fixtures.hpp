@@ -39,7 +39,7 @@ class SingleDeviceFixture : public SessionFixture {
 			else if (ret == 0)
 				FAIL() << "no devices plugged in";
 
-			if (m_session->add(m_session->m_available_devices[0]))
+			if (m_session->add(m_session->available_devices()[0]))
 				FAIL() << "failed adding device";
 
 			m_dev = *(m_session->m_devices.begin());
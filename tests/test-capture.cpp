@@ -0,0 +1,291 @@
+// Tests for capturing samples to disk, these use virtual devices.
+
+#include <gtest/gtest.h>
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <array>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fixtures.hpp"
+#include <libsmu/capture.hpp>
+#include <libsmu/libsmu.hpp>
+
+using namespace smu;
+
+// Create a session with virtual devices producing samples as fast as possible.
+class CaptureTest : public SessionFixture {
+	protected:
+		const char* m_path = "test-capture.smucap";
+		VirtualConfig m_config;
+		CaptureReader m_reader;
+
+		virtual void SetUp() {
+			SessionFixture::SetUp();
+			m_config.realtime = false;
+		}
+
+		virtual void TearDown() {
+			SessionFixture::TearDown();
+			m_reader.close();
+			std::remove(m_path);
+		}
+
+		// Get a signal of a device from the given sample.
+		float sample(uint64_t sample, unsigned dev, unsigned signal) {
+			std::vector<CaptureSpan> spans;
+			if (m_reader.view(sample, 1, spans) != 1)
+				return NAN;
+			return spans[0].at(0, dev)[signal];
+		}
+};
+
+TEST_F(CaptureTest, header) {
+	ASSERT_EQ(m_session->add_virtual(2, m_config), 2);
+	m_session->configure(50000);
+	Device* dev = *(m_session->m_devices.begin());
+	dev->set_mode(1, SIMV);
+
+	ASSERT_EQ(m_session->start_capture(m_path), 0);
+	EXPECT_EQ(m_session->start_capture(m_path), -EBUSY);
+	EXPECT_EQ(m_session->stop_capture(), 0);
+
+	ASSERT_EQ(m_reader.open(m_path), 0);
+	const CaptureHeader& header = m_reader.header();
+	EXPECT_EQ(std::memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)), 0);
+	EXPECT_EQ(header.version, CAPTURE_VERSION);
+	EXPECT_EQ(header.header_size % CAPTURE_ALIGNMENT, 0);
+	EXPECT_EQ(header.block_size, 1 << 20);
+	EXPECT_EQ(header.frames_per_block, (1 << 20) / 32);
+	EXPECT_EQ(header.format, CAPTURE_FLOAT32);
+	EXPECT_EQ(header.sample_rate, 50000);
+	EXPECT_EQ(header.num_samples, 0);
+	EXPECT_EQ(header.adc_mux, 0);
+	EXPECT_TRUE(m_reader.complete());
+	EXPECT_EQ(m_reader.blocks(), 0);
+	ASSERT_EQ(header.num_devices, 2);
+
+	const std::vector<CaptureDeviceInfo>& devices = m_reader.devices();
+	EXPECT_EQ(std::string(devices[0].serial), dev->m_serial);
+	EXPECT_EQ(std::string(devices[0].fwver), dev->m_fwver);
+	EXPECT_EQ(devices[0].mode[0], HI_Z);
+	EXPECT_EQ(devices[0].mode[1], SIMV);
+	EXPECT_EQ(devices[0].cal[0][1], 1.0f);
+}
+
+TEST_F(CaptureTest, samples) {
+	ASSERT_EQ(m_session->add_virtual(2, m_config), 2);
+	unsigned dev_i = 0;
+	for (Device* dev: m_session->m_devices) {
+		std::vector<float> buf(1000, 1 + dev_i++);
+		dev->set_mode(0, SVMI);
+		dev->write(buf, 0, true);
+	}
+
+	// use small blocks to cover block boundaries and a partial final block
+	ASSERT_EQ(m_session->start_capture(m_path, 4096), 0);
+	m_session->run(10000);
+	EXPECT_EQ(m_session->stop_capture(), 10000);
+
+	ASSERT_EQ(m_reader.open(m_path), 0);
+	EXPECT_EQ(m_reader.samples(), 10000);
+	EXPECT_EQ(m_reader.header().overflows, 0);
+	EXPECT_EQ(m_reader.header().frames_per_block, 128);
+	EXPECT_EQ(m_reader.blocks(), (10000 + 127) / 128);
+
+	// views are split at block boundaries
+	std::vector<CaptureSpan> spans;
+	EXPECT_EQ(m_reader.view(100, 200, spans), 200);
+	ASSERT_EQ(spans.size(), 3);
+	EXPECT_EQ(spans[0].first_sample, 100);
+	EXPECT_EQ(spans[0].num_samples, 28);
+	EXPECT_EQ(spans[1].num_samples, 128);
+	EXPECT_EQ(spans[2].num_samples, 44);
+	EXPECT_EQ(m_reader.view(9990, 100, spans), 10);
+	EXPECT_EQ(m_reader.view(10001, 1, spans), -EINVAL);
+
+	uint64_t count = 0;
+	m_reader.view(0, m_reader.samples(), spans);
+	for (const CaptureSpan& span: spans) {
+		for (uint64_t i = 0; i < span.num_samples; i++) {
+			EXPECT_NEAR(span.at(i, 0)[0], 1, 0.001) << "failed at sample: " << span.first_sample + i;
+			EXPECT_NEAR(span.at(i, 1)[0], 2, 0.001) << "failed at sample: " << span.first_sample + i;
+		}
+		count += span.num_samples;
+	}
+	EXPECT_EQ(count, 10000);
+}
+
+TEST_F(CaptureTest, continuous) {
+	ASSERT_EQ(m_session->add_virtual(16, m_config), 16);
+	ASSERT_EQ(m_session->start_capture(m_path), 0);
+	m_session->start(0);
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	m_session->end();
+	int64_t samples = m_session->stop_capture();
+	EXPECT_GT(samples, 0);
+
+	ASSERT_EQ(m_reader.open(m_path), 0);
+	EXPECT_EQ(m_reader.samples(), samples);
+	EXPECT_EQ(m_reader.devices().size(), 16);
+}
+
+TEST_F(CaptureTest, errors) {
+	EXPECT_EQ(m_session->start_capture(m_path), -ENODEV);
+	ASSERT_EQ(m_session->add_virtual(1, m_config), 1);
+	EXPECT_EQ(m_session->start_capture("nonexistent/test.smucap"), -ENOENT);
+	EXPECT_EQ(m_session->stop_capture(), 0);
+}
+
+TEST_F(CaptureTest, index) {
+	ASSERT_EQ(m_session->add_virtual(1, m_config), 1);
+	Device* dev = *(m_session->m_devices.begin());
+	std::vector<float> buf;
+	for (unsigned i = 0; i < 512; i++)
+		buf.push_back(i < 256 ? 1 : 3);
+	dev->set_mode(0, SVMI);
+	dev->write(buf, 0, true);
+
+	// 256 samples per block
+	ASSERT_EQ(m_session->start_capture(m_path, 4096), 0);
+	m_session->run(2048);
+	EXPECT_EQ(m_session->stop_capture(), 2048);
+
+	ASSERT_EQ(m_reader.open(m_path), 0);
+	ASSERT_TRUE(m_reader.complete());
+	ASSERT_EQ(m_reader.blocks(), 8);
+	std::vector<CaptureStats> stats;
+	float min = INFINITY, max = -INFINITY;
+	for (uint64_t block = 0; block < m_reader.blocks(); block++) {
+		ASSERT_EQ(m_reader.stats(block, stats), 0);
+		ASSERT_EQ(stats.size(), 4);
+		EXPECT_LE(stats[0].min, stats[0].mean);
+		EXPECT_GE(stats[0].max, stats[0].mean);
+		min = std::min(min, stats[0].min);
+		max = std::max(max, stats[0].max);
+	}
+	EXPECT_NEAR(min, 1, 0.001);
+	EXPECT_NEAR(max, 3, 0.001);
+	EXPECT_EQ(m_reader.stats(8, stats), -EINVAL);
+
+	// the index matches statistics computed from the samples
+	std::vector<CaptureSpan> spans;
+	m_reader.view(256, 256, spans);
+	double sum = 0;
+	for (uint64_t i = 0; i < spans[0].num_samples; i++)
+		sum += spans[0].at(i, 0)[0];
+	m_reader.stats(1, stats);
+	EXPECT_NEAR(stats[0].mean, sum / 256, 0.001);
+}
+
+TEST_F(CaptureTest, summary) {
+	ASSERT_EQ(m_session->add_virtual(2, m_config), 2);
+	Device* dev = *(m_session->m_devices.begin());
+	std::vector<float> buf;
+	for (unsigned i = 0; i < 512; i++)
+		buf.push_back(i < 256 ? 1 : 3);
+	dev->set_mode(0, SVMI);
+	dev->write(buf, 0, true);
+
+	ASSERT_EQ(m_session->start_capture(m_path, 4096), 0);
+	m_session->run(16384);
+	EXPECT_EQ(m_session->stop_capture(), 16384);
+	ASSERT_EQ(m_reader.open(m_path), 0);
+
+	// each pixel spans whole periods of the written waveform
+	std::vector<SignalStats> stats;
+	EXPECT_EQ(m_reader.summary(0, 0, 0, 16384, 8, stats), 2048);
+	ASSERT_EQ(stats.size(), 8);
+	for (const SignalStats& stat: stats) {
+		EXPECT_NEAR(stat.min, 1, 0.001);
+		EXPECT_NEAR(stat.max, 3, 0.001);
+		EXPECT_NEAR(stat.mean, 2, 0.01);
+	}
+
+	// pixels match statistics computed from the samples
+	EXPECT_EQ(m_reader.summary(0, 0, 0, 16384, 64, stats), 256);
+	ASSERT_EQ(stats.size(), 64);
+	std::vector<CaptureSpan> spans;
+	m_reader.view(1280, 256, spans);
+	float min = INFINITY, max = -INFINITY;
+	double sum = 0;
+	for (const CaptureSpan& span: spans) {
+		for (uint64_t i = 0; i < span.num_samples; i++) {
+			float v = span.at(i, 0)[0];
+			min = std::min(min, v);
+			max = std::max(max, v);
+			sum += v;
+		}
+	}
+	EXPECT_EQ(stats[5].min, min);
+	EXPECT_EQ(stats[5].max, max);
+	EXPECT_NEAR(stats[5].mean, sum / 256, 0.0001);
+
+	// pixels finer than a block are computed from the samples
+	EXPECT_EQ(m_reader.summary(0, 0, 256, 320, 4, stats), 16);
+	ASSERT_EQ(stats.size(), 4);
+	for (unsigned p = 0; p < stats.size(); p++) {
+		m_reader.view(256 + p * 16, 16, spans);
+		min = INFINITY, max = -INFINITY, sum = 0;
+		for (uint64_t i = 0; i < spans[0].num_samples; i++) {
+			float v = spans[0].at(i, 0)[0];
+			min = std::min(min, v);
+			max = std::max(max, v);
+			sum += v;
+		}
+		EXPECT_EQ(stats[p].min, min);
+		EXPECT_EQ(stats[p].max, max);
+		EXPECT_NEAR(stats[p].mean, sum / 16, 0.0001);
+	}
+
+	EXPECT_EQ(m_reader.summary(2, 0, 0, 16384, 8, stats), -EINVAL);
+	EXPECT_EQ(m_reader.summary(1, 0, 16384, 16400, 8, stats), -ERANGE);
+}
+
+TEST_F(CaptureTest, concurrent_read) {
+	ASSERT_EQ(m_session->add_virtual(2, m_config), 2);
+	ASSERT_EQ(m_session->start_capture(m_path, 4096), 0);
+	ASSERT_EQ(m_reader.open(m_path), 0);
+	EXPECT_FALSE(m_reader.complete());
+
+	// the reader follows the capture as blocks are written
+	m_session->start(0);
+	uint64_t samples = 0;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (samples < 10000 && std::chrono::steady_clock::now() < deadline) {
+		ASSERT_EQ(m_reader.refresh(), 0);
+		EXPECT_GE(m_reader.samples(), samples);
+		samples = m_reader.samples();
+		EXPECT_EQ(samples % m_reader.header().frames_per_block, 0);
+		std::vector<CaptureStats> stats;
+		if (m_reader.blocks()) {
+			EXPECT_EQ(m_reader.stats(m_reader.blocks() - 1, stats), 0);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	EXPECT_GE(samples, 10000);
+	std::vector<SignalStats> partial;
+	int64_t width = m_reader.summary(1, 0, 0, samples, 4, partial);
+	EXPECT_GT(width, 0);
+	m_session->end();
+
+	int64_t total = m_session->stop_capture();
+	ASSERT_EQ(m_reader.refresh(), 0);
+	EXPECT_TRUE(m_reader.complete());
+	EXPECT_EQ(m_reader.samples(), total);
+
+	// summaries computed before the index was written match it
+	std::vector<SignalStats> indexed;
+	EXPECT_EQ(m_reader.summary(1, 0, 0, samples, 4, indexed), width);
+	ASSERT_EQ(indexed.size(), partial.size());
+	for (size_t p = 0; p < indexed.size(); p++) {
+		EXPECT_EQ(indexed[p].min, partial[p].min);
+		EXPECT_EQ(indexed[p].max, partial[p].max);
+		EXPECT_FLOAT_EQ(indexed[p].mean, partial[p].mean);
+	}
+}
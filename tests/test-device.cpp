@@ -24,6 +24,25 @@ TEST_F(DeviceTest, hwver) {
 	ASSERT_NE(m_dev->m_hwver, "");
 }
 
+// Verify per-device queue sizes and the session memory budget.
+TEST_F(DeviceTest, queue_size) {
+	size_t default_mem = m_dev->queue_memory();
+	EXPECT_GT(default_mem, 0);
+
+	// explicitly sized queues are applied on configure
+	EXPECT_EQ(m_dev->set_queue_size(200000, 50000), 0);
+	EXPECT_GT(m_session->configure(), 0);
+	EXPECT_GT(m_dev->queue_memory(), default_mem);
+	EXPECT_EQ(m_session->queue_memory(), m_dev->queue_memory());
+
+	// session sized queues shrink to fit the budget
+	EXPECT_EQ(m_dev->set_queue_size(), 0);
+	m_session->m_queue_time = 1;
+	m_session->m_queue_memory_budget = 1 << 20;
+	EXPECT_GT(m_session->configure(), 0);
+	EXPECT_LE(m_session->queue_memory(), m_session->m_queue_memory_budget);
+}
+
 int main(int argc, char **argv) {
 	::testing::InitGoogleTest(&argc, argv);
 	return RUN_ALL_TESTS();
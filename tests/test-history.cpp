@@ -0,0 +1,144 @@
+// Tests for the compressed sample history, these use virtual devices.
+
+#include <gtest/gtest.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <array>
+#include <fstream>
+#include <vector>
+
+#include "fixtures.hpp"
+#include <libsmu/libsmu.hpp>
+
+using namespace smu;
+
+// Create a session with a virtual device producing samples as fast as possible.
+class HistoryTest : public SessionFixture {
+	protected:
+		Device* m_dev;
+		VirtualConfig m_config;
+		std::vector<std::array<float, 4>> rxbuf;
+		std::vector<std::array<float, 4>> history;
+
+		virtual void SetUp() {
+			SessionFixture::SetUp();
+			m_config.realtime = false;
+			m_config.load = VIRTUAL_RC;
+			if (m_session->add_virtual(1, m_config) != 1)
+				FAIL() << "failed adding virtual device";
+			m_dev = *(m_session->m_devices.begin());
+		}
+};
+
+TEST_F(HistoryTest, disabled) {
+	uint64_t first, end;
+	EXPECT_EQ(m_dev->read_history(history, 0, 1), -ENODATA);
+	EXPECT_EQ(m_dev->history_range(first, end), -ENODATA);
+	EXPECT_EQ(m_dev->history_memory(), 0);
+}
+
+TEST_F(HistoryTest, lossless) {
+	ASSERT_EQ(m_dev->set_history(1 << 20), 0);
+	m_dev->set_mode(0, SVMI);
+	m_dev->set_mode(1, SIMV);
+
+	// a charging RC load gives slowly varying signals on channel A
+	std::vector<float> a_txbuf;
+	for (unsigned i = 0; i < 20000; i++)
+		a_txbuf.push_back((i / 2000) % 2 ? 4.5 : 0.5);
+	std::vector<float> b_txbuf(20000, 0.001);
+	m_dev->write(a_txbuf, 0);
+	m_dev->write(b_txbuf, 1);
+	m_session->run(20000);
+	EXPECT_EQ(m_dev->read(rxbuf, 20000, -1), 20000);
+
+	uint64_t first, end;
+	ASSERT_EQ(m_dev->history_range(first, end), 0);
+	EXPECT_EQ(first, 0);
+	EXPECT_EQ(end, 20000);
+
+	// samples are restored exactly as they were read
+	EXPECT_EQ(m_dev->read_history(history, 0, 20000), 20000);
+	for (unsigned i = 0; i < history.size(); i++)
+		ASSERT_EQ(history[i], rxbuf[i]) << "failed at sample: " << i;
+
+	// random access spanning compressed chunks and staged samples
+	EXPECT_EQ(m_dev->read_history(history, 4000, 16000), 16000);
+	EXPECT_EQ(history[0], rxbuf[4000]);
+	EXPECT_EQ(history[15999], rxbuf[19999]);
+	EXPECT_EQ(m_dev->read_history(history, 19990, 100), 10);
+	EXPECT_EQ(m_dev->read_history(history, 20000, 1), -ERANGE);
+
+	// far smaller than the raw codes
+	EXPECT_LT(m_dev->history_memory(), 20000 * 8 / 2);
+}
+
+TEST_F(HistoryTest, current_gain) {
+	// channel A current measurements get a positive gain of 2 and a
+	// negative gain of 1, all other signals are left uncalibrated
+	const char* path = "test-history-cal.txt";
+	std::ofstream cal(path);
+	for (unsigned rec = 0; rec < 8; rec++) {
+		cal << "</>\n";
+		if (rec == 1)
+			cal << "<0, 0>\n<0.1, 0.05>\n<-0.1, -0.1>\n";
+		else
+			cal << "<0, 0>\n<1, 1>\n<-1, -1>\n";
+		cal << "<\\>\n";
+	}
+	cal.close();
+	ASSERT_EQ(m_dev->write_calibration(path), 0);
+	std::remove(path);
+
+	// The gain of a current sample depends on the sign of the previous
+	// sample of its transfer. Crossing zero every few samples with a period
+	// that doesn't divide the transfer size makes the samples at transfer
+	// boundaries and read starts sensitive to it.
+	ASSERT_EQ(m_dev->set_history(1 << 20), 0);
+	m_dev->set_mode(0, SIMV);
+	std::vector<float> a_txbuf;
+	for (unsigned i = 0; i < 20000; i++)
+		a_txbuf.push_back(i % 3 == 2 ? -0.05 : 0.05);
+	m_dev->write(a_txbuf, 0);
+	m_session->run(20000);
+	EXPECT_EQ(m_dev->read(rxbuf, 20000, -1), 20000);
+
+	// reads starting anywhere within a transfer decode as received
+	for (uint64_t start: {0, 1, 255, 1023, 4095, 4097, 12345, 19999}) {
+		ASSERT_EQ(m_dev->read_history(history, start, 20000 - start), 20000 - start);
+		for (unsigned i = 0; i < history.size(); i++)
+			ASSERT_EQ(history[i], rxbuf[start + i]) << "start: " << start << ", sample: " << i;
+	}
+}
+
+TEST_F(HistoryTest, retention) {
+	ASSERT_EQ(m_dev->set_history(4096), 0);
+	m_dev->set_mode(0, SVMI);
+	std::vector<float> a_txbuf(1000, 2);
+	m_dev->write(a_txbuf, 0, true);
+
+	m_session->start(0);
+	uint64_t count = 0;
+	while (count < 200000) {
+		ASSERT_EQ(m_dev->read(rxbuf, 1000, -1), 1000);
+		count += 1000;
+	}
+	m_session->end();
+
+	// the oldest samples are dropped once the budget is exceeded
+	uint64_t first, end;
+	ASSERT_EQ(m_dev->history_range(first, end), 0);
+	EXPECT_GT(first, 0);
+	EXPECT_GE(end, 200000);
+	EXPECT_EQ(m_dev->read_history(history, 0, 1), -ERANGE);
+	EXPECT_LE(m_dev->history_memory(), 4096 + 4096 * 8);
+
+	EXPECT_EQ(m_dev->read_history(history, end - 1000, 1000), 1000);
+	for (unsigned i = 0; i < history.size(); i++)
+		EXPECT_NEAR(history[i][0], 2, 0.001) << "failed at sample: " << i;
+
+	// disabling the history discards it
+	EXPECT_EQ(m_dev->set_history(0), 0);
+	EXPECT_EQ(m_dev->history_range(first, end), -ENODATA);
+}
@@ -71,6 +71,32 @@ TEST_F(MultiReadTest, continuous) {
 	}
 }
 
+TEST_F(MultiReadTest, session_frames) {
+	std::vector<std::vector<std::array<float, 4>>> frames;
+	std::vector<float> buf;
+
+	// Run session in continuous mode.
+	m_session->start(0);
+
+	// Grab 1000 aligned samples from every device in a blocking fashion.
+	EXPECT_EQ(m_session->read(frames, 1000, -1), 1000);
+	EXPECT_EQ(frames.size(), m_devices.size());
+	for (auto dev_frames: frames)
+		EXPECT_EQ(dev_frames.size(), 1000);
+
+	// Devices read at different rates get realigned.
+	std::vector<std::array<float, 4>> rxbuf;
+	(*m_devices.begin())->read(rxbuf, 500, -1);
+	EXPECT_EQ(m_session->read(frames, 1000, -1), 1000);
+	for (auto dev_frames: frames)
+		EXPECT_EQ(dev_frames.size(), 1000);
+
+	// Flat tensor layout holds four signals for every device sample.
+	EXPECT_EQ(m_session->read(buf, 1000, -1, FRAME_TENSOR), 1000);
+	EXPECT_EQ(buf.size(), m_devices.size() * 4 * 1000);
+
+	m_session->end();
+}
 
 int main(int argc, char **argv) {
 	::testing::InitGoogleTest(&argc, argv);
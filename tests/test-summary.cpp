@@ -0,0 +1,192 @@
+// Tests for multi-resolution sample summaries.
+
+#include <gtest/gtest.h>
+
+#include <cerrno>
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#include "fixtures.hpp"
+#include <libsmu/libsmu.hpp>
+#include <libsmu/pyramid.hpp>
+
+using namespace smu;
+
+// Compute the statistics of a signal over a range of samples.
+static SignalStats brute_stats(const std::vector<std::array<float, 4>>& frames,
+	unsigned signal, uint64_t start, uint64_t end)
+{
+	SignalStats stats = {INFINITY, -INFINITY, 0};
+	double sum = 0;
+	for (uint64_t i = start; i < end; i++) {
+		stats.min = std::min(stats.min, frames[i][signal]);
+		stats.max = std::max(stats.max, frames[i][signal]);
+		sum += frames[i][signal];
+	}
+	stats.mean = sum / (end - start);
+	return stats;
+}
+
+class PyramidTest : public testing::Test {
+	protected:
+		std::vector<std::array<float, 4>> m_frames;
+
+		virtual void SetUp() {
+			// deterministic pseudo-random signals with a slow trend
+			uint32_t state = 1;
+			for (unsigned i = 0; i < 1 << 18; i++) {
+				std::array<float, 4> frame;
+				for (unsigned s = 0; s < 4; s++) {
+					state = state * 1103515245 + 12345;
+					frame[s] = (state >> 16) / 65536.0f + s * std::sin(i / 10000.0f);
+				}
+				m_frames.push_back(frame);
+			}
+		}
+};
+
+TEST_F(PyramidTest, query) {
+	Pyramid pyramid;
+	// append in uneven pieces
+	for (size_t i = 0; i < m_frames.size(); i += 1000)
+		pyramid.append(m_frames.data() + i, std::min<size_t>(1000, m_frames.size() - i));
+	EXPECT_EQ(pyramid.samples(), m_frames.size());
+
+	uint64_t first, end;
+	pyramid.range(first, end);
+	EXPECT_EQ(first, 0);
+	EXPECT_EQ(end, m_frames.size());
+
+	// pixel boundaries aligned to level 0 bins match brute force statistics
+	std::vector<SignalStats> stats;
+	const uint64_t ranges[][3] = {
+		{0, 1 << 18, 100}, {16, 4096, 7}, {48000, 48000 + 16 * 1000, 1000}, {160, 240000, 33},
+	};
+	for (const auto& range: ranges) {
+		for (unsigned s = 0; s < 4; s++) {
+			int64_t width = pyramid.query(s, range[0], range[1], range[2], stats);
+			ASSERT_GT(width, 0);
+			ASSERT_LE(stats.size(), range[2]);
+			for (uint64_t p = 0; p < stats.size(); p++) {
+				uint64_t a = range[0] + p * width;
+				uint64_t b = std::min<uint64_t>(a + width, range[1]);
+				SignalStats expected = brute_stats(m_frames, s, a, b);
+				ASSERT_EQ(stats[p].min, expected.min) << "pixel " << p;
+				ASSERT_EQ(stats[p].max, expected.max) << "pixel " << p;
+				ASSERT_NEAR(stats[p].mean, expected.mean, 0.0001) << "pixel " << p;
+			}
+		}
+	}
+
+	// ranges finer than level 0 bins return fewer pixels
+	EXPECT_EQ(pyramid.query(0, 0, 64, 64, stats), 16);
+	EXPECT_EQ(stats.size(), 4);
+
+	EXPECT_EQ(pyramid.query(4, 0, 64, 64, stats), -EINVAL);
+	EXPECT_EQ(pyramid.query(0, 0, 64, 0, stats), -EINVAL);
+	EXPECT_EQ(pyramid.query(0, 1 << 18, 1 << 19, 8, stats), -ERANGE);
+}
+
+TEST_F(PyramidTest, retention) {
+	Pyramid pyramid(64);
+	pyramid.append(m_frames.data(), m_frames.size());
+
+	// level 0 only holds the most recent samples
+	uint64_t first, end;
+	pyramid.range(first, end);
+	EXPECT_EQ(end, m_frames.size());
+	EXPECT_EQ(first, 0);
+
+	// recent samples are summarized exactly
+	std::vector<SignalStats> stats;
+	uint64_t start = end - 64 * 16;
+	EXPECT_EQ(pyramid.query(0, start, end, 4, stats), 256);
+	SignalStats expected = brute_stats(m_frames, 0, start, start + 256);
+	EXPECT_EQ(stats[0].min, expected.min);
+	EXPECT_EQ(stats[0].max, expected.max);
+
+	// older ones from coarser bins, still bounding all samples
+	EXPECT_GT(pyramid.query(1, 0, end, 100, stats), 0);
+	expected = brute_stats(m_frames, 1, 0, end);
+	float min = INFINITY, max = -INFINITY;
+	for (const SignalStats& stat: stats) {
+		min = std::min(min, stat.min);
+		max = std::max(max, stat.max);
+	}
+	EXPECT_EQ(min, expected.min);
+	EXPECT_EQ(max, expected.max);
+
+	pyramid.clear();
+	EXPECT_EQ(pyramid.samples(), 0);
+	EXPECT_EQ(pyramid.query(0, 0, 16, 1, stats), -ERANGE);
+}
+
+// Summaries of streaming virtual devices.
+class SummaryTest : public SessionFixture {
+	protected:
+		Device* m_dev;
+		VirtualConfig m_config;
+
+		virtual void SetUp() {
+			SessionFixture::SetUp();
+			m_config.realtime = false;
+			if (m_session->add_virtual(1, m_config) != 1)
+				FAIL() << "failed adding virtual device";
+			m_dev = *(m_session->m_devices.begin());
+		}
+};
+
+TEST_F(SummaryTest, device) {
+	std::vector<SignalStats> stats;
+	uint64_t first, end;
+	EXPECT_EQ(m_dev->read_summary(0, 0, 16, 1, stats), -ENODATA);
+	EXPECT_EQ(m_dev->summary_range(first, end), -ENODATA);
+
+	ASSERT_EQ(m_dev->set_summary(1024), 0);
+	m_dev->set_mode(0, SVMI);
+	std::vector<float> a_txbuf;
+	for (unsigned i = 0; i < 1000; i++)
+		a_txbuf.push_back(i < 500 ? 1 : 4);
+	m_dev->write(a_txbuf, 0, true);
+	m_session->run(50000);
+
+	std::vector<std::array<float, 4>> rxbuf;
+	EXPECT_EQ(m_dev->read(rxbuf, 50000, -1), 50000);
+	ASSERT_EQ(m_dev->summary_range(first, end), 0);
+	EXPECT_EQ(first, 0);
+	EXPECT_EQ(end, 50000 / 16 * 16);
+
+	// the summary matches the samples read where level 0 bins are held
+	int64_t width = m_dev->read_summary(0, 0, end, 10, stats);
+	EXPECT_EQ(width, (end / 16 + 9) / 10 * 16);
+	ASSERT_EQ(stats.size(), 10);
+	SignalStats expected = brute_stats(rxbuf, 0, 9 * width, end);
+	EXPECT_EQ(stats[9].min, expected.min);
+	EXPECT_EQ(stats[9].max, expected.max);
+	EXPECT_NEAR(stats[9].mean, expected.mean, 0.0001);
+	EXPECT_NEAR(stats[0].min, 1, 0.01);
+	EXPECT_NEAR(stats[0].max, 4, 0.01);
+}
+
+TEST_F(SummaryTest, concurrent_queries) {
+	ASSERT_EQ(m_dev->set_summary(1024), 0);
+	// samples aren't read, all of them are summarized regardless
+	m_session->m_dataflow_exceptions = false;
+	m_session->start(200000);
+
+	// queries racing with the completions don't lose any samples
+	std::vector<SignalStats> stats;
+	uint64_t first, end = 0;
+	while (end < 100000) {
+		ASSERT_EQ(m_dev->summary_range(first, end), 0);
+		if (end) {
+			EXPECT_GT(m_dev->read_summary(0, first, end, 1000, stats), 0);
+		}
+	}
+	EXPECT_EQ(m_session->end(), 0);
+
+	ASSERT_EQ(m_dev->summary_range(first, end), 0);
+	EXPECT_EQ(end, 200000 / 16 * 16);
+}
@@ -0,0 +1,887 @@
+// Tests for virtual devices, these don't require hardware.
+
+#include <gtest/gtest.h>
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "fixtures.hpp"
+#include <libsmu/libsmu.hpp>
+
+using namespace smu;
+
+// Create a session with a virtual device producing samples as fast as possible.
+class VirtualDeviceTest : public SessionFixture {
+	protected:
+		Device* m_dev;
+		VirtualConfig m_config;
+		std::vector<std::array<float, 4>> rxbuf;
+		std::vector<float> a_txbuf;
+		std::vector<float> b_txbuf;
+
+		virtual void SetUp() {
+			SessionFixture::SetUp();
+			m_config.realtime = false;
+		}
+
+		void add_device() {
+			if (m_session->add_virtual(1, m_config) != 1)
+				FAIL() << "failed adding virtual device";
+			m_dev = *(m_session->m_devices.begin());
+		}
+};
+
+TEST_F(VirtualDeviceTest, info) {
+	add_device();
+	EXPECT_EQ(m_dev->m_fwver, "2.17");
+	EXPECT_EQ(m_dev->m_hwver, "F");
+
+	// virtual devices stay available across scans
+	m_session->scan();
+	ASSERT_EQ(m_session->available_devices().size(), 1);
+	EXPECT_EQ(m_session->available_devices()[0], m_dev);
+}
+
+TEST_F(VirtualDeviceTest, hotplug) {
+	add_device();
+	std::mutex lock;
+	std::vector<Device*> attached, detached;
+	m_session->hotplug_attach([&](Device* dev) {
+		std::lock_guard<std::mutex> guard(lock);
+		attached.push_back(dev);
+	});
+	m_session->hotplug_detach([&](Device* dev) {
+		std::lock_guard<std::mutex> guard(lock);
+		detached.push_back(dev);
+	});
+
+	// wait for the callbacks run on the session executor
+	auto wait_for = [&](std::vector<Device*>& events) {
+		for (unsigned i = 0; i < 1000; i++) {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (!events.empty())
+					return;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	};
+
+	// readers see consistent copies while hotplug events update the list
+	std::atomic<bool> done{false};
+	std::thread reader([&]() {
+		while (!done) {
+			for (Device* dev: m_session->available_devices())
+				ASSERT_EQ(dev, m_dev);
+		}
+	});
+
+	m_session->device_detached(m_dev);
+	wait_for(detached);
+	EXPECT_EQ(m_session->available_devices().size(), 0);
+	m_session->device_attached(m_dev);
+	wait_for(attached);
+	ASSERT_EQ(m_session->available_devices().size(), 1);
+	EXPECT_EQ(m_session->available_devices()[0], m_dev);
+
+	done = true;
+	reader.join();
+	std::lock_guard<std::mutex> guard(lock);
+	ASSERT_EQ(detached.size(), 1);
+	EXPECT_EQ(detached[0], m_dev);
+	ASSERT_EQ(attached.size(), 1);
+	EXPECT_EQ(attached[0], m_dev);
+}
+
+TEST_F(VirtualDeviceTest, hotplug_configure) {
+	add_device();
+	auto events = std::make_shared<std::atomic<unsigned>>(0);
+	m_session->hotplug_attach([=](Device*) { (*events)++; });
+	m_session->hotplug_detach([=](Device*) { (*events)++; });
+
+	// hotplug events keep arriving while configure() resizes the executor
+	std::atomic<bool> done{false};
+	unsigned submitted = 0;
+	std::thread hotplug([&]() {
+		while (!done) {
+			m_session->device_detached(m_dev);
+			m_session->device_attached(m_dev);
+			submitted += 2;
+		}
+	});
+	for (unsigned i = 0; i < 50; i++) {
+		m_session->m_executor_threads = i % 2 + 1;
+		EXPECT_GT(m_session->configure(0), 0);
+	}
+	done = true;
+	hotplug.join();
+
+	for (unsigned i = 0; i < 5000 && *events < submitted; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	EXPECT_EQ(*events, submitted);
+	EXPECT_EQ(m_session->available_devices().size(), 1);
+}
+
+TEST_F(VirtualDeviceTest, loopback) {
+	add_device();
+	m_dev->set_mode(0, SVMI);
+	m_dev->set_mode(1, SIMV);
+
+	a_txbuf.assign(1000, 2);
+	b_txbuf.assign(1000, 0.1);
+	m_dev->write(a_txbuf, 0);
+	m_dev->write(b_txbuf, 1);
+	m_session->run(1000);
+	EXPECT_EQ(m_dev->read(rxbuf, 1000, -1), 1000);
+
+	for (unsigned i = 0; i < rxbuf.size(); i++) {
+		EXPECT_NEAR(rxbuf[i][0], 2, 0.001) << "failed at sample: " << i;
+		EXPECT_NEAR(rxbuf[i][1], 0, 0.001) << "failed at sample: " << i;
+		EXPECT_NEAR(rxbuf[i][3], 0.1, 0.001) << "failed at sample: " << i;
+	}
+}
+
+TEST_F(VirtualDeviceTest, legacy_firmware) {
+	// firmware versions older than 2.00 use the planar packet format
+	m_config.fwver = "1.02";
+	add_device();
+	m_dev->set_mode(0, SVMI);
+	m_dev->set_mode(1, SVMI);
+
+	a_txbuf.assign(1000, 1);
+	b_txbuf.assign(1000, 3);
+	m_dev->write(a_txbuf, 0);
+	m_dev->write(b_txbuf, 1);
+	m_session->run(1000);
+	EXPECT_EQ(m_dev->read(rxbuf, 1000, -1), 1000);
+
+	for (unsigned i = 0; i < rxbuf.size(); i++) {
+		EXPECT_NEAR(rxbuf[i][0], 1, 0.001) << "failed at sample: " << i;
+		EXPECT_NEAR(rxbuf[i][2], 3, 0.001) << "failed at sample: " << i;
+	}
+}
+
+TEST_F(VirtualDeviceTest, rc_load) {
+	// 1 ms time constant, 100 samples at the default rate
+	m_config.load = VIRTUAL_RC;
+	m_config.resistance = 1000;
+	m_config.capacitance = 1e-6;
+	add_device();
+	m_dev->set_mode(0, SVMI);
+
+	a_txbuf.assign(2000, 5);
+	m_dev->write(a_txbuf, 0);
+	m_session->run(2000);
+	EXPECT_EQ(m_dev->read(rxbuf, 2000, -1), 2000);
+
+	// the capacitor charges from 0V, drawing 5 mA at first
+	EXPECT_NEAR(rxbuf[0][1], 0.005, 0.0002);
+	EXPECT_NEAR(rxbuf[100][1], 0.005 * std::exp(-1), 0.0002);
+	EXPECT_NEAR(rxbuf[1999][1], 0, 0.0002);
+}
+
+TEST_F(VirtualDeviceTest, continuous) {
+	add_device();
+	m_dev->set_mode(0, SVMI);
+	a_txbuf.assign(1024, 4);
+	m_dev->write(a_txbuf, 0, true);
+
+	m_session->start(0);
+	uint64_t sample_count = 0;
+	while (sample_count < 100000) {
+		ssize_t ret = m_dev->read(rxbuf, 1000, -1);
+		ASSERT_EQ(ret, 1000);
+		for (unsigned i = 0; i < rxbuf.size(); i++)
+			EXPECT_NEAR(rxbuf[i][0], 4, 0.001) << "failed at sample: " << sample_count + i;
+		sample_count += ret;
+	}
+	m_session->end();
+}
+
+TEST_F(VirtualDeviceTest, read_before_write) {
+	add_device();
+	m_dev->set_mode(0, SVMI);
+	m_dev->set_mode(1, SVMI);
+	m_session->start(0);
+
+	// samples arrive before anything is written to the source channels
+	EXPECT_EQ(m_dev->read(rxbuf, 1000, 500), 1000);
+
+	a_txbuf.assign(1024, 3);
+	m_dev->write(a_txbuf, 0, true);
+	m_dev->write(a_txbuf, 1, true);
+	uint64_t sample_count = 0;
+	while (sample_count < 100000) {
+		ssize_t ret = m_dev->read(rxbuf, 1000, 1000);
+		ASSERT_EQ(ret, 1000);
+		sample_count += ret;
+	}
+	EXPECT_NEAR(rxbuf.back()[0], 3, 0.001);
+	EXPECT_NEAR(rxbuf.back()[2], 3, 0.001);
+	m_session->end();
+}
+
+TEST_F(VirtualDeviceTest, unwritten_devices) {
+	// more source devices waiting for samples than executor threads
+	m_session->m_dataflow_exceptions = false;
+	ASSERT_EQ(m_session->add_virtual(6, m_config), 6);
+	for (Device* dev: m_session->m_devices)
+		dev->set_mode(0, SVMI);
+	m_session->start(0);
+
+	// every device keeps receiving samples
+	for (Device* dev: m_session->m_devices)
+		EXPECT_EQ(dev->read(rxbuf, 1000, 1000), 1000);
+	m_session->end();
+}
+
+TEST_F(VirtualDeviceTest, unlocked_completion) {
+	add_device();
+	m_dev->set_mode(0, SVMI);
+	a_txbuf.assign(1024, 2);
+	m_dev->write(a_txbuf, 0, true);
+	m_session->start(0);
+
+	// holding the device lock doesn't stall transfers
+	m_dev->lock();
+	EXPECT_EQ(m_dev->read(rxbuf, 10000, 1000), 10000);
+	m_dev->unlock();
+
+	// flushing while streaming drops the queued samples
+	m_session->flush();
+	a_txbuf.assign(1024, 4);
+	m_dev->write(a_txbuf, 0, true);
+	uint64_t sample_count = 0;
+	while (sample_count < 100000) {
+		ssize_t ret = m_dev->read(rxbuf, 1000, -1);
+		ASSERT_EQ(ret, 1000);
+		sample_count += ret;
+	}
+	EXPECT_NEAR(rxbuf.back()[0], 4, 0.001);
+	m_session->end();
+}
+
+TEST_F(VirtualDeviceTest, events) {
+	add_device();
+	DeviceEvent event;
+	EXPECT_FALSE(m_dev->poll_event(event));
+
+	// not reading from a small queue overflows it
+	m_session->m_dataflow_exceptions = false;
+	EXPECT_EQ(m_dev->set_queue_size(10000, 0), 0);
+	EXPECT_GT(m_session->configure(0), 0);
+	m_session->start(0);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	EXPECT_NO_THROW(m_dev->read(rxbuf, 1000, -1));
+
+	ASSERT_TRUE(m_dev->poll_event(event));
+	EXPECT_EQ(event.kind, EVENT_OVERFLOW);
+	EXPECT_EQ(event.device, m_dev);
+	EXPECT_EQ(event.channel, -1);
+	EXPECT_GE(event.sample, 10000);
+	EXPECT_GT(event.count, 0);
+	EXPECT_EQ(event.error, -EBUSY);
+
+	// subscribed events are passed to the callback instead
+	// (callbacks queued on the executor may outlive the test body)
+	auto overflows = std::make_shared<std::atomic<unsigned>>(0);
+	Device* dev = m_dev;
+	m_dev->set_event_callback([=](const DeviceEvent& e) {
+		if (e.kind == EVENT_OVERFLOW && e.device == dev)
+			(*overflows)++;
+	});
+	auto clk_start = std::chrono::high_resolution_clock::now();
+	while (!*overflows) {
+		auto clk_diff = std::chrono::high_resolution_clock::now() - clk_start;
+		ASSERT_LT(clk_diff, std::chrono::seconds(5));
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	m_session->end();
+	m_dev->set_event_callback(nullptr);
+
+	// overflows are thrown by default
+	m_session->m_dataflow_exceptions = true;
+	m_session->start(0);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	EXPECT_THROW(m_dev->read(rxbuf, 1000, -1), std::system_error);
+	m_session->end();
+}
+
+TEST_F(VirtualDeviceTest, event_callback) {
+	add_device();
+	m_session->m_dataflow_exceptions = false;
+	EXPECT_EQ(m_dev->set_queue_size(10000, 0), 0);
+	EXPECT_GT(m_session->configure(0), 0);
+
+	// events are delivered one at a time in the order they occurred
+	struct Events {
+		std::atomic<bool> running{false};
+		std::atomic<bool> overlapped{false};
+		std::atomic<bool> reordered{false};
+		std::atomic<unsigned> count{0};
+		uint64_t last = 0;
+	};
+	auto events = std::make_shared<Events>();
+	m_dev->set_event_callback([=](const DeviceEvent& e) {
+		if (events->running.exchange(true))
+			events->overlapped = true;
+		unsigned count = 0;
+		if (e.kind == EVENT_OVERFLOW) {
+			if (e.sample < events->last)
+				events->reordered = true;
+			events->last = e.sample;
+			count = ++events->count;
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+		events->running = false;
+		if (count == 5)
+			throw std::runtime_error("event callback failed");
+	});
+
+	// not reading from a small queue overflows it on every transfer
+	m_session->start(0);
+	auto clk_start = std::chrono::high_resolution_clock::now();
+	while (events->count < 20) {
+		auto clk_diff = std::chrono::high_resolution_clock::now() - clk_start;
+		ASSERT_LT(clk_diff, std::chrono::seconds(5));
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	m_dev->set_event_callback(nullptr);
+
+	// the exception thrown by the callback is passed on by end()
+	EXPECT_THROW(m_session->end(), std::runtime_error);
+	EXPECT_FALSE(events->overlapped);
+	EXPECT_FALSE(events->reordered);
+}
+
+TEST_F(VirtualDeviceTest, stats) {
+	add_device();
+	DataflowStats stats = m_dev->stats();
+	EXPECT_EQ(stats.transfers_submitted, 0);
+	EXPECT_EQ(stats.completion_interval.count, 0);
+
+	m_dev->set_mode(0, SVMI);
+	a_txbuf.assign(10000, 1);
+	m_dev->write(a_txbuf, 0);
+	m_session->run(10000);
+	EXPECT_EQ(m_dev->read(rxbuf, 10000, -1), 10000);
+
+	stats = m_dev->stats();
+	EXPECT_GT(stats.transfers_submitted, 0);
+	EXPECT_GE(stats.transfers_submitted, stats.transfers_completed);
+	EXPECT_GT(stats.bytes_in, 0);
+	EXPECT_GT(stats.bytes_out, 0);
+	EXPECT_GE(stats.samples_decoded, 10000);
+	EXPECT_GE(stats.samples_encoded, 10000);
+	EXPECT_EQ(stats.samples_dropped, 0);
+	EXPECT_GE(stats.in_queue_high_water, 10000);
+	EXPECT_GT(stats.out_queue_high_water, 0);
+	EXPECT_GT(stats.completion_interval.count, 0);
+	EXPECT_LE(stats.completion_interval.min, stats.completion_interval.mean);
+	EXPECT_LE(stats.completion_interval.mean, stats.completion_interval.max);
+	EXPECT_GT(stats.callback_duration.count, 0);
+
+	// a single device session reports the same counters
+	DataflowStats session_stats = m_session->stats();
+	EXPECT_EQ(session_stats.transfers_submitted, stats.transfers_submitted);
+	EXPECT_EQ(session_stats.samples_decoded, stats.samples_decoded);
+	EXPECT_EQ(session_stats.callback_duration.count, stats.callback_duration.count);
+
+	m_session->reset_stats();
+	stats = m_dev->stats();
+	EXPECT_EQ(stats.transfers_submitted, 0);
+	EXPECT_EQ(stats.in_queue_high_water, 0);
+	EXPECT_EQ(stats.callback_duration.count, 0);
+}
+
+TEST_F(VirtualDeviceTest, trace) {
+	const char* path = "test-virtual-trace.json";
+	add_device();
+	m_dev->set_mode(0, SVMI);
+	a_txbuf.assign(10000, 1);
+
+	// tracepoints can be compiled out
+	int ret = m_session->start_trace();
+	if (ret == -ENOSYS)
+		return;
+	ASSERT_EQ(ret, 0);
+	m_dev->write(a_txbuf, 0);
+	m_session->run(10000);
+	EXPECT_EQ(m_dev->read(rxbuf, 10000, -1), 10000);
+	int64_t events = m_session->stop_trace(path);
+	EXPECT_GT(events, 0);
+
+	std::ifstream file(path);
+	std::string trace((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	EXPECT_EQ(trace.find("{\"displayTimeUnit\""), 0);
+	for (const char* name: {"in_submit", "in_transfer", "decode", "encode", "out_transfer", "read", "write"})
+		EXPECT_NE(trace.find(std::string("\"name\":\"") + name + "\""), std::string::npos) << name;
+	std::remove(path);
+
+	// nothing is recorded once stopped
+	m_session->run(10000);
+	ASSERT_EQ(m_session->start_trace(), 0);
+	EXPECT_EQ(m_session->stop_trace(path), 0);
+	std::remove(path);
+}
+
+TEST_F(VirtualDeviceTest, profile) {
+	add_device();
+	// profiling can be compiled out
+	if (m_session->profile().empty())
+		return;
+
+	m_dev->set_mode(0, SVMI);
+	a_txbuf.assign(10000, 1);
+	m_dev->write(a_txbuf, 0);
+	m_session->m_completion_callback = [](unsigned) {};
+	m_session->run(10000);
+	EXPECT_EQ(m_dev->read(rxbuf, 10000, -1), 10000);
+	m_session->m_completion_callback = nullptr;
+
+	std::vector<StageProfile> profile = m_session->profile();
+	ASSERT_EQ(profile.size(), PROFILE_STAGES);
+	for (unsigned i = 0; i < PROFILE_STAGES; i++) {
+		const StageProfile& stage = profile[i];
+		EXPECT_EQ(stage.stage, i);
+		EXPECT_GT(stage.calls, 0) << stage.name;
+		EXPECT_GT(stage.transfers, 0) << stage.name;
+		EXPECT_GT(stage.per_transfer, 0) << stage.name;
+		EXPECT_EQ(stage.histogram.size(), 32);
+		uint64_t calls = 0;
+		for (uint64_t count: stage.histogram)
+			calls += count;
+		EXPECT_EQ(calls, stage.calls) << stage.name;
+	}
+	EXPECT_EQ(profile[PROFILE_DECODE].name, "decode");
+	EXPECT_GE(profile[PROFILE_DECODE].samples, 10000);
+	EXPECT_GT(profile[PROFILE_DECODE].per_sample, 0);
+	EXPECT_GE(profile[PROFILE_ENCODE].samples, 10000);
+	EXPECT_EQ(profile[PROFILE_QUEUE].samples, 10000);
+	EXPECT_EQ(profile[PROFILE_FEED].samples, 10000);
+
+	m_session->reset_profile();
+	for (const StageProfile& stage: m_session->profile()) {
+		EXPECT_EQ(stage.calls, 0);
+		EXPECT_EQ(stage.transfers, 0);
+	}
+}
+
+TEST_F(VirtualDeviceTest, logging) {
+	add_device();
+	struct Messages {
+		std::mutex lock;
+		std::vector<std::string> debug;
+	};
+	auto messages = std::make_shared<Messages>();
+	set_log_handler([=](LogLevel level, const char* message) {
+		std::lock_guard<std::mutex> lock(messages->lock);
+		if (level == LOG_LEVEL_DEBUG && !strncmp(message, "read:", 5))
+			messages->debug.push_back(message);
+	});
+	LogLevel level = log_level();
+
+	// reading from a stopped device waits for samples
+	set_log_level(LOG_LEVEL_NONE);
+	EXPECT_EQ(m_dev->read(rxbuf, 1000, 5), 0);
+	flush_log();
+	{
+		std::lock_guard<std::mutex> lock(messages->lock);
+		EXPECT_TRUE(messages->debug.empty());
+	}
+
+	set_log_level(LOG_LEVEL_DEBUG);
+	EXPECT_EQ(m_dev->read(rxbuf, 1000, 5), 0);
+	flush_log();
+	{
+		std::lock_guard<std::mutex> lock(messages->lock);
+		ASSERT_FALSE(messages->debug.empty());
+		EXPECT_EQ(messages->debug.front().find("read: waiting 5 ms for incoming samples"), 0);
+	}
+
+	set_log_level(level);
+	set_log_handler(nullptr);
+}
+
+TEST_F(VirtualDeviceTest, logging_threads) {
+	add_device();
+	auto count = std::make_shared<std::atomic<unsigned>>(0);
+	set_log_handler([=](LogLevel level, const char* message) {
+		if (!strncmp(message, "read:", 5))
+			(*count)++;
+	});
+	LogLevel level = log_level();
+	set_log_level(LOG_LEVEL_DEBUG);
+
+	// messages of exited threads are still handled, including the ones
+	// queued while the log thread was idle, each read logs at least once
+	for (unsigned i = 0; i < 100; i++) {
+		std::thread reader([&]() {
+			std::vector<std::array<float, 4>> buf;
+			m_dev->read(buf, 1000, 2);
+		});
+		reader.join();
+	}
+	flush_log();
+	unsigned handled = *count;
+	EXPECT_GE(handled, 100);
+
+	// nothing is left queued once flushed
+	flush_log();
+	EXPECT_EQ(*count, handled);
+
+	set_log_level(level);
+	set_log_handler(nullptr);
+}
+
+TEST_F(VirtualDeviceTest, realtime) {
+	m_config.realtime = true;
+	add_device();
+
+	// 10000 samples take 100 ms at the default rate
+	auto clk_start = std::chrono::high_resolution_clock::now();
+	m_session->run(10000);
+	auto clk_end = std::chrono::high_resolution_clock::now();
+	auto clk_diff = std::chrono::duration_cast<std::chrono::milliseconds>(clk_end - clk_start);
+	EXPECT_GE(clk_diff.count(), 100);
+	EXPECT_EQ(m_dev->read(rxbuf, 10000, -1), 10000);
+}
+
+TEST_F(VirtualDeviceTest, multiple_devices) {
+	EXPECT_EQ(m_session->add_virtual(16, m_config), 16);
+	EXPECT_EQ(m_session->m_devices.size(), 16);
+
+	std::vector<std::vector<std::array<float, 4>>> frames;
+	m_session->run(10000);
+	EXPECT_EQ(m_session->read(frames, 10000, -1), 10000);
+	EXPECT_EQ(frames.size(), 16);
+}
+
+TEST_F(VirtualDeviceTest, queue_budget) {
+	EXPECT_EQ(m_session->add_virtual(2, m_config), 2);
+
+	// session sized queues shrink to fit the budget
+	m_session->m_queue_time = 1;
+	m_session->m_queue_memory_budget = 1 << 20;
+	EXPECT_GT(m_session->configure(), 0);
+	EXPECT_LE(m_session->queue_memory(), m_session->m_queue_memory_budget);
+	EXPECT_GT(m_session->queue_memory(), m_session->m_queue_memory_budget * 0.9);
+
+	// queues have a minimum size
+	m_session->m_queue_memory_budget = 1 << 10;
+	EXPECT_EQ(m_session->configure(), -ENOMEM);
+}
+
+TEST_F(VirtualDeviceTest, shared_executor) {
+	// decode all devices on two executor threads
+	m_session->m_executor_threads = 2;
+	m_session->m_decode_offload = true;
+	EXPECT_EQ(m_session->add_virtual(8, m_config), 8);
+	for (auto dev: m_session->m_devices) {
+		dev->set_mode(0, SVMI);
+		a_txbuf.assign(1000, 3);
+		dev->write(a_txbuf, 0, true);
+	}
+	EXPECT_GT(m_session->configure(0), 0);
+
+	std::atomic<bool> completed(false);
+	std::thread::id callback_thread;
+	m_session->m_completion_callback = [&](unsigned) {
+		callback_thread = std::this_thread::get_id();
+		completed = true;
+	};
+
+	std::vector<std::vector<std::array<float, 4>>> frames;
+	m_session->run(10000);
+	ASSERT_EQ(m_session->read(frames, 10000, -1), 10000);
+	ASSERT_EQ(frames.size(), 8);
+	for (auto& dev_frames: frames) {
+		for (unsigned i = 0; i < dev_frames.size(); i++)
+			EXPECT_NEAR(dev_frames[i][0], 3, 0.001) << "failed at sample: " << i;
+	}
+
+	// the completion callback runs on the executor
+	for (unsigned i = 0; i < 100 && !completed; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	EXPECT_TRUE(completed);
+	EXPECT_NE(callback_thread, std::this_thread::get_id());
+}
+
+TEST_F(VirtualDeviceTest, thread_config) {
+	add_device();
+
+	// real-time scheduling may not be permitted, sampling continues regardless
+	m_session->m_usb_thread_config.policy = THREAD_FIFO;
+	m_session->m_executor_thread_config.policy = THREAD_RR;
+	int ret = m_session->apply_thread_config();
+	EXPECT_TRUE(ret == 0 || ret == -EPERM) << "unexpected error: " << ret;
+
+	m_session->m_usb_thread_config.policy = THREAD_DEFAULT;
+	m_session->m_executor_thread_config.policy = THREAD_DEFAULT;
+#ifdef __linux__
+	m_session->m_usb_thread_config.cpus = {0};
+	m_session->m_executor_thread_config.cpus = {0};
+	EXPECT_EQ(m_session->apply_thread_config(), 0);
+#endif
+	m_session->m_executor_thread_config.cpus = {100000};
+	EXPECT_LT(m_session->apply_thread_config(), 0);
+	m_session->m_executor_thread_config.cpus.clear();
+
+	EXPECT_GT(m_session->configure(0), 0);
+	m_session->run(10000);
+	EXPECT_EQ(m_dev->read(rxbuf, 10000, -1), 10000);
+}
+
+TEST_F(VirtualDeviceTest, record_replay) {
+	const char* path = "test-virtual-record.smurec";
+	add_device();
+	m_dev->set_mode(0, SVMI);
+	for (unsigned i = 0; i < 5000; i++)
+		a_txbuf.push_back((i % 500) / 100.0);
+	m_dev->write(a_txbuf, 0);
+
+	ASSERT_EQ(m_dev->record(path), 0);
+	m_session->run(5000);
+	std::vector<std::array<float, 4>> recorded;
+	EXPECT_EQ(m_dev->read(recorded, 5000, -1), 5000);
+	EXPECT_EQ(m_dev->record(), 0);
+	std::string serial = m_dev->m_serial;
+	m_session->remove(m_dev);
+
+	// the replayed device reports the recorded device's information and samples
+	ASSERT_EQ(m_session->add_replay(path, false), 0);
+	m_dev = *(m_session->m_devices.begin());
+	m_session->configure();
+	EXPECT_EQ(m_dev->m_serial, serial);
+	EXPECT_EQ(m_dev->m_fwver, "2.17");
+	m_session->run(5000);
+	EXPECT_EQ(m_dev->read(rxbuf, 5000, -1), 5000);
+	for (unsigned i = 0; i < rxbuf.size(); i++)
+		EXPECT_EQ(rxbuf[i], recorded[i]) << "failed at sample: " << i;
+
+	// replaying past the end of the recording stops the session
+	m_session->run(10000);
+	EXPECT_TRUE(m_session->cancelled());
+	EXPECT_LT(m_dev->read(rxbuf, 10000), 10000);
+
+	std::remove(path);
+}
+
+#ifdef __linux__
+TEST_F(VirtualDeviceTest, record_error) {
+	DeviceEvent event;
+	add_device();
+
+	// every write to /dev/full fails with ENOSPC
+	ASSERT_EQ(m_dev->record("/dev/full"), 0);
+	m_session->run(50000);
+	EXPECT_EQ(m_dev->read(rxbuf, 50000, -1), 50000);
+	EXPECT_EQ(m_dev->record(), -ENOSPC);
+
+	ASSERT_TRUE(m_dev->poll_event(event));
+	EXPECT_EQ(event.kind, EVENT_RECORD_ERROR);
+	EXPECT_EQ(event.error, -ENOSPC);
+	EXPECT_FALSE(m_dev->poll_event(event));
+
+	// streaming is unaffected and a new recording starts cleanly
+	ASSERT_EQ(m_dev->record("test-virtual-record-error.smurec"), 0);
+	m_session->run(1000);
+	EXPECT_EQ(m_dev->read(rxbuf, 1000, -1), 1000);
+	EXPECT_EQ(m_dev->record(), 0);
+	std::remove("test-virtual-record-error.smurec");
+}
+#endif
+
+TEST_F(VirtualDeviceTest, skew) {
+	// channel A of both devices is wired together, the second device
+	// starts sampling 18 microframes after the first
+	m_config.realtime = true;
+	m_config.load = VIRTUAL_WIRE;
+	add_device();
+	Device* source = m_dev;
+	m_config.start_delay = 18;
+	ASSERT_EQ(m_session->add_virtual(1, m_config), 1);
+	Device* late = NULL;
+	for (Device* dev: m_session->m_devices) {
+		if (dev != source)
+			late = dev;
+	}
+
+	// a microframe spans 1.25 samples at 10 kHz
+	m_session->configure(10000);
+	ASSERT_EQ(m_session->m_sample_rate, 10000);
+
+	// The late device captures events 22.5 samples early, interpolated
+	// between the correlation peaks. The devices sync one after the other,
+	// on either side of a millisecond boundary they start whole
+	// milliseconds (10 samples) further apart or closer.
+	ASSERT_EQ(m_session->calibrate_skew(source, 0), 0);
+	EXPECT_EQ(m_session->m_skew[source], 0);
+	double skew = m_session->m_skew[late];
+	EXPECT_NEAR(std::remainder(skew + 22.5, 10), 0, 0.01) << "measured skew: " << skew;
+	EXPECT_LT(skew, 0);
+
+	// Frames read from the session are realigned, including the edges
+	// sampled halfway by the late device. The devices may start in other
+	// milliseconds than while calibrating, shifting the frames by whole
+	// milliseconds, but always in the same order.
+	std::vector<float> wave;
+	for (unsigned i = 0; i < 5000; i++)
+		wave.push_back((i / 100) % 2 ? 4.0 : 1.0);
+	source->set_mode(0, SVMI);
+	late->set_mode(0, HI_Z);
+	auto index = [&](Device* dev) {
+		return std::distance(m_session->m_devices.begin(), m_session->m_devices.find(dev));
+	};
+	std::vector<std::vector<std::array<float, 4>>> frames;
+	auto aligned = [&]() {
+		auto& a = frames[index(source)];
+		auto& b = frames[index(late)];
+		for (int shift: {0, 10, -10, 20, -20, 30, -30}) {
+			unsigned i;
+			for (i = 30; i < 3970; i++) {
+				if (std::fabs(a[i][0] - b[i + shift][0]) > 0.01)
+					break;
+			}
+			if (i == 3970)
+				return true;
+		}
+		return false;
+	};
+
+	source->write(wave, 0);
+	m_session->run(5000);
+	ASSERT_EQ(m_session->read(frames, 4000, 1000), 4000);
+	EXPECT_TRUE(aligned());
+	unsigned edges = 0;
+	for (auto& frame: frames[index(late)]) {
+		if (std::fabs(frame[0] - 2.5) < 0.01)
+			edges++;
+	}
+	EXPECT_GE(edges, 30);
+
+	// without realignment the edges don't line up
+	m_session->m_skew.clear();
+	source->write(wave, 0);
+	m_session->run(5000);
+	ASSERT_EQ(m_session->read(frames, 4000, 1000), 4000);
+	EXPECT_FALSE(aligned());
+}
+
+TEST_F(VirtualDeviceTest, elastic) {
+	const char* path = "test-virtual-elastic.smurec";
+	m_config.realtime = true;
+
+	// recording used as a device that detaches itself once it ends
+	add_device();
+	ASSERT_EQ(m_dev->record(path), 0);
+	m_session->run(2000);
+	EXPECT_EQ(m_dev->read(rxbuf, 2000, -1), 2000);
+	EXPECT_EQ(m_dev->record(), 0);
+	m_session->remove(m_dev);
+
+	add_device();
+	m_session->configure();
+	Device* a = m_dev;
+
+	auto index = [&](Device* dev) {
+		return std::distance(m_session->m_devices.begin(), m_session->m_devices.find(dev));
+	};
+	auto count_nan = [](const std::vector<std::array<float, 4>>& samples) {
+		unsigned nan = 0;
+		for (auto& sample: samples)
+			nan += std::isnan(sample[0]);
+		return nan;
+	};
+
+	std::vector<std::vector<std::array<float, 4>>> frames;
+	m_session->start(0);
+	EXPECT_EQ(m_session->read(frames, 5000, 1000), 5000);
+
+	// a device joins the running session, padded until its first sample
+	ASSERT_EQ(m_session->add_virtual(1, m_config), 1);
+	ASSERT_EQ(m_session->m_devices.size(), 2);
+	Device* b = *m_session->m_devices.begin() == a ? *m_session->m_devices.rbegin() : *m_session->m_devices.begin();
+	EXPECT_EQ(m_session->read(frames, 20000, 1000), 20000);
+	ASSERT_EQ(frames.size(), 2);
+	EXPECT_EQ(count_nan(frames[index(a)]), 0);
+	unsigned pad = count_nan(frames[index(b)]);
+	EXPECT_GT(pad, 0);
+	EXPECT_LT(pad, 20000);
+	for (unsigned i = pad; i < 20000; i++)
+		ASSERT_FALSE(std::isnan(frames[index(b)][i][0])) << "failed at sample: " << i;
+
+	// removing it doesn't stop the other device
+	EXPECT_EQ(m_session->remove(b), 0);
+	EXPECT_EQ(m_session->m_devices.size(), 1);
+	EXPECT_EQ(m_session->read(frames, 5000, 1000), 5000);
+	EXPECT_EQ(frames.size(), 1);
+
+	// a detached device is dropped from the stream
+	ASSERT_EQ(m_session->add_replay(path), 0);
+	Device* replay = *m_session->m_devices.begin() == a ? *m_session->m_devices.rbegin() : *m_session->m_devices.begin();
+	EXPECT_EQ(m_session->read(frames, 20000, 1000), 20000);
+	ASSERT_EQ(frames.size(), 2);
+	EXPECT_EQ(count_nan(frames[index(a)]), 0);
+	EXPECT_GE(count_nan(frames[index(replay)]), 15000);
+	EXPECT_FALSE(m_session->cancelled());
+	EXPECT_EQ(m_session->remove(replay, true), 0);
+
+	EXPECT_EQ(m_session->read(frames, 5000, 1000), 5000);
+	EXPECT_EQ(m_session->end(), 0);
+	std::remove(path);
+}
+
+TEST_F(VirtualDeviceTest, elastic_budget) {
+	m_config.realtime = true;
+	add_device();
+	m_session->m_queue_time = 1;
+	m_session->m_queue_memory_budget = 1 << 20;
+	EXPECT_GT(m_session->configure(), 0);
+	m_session->start(0);
+
+	// joining devices only get the budget left by the streaming ones
+	EXPECT_EQ(m_session->add_virtual(1, m_config), -ENOMEM);
+	EXPECT_EQ(m_session->m_devices.size(), 1);
+	m_session->m_queue_memory_budget = 2 << 20;
+	EXPECT_EQ(m_session->add_virtual(1, m_config), 1);
+	EXPECT_EQ(m_session->m_devices.size(), 2);
+	EXPECT_LE(m_session->queue_memory(), m_session->m_queue_memory_budget);
+	EXPECT_EQ(m_session->end(), 0);
+}
+
+TEST_F(VirtualDeviceTest, replay_loop) {
+	const char* path = "test-virtual-loop.smurec";
+	add_device();
+	ASSERT_EQ(m_dev->record(path), 0);
+	m_session->run(1000);
+	EXPECT_EQ(m_dev->read(rxbuf, 1000, -1), 1000);
+	EXPECT_EQ(m_dev->record(), 0);
+	m_session->remove(m_dev);
+
+	ASSERT_EQ(m_session->add_replay(path, false, true), 0);
+	m_dev = *(m_session->m_devices.begin());
+	m_session->configure();
+	m_session->run(10000);
+	EXPECT_EQ(m_dev->read(rxbuf, 10000, -1), 10000);
+
+	std::remove(path);
+}
+
+TEST_F(VirtualDeviceTest, replay_invalid) {
+	EXPECT_EQ(m_session->add_replay("nonexistent.smurec"), -ENOENT);
+	EXPECT_EQ(m_session->m_devices.size(), 0);
+}